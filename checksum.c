@@ -0,0 +1,575 @@
+/******************************************************************************
+ *
+ * FILENAME:
+ *     checksum.c
+ *
+ * DESCRIPTION:
+ *     Compute 16-bit One's Complement sum of data (RFC-1071), with SSE2/AVX2
+ *     implementations selected at startup by the features of the CPU. And
+ *     CRC32C, with the crc32 instruction of SSE4.2 or slicing-by-8 tables.
+ *
+ * REVISION(MM/DD/YYYY):
+ *     10/16/2026
+ *     - Initial version
+ *
+ ******************************************************************************/
+#include <string.h>
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+
+/*
+ * Shorter data (e.g. the header only packets) is summed faster by the scalar
+ * loop than by setting up the vectors.
+ */
+#define CHECKSUM_VEC_MIN_LEN    64
+
+/*
+ * The max number of vectors summed into 32-bit lanes before they are added
+ * up to the 64-bit sum. Every lane gets 2 words(<= 0xFFFF) per vector, so
+ * it can't overflow.
+ */
+#define CHECKSUM_VEC_CHUNK      16384
+
+/* The CRC32C polynomial, bit-reversed */
+#define CRC32C_POLY             0x82F63B78
+
+/* Tables of slicing-by-8, crc32c_table[k][b] is the CRC of byte b followed by
+ * k zero bytes */
+static uint32_t crc32c_table[8][256];
+
+
+/******************************************************************************
+ * NAME:
+ *      checksum_fold
+ *
+ * DESCRIPTION:
+ *      Take only 16 bits out of the sum, add up the carries and return the
+ *      complement of it.
+ *
+ * PARAMETERS:
+ *      sum - The sum of 16-bit words
+ *
+ * RETURN:
+ *      Checksum
+ ******************************************************************************/
+static inline uint16_t checksum_fold(uint64_t sum)
+{
+    while (sum>>16) {
+        sum = (sum>>16) + (sum&0xFFFF);
+    }
+
+    return (uint16_t)(~sum);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      checksum_tail
+ *
+ * DESCRIPTION:
+ *      Sum the 16-bit words of a buffer one by one, and the last byte if the
+ *      length is an odd number.
+ *
+ * PARAMETERS:
+ *      p   - The data buffer, no alignment required
+ *      len - The length of data(bytes)
+ *
+ * RETURN:
+ *      The sum of words
+ ******************************************************************************/
+static inline uint64_t checksum_tail(const uint8_t *p, ssize_t len)
+{
+    uint64_t sum = 0;
+    uint16_t word;
+
+    while (len >= 2) {
+        memcpy(&word, p, sizeof(word));
+        sum += word;
+        p += 2;
+        len -= 2;
+    }
+
+    if (len & 1) {
+        sum += *p;
+    }
+
+    return sum;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      checksum_scalar
+ *
+ * DESCRIPTION:
+ *      Compute 16-bit One's Complement sum of data. (The algorithm comes from
+ *      RFC-1071)
+ *      NOTES: Before call this function, please set the checksum field to 0.
+ *
+ * PARAMETERS:
+ *      buf  - The data buffer
+ *      len  - The length of data(bytes).
+ *
+ * RETURN:
+ *      Checksum
+ ******************************************************************************/
+static uint16_t checksum_scalar(void *buf, ssize_t len)
+{
+    uint16_t *word;
+    uint8_t *byte;
+    ssize_t i;
+    unsigned long sum = 0;
+
+    if (!buf) {
+        return 0;
+    }
+
+    word = (uint16_t *)buf;
+    for (i = 0; i < len/2; i++) {
+        sum += word[i];
+    }
+
+    /* If the length(bytes) of data buffer is an odd number, add the last byte. */
+    if (len & 1) {
+        byte = (uint8_t *)buf;
+        sum += byte[len-1];
+    }
+
+    return checksum_fold(sum);
+}
+
+
+static int checksum_scalar_supported(void)
+{
+    return 1;
+}
+
+
+#ifdef CHECKSUM_X86
+/******************************************************************************
+ * NAME:
+ *      checksum_sse2
+ *
+ * DESCRIPTION:
+ *      The same as checksum_scalar, but sum 8 words per instruction. The words
+ *      are zero-extended to 32-bit lanes, so the sum is the same as the one of
+ *      the scalar loop, bit by bit.
+ *
+ * PARAMETERS:
+ *      buf  - The data buffer
+ *      len  - The length of data(bytes).
+ *
+ * RETURN:
+ *      Checksum
+ ******************************************************************************/
+__attribute__((target("sse2")))
+static uint16_t checksum_sse2(void *buf, ssize_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t lanes[4];
+    uint64_t sum = 0;
+
+    if (!buf) {
+        return 0;
+    }
+
+    while (len >= 16) {
+        ssize_t n = len / 16;
+        __m128i acc = zero;
+
+        if (n > CHECKSUM_VEC_CHUNK) {
+            n = CHECKSUM_VEC_CHUNK;
+        }
+        len -= n * 16;
+
+        while (n--) {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+            p += 16;
+        }
+
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    sum += checksum_tail(p, len);
+
+    return checksum_fold(sum);
+}
+
+
+static int checksum_sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      checksum_avx2
+ *
+ * DESCRIPTION:
+ *      The same as checksum_sse2, but sum 16 words per instruction.
+ *
+ * PARAMETERS:
+ *      buf  - The data buffer
+ *      len  - The length of data(bytes).
+ *
+ * RETURN:
+ *      Checksum
+ ******************************************************************************/
+__attribute__((target("avx2")))
+static uint16_t checksum_avx2(void *buf, ssize_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t lanes[8];
+    uint64_t sum = 0;
+    int i;
+
+    if (!buf) {
+        return 0;
+    }
+
+    while (len >= 32) {
+        ssize_t n = len / 32;
+        __m256i acc = zero;
+
+        if (n > CHECKSUM_VEC_CHUNK) {
+            n = CHECKSUM_VEC_CHUNK;
+        }
+        len -= n * 32;
+
+        while (n--) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)p);
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+            p += 32;
+        }
+
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (i = 0; i < 8; i++) {
+            sum += lanes[i];
+        }
+    }
+
+    sum += checksum_tail(p, len);
+
+    return checksum_fold(sum);
+}
+
+
+static int checksum_avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif /* CHECKSUM_X86 */
+
+
+/******************************************************************************
+ * NAME:
+ *      crc32c_init_tables
+ *
+ * DESCRIPTION:
+ *      Build the tables of crc32c_sb8().
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void crc32c_init_tables(void)
+{
+    uint32_t crc;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            crc = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xFF];
+        }
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      crc32c_sb8
+ *
+ * DESCRIPTION:
+ *      Update CRC32C with data, 8 bytes per step by looking up 8 tables
+ *      (slicing-by-8). The words are read in little-endian order.
+ *
+ * PARAMETERS:
+ *      crc - The CRC of the data before, 0 to start
+ *      buf - The data buffer
+ *      len - The length of data(bytes)
+ *
+ * RETURN:
+ *      The CRC
+ ******************************************************************************/
+static uint32_t crc32c_sb8(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    uint64_t v;
+
+    crc = ~crc;
+    while ((len > 0) && ((uintptr_t)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xFF] ^
+            crc32c_table[6][(v >> 8) & 0xFF] ^
+            crc32c_table[5][(v >> 16) & 0xFF] ^
+            crc32c_table[4][(v >> 24) & 0xFF] ^
+            crc32c_table[3][(v >> 32) & 0xFF] ^
+            crc32c_table[2][(v >> 40) & 0xFF] ^
+            crc32c_table[1][(v >> 48) & 0xFF] ^
+            crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+
+    return ~crc;
+}
+
+
+static int crc32c_sb8_supported(void)
+{
+    return 1;
+}
+
+
+#ifdef CHECKSUM_X86
+/******************************************************************************
+ * NAME:
+ *      crc32c_sse42
+ *
+ * DESCRIPTION:
+ *      The same as crc32c_sb8, with the crc32 instruction of SSE4.2, 8 bytes
+ *      per instruction on x86-64.
+ *
+ * PARAMETERS:
+ *      crc - The CRC of the data before, 0 to start
+ *      buf - The data buffer
+ *      len - The length of data(bytes)
+ *
+ * RETURN:
+ *      The CRC
+ ******************************************************************************/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    uint32_t w;
+#ifdef __x86_64__
+    uint64_t c = ~crc & 0xFFFFFFFF, v;
+#else
+    uint32_t c = ~crc;
+#endif
+
+    while ((len > 0) && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+
+#ifdef __x86_64__
+    while (len >= 8) {
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len >= 4) {
+        memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u32(c, w);
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+
+    return ~(uint32_t)c;
+}
+
+
+static int crc32c_sse42_supported(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif /* CHECKSUM_X86 */
+
+
+const checksum_impl_t checksum_impls[] = {
+    { "scalar", checksum_scalar, checksum_scalar_supported },
+#ifdef CHECKSUM_X86
+    { "sse2",   checksum_sse2,   checksum_sse2_supported },
+    { "avx2",   checksum_avx2,   checksum_avx2_supported },
+#endif
+    { NULL,     NULL,            NULL }
+};
+
+const crc32c_impl_t crc32c_impls[] = {
+    { "sb8",    crc32c_sb8,      crc32c_sb8_supported },
+#ifdef CHECKSUM_X86
+    { "sse4.2", crc32c_sse42,    crc32c_sse42_supported },
+#endif
+    { NULL,     NULL,            NULL }
+};
+
+
+/* The implementations used by compute_checksum() and compute_crc32c() */
+static const checksum_impl_t *checksum_selected = &checksum_impls[0];
+static const crc32c_impl_t *crc32c_selected = &crc32c_impls[0];
+
+
+/******************************************************************************
+ * NAME:
+ *      checksum_select
+ *
+ * DESCRIPTION:
+ *      Select the fastest implementations supported by the CPU, and build
+ *      the tables of CRC32C. It runs before main(), so compute_checksum() and
+ *      compute_crc32c() never race with it.
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+__attribute__((constructor))
+static void checksum_select(void)
+{
+    const checksum_impl_t *impl;
+    const crc32c_impl_t *crc_impl;
+
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+#endif
+    for (impl = checksum_impls; impl->name != NULL; impl++) {
+        if (impl->supported()) {
+            checksum_selected = impl;
+        }
+    }
+
+    crc32c_init_tables();
+    for (crc_impl = crc32c_impls; crc_impl->name != NULL; crc_impl++) {
+        if (crc_impl->supported()) {
+            crc32c_selected = crc_impl;
+        }
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      compute_checksum
+ *
+ * DESCRIPTION:
+ *      Compute 16-bit One's Complement sum of data. (The algorithm comes from
+ *      RFC-1071)
+ *      NOTES: Before call this function, please set the checksum field to 0.
+ *
+ * PARAMETERS:
+ *      buf  - The data buffer
+ *      len  - The length of data(bytes).
+ *
+ * RETURN:
+ *      Checksum
+ ******************************************************************************/
+uint16_t compute_checksum(void *buf, ssize_t len)
+{
+    if (len < CHECKSUM_VEC_MIN_LEN) {
+        return checksum_scalar(buf, len);
+    }
+
+    return checksum_selected->func(buf, len);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      checksum_impl_name
+ *
+ * DESCRIPTION:
+ *      Get the name of the implementation used by compute_checksum().
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      The name of the implementation
+ ******************************************************************************/
+const char *checksum_impl_name(void)
+{
+    return checksum_selected->name;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      compute_crc32c
+ *
+ * DESCRIPTION:
+ *      Update CRC32C (Castagnoli) with data. The CRC of a buffer in pieces is
+ *      the same as the one of the whole buffer.
+ *
+ * PARAMETERS:
+ *      crc - The CRC of the data before, 0 to start
+ *      buf - The data buffer
+ *      len - The length of data(bytes)
+ *
+ * RETURN:
+ *      The CRC
+ ******************************************************************************/
+uint32_t compute_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_selected->func(crc, buf, len);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      crc32c_impl_name
+ *
+ * DESCRIPTION:
+ *      Get the name of the implementation used by compute_crc32c().
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      The name of the implementation
+ ******************************************************************************/
+const char *crc32c_impl_name(void)
+{
+    return crc32c_selected->name;
+}
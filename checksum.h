@@ -0,0 +1,54 @@
+/******************************************************************************
+*
+* FILENAME:
+*     checksum.h
+*
+* DESCRIPTION:
+*     Define the checksum functions of the request/response packets: the
+*     16-bit One's Complement sum, and CRC32C (Castagnoli).
+*
+* REVISION(MM/DD/YYYY):
+*     10/16/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* Prototype of the functions computing 16-bit One's Complement sum */
+typedef uint16_t (*checksum_func_t) (void *buf, ssize_t len);
+
+/* One implementation of the checksum */
+typedef struct checksum_impl {
+    const char *name;           /* Name of the implementation */
+    checksum_func_t func;       /* Function of the implementation */
+    int (*supported)(void);     /* Return 1 if the CPU supports it */
+} checksum_impl_t;
+
+
+/* Prototype of the functions updating CRC32C with data, crc is 0 to start */
+typedef uint32_t (*crc32c_func_t) (uint32_t crc, const void *buf, size_t len);
+
+/* One implementation of CRC32C */
+typedef struct crc32c_impl {
+    const char *name;           /* Name of the implementation */
+    crc32c_func_t func;         /* Function of the implementation */
+    int (*supported)(void);     /* Return 1 if the CPU supports it */
+} crc32c_impl_t;
+
+
+/* All implementations, from the slowest to the fastest, end with NULL name */
+extern const checksum_impl_t checksum_impls[];
+extern const crc32c_impl_t crc32c_impls[];
+
+uint16_t compute_checksum(void *buf, ssize_t len);
+const char *checksum_impl_name(void);
+uint32_t compute_crc32c(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_impl_name(void);
+
+
+#endif /* _CHECKSUM_H_ */
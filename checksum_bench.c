@@ -0,0 +1,258 @@
+/******************************************************************************
+*
+* FILENAME:
+*     checksum_bench.c
+*
+* DESCRIPTION:
+*     Microbenchmark of the checksum and CRC32C implementations supported by
+*     the CPU, to compare the integrity modes of the packets per payload size.
+*
+* REVISION(MM/DD/YYYY):
+*     10/16/2026
+*     - Initial version
+*
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "checksum.h"
+
+
+/* Payload sizes measured, the max one shall be no more than BENCH_BUF_SIZE */
+static const int bench_sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+#define BENCH_NSIZES        (int)(sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+#define BENCH_BUF_SIZE      4096
+
+/* Bytes summed per measurement */
+#define BENCH_BYTES         (256 * 1024 * 1024L)
+
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      check_impls
+ *
+ * DESCRIPTION:
+ *      Check all supported implementations against the scalar one, with every
+ *      length up to the buffer size and every offset of a 32-byte line.
+ *
+ * PARAMETERS:
+ *      buf - Random data, BENCH_BUF_SIZE + 32 bytes
+ *
+ * RETURN:
+ *      0 - OK, Others - Mismatch found
+ ******************************************************************************/
+static int check_impls(uint8_t *buf)
+{
+    const checksum_impl_t *impl;
+    int len, off;
+
+    for (impl = &checksum_impls[1]; impl->name != NULL; impl++) {
+        if (!impl->supported()) {
+            continue;
+        }
+        for (off = 0; off < 32; off++) {
+            for (len = 0; len <= BENCH_BUF_SIZE; len++) {
+                uint16_t expect = checksum_impls[0].func(buf + off, len);
+                uint16_t got = impl->func(buf + off, len);
+                if (got != expect) {
+                    printf("Error: %s mismatch (offset %d, length %d): "
+                        "0x%04X != 0x%04X\n", impl->name, off, len, got, expect);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      check_crc32c_impls
+ *
+ * DESCRIPTION:
+ *      Check all supported CRC32C implementations against the check value of
+ *      CRC-32C and the slicing-by-8 one, with every length up to the buffer
+ *      size, every offset of a 32-byte line, and the data split in two.
+ *
+ * PARAMETERS:
+ *      buf - Random data, BENCH_BUF_SIZE + 32 bytes
+ *
+ * RETURN:
+ *      0 - OK, Others - Mismatch found
+ ******************************************************************************/
+static int check_crc32c_impls(uint8_t *buf)
+{
+    const crc32c_impl_t *impl;
+    uint32_t expect, got;
+    int len, off;
+
+    for (impl = crc32c_impls; impl->name != NULL; impl++) {
+        if (!impl->supported()) {
+            continue;
+        }
+        got = impl->func(0, "123456789", 9);
+        if (got != 0xE3069283) {
+            printf("Error: %s check value 0x%08X != 0xE3069283\n",
+                impl->name, got);
+            return -1;
+        }
+        for (off = 0; off < 32; off++) {
+            for (len = 0; len <= BENCH_BUF_SIZE; len++) {
+                expect = crc32c_impls[0].func(0, buf + off, len);
+                got = impl->func(impl->func(0, buf + off, len / 3),
+                    buf + off + len / 3, len - len / 3);
+                if (got != expect) {
+                    printf("Error: %s mismatch (offset %d, length %d): "
+                        "0x%08X != 0x%08X\n", impl->name, off, len, got, expect);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      print_usage
+ *
+ * DESCRIPTION:
+ *      Print usage information and exit the program.
+ *
+ * PARAMETERS:
+ *      pname - The name of the program.
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void print_usage(char *pname)
+{
+    printf("\n"
+        "Usage: %s [-n bytes]\n"
+        "\n"
+        "Options:\n"
+        "    -n bytes   Bytes summed per variant and payload size, default: %ld\n"
+        "\n",
+        pname, BENCH_BYTES
+        );
+    exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const checksum_impl_t *impl;
+    const crc32c_impl_t *crc_impl;
+    uint8_t *buf;
+    long total = BENCH_BYTES;
+    volatile uint16_t sink = 0;
+    volatile uint32_t crc_sink = 0;
+    char name[32];
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, ":hn:")) != -1) {
+        switch (opt) {
+        case 'n':
+            total = strtol(optarg, NULL, 10);
+            if (total <= 0) {
+                printf("Error: invalid number of bytes!\n");
+                print_usage(argv[0]);
+            }
+            break;
+
+        default:
+            print_usage(argv[0]);
+            break;
+        }
+    }
+
+    buf = (uint8_t *)malloc(BENCH_BUF_SIZE + 32);
+    if (buf == NULL) {
+        perror("malloc error");
+        return 1;
+    }
+    srand(time(NULL));
+    for (i = 0; i < BENCH_BUF_SIZE + 32; i++) {
+        buf[i] = rand();
+    }
+
+    if ((check_impls(buf) != 0) || (check_crc32c_impls(buf) != 0)) {
+        free(buf);
+        return 1;
+    }
+    printf("All implementations are bit-exact with scalar, selected: %s\n",
+        checksum_impl_name());
+    printf("All CRC32C implementations are bit-exact with sb8, selected: %s"
+        "\n\n", crc32c_impl_name());
+
+    printf("%-8s", "size");
+    for (impl = checksum_impls; impl->name != NULL; impl++) {
+        if (impl->supported()) {
+            printf("%12s", impl->name);
+        }
+    }
+    for (crc_impl = crc32c_impls; crc_impl->name != NULL; crc_impl++) {
+        if (crc_impl->supported()) {
+            snprintf(name, sizeof(name), "crc:%s", crc_impl->name);
+            printf("%12s", name);
+        }
+    }
+    printf("   (GB/s)\n");
+
+    for (i = 0; i < BENCH_NSIZES; i++) {
+        int size = bench_sizes[i];
+        long loops = total / size;
+
+        printf("%-8d", size);
+        for (impl = checksum_impls; impl->name != NULL; impl++) {
+            double start, elapsed;
+            long n;
+
+            if (!impl->supported()) {
+                continue;
+            }
+            start = now_sec();
+            for (n = 0; n < loops; n++) {
+                /* Feed the result back, so the calls can't be merged */
+                buf[0] = sink;
+                sink = impl->func(buf, size);
+            }
+            elapsed = now_sec() - start;
+            printf("%12.2f", (double)loops * size / elapsed / 1e9);
+        }
+        for (crc_impl = crc32c_impls; crc_impl->name != NULL; crc_impl++) {
+            double start, elapsed;
+            long n;
+
+            if (!crc_impl->supported()) {
+                continue;
+            }
+            start = now_sec();
+            for (n = 0; n < loops; n++) {
+                buf[0] = crc_sink;
+                crc_sink = crc_impl->func(0, buf, size);
+            }
+            elapsed = now_sec() - start;
+            printf("%12.2f", (double)loops * size / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+
+    free(buf);
+    return 0;
+}
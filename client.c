@@ -15,9 +15,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include "common.h"
 
 
+/* The number of requests sent without waiting for the responses */
+#define PIPELINE_DEPTH          16
+
+/* The size of the large message sent with CMD_PUT_BLOB */
+#define BLOB_SIZE               (4 * 1024 * 1024)
+
+
 /******************************************************************************
  * NAME:
  *      print_usage
@@ -39,18 +47,21 @@ void print_usage(char *pname)
         "                    v%d.%d                      \n"
         "================================================\n"
         "\n"
-        "Usage: %s [-s server_ip] [-p port_number]\n"
+        "Usage: %s [-s server_ip] [-p port_number] [-U path]\n"
         "\n"
         "Options:\n"
         "    -s server_ip     The IP address of server, default: %s\n"
         "    -p port_number   The port number of server, default: %d\n"
+        "    -U path          Connect to the Unix domain socket of server\n"
+        "                     instead, '@name' for an abstract name\n"
         "\n"
         "Example:\n"
         "    %s -p 9000\n"
+        "    %s -U /tmp/dsc.sock\n"
         "\n",
         VERSION_MAJOR, VERSION_MINOR,
         pname, SERVER_IP, SERVER_PORT,
-        pname
+        pname, pname
         );
     exit(STATUS_ERROR);
 }
@@ -62,9 +73,10 @@ int main(int argc, char *argv[])
     char *pname = argv[0];
     const char *server_ip = SERVER_IP;
     int serv_port = SERVER_PORT;
+    const char *unix_path = NULL;
     int opt;
 
-    while ((opt = getopt(argc, argv, ":hp:s:")) != -1) {
+    while ((opt = getopt(argc, argv, ":hp:s:U:")) != -1) {
         switch (opt) {
         case 'p':
             serv_port = strtol(optarg, NULL, 10);
@@ -78,6 +90,10 @@ int main(int argc, char *argv[])
             server_ip = optarg;
             break;
 
+        case 'U':
+            unix_path = optarg;
+            break;
+
         case 'h':
             print_usage(pname);
             break;
@@ -99,8 +115,13 @@ int main(int argc, char *argv[])
         print_usage(pname);
     }
 
-    printf("Connect server %s:%d\n", server_ip, serv_port);
-    clnt = client_init(server_ip, serv_port);
+    if (unix_path != NULL) {
+        printf("Connect server %s\n", unix_path);
+        clnt = client_init_unix(unix_path);
+    } else {
+        printf("Connect server %s:%d\n", server_ip, serv_port);
+        clnt = client_init(server_ip, serv_port);
+    }
     if (clnt == NULL) {
         printf("Error: client init error\n");
         return STATUS_INIT_ERROR;
@@ -109,26 +130,24 @@ int main(int argc, char *argv[])
     /********************** Get version of server ***********************/
     {
         dsc_command_t req;
-        dsc_response_version_t *ver;
+        dsc_response_version_t ver;
 
         req.command = CMD_GET_VERSION;
         req.data_len = 0;
 
+        /* Receive the response into a local buffer */
         printf("Send CMD_GET_VERSION request\n");
-        ver = (dsc_response_version_t *)client_send_request(clnt, &req);
-        if (ver == NULL) {
+        if (client_send_request_into(clnt, &req, &ver, sizeof(ver)) < 0) {
             printf("Error: client send request error\n");
             client_close(clnt);
             return STATUS_ERROR;
         }
 
-        if (ver->common.status == STATUS_SUCCESS) {
-            printf("Version: %d.%d\n", ver->major, ver->minor);
+        if (ver.common.status == STATUS_SUCCESS) {
+            printf("Version: %d.%d\n", ver.major, ver.minor);
         } else {
-            printf("CMD_GET_VERSION error(%d)\n", ver->common.status);
+            printf("CMD_GET_VERSION error(%d)\n", ver.common.status);
         }
-
-        free(ver);
     }
 
     /********************** Get message from server ***********************/
@@ -139,8 +158,9 @@ int main(int argc, char *argv[])
         req.command = CMD_GET_MESSAGE;
         req.data_len = 0;
 
+        /* Get the response in the buffer of client, no need to free it */
         printf("Send CMD_GET_MESSAGE request\n");
-        res = (dsc_response_get_msg_t *)client_send_request(clnt, &req);
+        res = (dsc_response_get_msg_t *)client_send_request_buf(clnt, &req);
         if (res == NULL) {
             printf("Error: client send request error\n");
             client_close(clnt);
@@ -148,12 +168,24 @@ int main(int argc, char *argv[])
         }
 
         if (res->common.status == STATUS_SUCCESS) {
-            printf("Message: %s\n", res->data);
+            printf("Message: %.*s\n", (int)res->common.data_len, res->data);
         } else {
             printf("CMD_GET_MESSAGE error(%d)\n", res->common.status);
         }
+    }
 
-        free(res);
+    /********************** Subscribe to the messages ***********************/
+    {
+        int lease;
+
+        /* The server pushes the messages put from now on */
+        printf("Send DSC_CMD_SUBSCRIBE request\n");
+        lease = client_subscribe(clnt, 0);
+        if (lease < 0) {
+            printf("DSC_CMD_SUBSCRIBE error\n");
+        } else {
+            printf("Subscribed for %d seconds\n", lease);
+        }
     }
 
     /********************** Put message to server ***********************/
@@ -175,13 +207,172 @@ int main(int argc, char *argv[])
             return STATUS_ERROR;
         }
 
-        if (res->status == STATUS_SUCCESS) {
+        if (res->status != STATUS_SUCCESS) {
+            printf("CMD_PUT_MESSAGE error(%d)\n", res->status);
+        } else if (res->data_len < sizeof(uint64_t)) {
             printf("CMD_PUT_MESSAGE OK\n");
         } else {
-            printf("CMD_PUT_MESSAGE error(%d)\n", res->status);
+            /* The server keeps the messages, read it back by offset */
+            dsc_request_get_msg_t get;
+            dsc_response_get_msg_t *msg;
+
+            get.offset = ((dsc_response_put_msg_t *)res)->offset;
+            printf("CMD_PUT_MESSAGE OK (offset %llu)\n",
+                (unsigned long long)get.offset);
+            get.common.command = CMD_GET_MESSAGE;
+            get.common.data_len = sizeof(get.offset);
+            msg = (dsc_response_get_msg_t *)client_send_request_buf(clnt,
+                (dsc_command_t *)&get);
+            if ((msg != NULL) && (msg->common.status == STATUS_SUCCESS)) {
+                printf("Message at %llu: %.*s\n",
+                    (unsigned long long)get.offset,
+                    (int)msg->common.data_len, msg->data);
+            } else {
+                printf("CMD_GET_MESSAGE error\n");
+            }
+        }
+
+        free(res);
+    }
+
+    /********************** Get the message pushed ***********************/
+    {
+        dsc_request_put_msg_t push;
+        ssize_t len;
+
+        /* It arrives with the response of CMD_PUT_MESSAGE, or soon after */
+        len = client_recv_push(clnt, &push, sizeof(push), 1000);
+        if (len > 0) {
+            printf("Pushed message: %.*s\n", (int)push.common.data_len,
+                push.data);
+        } else {
+            printf("No message pushed\n");
         }
+        client_unsubscribe(clnt);
+    }
+
+    /********************** Put/get a large message ***********************/
+    {
+        dsc_command_t *req;
+        dsc_command_t *res;
+        struct timespec t0, t1;
+        uint8_t *data;
+        double sec;
+        uint32_t i;
+
+        req = (dsc_command_t *)malloc(sizeof(dsc_command_t) + BLOB_SIZE);
+        if (req == NULL) {
+            perror("malloc error");
+            client_close(clnt);
+            return STATUS_ERROR;
+        }
+        data = (uint8_t *)(req + 1);
+        for (i = 0; i < BLOB_SIZE; i++) {
+            data[i] = (uint8_t)(i * 7 + (i >> 12));
+        }
+        req->command = CMD_PUT_BLOB;
+        req->data_len = BLOB_SIZE;
+
+        printf("Send CMD_PUT_BLOB request (%d bytes)\n", BLOB_SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        res = client_send_request(clnt, req);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if ((res != NULL) && (res->status == STATUS_SUCCESS)) {
+            sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            printf("CMD_PUT_BLOB OK (%.1f MB/s)\n", BLOB_SIZE / sec / 1e6);
+        } else {
+            printf("CMD_PUT_BLOB error\n");
+        }
+        free(res);
 
+        req->command = CMD_GET_BLOB;
+        req->data_len = 0;
+
+        printf("Send CMD_GET_BLOB request\n");
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        res = client_send_request(clnt, req);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if ((res != NULL) && (res->status == STATUS_SUCCESS) &&
+            (res->data_len == BLOB_SIZE) &&
+            (memcmp(res + 1, data, BLOB_SIZE) == 0)) {
+            sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            printf("CMD_GET_BLOB OK (%.1f MB/s)\n", BLOB_SIZE / sec / 1e6);
+        } else {
+            printf("CMD_GET_BLOB error\n");
+        }
         free(res);
+        free(req);
+    }
+
+    /********************** Pipelined requests ***********************/
+    {
+        dsc_command_t req;
+        dsc_completion_t comps[PIPELINE_DEPTH];
+        int i, n, done = 0, ok = 0;
+
+        printf("Send %d pipelined CMD_GET_VERSION requests\n", PIPELINE_DEPTH);
+        for (i = 0; i < PIPELINE_DEPTH; i++) {
+            req.command = CMD_GET_VERSION;
+            req.data_len = 0;
+            if (client_submit(clnt, &req, NULL) != 0) {
+                printf("Error: client submit request error\n");
+                break;
+            }
+        }
+
+        while (clnt->ninflight > 0) {
+            n = client_wait(clnt, comps, PIPELINE_DEPTH, -1);
+            if (n < 0) {
+                break;
+            }
+            for (i = 0; i < n; i++) {
+                if (comps[i].resp != NULL) {
+                    if (comps[i].resp->status == STATUS_SUCCESS) {
+                        ok++;
+                    }
+                    free(comps[i].resp);
+                }
+                done++;
+            }
+        }
+        printf("Pipelined requests: %d OK, %d completed\n", ok, done);
+    }
+
+    /********************** Batched requests ***********************/
+    {
+        dsc_command_t req;
+        dsc_completion_t comps[PIPELINE_DEPTH];
+        int i, n, done = 0, ok = 0;
+
+        printf("Send %d requests in batches\n", PIPELINE_DEPTH);
+        client_set_batching(clnt, DSC_BUF_SIZE, 100);
+        for (i = 0; i < PIPELINE_DEPTH; i++) {
+            req.command = (i % 2) ? CMD_GET_MESSAGE : CMD_GET_VERSION;
+            req.data_len = 0;
+            if (client_submit(clnt, &req, NULL) != 0) {
+                printf("Error: client submit request error\n");
+                break;
+            }
+        }
+        client_flush(clnt);
+
+        while (clnt->ninflight > 0) {
+            n = client_wait(clnt, comps, PIPELINE_DEPTH, -1);
+            if (n < 0) {
+                break;
+            }
+            for (i = 0; i < n; i++) {
+                if (comps[i].resp != NULL) {
+                    if (comps[i].resp->status == STATUS_SUCCESS) {
+                        ok++;
+                    }
+                    free(comps[i].resp);
+                }
+                done++;
+            }
+        }
+        client_set_batching(clnt, 0, 0);
+        printf("Batched requests: %d OK, %d completed\n", ok, done);
     }
 
     /********************** Send an unknown request to server ***********************/
@@ -204,6 +395,29 @@ int main(int argc, char *argv[])
         free(res);
     }
 
+    /********************** Get the stats of server ***********************/
+    {
+        dsc_stats_t *stats;
+
+        stats = (dsc_stats_t *)malloc(sizeof(dsc_stats_t));
+        if (stats == NULL) {
+            perror("malloc error");
+            client_close(clnt);
+            return STATUS_ERROR;
+        }
+
+        printf("Send DSC_CMD_GET_STATS request\n");
+        if (client_get_stats(clnt, stats) != 0) {
+            printf("Error: client send request error\n");
+            free(stats);
+            client_close(clnt);
+            return STATUS_ERROR;
+        }
+        server_print_stats(stats, stdout);
+
+        free(stats);
+    }
+
     client_close(clnt);
     return STATUS_SUCCESS;
 }
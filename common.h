@@ -26,17 +26,18 @@
 #define SERVER_IP               "127.0.0.1"
 #define SERVER_PORT             6666
 
-/* Extra status code, refer STATUS_ERROR defined in uds.h,
+/* Extra status code, refer STATUS_ERROR defined in dsc.h,
  * the values used in struct dsc_command_t.status */
 #define STATUS_INIT_ERROR       (STATUS_ERROR+1)    /* Server/client init error */
-#define STATUS_INVALID_COMMAND  (STATUS_ERROR+2)    /* Unkown request type */
 
 
 /* Request type, the values used in struct dsc_command_t.command */
 enum dsc_request_type {
-    CMD_GET_VERSION = 0x8001,   /* Get the version of server */
+    CMD_GET_VERSION = DSC_CMD_BASE, /* Get the version of server */
     CMD_GET_MESSAGE,            /* Receive a message from server */
     CMD_PUT_MESSAGE,            /* Send a message to server */
+    CMD_PUT_BLOB,               /* Store a large message on server */
+    CMD_GET_BLOB,               /* Get the message stored by CMD_PUT_BLOB */
 
     CMD_UNKNOWN                 /* */
 };
@@ -50,6 +51,13 @@ typedef struct dsc_response_version {
 } BYTE_ALIGNED dsc_response_version_t;
 
 
+/* Request for CMD_GET_MESSAGE by offset, without data to get the last one */
+typedef struct dsc_request_get_msg {
+    dsc_command_t common;           /* Common header of request */
+    uint64_t offset;                /* Offset returned by CMD_PUT_MESSAGE */
+} BYTE_ALIGNED dsc_request_get_msg_t;
+
+
 /* Response for CMD_GET_MESSAGE */
 #define DSC_GET_MSG_SIZE        256
 typedef struct dsc_response_get_msg {
@@ -66,4 +74,11 @@ typedef struct dsc_request_put_msg {
 } BYTE_ALIGNED dsc_request_put_msg_t;
 
 
+/* Response for CMD_PUT_MESSAGE, if the server has a message store */
+typedef struct dsc_response_put_msg {
+    dsc_command_t common;           /* Common header of response */
+    uint64_t offset;                /* Offset of the message in the store */
+} BYTE_ALIGNED dsc_response_put_msg_t;
+
+
 #endif /* _COMMON_H_ */
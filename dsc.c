@@ -11,397 +11,8196 @@
  *     - Initial version 
  *
  ******************************************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <linux/futex.h>
+#include <linux/errqueue.h>
 #include "dsc.h"
+#include "checksum.h"
+#include "frag.h"
+#include "dsc_log.h"
+#include "dsc_uring.h"
+#include "lz.h"
+
+
+/* Buffers used by server_accept_batch(), allocated on first use */
+struct dsc_batch {
+    struct mmsghdr msgs[DSC_BATCH_MAX];         /* Messages for recvmmsg() */
+    struct mmsghdr resp_msgs[DSC_BATCH_MAX];    /* Messages for sendmmsg() */
+    struct iovec iovs[DSC_BATCH_MAX];           /* Receive buffers */
+    struct iovec resp_iovs[DSC_BATCH_MAX];      /* Send buffers */
+    dsc_addr_t addrs[DSC_BATCH_MAX];            /* Client addresses */
+    dsc_command_t *allocs[DSC_BATCH_MAX];       /* Responses to be freed */
+    uint8_t bufs[DSC_BATCH_MAX][DSC_BUF_SIZE];  /* Request packets */
+    uint8_t resp_bufs[DSC_BATCH_MAX][DSC_BUF_SIZE]; /* Response packets */
+};
+
+
+/*
+ * Tags of the events of server_run(), in epoll_event.data.u32. The index of
+ * the listener or timer is in the low 16 bits.
+ */
+#define SERVER_EV_STOP          0x10000     /* server_stop() is called */
+#define SERVER_EV_LISTENER      0x20000     /* A listening socket is readable */
+#define SERVER_EV_TIMER         0x30000     /* A timer expires */
+#define SERVER_EV_XFER          0x40000     /* Transfers need retransmission */
+#define SERVER_EV_WORKER        0x50000     /* Workers handed off responses */
+#define SERVER_EV_TYPE(tag)     ((tag) & 0xFFFF0000)
+#define SERVER_EV_INDEX(tag)    ((tag) & 0xFFFF)
+
+/*
+ * The max rounds of recvmmsg() on one readable socket per event, so a busy
+ * socket can't starve the other sockets and timers.
+ */
+#define SERVER_MAX_ROUNDS       16
+
+/* Sizes of the io_uring backend, refer server_set_backend() */
+#define URING_ENTRIES           256     /* Submission entries */
+#define URING_RECV_BUFS         512     /* Receive buffers, power of 2 */
+#define URING_SEND_SLOTS        256     /* Responses being sent */
+#define URING_NAME_LEN          112     /* Room for the client address, keeps
+                                           the packet 8-byte aligned */
+
+/* Types of the io_uring operations, in the high 32 bits of user_data */
+#define URING_OP_RECV           1       /* Multishot receive, listener index */
+#define URING_OP_SEND           2       /* sendmsg(), send slot index */
+#define URING_OP_POLL           3       /* Multishot poll of epfd */
+#define URING_DATA(op, idx)     (((uint64_t)(op) << 32) | (uint32_t)(idx))
+#define URING_DATA_OP(data)     ((uint32_t)((data) >> 32))
+#define URING_DATA_INDEX(data)  ((uint32_t)(data))
+
+/* Interval(milliseconds) of the retransmit timer while transfers are active */
+#define XFER_TICK               5
+
+/* Time(microseconds) to drop a transfer without progress */
+#define XFER_TIMEOUT            (2 * 1000000)
+
+
+/*
+ * A fragmented request or response transferring with a client, identified by
+ * the client address and request ID. After a fragmented request is complete,
+ * the entry is kept until XFER_TIMEOUT to acknowledge duplicated fragments.
+ */
+struct dsc_xfer {
+    int in_use;                 /* 1 if the entry is used */
+    dsc_addr_t addr;            /* Client address */
+    uint32_t request_id;        /* ID of the request */
+    uint64_t expire;            /* Time(microseconds) to drop the entry */
+    int rx_active;              /* The request is being reassembled */
+    uint32_t rx_count;          /* Number of fragments of the request */
+    frag_rx_t rx;               /* Receiving side of the request */
+    int tx_active;              /* The response is being sent */
+    frag_tx_t tx;               /* Sending side of the response */
+    dsc_command_t *resp;        /* The response being sent, allocated */
+};
+
+
+/* A response kept to answer the request sent again by client */
+struct dsc_replay {
+    uint32_t request_id;        /* ID of the request */
+    uint16_t len;               /* Length of the response, 0 if empty */
+    uint16_t cap;               /* Size of the buffer */
+    int pending;                /* The request is queued or running in a
+                                   worker, no response yet */
+    uint8_t *pkt;               /* The response packet */
+};
+
+/* Number of clients in a set of the replay cache, refer find_replay() */
+#define REPLAY_WAYS             4
+
+/* The latest responses to a client address, its window of the replay cache */
+struct dsc_replay_client {
+    dsc_addr_t addr;                    /* Client address */
+    uint64_t used;                      /* When it's used last (a count of
+                                           the clients taken), 0 if empty */
+    uint32_t next;                      /* The entry the next request takes */
+    struct dsc_replay entries[DSC_REPLAY_WINDOW];   /* The responses */
+};
+
+/*
+ * Token bucket of a client address, 4 per cache line. The fields are updated
+ * with atomics, the buckets of a pool are shared by its serving threads.
+ */
+struct dsc_admit {
+    uint32_t key;               /* Client IP address, or hash of the name of
+                                   a local client */
+    uint32_t tokens;            /* Tokens left, 1000 per packet */
+    uint64_t last;              /* Time(microseconds) of the last refill, 0 if
+                                   the entry is empty */
+};
+
+
+/*
+ * Add to a counter of the server stats. Only the serving thread writes them,
+ * so no atomic read-modify-write is needed, the relaxed store only keeps the
+ * readers in other threads from seeing a torn value.
+ */
+#define STATS_ADD(field, n)     __atomic_store_n(&(field), \
+    __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+
+/* A response cached for a command, refer DSC_FLAG_CACHEABLE */
+struct dsc_resp_cache {
+    uint32_t gen;                       /* cache_gen of the command then */
+    uint16_t len;                       /* Length of the response, 0 if empty */
+    uint16_t cap;                       /* Size of the buffer */
+    uint32_t req_len;                   /* Data length of the request */
+    uint8_t req[DSC_CACHE_KEY_SIZE];    /* Data of the request */
+    uint8_t *pkt;                       /* The response, request ID is 0 */
+    uint16_t zlen;                      /* Length of the compressed response,
+                                           0 if it isn't compressed */
+    uint16_t zcap;                      /* Size of the buffer */
+    uint8_t *zpkt;                      /* The response compressed, for the
+                                           requests with DSC_FLAG_ACCEPT_LZ */
+};
+
+
+/* A request queued for the workers, refer server_set_workers() */
+struct dsc_work {
+    uint64_t seq;                       /* Position of the slot when it can be
+                                           written, position + 1 when written */
+    int fd;                             /* The socket the request comes from */
+    dsc_addr_t addr;                    /* Client address */
+    ssize_t len;                        /* Length of the request packet */
+    uint8_t buf[DSC_BUF_SIZE];          /* The request packet */
+};
+
+/*
+ * Bounded lock-free MPMC queue of requests (Vyukov's queue). The positions
+ * written by the serving thread and by the workers are in separate cache
+ * lines.
+ */
+struct dsc_workq {
+    uint64_t tail __attribute__((aligned(64)));     /* Next position written */
+    uint64_t head __attribute__((aligned(64)));     /* Next position read */
+    uint32_t futex __attribute__((aligned(64)));    /* Bumped to wake workers */
+    int sleepers;                       /* Workers waiting on the futex */
+    int stop;                           /* Set to stop the workers */
+    uint32_t size;                      /* Number of slots, power of 2 */
+    struct dsc_work slots[];            /* The requests */
+};
+
+/* A thread running the request handlers */
+struct dsc_worker {
+    dsc_server_t *s;                    /* The server */
+    struct dsc_workq *q;                /* The queue of the requests */
+    pthread_t tid;                      /* The thread */
+    int started;                        /* The thread is created */
+    dsc_stats_t stats;                  /* Stats of the requests it handles */
+    uint8_t resp_buf[DSC_BUF_SIZE];     /* Buffer of response */
+};
+
+/* A response larger than DSC_BUF_SIZE, sent by the serving thread */
+struct dsc_handoff {
+    struct dsc_handoff *next;           /* The next one in the list */
+    int fd;                             /* The socket to send from */
+    dsc_addr_t addr;                    /* Client address */
+    dsc_command_t *resp;                /* The response, allocated */
+};
+
+
+/* A response being sent by the io_uring backend */
+struct dsc_uring_send {
+    struct msghdr msg;                  /* Message of sendmsg() */
+    struct iovec iov;                   /* The response */
+    dsc_addr_t addr;                    /* Client address */
+    uint8_t buf[DSC_BUF_SIZE];          /* The response packet */
+};
+
+/* State of the io_uring backend of a server */
+struct dsc_uring_io {
+    dsc_uring_t ring;                   /* The io_uring instance */
+    struct msghdr recv_msg;             /* Layout of the received buffers */
+    int nfree;                          /* Number of free send slots */
+    int free[URING_SEND_SLOTS];         /* Indexes of the free send slots */
+    struct dsc_uring_send sends[URING_SEND_SLOTS];  /* Send slots */
+};
+
+
+/* State of an entry of the subscribers */
+#define SUB_EMPTY               0       /* Never used, ends a probe */
+#define SUB_USED                1       /* A subscriber */
+#define SUB_DEAD                2       /* Unsubscribed or expired */
+
+/* Period(microseconds) of the nonces of DSC_CMD_SUBSCRIBE, the one of the
+ * previous period is taken too */
+#define SUB_NONCE_PERIOD        30000000
+
+/* A client subscribed to the messages of server_publish() */
+struct dsc_sub {
+    dsc_addr_t addr;                    /* Client address */
+    int fd;                             /* The socket it subscribed through */
+    int state;                          /* SUB_* */
+    uint64_t expire;                    /* Time(microseconds) the lease ends */
+};
+
+/*
+ * Subscribers of a server, an open addressing hash table by client address
+ * with linear probing. The deleted entries are reused by the next inserts,
+ * and dropped when the table is rebuilt.
+ */
+struct dsc_subs {
+    uint32_t size;                      /* Number of entries, power of 2 */
+    uint32_t count;                     /* Number of subscribers */
+    uint32_t dead;                      /* Number of SUB_DEAD entries */
+    struct dsc_sub *entries;            /* The entries */
+    struct mmsghdr msgs[DSC_PUBLISH_BATCH]; /* Messages of sendmmsg() */
+};
+
+/* A message pushed to client, kept until client_recv_push() */
+struct dsc_push {
+    uint16_t len;                       /* Length of the packet */
+    uint8_t pkt[DSC_BUF_SIZE];          /* The packet */
+};
+
+
+/* Backend of the servers created, refer server_set_default_backend() */
+static int default_backend = DSC_BACKEND_EPOLL;
+
+static void uring_release(dsc_server_t *s);
+
+
+/* An asynchronous request in flight */
+struct dsc_inflight {
+    int in_use;                 /* 1 if the slot is used */
+    uint32_t request_id;        /* ID of the request */
+    void *cookie;               /* User data passed to client_submit() */
+    uint64_t deadline;          /* Time(microseconds) to give up */
+    uint64_t sent_at;           /* Time(microseconds) of the first send */
+    uint64_t retry_at;          /* Time(microseconds) to send it again */
+    int sends;                  /* Times sent */
+    uint16_t len;               /* Length of the request packet */
+    uint16_t cap;               /* Size of the buffer */
+    uint8_t *pkt;               /* The request packet, to send it again */
+    uint16_t nsubs;             /* Number of requests batched in the packet,
+                                   0 if it's not a batch */
+    uint16_t next_sub;          /* The next of them to complete */
+    uint32_t sub_off;           /* Offset of its response in the data */
+    void **cookies;             /* User data of the batched requests */
+    dsc_command_t *resp;        /* The response of the batch, being
+                                   completed */
+};
+
+/* States of a wait slot of a shared client, the futex word */
+#define CALL_FREE               0   /* Not used */
+#define CALL_BUSY               1   /* Owned by a caller, not waiting */
+#define CALL_WAITING            2   /* Waiting for the response */
+#define CALL_FILLING            3   /* The receiver is filling the response */
+#define CALL_DONE               4   /* The response or error is filled */
+
+/* Wait slot of a call on a shared client, one cache line per slot */
+struct dsc_call {
+    uint32_t state;             /* CALL_FREE, ..., the futex word */
+    uint32_t request_id;        /* ID of the request */
+    uint32_t gen;               /* Calls made in the slot, part of the ID */
+    int alloc;                  /* Allocate the response if it doesn't fit */
+    void *resp_buf;             /* The buffer of caller */
+    size_t cap;                 /* The size of the buffer */
+    dsc_command_t *large;       /* The response allocated, or NULL */
+    ssize_t len;                /* Length of the response, -1 on error */
+    int err;                    /* errno of the error */
+} __attribute__((aligned(64)));
+
+
+/******************************************************************************
+ * NAME:
+ *      now_usec
+ *
+ * DESCRIPTION: 
+ *      Get the time of the monotonic clock.
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      The time in microseconds
+ ******************************************************************************/
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      now_nsec
+ *
+ * DESCRIPTION: 
+ *      Get the time of the monotonic clock in nanoseconds.
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      The time in nanoseconds
+ ******************************************************************************/
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      is_loopback
+ *
+ * DESCRIPTION: 
+ *      Check if an address is a loopback address (127.0.0.0/8) or a local
+ *      socket, the packets from it never left the host.
+ *
+ * PARAMETERS:
+ *      addr - The address
+ *
+ * RETURN:
+ *      1 - Loopback, 0 - Others
+ ******************************************************************************/
+static inline int is_loopback(const dsc_addr_t *addr)
+{
+    if (addr->sa.sa_family == AF_UNIX) {
+        return 1;
+    }
+    return (ntohl(addr->in.sin_addr.s_addr) >> 24) == 127;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      addr_equal
+ *
+ * DESCRIPTION: 
+ *      Check if two addresses are the same peer.
+ *
+ * PARAMETERS:
+ *      a - An address
+ *      b - The other address
+ *
+ * RETURN:
+ *      1 - The same, 0 - Different
+ ******************************************************************************/
+static inline int addr_equal(const dsc_addr_t *a, const dsc_addr_t *b)
+{
+    if (a->sa.sa_family == AF_INET) {
+        return (b->sa.sa_family == AF_INET) &&
+            (a->in.sin_addr.s_addr == b->in.sin_addr.s_addr) &&
+            (a->in.sin_port == b->in.sin_port);
+    }
+    return (a->len == b->len) && (memcmp(&a->un, &b->un, a->len) == 0);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      same_source
+ *
+ * DESCRIPTION: 
+ *      Check if two addresses are on the same client host: the same IP
+ *      address on any port, or the same local socket.
+ *
+ * PARAMETERS:
+ *      a - An address
+ *      b - The other address
+ *
+ * RETURN:
+ *      1 - The same, 0 - Different
+ ******************************************************************************/
+static inline int same_source(const dsc_addr_t *a, const dsc_addr_t *b)
+{
+    if (a->sa.sa_family == AF_INET) {
+        return (b->sa.sa_family == AF_INET) &&
+            (a->in.sin_addr.s_addr == b->in.sin_addr.s_addr);
+    }
+    return addr_equal(a, b);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      addr_hash
+ *
+ * DESCRIPTION: 
+ *      Hash an address, the IP address and port, or the name of a local
+ *      socket (FNV-1a).
+ *
+ * PARAMETERS:
+ *      addr - The address
+ *
+ * RETURN:
+ *      The hash
+ ******************************************************************************/
+static inline uint32_t addr_hash(const dsc_addr_t *addr)
+{
+    const uint8_t *p = (const uint8_t *)addr->un.sun_path;
+    uint32_t h = 2166136261u;
+    socklen_t i;
+
+    if (addr->sa.sa_family == AF_INET) {
+        return (addr->in.sin_addr.s_addr * 0x9E3779B1u) ^
+            (addr->in.sin_port * 0x85EBCA6Bu);
+    }
+    for (i = offsetof(struct sockaddr_un, sun_path); i < addr->len; i++) {
+        h = (h ^ *p++) * 16777619u;
+    }
+    return h;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      addr_name
+ *
+ * DESCRIPTION: 
+ *      Format an address for the logs: "ip:port", the path of a local
+ *      socket, or "@name" for an abstract one.
+ *
+ * PARAMETERS:
+ *      addr - The address
+ *      buf  - Output, the text
+ *      size - The size of the buffer
+ *
+ * RETURN:
+ *      The text, buf
+ ******************************************************************************/
+static const char *addr_name(const dsc_addr_t *addr, char *buf, size_t size)
+{
+    int n;
+
+    if (addr->sa.sa_family == AF_INET) {
+        snprintf(buf, size, "%s:%d", inet_ntoa(addr->in.sin_addr),
+            ntohs(addr->in.sin_port));
+        return buf;
+    }
+
+    n = (int)(addr->len - offsetof(struct sockaddr_un, sun_path));
+    if ((n > 0) && (addr->un.sun_path[0] == '\0')) {
+        snprintf(buf, size, "@%.*s", n - 1, addr->un.sun_path + 1);
+    } else {
+        snprintf(buf, size, "%.*s", (n > 0) ? n : 0, addr->un.sun_path);
+    }
+    return buf;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      unix_addr
+ *
+ * DESCRIPTION: 
+ *      Make the address of a local socket, "@name" for an abstract name.
+ *
+ * PARAMETERS:
+ *      path - The path or "@name"
+ *      addr - Output, the address
+ *
+ * RETURN:
+ *      0 - OK, Others - Error (the name is empty or too long)
+ ******************************************************************************/
+static int unix_addr(const char *path, dsc_addr_t *addr)
+{
+    size_t n = strlen(path);
+
+    memset(addr, 0, sizeof(*addr));
+    if ((n == 0) || (n >= sizeof(addr->un.sun_path)) ||
+        ((path[0] == '@') && (n == 1))) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr->un.sun_family = AF_UNIX;
+    memcpy(addr->un.sun_path, path, n);
+    if (path[0] == '@') {
+        addr->un.sun_path[0] = '\0';
+        addr->len = offsetof(struct sockaddr_un, sun_path) + n;
+    } else {
+        addr->len = offsetof(struct sockaddr_un, sun_path) + n + 1;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      packet_crc32c
+ *
+ * DESCRIPTION: 
+ *      Compute the CRC32C checksum of a packet: the header before the
+ *      checksum field, then the data.
+ *
+ * PARAMETERS:
+ *      pkt - The packet
+ *      len - The length of the packet
+ *
+ * RETURN:
+ *      The CRC
+ ******************************************************************************/
+static uint32_t packet_crc32c(const dsc_command_t *pkt, size_t len)
+{
+    uint32_t crc;
+
+    crc = compute_crc32c(0, pkt, offsetof(dsc_command_t, checksum));
+    return compute_crc32c(crc, pkt + 1, len - sizeof(dsc_command_t));
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      seal_packet
+ *
+ * DESCRIPTION: 
+ *      Compute the checksum of a packet, by the integrity mode in its flags.
+ *
+ * PARAMETERS:
+ *      pkt - The packet
+ *      len - The length of the packet
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void seal_packet(dsc_command_t *pkt, size_t len)
+{
+    switch (pkt->flags & DSC_FLAG_INTEGRITY) {
+    case DSC_FLAG_CRC32C:
+        pkt->checksum = packet_crc32c(pkt, len);
+        break;
+    case DSC_FLAG_TRUSTED:
+        pkt->checksum = 0;
+        break;
+    default:
+        pkt->checksum = 0;
+        pkt->checksum = compute_checksum(pkt, len);
+        break;
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      verify_command_packet
+ *
+ * DESCRIPTION: 
+ *      Verify the data integrity of the command packet, by the integrity mode
+ *      in its flags. A packet without checksum (DSC_FLAG_TRUSTED) is taken
+ *      only if the peer is trusted.
+ *
+ * PARAMETERS:
+ *      buf     - The data of command packet
+ *      len     - The length of data
+ *      trusted - 1 if the peer is on a loopback address
+ *      stats   - The stats to count the invalid packet in, or NULL
+ *
+ * RETURN:
+ *      1 - OK, 0 - FAIL
+ ******************************************************************************/
+static int verify_command_packet(void *buf, size_t len, int trusted,
+    dsc_stats_t *stats)
+{
+    dsc_command_t *pkt;
+    int ok;
+
+    if (buf == NULL) {
+        return 0;
+    }
+    pkt = (dsc_command_t *)buf;
+
+    if (len < sizeof(dsc_command_t)) {
+        if (stats != NULL) {
+            STATS_ADD(stats->drop_length, 1);
+        }
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_WARN,
+            "invalid length of packet (%ld)\n", len);
+        return 0;
+    }
+
+    if (pkt->signature != DSC_SIGNATURE) {
+        if (stats != NULL) {
+            STATS_ADD(stats->drop_signature, 1);
+        }
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_WARN,
+            "invalid signature of packet (0x%08X)\n", pkt->signature);
+        return 0;
+    }
+
+    if (pkt->data_len + sizeof(dsc_command_t) != len) {
+        if (stats != NULL) {
+            STATS_ADD(stats->drop_length, 1);
+        }
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_WARN,
+            "invalid length of packet (%ld:%ld)\n",
+            pkt->data_len + sizeof(dsc_command_t), len);
+        return 0;
+    }
+
+    switch (pkt->flags & DSC_FLAG_INTEGRITY) {
+    case 0:
+        ok = (compute_checksum(buf, len) == 0);
+        break;
+    case DSC_FLAG_CRC32C:
+        ok = (packet_crc32c(pkt, len) == pkt->checksum);
+        break;
+    case DSC_FLAG_TRUSTED:
+        ok = trusted;
+        break;
+    default:
+        ok = 0;
+        break;
+    }
+    if (!ok) {
+        if (stats != NULL) {
+            STATS_ADD(stats->drop_checksum, 1);
+        }
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_WARN, "invalid checksum of packet\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      compress_packet
+ *
+ * DESCRIPTION: 
+ *      Compress the data of a packet, if it gets shorter and fits in one
+ *      datagram. The checksum is not computed.
+ *
+ * PARAMETERS:
+ *      pkt - The packet
+ *      out - Output, the packet compressed, DSC_BUF_SIZE bytes
+ *
+ * RETURN:
+ *      The length of the packet compressed, 0 if it is sent as is.
+ ******************************************************************************/
+static ssize_t compress_packet(dsc_command_t *pkt, uint8_t *out)
+{
+    dsc_command_t *z = (dsc_command_t *)out;
+    size_t hdr_len = sizeof(dsc_command_t) + sizeof(dsc_lz_t);
+    size_t cap, zlen;
+
+    /* Keep at least one byte, or it's not worth the decompression */
+    if (pkt->data_len <= sizeof(dsc_lz_t) + 1) {
+        return 0;
+    }
+    cap = pkt->data_len - sizeof(dsc_lz_t) - 1;
+    if (cap > DSC_BUF_SIZE - hdr_len) {
+        cap = DSC_BUF_SIZE - hdr_len;
+    }
+
+    zlen = lz_compress(pkt + 1, pkt->data_len, out + hdr_len, cap);
+    if (zlen == 0) {
+        return 0;
+    }
+    *z = *pkt;
+    z->flags |= DSC_FLAG_COMPRESSED;
+    z->data_len = sizeof(dsc_lz_t) + zlen;
+    ((dsc_lz_t *)(z + 1))->raw_len = pkt->data_len;
+
+    return hdr_len + zlen;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      decompressed_len
+ *
+ * DESCRIPTION: 
+ *      Get the length of a packet with DSC_FLAG_COMPRESSED once decompressed.
+ *
+ * PARAMETERS:
+ *      pkt - The packet, verified
+ *
+ * RETURN:
+ *      The length, 0 if the packet is invalid.
+ ******************************************************************************/
+static size_t decompressed_len(dsc_command_t *pkt)
+{
+    uint32_t raw_len;
+
+    if (pkt->data_len < sizeof(dsc_lz_t)) {
+        return 0;
+    }
+    raw_len = ((dsc_lz_t *)(pkt + 1))->raw_len;
+    if (raw_len > DSC_MAX_MSG_SIZE) {
+        return 0;
+    }
+
+    return sizeof(dsc_command_t) + raw_len;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      decompress_packet
+ *
+ * DESCRIPTION: 
+ *      Decompress a packet with DSC_FLAG_COMPRESSED, the flag is cleared.
+ *
+ * PARAMETERS:
+ *      pkt - The packet, verified
+ *      out - Output, the packet decompressed, not overlapping pkt
+ *      cap - The size of the output
+ *
+ * RETURN:
+ *      The length of the packet decompressed, -1 on error (errno is EMSGSIZE
+ *      if it doesn't fit in cap, EINVAL if the data is invalid).
+ ******************************************************************************/
+static ssize_t decompress_packet(dsc_command_t *pkt, void *out, size_t cap)
+{
+    dsc_command_t *raw = (dsc_command_t *)out;
+    size_t len = decompressed_len(pkt);
+    ssize_t raw_len;
+
+    if (len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len > cap) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    raw_len = len - sizeof(dsc_command_t);
+    if (lz_decompress((uint8_t *)(pkt + 1) + sizeof(dsc_lz_t),
+        pkt->data_len - sizeof(dsc_lz_t), raw + 1, raw_len) != raw_len) {
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_WARN, "invalid compressed packet\n");
+        errno = EINVAL;
+        return -1;
+    }
+    *raw = *pkt;
+    raw->flags &= ~DSC_FLAG_COMPRESSED;
+    raw->data_len = raw_len;
+
+    return len;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      cmd_stats
+ *
+ * DESCRIPTION: 
+ *      Get the stats of a command.
+ *
+ * PARAMETERS:
+ *      st      - The stats of the thread handling the request
+ *      command - The command
+ *
+ * RETURN:
+ *      The stats of the command, the shared one for the commands out of the
+ *      range of the handlers.
+ ******************************************************************************/
+static inline dsc_cmd_stats_t *cmd_stats(dsc_stats_t *st, uint32_t command)
+{
+    uint32_t idx = command - DSC_CMD_BASE;
+
+    if (idx >= DSC_MAX_COMMANDS) {
+        idx = DSC_MAX_COMMANDS;
+    }
+    return &st->cmds[idx];
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      latency_bucket
+ *
+ * DESCRIPTION: 
+ *      Get the histogram bucket of a latency, refer DSC_LATENCY_BUCKETS.
+ *
+ * PARAMETERS:
+ *      nsec - The latency in nanoseconds
+ *
+ * RETURN:
+ *      The index of the bucket
+ ******************************************************************************/
+static inline int latency_bucket(uint64_t nsec)
+{
+    int i = 63 - __builtin_clzll(nsec | 1);
+
+    return (i < DSC_LATENCY_BUCKETS) ? i : DSC_LATENCY_BUCKETS - 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      open_socket
+ *
+ * DESCRIPTION: 
+ *      Create a socket of server and bind it to the port.
+ *
+ * PARAMETERS:
+ *      port      - The port number of server
+ *      timeout   - Timeout value(seconds) of recvfrom operation while waiting
+ *                  for request from client, -1 to wait forever.
+ *      reuseport - Set SO_REUSEPORT to share the port with other sockets.
+ *      addr      - Output, the address bound
+ *
+ * RETURN:
+ *      The socket fd, -1 on error.
+ ******************************************************************************/
+static int open_socket(int port, int timeout, int reuseport,
+    struct sockaddr_in *addr)
+{
+    int fd, rc;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr.s_addr = htonl(INADDR_ANY);
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        DSC_LOG_ERROR("socket error: %m\n");
+        return -1;
+    }
+
+    /* Set the timeout value of recvfrom operation. */
+    if (timeout >= 0) {
+        struct timeval tv;
+        tv.tv_sec = timeout;
+        tv.tv_usec = 0;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+            DSC_LOG_ERROR("Set recv timeout error: %m\n");
+            close(fd);
+            return -1;
+        }
+    }
+
+    /* Avoid "Address already in use" error in bind() */
+    int val = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) == -1) {
+        DSC_LOG_ERROR("setsockopt error: %m\n");
+        close(fd);
+        return -1;
+    }
+
+    /* Let the kernel spread the requests over the sockets on the same port */
+    if (reuseport && (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val,
+        sizeof(val)) == -1)) {
+        DSC_LOG_ERROR("setsockopt error: %m\n");
+        close(fd);
+        return -1;
+    }
+
+    rc = bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+    if (rc != 0) {
+        DSC_LOG_ERROR("bind error: %m\n");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_create
+ *
+ * DESCRIPTION: 
+ *      Allocate the server info, create the socket and bind it to the port.
+ *
+ * PARAMETERS:
+ *      req_handler - The function pointer of a user-defined request handler,
+ *                    which allocates the response.
+ *      buf_handler - The function pointer of a user-defined request handler,
+ *                    which fills the response in a server-owned buffer. At
+ *                    most one of the handlers is used, the other one is NULL.
+ *      port        - The port number of server
+ *      timeout     - Timeout value(seconds) of recvfrom operation while waiting
+ *                    for request from client, -1 to wait forever.
+ *      reuseport   - Set SO_REUSEPORT to share the port with other sockets.
+ *
+ * RETURN:
+ *      A pointer of server info.
+ ******************************************************************************/
+static dsc_server_t *server_create(request_handler_t req_handler,
+    request_buf_handler_t buf_handler, int port, int timeout, int reuseport)
+{
+    dsc_server_t *s;
+    struct epoll_event ev;
+
+    s = (dsc_server_t *)malloc(sizeof(dsc_server_t));
+    if (s == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        return NULL;
+    }
+    memset(s, 0, sizeof(dsc_server_t));
+    s->epfd = -1;
+    s->evfd = -1;
+    s->xfer_timerfd = -1;
+    s->wake_fd = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->sub_lock, NULL);
+    s->reuseport = reuseport;
+    s->batch_size = DSC_BATCH_MAX;
+    s->compress_min = DSC_COMPRESS_MIN;
+    s->replay_wanted = DSC_REPLAY_CACHE_SIZE / DSC_REPLAY_WINDOW;
+    s->xfer_max_msg = DSC_MAX_MSG_SIZE;
+    s->xfer_mem_max = DSC_REASSEMBLY_MEM;
+    s->xfer_mem = &s->xfer_mem_own;
+    s->sub_max_lease = DSC_SUB_LEASE;
+    s->admit = &s->admit_own;
+    if (getrandom(&s->sub_secret, sizeof(s->sub_secret), GRND_NONBLOCK) !=
+        sizeof(s->sub_secret)) {
+        s->sub_secret = now_nsec() ^ ((uint64_t)getpid() << 32);
+    }
+
+    /* Setup request handler */
+    s->request_handler = req_handler;
+    s->request_buf_handler = buf_handler;
+
+    s->sockfd = open_socket(port, timeout, reuseport, &s->addr);
+    if (s->sockfd < 0) {
+        free(s);
+        return NULL;
+    }
+    s->listen_fds[s->nlisteners++] = s->sockfd;
+
+    /* The eventfd is written by server_stop() to wake up server_run() */
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    s->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((s->epfd < 0) || (s->evfd < 0)) {
+        DSC_LOG_ERROR("epoll/eventfd error: %m\n");
+        server_close(s);
+        return NULL;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = SERVER_EV_STOP;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->evfd, &ev) != 0) {
+        DSC_LOG_ERROR("epoll_ctl error: %m\n");
+        server_close(s);
+        return NULL;
+    }
+    ev.data.u32 = SERVER_EV_LISTENER;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->sockfd, &ev) != 0) {
+        DSC_LOG_ERROR("epoll_ctl error: %m\n");
+        server_close(s);
+        return NULL;
+    }
+
+    /* The retransmit timer is armed only while transfers are active */
+    s->xfer_timerfd = timerfd_create(CLOCK_MONOTONIC,
+        TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s->xfer_timerfd < 0) {
+        DSC_LOG_ERROR("timerfd_create error: %m\n");
+        server_close(s);
+        return NULL;
+    }
+    ev.data.u32 = SERVER_EV_XFER;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->xfer_timerfd, &ev) != 0) {
+        DSC_LOG_ERROR("epoll_ctl error: %m\n");
+        server_close(s);
+        return NULL;
+    }
+
+    if (default_backend != DSC_BACKEND_EPOLL) {
+        server_set_backend(s, default_backend);
+    }
+
+    return s;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_init
+ *
+ * DESCRIPTION: 
+ *      Do some initialzation work for server.
+ *
+ * PARAMETERS:
+ *      req_handler - The function pointer of a user-defined request handler.
+ *      port        - The port number of server
+ *      timeout     - Timeout value(seconds) of recvfrom operation while waiting
+ *                    for request from client.
+ *
+ * RETURN:
+ *      A pointer of server info.
+ ******************************************************************************/
+dsc_server_t *server_init(request_handler_t req_handler, int port, int timeout)
+{
+    if (req_handler == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return NULL;
+    }
+
+    return server_create(req_handler, NULL, port, timeout, 0);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_init_buf
+ *
+ * DESCRIPTION: 
+ *      The same as server_init, but the request handler fills the response in
+ *      a buffer owned by the server, so no memory is allocated per request.
+ *
+ * PARAMETERS:
+ *      buf_handler - The function pointer of a user-defined request handler,
+ *                    it handles the commands without a handler registered by
+ *                    server_register_handler(). NULL to answer them with
+ *                    STATUS_INVALID_COMMAND.
+ *      port        - The port number of server
+ *      timeout     - Timeout value(seconds) of recvfrom operation while waiting
+ *                    for request from client.
+ *
+ * RETURN:
+ *      A pointer of server info.
+ ******************************************************************************/
+dsc_server_t *server_init_buf(request_buf_handler_t buf_handler, int port,
+    int timeout)
+{
+    return server_create(NULL, buf_handler, port, timeout, 0);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      find_sub
+ *
+ * DESCRIPTION: 
+ *      Find the entry of a client in the subscribers, or the entry to insert
+ *      it: the first deleted one on the probe, or the empty one ending it.
+ *
+ * PARAMETERS:
+ *      subs - The subscribers
+ *      addr - Client address
+ *
+ * RETURN:
+ *      The entry, its state is SUB_USED if the client is found.
+ ******************************************************************************/
+static struct dsc_sub *find_sub(struct dsc_subs *subs, dsc_addr_t *addr)
+{
+    struct dsc_sub *e = NULL, *free_entry = NULL;
+    uint32_t i, h;
+
+    h = addr_hash(addr);
+    for (i = 0; i < subs->size; i++) {
+        e = &subs->entries[(h + i) & (subs->size - 1)];
+        if (e->state == SUB_EMPTY) {
+            break;
+        }
+        if (e->state == SUB_DEAD) {
+            if (free_entry == NULL) {
+                free_entry = e;
+            }
+            continue;
+        }
+        if (addr_equal(&e->addr, addr)) {
+            return e;
+        }
+    }
+
+    return (free_entry != NULL) ? free_entry : e;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      resize_subs
+ *
+ * DESCRIPTION: 
+ *      Rebuild the table of subscribers with a new size, the deleted and
+ *      expired entries are dropped.
+ *
+ * PARAMETERS:
+ *      subs - The subscribers
+ *      size - The new number of entries, power of 2
+ *      now  - Time(microseconds) now
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int resize_subs(struct dsc_subs *subs, uint32_t size, uint64_t now)
+{
+    struct dsc_sub *old = subs->entries;
+    uint32_t i, old_size = subs->size;
+
+    subs->entries = (struct dsc_sub *)calloc(size, sizeof(struct dsc_sub));
+    if (subs->entries == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        subs->entries = old;
+        return -1;
+    }
+    subs->size = size;
+    subs->count = 0;
+    subs->dead = 0;
+    for (i = 0; i < old_size; i++) {
+        if ((old[i].state == SUB_USED) && (old[i].expire > now)) {
+            *find_sub(subs, &old[i].addr) = old[i];
+            subs->count++;
+        }
+    }
+    free(old);
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      sub_nonce
+ *
+ * DESCRIPTION: 
+ *      Get the nonce of DSC_CMD_SUBSCRIBE for a client address in a period,
+ *      keyed by the secret of the server so it can't be guessed by a client
+ *      which doesn't receive it.
+ *
+ * PARAMETERS:
+ *      s      - A pointer of server info
+ *      addr   - Client address
+ *      period - The period, refer SUB_NONCE_PERIOD
+ *
+ * RETURN:
+ *      The nonce, never 0
+ ******************************************************************************/
+static uint32_t sub_nonce(const dsc_server_t *s, const dsc_addr_t *addr,
+    uint64_t period)
+{
+    uint64_t h;
+
+    if (addr->sa.sa_family == AF_INET) {
+        h = ((uint64_t)addr->in.sin_addr.s_addr << 16) | addr->in.sin_port;
+    } else {
+        h = addr_hash(addr);
+    }
+
+    /* Two rounds of the finalizer of MurmurHash3, the key mixed in each */
+    h ^= s->sub_secret;
+    h = (h ^ (h >> 33)) * 0xFF51AFD7ED558CCDull;
+    h = (h ^ (h >> 33)) * 0xC4CEB9FE1A85EC53ull;
+    h ^= (h >> 33) ^ period ^ (s->sub_secret >> 7);
+    h = (h ^ (h >> 33)) * 0xFF51AFD7ED558CCDull;
+    h = (h ^ (h >> 33)) * 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+
+    return (uint32_t)h | 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      check_sub_nonce
+ *
+ * DESCRIPTION: 
+ *      Check the nonce echoed by DSC_CMD_SUBSCRIBE or DSC_CMD_UNSUBSCRIBE,
+ *      the one of this period or the previous one is taken.
+ *
+ * PARAMETERS:
+ *      s      - A pointer of server info
+ *      addr   - Client address
+ *      nonce  - The nonce of the request, 0 if none
+ *      period - The current period, refer SUB_NONCE_PERIOD
+ *
+ * RETURN:
+ *      1 - Valid, 0 - Invalid
+ ******************************************************************************/
+static int check_sub_nonce(const dsc_server_t *s, const dsc_addr_t *addr,
+    uint32_t nonce, uint64_t period)
+{
+    return (nonce != 0) && ((nonce == sub_nonce(s, addr, period)) ||
+        (nonce == sub_nonce(s, addr, period - 1)));
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      subscribe
+ *
+ * DESCRIPTION: 
+ *      Add a client to the subscribers, or renew its lease.
+ *
+ * PARAMETERS:
+ *      s     - A pointer of server info
+ *      fd    - The socket the request comes from, the messages are sent
+ *              from it
+ *      addr  - Client address
+ *      lease - Lease(seconds) of the subscription
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int subscribe(dsc_server_t *s, int fd, dsc_addr_t *addr,
+    uint32_t lease)
+{
+    struct dsc_subs *subs;
+    struct dsc_sub *e;
+    uint64_t now = now_usec();
+    uint32_t size;
+
+    pthread_mutex_lock(&s->sub_lock);
+    subs = s->subs;
+    if (subs == NULL) {
+        subs = (struct dsc_subs *)calloc(1, sizeof(struct dsc_subs));
+        if (subs == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            pthread_mutex_unlock(&s->sub_lock);
+            return -1;
+        }
+        if (resize_subs(subs, 64, now) != 0) {
+            free(subs);
+            pthread_mutex_unlock(&s->sub_lock);
+            return -1;
+        }
+        s->subs = subs;
+    }
+
+    e = find_sub(subs, addr);
+    if (e->state != SUB_USED) {
+        if (subs->count >= DSC_MAX_SUBSCRIBERS) {
+            DSC_LOG_LIMITED(DSC_LOG_LEVEL_WARN, "too many subscribers\n");
+            pthread_mutex_unlock(&s->sub_lock);
+            return -1;
+        }
+
+        /* Keep the table no more than 3/4 full, deleted entries included */
+        if ((subs->count + subs->dead + 1) * 4 > subs->size * 3) {
+            size = 64;
+            while (size < (subs->count + 1) * 2) {
+                size <<= 1;
+            }
+            if (resize_subs(subs, size, now) != 0) {
+                pthread_mutex_unlock(&s->sub_lock);
+                return -1;
+            }
+            e = find_sub(subs, addr);
+        }
+        if (e->state == SUB_DEAD) {
+            subs->dead--;
+        }
+        e->addr = *addr;
+        e->state = SUB_USED;
+        subs->count++;
+    }
+    e->fd = fd;
+    e->expire = now + (uint64_t)lease * 1000000;
+    pthread_mutex_unlock(&s->sub_lock);
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      unsubscribe
+ *
+ * DESCRIPTION: 
+ *      Remove a client from the subscribers.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      addr - Client address
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void unsubscribe(dsc_server_t *s, dsc_addr_t *addr)
+{
+    struct dsc_sub *e;
+
+    pthread_mutex_lock(&s->sub_lock);
+    if (s->subs != NULL) {
+        e = find_sub(s->subs, addr);
+        if (e->state == SUB_USED) {
+            e->state = SUB_DEAD;
+            s->subs->count--;
+            s->subs->dead++;
+        }
+    }
+    pthread_mutex_unlock(&s->sub_lock);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      send_batch
+ *
+ * DESCRIPTION: 
+ *      Send the messages of a batch of server_publish().
+ *
+ * PARAMETERS:
+ *      msgs - The messages
+ *      n    - Number of messages
+ *      fd   - The socket to send from
+ *
+ * RETURN:
+ *      The number of messages sent
+ ******************************************************************************/
+static int send_batch(struct mmsghdr *msgs, int n, int fd)
+{
+    int rc, sent = 0;
+
+    while (sent < n) {
+        rc = sendmmsg(fd, &msgs[sent], n - sent, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DSC_LOG_LIMITED(DSC_LOG_LEVEL_ERROR, "sendmmsg error: %m\n");
+
+            /* Skip the failed one, e.g. a local subscriber which is gone */
+            msgs++;
+            n--;
+            continue;
+        }
+        sent += rc;
+    }
+
+    return sent;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      fan_out
+ *
+ * DESCRIPTION: 
+ *      Send a packet to all subscribers of a server, the expired ones are
+ *      removed. All messages share the packet, only the address differs, so
+ *      the cost per subscriber is one entry of sendmmsg().
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      iov - The packet, encoded and checksummed
+ *      now - Time(microseconds) now
+ *
+ * RETURN:
+ *      The number of subscribers the packet is sent to
+ ******************************************************************************/
+static int fan_out(dsc_server_t *s, struct iovec *iov, uint64_t now)
+{
+    struct dsc_subs *subs;
+    struct dsc_sub *e;
+    uint32_t i;
+    int n = 0, fd = -1, sent = 0;
+
+    pthread_mutex_lock(&s->sub_lock);
+    subs = s->subs;
+    for (i = 0; (subs != NULL) && (i < subs->size); i++) {
+        e = &subs->entries[i];
+        if (e->state != SUB_USED) {
+            continue;
+        }
+        if (e->expire <= now) {
+            e->state = SUB_DEAD;
+            subs->count--;
+            subs->dead++;
+            continue;
+        }
+
+        /* A batch is sent from one socket */
+        if ((n == DSC_PUBLISH_BATCH) || ((n > 0) && (e->fd != fd))) {
+            sent += send_batch(subs->msgs, n, fd);
+            n = 0;
+        }
+        fd = e->fd;
+        memset(&subs->msgs[n].msg_hdr, 0, sizeof(struct msghdr));
+        subs->msgs[n].msg_hdr.msg_name = &e->addr;
+        subs->msgs[n].msg_hdr.msg_namelen = e->addr.len;
+        subs->msgs[n].msg_hdr.msg_iov = iov;
+        subs->msgs[n].msg_hdr.msg_iovlen = 1;
+        n++;
+    }
+    if (n > 0) {
+        sent += send_batch(subs->msgs, n, fd);
+    }
+    pthread_mutex_unlock(&s->sub_lock);
+
+    return sent;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      encode_push
+ *
+ * DESCRIPTION: 
+ *      Encode the packet of server_publish(), once for all subscribers.
+ *
+ * PARAMETERS:
+ *      buf  - The buffer of the packet, DSC_BUF_SIZE bytes
+ *      cmd  - The command
+ *      data - The data of the message
+ *      len  - The data length
+ *      iov  - Output, the packet
+ *
+ * RETURN:
+ *      0 - OK, Others - Error (the message doesn't fit in one datagram)
+ ******************************************************************************/
+static int encode_push(uint8_t *buf, uint32_t cmd, const void *data,
+    uint32_t len, struct iovec *iov)
+{
+    dsc_command_t *pkt = (dsc_command_t *)buf;
+
+    if ((len > DSC_BUF_SIZE - sizeof(dsc_command_t)) ||
+        ((len > 0) && (data == NULL))) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+    pkt->signature = DSC_SIGNATURE;
+    pkt->command = cmd;
+    pkt->data_len = len;
+    pkt->request_id = 0;
+    pkt->flags = DSC_FLAG_PUSH;
+    memcpy(pkt + 1, data, len);
+    pkt->checksum = 0;
+    pkt->checksum = compute_checksum(pkt, sizeof(dsc_command_t) + len);
+    iov->iov_base = pkt;
+    iov->iov_len = sizeof(dsc_command_t) + len;
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_publish
+ *
+ * DESCRIPTION: 
+ *      Push a message to the clients subscribed with DSC_CMD_SUBSCRIBE. The
+ *      packet is encoded once and sent to the subscribers with sendmmsg(),
+ *      up to DSC_PUBLISH_BATCH per call. The subscribers whose lease ended
+ *      are removed. If the server is in a pool, the message is pushed to the
+ *      subscribers of all servers of the pool. It can be called from any
+ *      thread, e.g. from a request handler. The push is not retransmitted,
+ *      a message lost is not seen by the subscriber.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      cmd  - The command of the message
+ *      data - The data of the message
+ *      len  - The data length, no more than DSC_BUF_SIZE - header
+ *
+ * RETURN:
+ *      The number of subscribers the message is sent to, -1 on error.
+ ******************************************************************************/
+int server_publish(dsc_server_t *s, uint32_t cmd, const void *data,
+    uint32_t len)
+{
+    uint8_t buf[DSC_BUF_SIZE];
+    struct iovec iov;
+
+    if (s == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+    if (s->pool != NULL) {
+        return server_pool_publish(s->pool, cmd, data, len);
+    }
+    if (encode_push(buf, cmd, data, len, &iov) != 0) {
+        return -1;
+    }
+
+    return fan_out(s, &iov, now_usec());
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      dispatch_request
+ *
+ * DESCRIPTION: 
+ *      Pass a request to its handler: the handler registered for the command,
+ *      or the request handler of the server if no handler is registered. If
+ *      neither exists, answer STATUS_INVALID_COMMAND without user code.
+ *
+ * PARAMETERS:
+ *      s        - A pointer of server info
+ *      fd       - The socket which the request comes from
+ *      addr     - The client address
+ *      req      - The request packet
+ *      resp_buf - The buffer of response packet, DSC_BUF_SIZE bytes
+ *
+ * RETURN:
+ *      The response packet (in resp_buf, or allocated for a response larger
+ *      than DSC_BUF_SIZE or by the request handler), NULL if the handler fails.
+ ******************************************************************************/
+static dsc_command_t *dispatch_request(dsc_server_t *s, int fd,
+    dsc_addr_t *addr, dsc_command_t *req, uint8_t *resp_buf)
+{
+    dsc_command_t *resp = (dsc_command_t *)resp_buf;
+    request_buf_handler_t handler = NULL;
+    size_t cap = DSC_BUF_SIZE;
+    uint32_t idx;
+    int rc;
+
+    /*
+     * Reserved command, the response is sent in fragments. The source address
+     * of a remote request may be forged, don't reflect the large response to
+     * it unless the server allows (server_set_remote_stats())
+     */
+    if (req->command == DSC_CMD_GET_STATS) {
+        if (!is_loopback(addr) &&
+            !__atomic_load_n(&s->remote_stats, __ATOMIC_RELAXED)) {
+            resp->status = STATUS_INVALID_COMMAND;
+            resp->data_len = 0;
+            resp->flags = 0;
+            return resp;
+        }
+        resp = (dsc_command_t *)malloc(sizeof(dsc_command_t) +
+            sizeof(dsc_stats_t));
+        if (resp == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            return NULL;
+        }
+        server_get_stats(s, (dsc_stats_t *)(resp + 1));
+        resp->status = STATUS_SUCCESS;
+        resp->data_len = sizeof(dsc_stats_t);
+        resp->flags = 0;
+        return resp;
+    }
+
+    /* Reserved commands of the subscriptions, refer server_publish() */
+    if (req->command == DSC_CMD_SUBSCRIBE) {
+        dsc_subscribe_t *sub = (dsc_subscribe_t *)(resp + 1);
+        uint32_t lease = DSC_SUB_LEASE, nonce = 0, max_lease;
+        uint64_t period = now_usec() / SUB_NONCE_PERIOD;
+
+        if (req->data_len >= sizeof(dsc_subscribe_t)) {
+            if (((dsc_subscribe_t *)(req + 1))->lease > 0) {
+                lease = ((dsc_subscribe_t *)(req + 1))->lease;
+            }
+            nonce = ((dsc_subscribe_t *)(req + 1))->nonce;
+        }
+        max_lease = __atomic_load_n(&s->sub_max_lease, __ATOMIC_RELAXED);
+        if (lease > max_lease) {
+            lease = max_lease;
+        }
+        resp->flags = 0;
+        resp->data_len = sizeof(dsc_subscribe_t);
+        sub->lease = lease;
+        sub->nonce = 0;
+
+        /*
+         * The pushes go to the address of the request, which may be forged:
+         * subscribe it only once it echoes the nonce sent to it, the
+         * response of the challenge is no larger than the request
+         */
+        if (!check_sub_nonce(s, addr, nonce, period)) {
+            sub->nonce = sub_nonce(s, addr, period);
+            resp->status = STATUS_CHALLENGE;
+        } else if (subscribe(s, fd, addr, lease) == 0) {
+            resp->status = STATUS_SUCCESS;
+        } else {
+            resp->data_len = 0;
+            resp->status = STATUS_ERROR;
+        }
+        return resp;
+    }
+    if (req->command == DSC_CMD_UNSUBSCRIBE) {
+        dsc_subscribe_t *sub = (dsc_subscribe_t *)(resp + 1);
+        uint32_t nonce = 0;
+        uint64_t period = now_usec() / SUB_NONCE_PERIOD;
+
+        if (req->data_len >= sizeof(dsc_subscribe_t)) {
+            nonce = ((dsc_subscribe_t *)(req + 1))->nonce;
+        }
+        resp->flags = 0;
+
+        /* Likewise, a forged request shall not drop the subscriber */
+        if (!check_sub_nonce(s, addr, nonce, period)) {
+            sub->lease = 0;
+            sub->nonce = sub_nonce(s, addr, period);
+            resp->data_len = sizeof(dsc_subscribe_t);
+            resp->status = STATUS_CHALLENGE;
+        } else {
+            unsubscribe(s, addr);
+            resp->data_len = 0;
+            resp->status = STATUS_SUCCESS;
+        }
+        return resp;
+    }
+
+    /* The commands start from DSC_CMD_BASE, smaller ones wrap to huge index */
+    idx = req->command - DSC_CMD_BASE;
+    if (idx < DSC_MAX_COMMANDS) {
+        handler = __atomic_load_n(&s->handlers[idx], __ATOMIC_ACQUIRE);
+    }
+    if (handler == NULL) {
+        handler = s->request_buf_handler;
+    }
+
+    if (handler != NULL) {
+        resp->flags = 0;
+        rc = handler(req, resp, cap);
+
+        /* The response doesn't fit, call the handler again with a larger one */
+        if ((rc > DSC_BUF_SIZE) &&
+            ((size_t)rc <= sizeof(dsc_command_t) + DSC_MAX_MSG_SIZE)) {
+            cap = rc;
+            resp = (dsc_command_t *)malloc(cap);
+            if (resp == NULL) {
+                DSC_LOG_ERROR("malloc error: %m\n");
+                return NULL;
+            }
+            resp->flags = 0;
+            rc = handler(req, resp, cap);
+        }
+
+        if ((rc != 0) || (resp->data_len > cap - sizeof(dsc_command_t))) {
+            if (resp != (dsc_command_t *)resp_buf) {
+                free(resp);
+            }
+            return NULL;
+        }
+        return resp;
+    }
+
+    if (s->request_handler != NULL) {
+        /* The allocated response is never cached */
+        resp = s->request_handler(req);
+        if (resp != NULL) {
+            resp->flags = 0;
+        }
+        return resp;
+    }
+
+    resp->status = STATUS_INVALID_COMMAND;
+    resp->data_len = 0;
+    resp->flags = 0;
+    return resp;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      dispatch_multi
+ *
+ * DESCRIPTION: 
+ *      Run the requests of a multi-command packet (DSC_CMD_MULTI) in order,
+ *      and pack their responses into one response. Every request is counted
+ *      in the stats of its own command. The response is built in resp_buf,
+ *      and moved to allocated memory if it gets larger, to be sent in
+ *      fragments.
+ *
+ * PARAMETERS:
+ *      s        - A pointer of server info
+ *      st       - The stats of the thread handling the request
+ *      fd       - The socket which the request comes from
+ *      addr     - The client address
+ *      req      - The multi-command request, decompressed
+ *      resp_buf - The buffer of response packet, DSC_BUF_SIZE bytes
+ *
+ * RETURN:
+ *      The response, NULL if the request is malformed or on error. If it is
+ *      not resp_buf, the caller need to free the memory.
+ ******************************************************************************/
+static dsc_command_t *dispatch_multi(dsc_server_t *s, dsc_stats_t *st, int fd,
+    dsc_addr_t *addr, dsc_command_t *req, uint8_t *resp_buf)
+{
+    uint8_t sub_buf[DSC_BUF_SIZE];
+    uint8_t *in = (uint8_t *)(req + 1), *out = resp_buf, *grown;
+    dsc_command_t *sub, *r, *packed;
+    dsc_cmd_stats_t *cs;
+    size_t off = 0, used = sizeof(dsc_command_t), cap = DSC_BUF_SIZE;
+    size_t len, need;
+    uint64_t start;
+
+    while (off < req->data_len) {
+        /* Every request shall be within the data */
+        sub = (dsc_command_t *)(in + off);
+        if ((req->data_len - off < sizeof(dsc_command_t)) ||
+            (sub->data_len > req->data_len - off - sizeof(dsc_command_t))) {
+            goto error;
+        }
+        off += DSC_MULTI_PAD(sizeof(dsc_command_t) + sub->data_len);
+
+        cs = cmd_stats(st, sub->command);
+        STATS_ADD(cs->requests, 1);
+        STATS_ADD(cs->bytes_in, sizeof(dsc_command_t) + sub->data_len);
+        start = now_nsec();
+        if (sub->command != DSC_CMD_MULTI) {
+            r = dispatch_request(s, fd, addr, sub, sub_buf);
+        } else {
+            /* No nesting */
+            r = (dsc_command_t *)sub_buf;
+            r->status = STATUS_INVALID_COMMAND;
+            r->data_len = 0;
+        }
+        STATS_ADD(cs->latency[latency_bucket(now_nsec() - start)], 1);
+        if (r == NULL) {
+            r = (dsc_command_t *)sub_buf;
+            r->status = STATUS_ERROR;
+            r->data_len = 0;
+        }
+        if (r->status != STATUS_SUCCESS) {
+            STATS_ADD(cs->errors, 1);
+        }
+        len = sizeof(dsc_command_t) + r->data_len;
+        STATS_ADD(cs->bytes_out, len);
+
+        /* Move the response to a larger buffer */
+        need = used + DSC_MULTI_PAD(len);
+        if (need > cap) {
+            if (need > sizeof(dsc_command_t) + DSC_MAX_MSG_SIZE) {
+                DSC_LOG_ERROR("multi-command response too large\n");
+                goto free_error;
+            }
+            cap = (need > cap * 2) ? need : cap * 2;
+            if (out == resp_buf) {
+                grown = (uint8_t *)malloc(cap);
+                if (grown != NULL) {
+                    memcpy(grown, out, used);
+                }
+            } else {
+                grown = (uint8_t *)realloc(out, cap);
+            }
+            if (grown == NULL) {
+                DSC_LOG_ERROR("malloc error: %m\n");
+                goto free_error;
+            }
+            out = grown;
+        }
+
+        packed = (dsc_command_t *)(out + used);
+        memcpy(packed, r, len);
+        memset(out + used + len, 0, DSC_MULTI_PAD(len) - len);
+        packed->signature = DSC_SIGNATURE;
+        packed->request_id = sub->request_id;
+        packed->flags = 0;
+        packed->checksum = 0;
+        used += DSC_MULTI_PAD(len);
+        if ((r != (dsc_command_t *)sub_buf) && (r != sub)) {
+            free(r);
+        }
+    }
+
+    packed = (dsc_command_t *)out;
+    packed->status = STATUS_SUCCESS;
+    packed->data_len = used - sizeof(dsc_command_t);
+    packed->flags = 0;
+    return packed;
+
+free_error:
+    if ((r != (dsc_command_t *)sub_buf) && (r != sub)) {
+        free(r);
+    }
+error:
+    if (out != resp_buf) {
+        free(out);
+    }
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      free_replay
+ *
+ * DESCRIPTION: 
+ *      Free the replay cache of a server.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void free_replay(dsc_server_t *s)
+{
+    int i, j;
+
+    for (i = 0; i < s->replay_size; i++) {
+        for (j = 0; j < DSC_REPLAY_WINDOW; j++) {
+            free(s->replay[i].entries[j].pkt);
+        }
+    }
+    free(s->replay);
+    s->replay = NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      find_replay
+ *
+ * DESCRIPTION: 
+ *      Get the entry of a request in the replay cache. Every client address
+ *      has a window of the DSC_REPLAY_WINDOW latest requests, a new request
+ *      replaces the oldest one of the same client, so the responses are kept
+ *      however busy the other clients are. The clients are kept in sets of
+ *      REPLAY_WAYS, a new address replaces the least recently used one of
+ *      its set. If the size is changed by server_set_replay_cache(), the
+ *      cache is rebuilt here, in the serving thread.
+ *
+ * PARAMETERS:
+ *      s          - A pointer of server info
+ *      addr       - The client address
+ *      request_id - The ID of the request
+ *      take       - 1 to take an entry if the request has none
+ *
+ * RETURN:
+ *      The entry, NULL if none or the cache is disabled.
+ ******************************************************************************/
+static struct dsc_replay *find_replay(dsc_server_t *s, dsc_addr_t *addr,
+    uint32_t request_id, int take)
+{
+    struct dsc_replay_client *set, *c = NULL;
+    struct dsc_replay *r;
+    int i, wanted;
+    uint32_t h;
+
+    wanted = __atomic_load_n(&s->replay_wanted, __ATOMIC_RELAXED);
+    if (wanted != s->replay_size) {
+        free_replay(s);
+        s->replay_size = wanted;
+        if (wanted > 0) {
+            s->replay = (struct dsc_replay_client *)calloc(wanted,
+                sizeof(struct dsc_replay_client));
+            if (s->replay == NULL) {
+                DSC_LOG_ERROR("malloc error: %m\n");
+                s->replay_size = 0;
+                __atomic_store_n(&s->replay_wanted, 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    if (s->replay == NULL) {
+        return NULL;
+    }
+
+    h = addr_hash(addr) * 0x9E3779B1;
+    set = &s->replay[(h ^ (h >> 16)) & (s->replay_size - REPLAY_WAYS)];
+    for (i = 0; i < REPLAY_WAYS; i++) {
+        if ((set[i].used != 0) && addr_equal(&set[i].addr, addr)) {
+            c = &set[i];
+            break;
+        }
+    }
+
+    if (c != NULL) {
+        for (i = 0; i < DSC_REPLAY_WINDOW; i++) {
+            r = &c->entries[i];
+            if (((r->len != 0) || r->pending) &&
+                (r->request_id == request_id)) {
+                return r;
+            }
+        }
+    }
+    if (!take) {
+        return NULL;
+    }
+
+    if (c == NULL) {
+        /* The least recently used client of the set, an empty one is 0 */
+        c = &set[0];
+        for (i = 1; i < REPLAY_WAYS; i++) {
+            if (set[i].used < c->used) {
+                c = &set[i];
+            }
+        }
+        c->addr = *addr;
+        for (i = 0; i < DSC_REPLAY_WINDOW; i++) {
+            c->entries[i].len = 0;
+            c->entries[i].pending = 0;
+        }
+    }
+    c->used = ++s->replay_clock;
+
+    r = &c->entries[c->next];
+    c->next = (c->next + 1) % DSC_REPLAY_WINDOW;
+    r->request_id = request_id;
+    r->len = 0;
+    r->pending = 0;
+    return r;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lookup_replay
+ *
+ * DESCRIPTION: 
+ *      Find the response of a request already processed, i.e. the request is
+ *      sent again by the client since the response is lost.
+ *
+ * PARAMETERS:
+ *      s          - A pointer of server info
+ *      addr       - The client address
+ *      request_id - The ID of the request
+ *
+ * RETURN:
+ *      The entry of the response, NULL if not found.
+ ******************************************************************************/
+static struct dsc_replay *lookup_replay(dsc_server_t *s,
+    dsc_addr_t *addr, uint32_t request_id)
+{
+    struct dsc_replay *r;
+
+    r = find_replay(s, addr, request_id, 0);
+    if ((r == NULL) || (r->len == 0)) {
+        return NULL;
+    }
+
+    return r;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      save_replay
+ *
+ * DESCRIPTION: 
+ *      Keep a response in the replay cache. The buffer of the entry is reused,
+ *      so nothing is allocated once the cache is warm.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      addr - The client address
+ *      resp - The response packet
+ *      len  - The length of the response packet
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void save_replay(dsc_server_t *s, dsc_addr_t *addr,
+    dsc_command_t *resp, ssize_t len)
+{
+    struct dsc_replay *r;
+    uint8_t *pkt;
+
+    r = find_replay(s, addr, resp->request_id, 1);
+    if (r == NULL) {
+        return;
+    }
+
+    r->pending = 0;
+    if (r->cap < len) {
+        pkt = (uint8_t *)realloc(r->pkt, len);
+        if (pkt == NULL) {
+            r->len = 0;
+            return;
+        }
+        r->pkt = pkt;
+        r->cap = len;
+    }
+
+    memcpy(r->pkt, resp, len);
+    r->len = len;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      begin_replay
+ *
+ * DESCRIPTION: 
+ *      Note a request in the replay cache before it's queued for the workers,
+ *      so a retry arriving while the handler runs is known. save_replay()
+ *      fills the entry in place when the worker is done.
+ *
+ * PARAMETERS:
+ *      s          - A pointer of server info
+ *      addr       - The client address
+ *      request_id - The ID of the request
+ *
+ * RETURN:
+ *      1 - Noted (or the cache is disabled), 0 - The request is in progress
+ *      already, it's a retry
+ ******************************************************************************/
+static int begin_replay(dsc_server_t *s, dsc_addr_t *addr,
+    uint32_t request_id)
+{
+    struct dsc_replay *r;
+
+    r = find_replay(s, addr, request_id, 1);
+    if (r == NULL) {
+        return 1;
+    }
+    if (r->pending) {
+        return 0;
+    }
+
+    r->pending = 1;
+    r->len = 0;
+    return 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      end_replay
+ *
+ * DESCRIPTION: 
+ *      Forget a request noted by begin_replay() whose response is not kept,
+ *      e.g. it's dropped from the queue, or cached by command, so a retry
+ *      runs it again.
+ *
+ * PARAMETERS:
+ *      s          - A pointer of server info
+ *      addr       - The client address
+ *      request_id - The ID of the request
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void end_replay(dsc_server_t *s, dsc_addr_t *addr, uint32_t request_id)
+{
+    struct dsc_replay *r;
+
+    r = find_replay(s, addr, request_id, 0);
+    if ((r != NULL) && r->pending) {
+        r->pending = 0;
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      patch_request_id
+ *
+ * DESCRIPTION: 
+ *      Set the request ID and the integrity mode of an encoded packet whose
+ *      request ID is 0. The 16-bit checksum is updated incrementally
+ *      (RFC-1624) instead of computed over the whole packet again, the other
+ *      modes are sealed again.
+ *
+ * PARAMETERS:
+ *      pkt        - The packet
+ *      len        - The length of the packet
+ *      request_id - The request ID
+ *      mode       - The integrity mode, refer DSC_INTEGRITY_SUM16
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void patch_request_id(dsc_command_t *pkt, size_t len,
+    uint32_t request_id, uint16_t mode)
+{
+    uint16_t words[2];
+    uint32_t sum;
+
+    if ((mode != DSC_INTEGRITY_SUM16) ||
+        ((pkt->flags & DSC_FLAG_INTEGRITY) != DSC_INTEGRITY_SUM16)) {
+        pkt->flags = (pkt->flags & ~DSC_FLAG_INTEGRITY) | mode;
+        pkt->request_id = request_id;
+        seal_packet(pkt, len);
+        return;
+    }
+
+    /* HC' = ~(~HC + ~m + m'), ~m is -0 since the old ID is 0 */
+    memcpy(words, &request_id, sizeof(words));
+    sum = (uint16_t)~pkt->checksum;
+    sum += words[0];
+    sum += words[1];
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    pkt->request_id = request_id;
+    pkt->checksum = (uint16_t)~sum;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lookup_resp_cache
+ *
+ * DESCRIPTION: 
+ *      Find the cached response of a request: the command has a response
+ *      cached, not invalidated since, for a request with the same data.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      req - The request packet
+ *
+ * RETURN:
+ *      The entry of the response, NULL if not found.
+ ******************************************************************************/
+static struct dsc_resp_cache *lookup_resp_cache(dsc_server_t *s,
+    dsc_command_t *req)
+{
+    struct dsc_resp_cache *e;
+    uint32_t idx = req->command - DSC_CMD_BASE;
+
+    if ((s->resp_cache == NULL) || (idx >= DSC_MAX_COMMANDS)) {
+        return NULL;
+    }
+
+    e = &s->resp_cache[idx];
+    if ((e->len == 0) || (e->req_len != req->data_len) ||
+        (e->gen != __atomic_load_n(&s->cache_gen[idx], __ATOMIC_ACQUIRE)) ||
+        (memcmp(e->req, req + 1, req->data_len) != 0)) {
+        return NULL;
+    }
+
+    return e;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      save_resp_cache
+ *
+ * DESCRIPTION: 
+ *      Keep the encoded response of a request (the request ID is 0), and
+ *      its compressed version if any.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      req  - The request packet
+ *      gen  - The generation of the command read before calling the handler,
+ *             so a response made before an invalidation is never served
+ *      resp - The response packet
+ *      len  - The length of the response packet
+ *      zpkt - The response compressed, NULL if not compressed
+ *      zlen - The length of the response compressed
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void save_resp_cache(dsc_server_t *s, dsc_command_t *req, uint32_t gen,
+    dsc_command_t *resp, ssize_t len, uint8_t *zpkt, ssize_t zlen)
+{
+    struct dsc_resp_cache *e;
+    uint32_t idx = req->command - DSC_CMD_BASE;
+    uint8_t *pkt;
+
+    if ((idx >= DSC_MAX_COMMANDS) || (req->data_len > DSC_CACHE_KEY_SIZE)) {
+        return;
+    }
+
+    if (s->resp_cache == NULL) {
+        s->resp_cache = (struct dsc_resp_cache *)calloc(DSC_MAX_COMMANDS,
+            sizeof(struct dsc_resp_cache));
+        if (s->resp_cache == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            return;
+        }
+    }
+
+    e = &s->resp_cache[idx];
+    if (e->cap < len) {
+        pkt = (uint8_t *)realloc(e->pkt, len);
+        if (pkt == NULL) {
+            e->len = 0;
+            return;
+        }
+        e->pkt = pkt;
+        e->cap = len;
+    }
+
+    e->zlen = 0;
+    if (zpkt != NULL) {
+        if (e->zcap < zlen) {
+            pkt = (uint8_t *)realloc(e->zpkt, zlen);
+            if (pkt != NULL) {
+                e->zpkt = pkt;
+                e->zcap = zlen;
+            }
+        }
+        if (e->zcap >= zlen) {
+            memcpy(e->zpkt, zpkt, zlen);
+            e->zlen = zlen;
+        }
+    }
+
+    memcpy(e->pkt, resp, len);
+    memcpy(e->req, req + 1, req->data_len);
+    e->req_len = req->data_len;
+    e->len = len;
+    e->gen = gen;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lock_caches
+ *
+ * DESCRIPTION: 
+ *      Lock the replay cache, the response cache and the handoff list, which
+ *      are shared by the serving thread and the workers. Without workers,
+ *      only the serving thread uses them, nothing is locked.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      1 if locked, pass it to unlock_caches()
+ ******************************************************************************/
+static inline int lock_caches(dsc_server_t *s)
+{
+    if (__atomic_load_n(&s->nworkers, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(&s->lock);
+        return 1;
+    }
+    return 0;
+}
+
+static inline void unlock_caches(dsc_server_t *s, int locked)
+{
+    if (locked) {
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+
+static long sys_futex(uint32_t *uaddr, int op, uint32_t val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      futex_wait
+ *
+ * DESCRIPTION: 
+ *      Wait until a futex word is woken, if it still has the value, or the
+ *      timeout.
+ *
+ * PARAMETERS:
+ *      uaddr   - The futex word
+ *      val     - The value expected
+ *      timeout - The timeout(microseconds)
+ *
+ * RETURN:
+ *      0 - Woken, -1 - Not waited or timed out
+ ******************************************************************************/
+static long futex_wait(uint32_t *uaddr, uint32_t val, uint64_t timeout)
+{
+    struct timespec ts;
+
+    ts.tv_sec = timeout / 1000000;
+    ts.tv_nsec = (timeout % 1000000) * 1000;
+    return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      workq_push
+ *
+ * DESCRIPTION: 
+ *      Copy a request into the queue of the workers, and wake up one of them
+ *      if all are sleeping. Called by the serving thread.
+ *
+ * PARAMETERS:
+ *      q    - The queue
+ *      fd   - The socket the request comes from
+ *      addr - The client address
+ *      buf  - The request packet
+ *      len  - The length of the request packet
+ *
+ * RETURN:
+ *      The number of requests queued, -1 if the queue is full.
+ ******************************************************************************/
+static int workq_push(struct dsc_workq *q, int fd, dsc_addr_t *addr,
+    uint8_t *buf, ssize_t len)
+{
+    struct dsc_work *w;
+    uint64_t pos, seq;
+
+    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        w = &q->slots[pos & (q->size - 1)];
+        seq = __atomic_load_n(&w->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((int64_t)(seq - pos) < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    w->fd = fd;
+    w->addr = *addr;
+    w->len = len;
+    memcpy(w->buf, buf, len);
+    __atomic_store_n(&w->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* Pairs with the increment of sleepers before the queue is checked */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleepers, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(&q->futex, 1, __ATOMIC_RELAXED);
+        sys_futex(&q->futex, FUTEX_WAKE_PRIVATE, 1);
+    }
+
+    return pos + 1 - __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      workq_pop
+ *
+ * DESCRIPTION: 
+ *      Take a request from the queue without waiting. The slot is handled in
+ *      place, and given back by workq_release() when it's done.
+ *
+ * PARAMETERS:
+ *      q   - The queue
+ *      pos - Output, the position of the slot
+ *
+ * RETURN:
+ *      The request, NULL if the queue is empty.
+ ******************************************************************************/
+static struct dsc_work *workq_pop(struct dsc_workq *q, uint64_t *pos)
+{
+    struct dsc_work *w;
+    uint64_t p, seq;
+
+    p = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;) {
+        w = &q->slots[p & (q->size - 1)];
+        seq = __atomic_load_n(&w->seq, __ATOMIC_ACQUIRE);
+        if (seq == p + 1) {
+            if (__atomic_compare_exchange_n(&q->head, &p, p + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos = p;
+                return w;
+            }
+        } else if ((int64_t)(seq - (p + 1)) < 0) {
+            return NULL;
+        } else {
+            p = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+static void workq_release(struct dsc_workq *q, struct dsc_work *w,
+    uint64_t pos)
+{
+    /* The slot can be written again one lap later */
+    __atomic_store_n(&w->seq, pos + q->size, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      workq_wait
+ *
+ * DESCRIPTION: 
+ *      Take a request from the queue, sleep on the futex while it's empty.
+ *
+ * PARAMETERS:
+ *      q   - The queue
+ *      pos - Output, the position of the slot
+ *
+ * RETURN:
+ *      The request, NULL if the workers are stopped.
+ ******************************************************************************/
+static struct dsc_work *workq_wait(struct dsc_workq *q, uint64_t *pos)
+{
+    struct dsc_work *w;
+    uint32_t val;
+
+    for (;;) {
+        w = workq_pop(q, pos);
+        if (w != NULL) {
+            return w;
+        }
+        if (__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+
+        /* Check the queue again after telling the serving thread to wake us */
+        val = __atomic_load_n(&q->futex, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+        w = workq_pop(q, pos);
+        if ((w == NULL) && !__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+            sys_futex(&q->futex, FUTEX_WAIT_PRIVATE, val);
+        }
+        __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_RELAXED);
+        if (w != NULL) {
+            return w;
+        }
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      set_xfer_timer
+ *
+ * DESCRIPTION: 
+ *      Arm or disarm the retransmit timer of the transfers, so an idle server
+ *      is not woken up by it.
+ *
+ * PARAMETERS:
+ *      s  - A pointer of server info
+ *      on - 1 to arm the timer, 0 to disarm it
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void set_xfer_timer(dsc_server_t *s, int on)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_interval.tv_nsec = XFER_TICK * 1000000L;
+        its.it_value = its.it_interval;
+    }
+    if (timerfd_settime(s->xfer_timerfd, 0, &its, NULL) != 0) {
+        DSC_LOG_ERROR("timerfd_settime error: %m\n");
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      find_xfer
+ *
+ * DESCRIPTION: 
+ *      Find the transfer of a request.
+ *
+ * PARAMETERS:
+ *      s          - A pointer of server info
+ *      addr       - The client address
+ *      request_id - The ID of the request
+ *
+ * RETURN:
+ *      The transfer, NULL if not found.
+ ******************************************************************************/
+static struct dsc_xfer *find_xfer(dsc_server_t *s, dsc_addr_t *addr,
+    uint32_t request_id)
+{
+    struct dsc_xfer *x;
+    int i;
+
+    if (s->nxfers == 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < DSC_MAX_TRANSFERS; i++) {
+        x = &s->xfers[i];
+        if (x->in_use && (x->request_id == request_id) &&
+            addr_equal(&x->addr, addr)) {
+            return x;
+        }
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      free_xfer
+ *
+ * DESCRIPTION: 
+ *      Release a transfer and the memory of the message.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *      x - The transfer
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void free_xfer(dsc_server_t *s, struct dsc_xfer *x)
+{
+    if (x->rx_active) {
+        frag_rx_free(&x->rx);
+    }
+    free(x->resp);
+    memset(x, 0, sizeof(*x));
+
+    if (--s->nxfers == 0) {
+        set_xfer_timer(s, 0);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      alloc_xfer
+ *
+ * DESCRIPTION: 
+ *      Allocate a transfer for a request. If all entries are used, the one of
+ *      a completed request kept for acknowledgment is taken.
+ *
+ * PARAMETERS:
+ *      s          - A pointer of server info
+ *      addr       - The client address
+ *      request_id - The ID of the request
+ *
+ * RETURN:
+ *      The transfer, NULL if too many transfers are active.
+ ******************************************************************************/
+static struct dsc_xfer *alloc_xfer(dsc_server_t *s, dsc_addr_t *addr,
+    uint32_t request_id)
+{
+    struct dsc_xfer *x = NULL;
+    int i;
+
+    if (s->xfers == NULL) {
+        s->xfers = (struct dsc_xfer *)calloc(DSC_MAX_TRANSFERS,
+            sizeof(struct dsc_xfer));
+        if (s->xfers == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < DSC_MAX_TRANSFERS; i++) {
+        if (!s->xfers[i].in_use) {
+            x = &s->xfers[i];
+            break;
+        }
+        if (!s->xfers[i].rx_active && !s->xfers[i].tx_active &&
+            ((x == NULL) || (s->xfers[i].expire < x->expire))) {
+            x = &s->xfers[i];
+        }
+    }
+    if (x == NULL) {
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_ERROR, "too many transfers\n");
+        return NULL;
+    }
+
+    if (x->in_use) {
+        free_xfer(s, x);
+    }
+    x->in_use = 1;
+    x->addr = *addr;
+    x->request_id = request_id;
+    x->expire = now_usec() + XFER_TIMEOUT;
+    if (s->nxfers++ == 0) {
+        set_xfer_timer(s, 1);
+    }
+
+    return x;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      admit_transfer
+ *
+ * DESCRIPTION: 
+ *      Check if a fragmented request may start to be reassembled: it's not
+ *      larger than the max set by server_set_reassembly(), and its client
+ *      host doesn't have DSC_XFER_PER_SOURCE requests being reassembled
+ *      already, so a few sources can't take all transfers.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      addr - The client address
+ *      pkt  - The first fragment received (verified)
+ *
+ * RETURN:
+ *      1 - Admitted, 0 - Dropped
+ ******************************************************************************/
+static int admit_transfer(dsc_server_t *s, dsc_addr_t *addr,
+    dsc_command_t *pkt)
+{
+    const dsc_frag_t *frag = (const dsc_frag_t *)(pkt + 1);
+    int i, n = 0;
+
+    if ((pkt->data_len < sizeof(dsc_frag_t)) || (frag->msg_len >
+        __atomic_load_n(&s->xfer_max_msg, __ATOMIC_RELAXED))) {
+        STATS_ADD(s->stats.drop_length, 1);
+        return 0;
+    }
+
+    for (i = 0; (s->nxfers > 0) && (i < DSC_MAX_TRANSFERS); i++) {
+        if (s->xfers[i].in_use && s->xfers[i].rx_active &&
+            same_source(&s->xfers[i].addr, addr)) {
+            n++;
+        }
+    }
+    if (n >= DSC_XFER_PER_SOURCE) {
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_WARN, "too many transfers from "
+            "a client\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      receive_fragment
+ *
+ * DESCRIPTION: 
+ *      Take a fragment of request, or an acknowledgment of the fragments of
+ *      response, from a client.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      fd   - The socket which the packet comes from
+ *      addr - The client address
+ *      pkt  - The packet (verified)
+ *      xp   - Output, the transfer of the request when it is complete
+ *
+ * RETURN:
+ *      The request reassembled, NULL if it is not complete yet.
+ ******************************************************************************/
+static dsc_command_t *receive_fragment(dsc_server_t *s, int fd,
+    dsc_addr_t *addr, dsc_command_t *pkt, struct dsc_xfer **xp)
+{
+    struct dsc_xfer *x;
+    struct dsc_replay *r;
+    uint64_t now = now_usec();
+    int locked;
+
+    x = find_xfer(s, addr, pkt->request_id);
+
+    if (pkt->flags & DSC_FLAG_ACK) {
+        if ((x == NULL) || !x->tx_active) {
+            return NULL;
+        }
+        x->expire = now + XFER_TIMEOUT;
+        if (frag_tx_ack(&x->tx, pkt)) {
+            /* The client has got the whole response */
+            free_xfer(s, x);
+        } else {
+            frag_tx_pump(&x->tx, now);
+        }
+        return NULL;
+    }
+
+    if (x == NULL) {
+        if (!admit_transfer(s, addr, pkt)) {
+            return NULL;
+        }
+        x = alloc_xfer(s, addr, pkt->request_id);
+        if (x == NULL) {
+            return NULL;
+        }
+        if (frag_rx_init(&x->rx, pkt, NULL, 0) != 0) {
+            free_xfer(s, x);
+            return NULL;
+        }
+        frag_rx_set_budget(&x->rx, s->xfer_mem,
+            __atomic_load_n(&s->xfer_mem_max, __ATOMIC_RELAXED));
+        x->rx_active = 1;
+        x->rx_count = x->rx.count;
+    } else if (!x->rx_active) {
+        /* The request is complete, but the client has lost the last ack */
+        if (x->rx_count > 0) {
+            frag_send_ack(fd, addr, pkt->request_id, x->rx_count, x->rx_count,
+                0);
+        }
+
+        /* Or the response */
+        locked = lock_caches(s);
+        r = lookup_replay(s, addr, pkt->request_id);
+        if (r != NULL) {
+            sendto(fd, r->pkt, r->len, 0, &addr->sa, addr->len);
+        }
+        unlock_caches(s, locked);
+        return NULL;
+    }
+
+    x->expire = now + XFER_TIMEOUT;
+    if (frag_rx_add(&x->rx, pkt, fd, addr) <= 0) {
+        return NULL;
+    }
+
+    *xp = x;
+    return x->rx.msg;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      send_large_response
+ *
+ * DESCRIPTION: 
+ *      Start to send a response larger than DSC_BUF_SIZE in fragments.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      fd   - The socket to send from
+ *      addr - The client address
+ *      resp - The response (allocated), it's freed when the transfer ends
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void send_large_response(dsc_server_t *s, int fd,
+    dsc_addr_t *addr, dsc_command_t *resp)
+{
+    struct dsc_xfer *x;
+
+    x = find_xfer(s, addr, resp->request_id);
+    if (x == NULL) {
+        x = alloc_xfer(s, addr, resp->request_id);
+    }
+    if ((x == NULL) || x->tx_active) {
+        free(resp);
+        return;
+    }
+
+    x->resp = resp;
+    x->tx_active = 1;
+    x->expire = now_usec() + XFER_TIMEOUT;
+    frag_tx_init(&x->tx, resp, fd, addr);
+    frag_tx_pump(&x->tx, now_usec());
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      hand_off
+ *
+ * DESCRIPTION: 
+ *      Pass a response larger than DSC_BUF_SIZE from a worker to the serving
+ *      thread, which owns the transfers, and wake it up.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      fd   - The socket to send from
+ *      addr - The client address
+ *      resp - The response (allocated), it's freed when the transfer ends
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void hand_off(dsc_server_t *s, int fd, dsc_addr_t *addr,
+    dsc_command_t *resp)
+{
+    struct dsc_handoff *h;
+    uint64_t val = 1;
+    int locked;
+
+    h = (struct dsc_handoff *)malloc(sizeof(struct dsc_handoff));
+    if (h == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        locked = lock_caches(s);
+        end_replay(s, addr, resp->request_id);
+        unlock_caches(s, locked);
+        free(resp);
+        return;
+    }
+    h->fd = fd;
+    h->addr = *addr;
+    h->resp = resp;
+
+    locked = lock_caches(s);
+    h->next = s->handoffs;
+    __atomic_store_n(&s->handoffs, h, __ATOMIC_RELEASE);
+    unlock_caches(s, locked);
+
+    if (write(s->wake_fd, &val, sizeof(val)) != sizeof(val)) {
+        DSC_LOG_ERROR("eventfd write error: %m\n");
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      run_handoffs
+ *
+ * DESCRIPTION: 
+ *      Start to send the responses handed off by the workers, in the serving
+ *      thread.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void run_handoffs(dsc_server_t *s)
+{
+    struct dsc_handoff *h, *next;
+    int locked;
+
+    locked = lock_caches(s);
+    h = s->handoffs;
+    s->handoffs = NULL;
+    unlock_caches(s, locked);
+
+    for (; h != NULL; h = next) {
+        uint32_t request_id = h->resp->request_id;
+
+        next = h->next;
+        send_large_response(s, h->fd, &h->addr, h->resp);
+
+        /* From now on a retry pumps the transfer */
+        locked = lock_caches(s);
+        end_replay(s, &h->addr, request_id);
+        unlock_caches(s, locked);
+        free(h);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      run_transfers
+ *
+ * DESCRIPTION: 
+ *      Retransmit the lost fragments of responses, and drop the transfers
+ *      without progress in XFER_TIMEOUT. Called by the retransmit timer.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void run_transfers(dsc_server_t *s)
+{
+    struct dsc_xfer *x;
+    uint64_t now = now_usec();
+    int i;
+
+    for (i = 0; (i < DSC_MAX_TRANSFERS) && (s->nxfers > 0); i++) {
+        x = &s->xfers[i];
+        if (!x->in_use) {
+            continue;
+        }
+        if (now >= x->expire) {
+            free_xfer(s, x);
+        } else if (x->tx_active) {
+            frag_tx_pump(&x->tx, now);
+        }
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      handle_request
+ *
+ * DESCRIPTION: 
+ *      Pass a request to the request handler and build the response packet
+ *      (signature and checksum included). It runs in the serving thread, or
+ *      in a worker if the server has workers. A compressed request is
+ *      decompressed first, and the response is compressed if the client
+ *      takes it (DSC_FLAG_ACCEPT_LZ) and it gets shorter.
+ *
+ * PARAMETERS:
+ *      s        - A pointer of server info
+ *      st       - The stats of the thread
+ *      fd       - The socket which the request comes from
+ *      addr     - The client address
+ *      req      - The request packet, verified
+ *      x        - The transfer of the request if it was fragmented, or NULL
+ *      resp_buf - The buffer of response packet, DSC_BUF_SIZE bytes
+ *      resp_len - Output, the length of the response packet
+ *
+ * RETURN:
+ *      The response packet, NULL if nothing to send, refer process_request().
+ ******************************************************************************/
+static dsc_command_t *handle_request(dsc_server_t *s, dsc_stats_t *st, int fd,
+    dsc_addr_t *addr, dsc_command_t *req, struct dsc_xfer *x,
+    uint8_t *resp_buf, ssize_t *resp_len)
+{
+    uint8_t zbuf[DSC_BUF_SIZE];
+    dsc_command_t *resp, *in = req, *raw = NULL;
+    dsc_cmd_stats_t *cs;
+    uint32_t request_id, idx, gen = 0, min_len;
+    uint64_t start;
+    ssize_t zlen = 0;
+    size_t len;
+    uint16_t mode;
+    int cacheable, locked, accept;
+
+    request_id = req->request_id;
+    accept = req->flags & DSC_FLAG_ACCEPT_LZ;
+    mode = req->flags & DSC_FLAG_INTEGRITY;
+    idx = req->command - DSC_CMD_BASE;
+    if (idx < DSC_MAX_COMMANDS) {
+        gen = __atomic_load_n(&s->cache_gen[idx], __ATOMIC_ACQUIRE);
+    }
+    cs = cmd_stats(st, req->command);
+    STATS_ADD(cs->requests, 1);
+    STATS_ADD(cs->bytes_in, sizeof(dsc_command_t) + req->data_len);
+
+    /* The handler gets the request decompressed */
+    if (req->flags & DSC_FLAG_COMPRESSED) {
+        len = decompressed_len(req);
+        raw = (len > 0) ? (dsc_command_t *)malloc(len) : NULL;
+        if ((raw != NULL) && (decompress_packet(req, raw, len) < 0)) {
+            free(raw);
+            raw = NULL;
+        }
+    }
+
+    start = now_nsec();
+    if ((req->flags & DSC_FLAG_COMPRESSED) && (raw == NULL)) {
+        resp = NULL;
+    } else {
+        if (raw != NULL) {
+            req = raw;
+        }
+        if (req->command == DSC_CMD_MULTI) {
+            resp = dispatch_multi(s, st, fd, addr, req, resp_buf);
+        } else {
+            resp = dispatch_request(s, fd, addr, req, resp_buf);
+        }
+    }
+    STATS_ADD(cs->latency[latency_bucket(now_nsec() - start)], 1);
+    cacheable = (resp != NULL) && (resp->flags & DSC_FLAG_CACHEABLE) &&
+        (x == NULL);
+    if (x != NULL) {
+        /* Keep the entry only to acknowledge duplicated fragments */
+        if (resp == req) {
+            x->rx.own_msg = 0;
+        }
+        frag_rx_free(&x->rx);
+        x->rx_active = 0;
+    }
+    if (resp == NULL) {
+        resp = (dsc_command_t *)resp_buf;
+        resp->status = STATUS_ERROR;
+        resp->data_len = 0;
+    }
+
+    /* The response owns the decompressed request if it's the same memory */
+    if (resp == raw) {
+        raw = NULL;
+    }
+
+    *resp_len = sizeof(dsc_command_t) + resp->data_len;
+    if (resp->status != STATUS_SUCCESS) {
+        STATS_ADD(cs->errors, 1);
+    }
+    resp->signature = DSC_SIGNATURE;
+    resp->request_id = request_id;
+    resp->flags = mode;
+    min_len = __atomic_load_n(&s->compress_min, __ATOMIC_RELAXED);
+    if (accept && (min_len > 0) && (resp->data_len >= min_len)) {
+        zlen = compress_packet(resp, zbuf);
+    }
+    STATS_ADD(cs->bytes_out, (zlen > 0) ? zlen : *resp_len);
+    if ((*resp_len > DSC_BUF_SIZE) && (zlen == 0)) {
+        free(raw);
+        if (st != &s->stats) {
+            hand_off(s, fd, addr, resp);
+        } else {
+            send_large_response(s, fd, addr, resp);
+        }
+        return NULL;
+    }
+    cacheable = cacheable && (*resp_len <= DSC_BUF_SIZE);
+    if (cacheable) {
+        /* Cache it with request ID 0, then patch the ID like a cache hit */
+        resp->request_id = 0;
+        seal_packet(resp, *resp_len);
+        if (zlen > 0) {
+            ((dsc_command_t *)zbuf)->request_id = 0;
+            seal_packet((dsc_command_t *)zbuf, zlen);
+        }
+        locked = lock_caches(s);
+        save_resp_cache(s, req, gen, resp, *resp_len,
+            (zlen > 0) ? zbuf : NULL, zlen);
+        unlock_caches(s, locked);
+    }
+    free(raw);
+
+    /* Send the compressed response from resp_buf, drop the one allocated */
+    if (zlen > 0) {
+        if ((resp != (dsc_command_t *)resp_buf) &&
+            ((resp != in) || (x != NULL))) {
+            free(resp);
+        }
+        resp = (dsc_command_t *)resp_buf;
+        memcpy(resp, zbuf, zlen);
+        *resp_len = zlen;
+    }
+    if (cacheable) {
+        /* A retry is answered by the response cache */
+        if (st != &s->stats) {
+            locked = lock_caches(s);
+            end_replay(s, addr, request_id);
+            unlock_caches(s, locked);
+        }
+        patch_request_id(resp, *resp_len, request_id, mode);
+        return resp;
+    }
+
+    seal_packet(resp, *resp_len);
+    locked = lock_caches(s);
+    save_replay(s, addr, resp, *resp_len);
+    unlock_caches(s, locked);
+
+    return resp;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      admit_table
+ *
+ * DESCRIPTION: 
+ *      Get the table of the token buckets, allocated by the first packet
+ *      checked. The servers of a pool race to allocate the shared one, the
+ *      loser frees its own.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      The table, NULL on error.
+ ******************************************************************************/
+static struct dsc_admit *admit_table(dsc_server_t *s)
+{
+    struct dsc_admit *t, *cur = NULL;
+
+    t = __atomic_load_n(s->admit, __ATOMIC_ACQUIRE);
+    if (t != NULL) {
+        return t;
+    }
+
+    t = (struct dsc_admit *)aligned_alloc(64,
+        DSC_ADMIT_TABLE_SIZE * sizeof(struct dsc_admit));
+    if (t == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        return NULL;
+    }
+    memset(t, 0, DSC_ADMIT_TABLE_SIZE * sizeof(struct dsc_admit));
+    if (!__atomic_compare_exchange_n(s->admit, &cur, t, 0, __ATOMIC_ACQ_REL,
+        __ATOMIC_ACQUIRE)) {
+        free(t);
+        t = cur;
+    }
+
+    return t;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      admit_request
+ *
+ * DESCRIPTION: 
+ *      Take a token from the bucket of the client address, before anything
+ *      else is done with the packet. The buckets are kept in groups of
+ *      DSC_ADMIT_PROBE entries (2 cache lines), a new address replaces the
+ *      least recently seen one of its group, so the memory is bounded and a
+ *      flood of spoofed addresses only evicts the others. The servers of a
+ *      pool share the buckets: a refill is claimed by moving the time of the
+ *      last one with a CAS, so every interval is counted once, and the
+ *      tokens are taken with a CAS. A packet racing with the eviction of its
+ *      entry may take a token of the new address, as if it were evicted
+ *      first.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      addr - The client address
+ *
+ * RETURN:
+ *      1 - Admitted, 0 - Over the rate, shed it
+ ******************************************************************************/
+static int admit_request(dsc_server_t *s, dsc_addr_t *addr)
+{
+    struct dsc_admit *table, *group, *e, *victim = NULL;
+    uint32_t rate, h, key, cur, want;
+    uint64_t now, last = 0, vlast = 0, cap, elapsed, tokens;
+    int i;
+
+    rate = __atomic_load_n(&s->admit_rate, __ATOMIC_RELAXED);
+    if (rate == 0) {
+        return 1;
+    }
+    table = admit_table(s);
+    if (table == NULL) {
+        __atomic_store_n(&s->admit_rate, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    cap = (uint64_t)__atomic_load_n(&s->admit_burst, __ATOMIC_RELAXED) * 1000;
+    now = now_usec();
+
+    key = (addr->sa.sa_family == AF_INET) ? addr->in.sin_addr.s_addr :
+        addr_hash(addr);
+    h = key * 0x9E3779B1;
+    h ^= h >> 16;
+    group = &table[h & (DSC_ADMIT_TABLE_SIZE - DSC_ADMIT_PROBE)];
+    for (i = 0; i < DSC_ADMIT_PROBE; i++) {
+        e = &group[i];
+        last = __atomic_load_n(&e->last, __ATOMIC_ACQUIRE);
+        if ((last != 0) &&
+            (__atomic_load_n(&e->key, __ATOMIC_RELAXED) == key)) {
+            break;
+        }
+        if ((victim == NULL) || (last < vlast)) {
+            victim = e;
+            vlast = last;
+        }
+        if (last == 0) {
+            break;
+        }
+    }
+    if ((i == DSC_ADMIT_PROBE) || (last == 0)) {
+        if (vlast != 0) {
+            STATS_ADD(s->stats.admit_evictions, 1);
+        }
+        e = victim;
+        __atomic_store_n(&e->key, key, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->tokens, (uint32_t)cap, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->last, now, __ATOMIC_RELEASE);
+        last = now;
+    }
+
+    /*
+     * The time left over by a refill of less than a token/1000 is kept. A
+     * bucket is full after cap * 1000 / rate microseconds, a longer time
+     * would only overflow the product. Another thread may have moved the
+     * time past now.
+     */
+    elapsed = (now > last) ? now - last : 0;
+    if (elapsed > cap * 1000 / rate) {
+        elapsed = cap * 1000 / rate + 1;
+    }
+    tokens = elapsed * rate / 1000;
+    if ((tokens > 0) && __atomic_compare_exchange_n(&e->last, &last, now, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        cur = __atomic_load_n(&e->tokens, __ATOMIC_RELAXED);
+        do {
+            want = (cur + tokens < cap) ? cur + tokens : cap;
+        } while (!__atomic_compare_exchange_n(&e->tokens, &cur, want, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    cur = __atomic_load_n(&e->tokens, __ATOMIC_RELAXED);
+    do {
+        if (cur < 1000) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&e->tokens, &cur, cur - 1000, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      busy_response
+ *
+ * DESCRIPTION: 
+ *      Build the STATUS_BUSY response of a request, in the integrity mode of
+ *      the request.
+ *
+ * PARAMETERS:
+ *      req      - The request packet, the header at least
+ *      trusted  - 1 if the client is on a loopback address
+ *      resp_buf - The buffer of response packet, DSC_BUF_SIZE bytes
+ *      resp_len - Output, the length of the response packet
+ *
+ * RETURN:
+ *      The response packet
+ ******************************************************************************/
+static dsc_command_t *busy_response(dsc_command_t *req, int trusted,
+    uint8_t *resp_buf, ssize_t *resp_len)
+{
+    dsc_command_t *resp = (dsc_command_t *)resp_buf;
+
+    resp->signature = DSC_SIGNATURE;
+    resp->status = STATUS_BUSY;
+    resp->data_len = 0;
+    resp->request_id = req->request_id;
+    resp->flags = req->flags & DSC_FLAG_INTEGRITY;
+    if ((resp->flags != DSC_FLAG_CRC32C) &&
+        ((resp->flags != DSC_FLAG_TRUSTED) || !trusted)) {
+        resp->flags = 0;
+    }
+    seal_packet(resp, sizeof(dsc_command_t));
+    *resp_len = sizeof(dsc_command_t);
+
+    return resp;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      queue_request
+ *
+ * DESCRIPTION: 
+ *      Queue a request for the workers. If the queue is full, the request is
+ *      dropped or answered with STATUS_BUSY, by the policy of the server.
+ *
+ * PARAMETERS:
+ *      s        - A pointer of server info
+ *      fd       - The socket which the request comes from
+ *      addr     - The client address
+ *      buf      - The request packet
+ *      req_len  - The length of the request packet
+ *      resp_buf - The buffer of response packet, DSC_BUF_SIZE bytes
+ *      resp_len - Output, the length of the response packet
+ *
+ * RETURN:
+ *      The STATUS_BUSY response, NULL if nothing to send.
+ ******************************************************************************/
+static dsc_command_t *queue_request(dsc_server_t *s, int fd,
+    dsc_addr_t *addr, uint8_t *buf, ssize_t req_len,
+    uint8_t *resp_buf, ssize_t *resp_len)
+{
+    int depth, locked;
+
+    depth = workq_push(s->workq, fd, addr, buf, req_len);
+    if (depth >= 0) {
+        if ((uint64_t)depth > s->stats.queue_peak) {
+            STATS_ADD(s->stats.queue_peak, depth - s->stats.queue_peak);
+        }
+        return NULL;
+    }
+
+    /* Not run, a retry is taken as new */
+    locked = lock_caches(s);
+    end_replay(s, addr, ((dsc_command_t *)buf)->request_id);
+    unlock_caches(s, locked);
+
+    if (s->queue_policy != DSC_QUEUE_BUSY) {
+        STATS_ADD(s->stats.queue_drops, 1);
+        return NULL;
+    }
+
+    STATS_ADD(s->stats.queue_busy, 1);
+    return busy_response((dsc_command_t *)buf, is_loopback(addr), resp_buf,
+        resp_len);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      process_request
+ *
+ * DESCRIPTION: 
+ *      Verify a request packet, pass it to the request handler and build the
+ *      response packet (signature and checksum included). The fragments are
+ *      reassembled first, and a response larger than DSC_BUF_SIZE is sent in
+ *      fragments here. If the server has workers, the request is queued for
+ *      them instead, unless it was fragmented.
+ *
+ * PARAMETERS:
+ *      s        - A pointer of server info
+ *      fd       - The socket which the request comes from
+ *      addr     - The client address
+ *      buf      - The request packet
+ *      req_len  - The length of the request packet
+ *      resp_buf - The buffer of response packet, DSC_BUF_SIZE bytes
+ *      resp_len - Output, the length of the response packet
+ *
+ * RETURN:
+ *      The response packet, NULL if nothing to send. If the response is
+ *      neither the request nor the response buffer, it is allocated by the
+ *      request handler and the caller need to free the memory.
+ ******************************************************************************/
+static dsc_command_t *process_request(dsc_server_t *s, int fd,
+    dsc_addr_t *addr, uint8_t *buf, ssize_t req_len,
+    uint8_t *resp_buf, ssize_t *resp_len)
+{
+    dsc_command_t *req;
+    struct dsc_xfer *x = NULL;
+    struct dsc_replay *r;
+    struct dsc_resp_cache *e;
+    dsc_cmd_stats_t *cs;
+    int locked, noted;
+
+    STATS_ADD(s->stats.rx_packets, 1);
+    STATS_ADD(s->stats.rx_bytes, req_len);
+
+    /* A local client without name can't be answered */
+    if ((addr->sa.sa_family == AF_UNIX) &&
+        (addr->len <= offsetof(struct sockaddr_un, sun_path))) {
+        return NULL;
+    }
+
+    /* Shed the clients over their rate before the packet costs anything */
+    if (!admit_request(s, addr)) {
+        STATS_ADD(s->stats.admit_shed, 1);
+        req = (dsc_command_t *)buf;
+        if ((__atomic_load_n(&s->admit_policy, __ATOMIC_RELAXED) ==
+            DSC_QUEUE_BUSY) && ((size_t)req_len >= sizeof(dsc_command_t)) &&
+            (req->signature == DSC_SIGNATURE) &&
+            !(req->flags & (DSC_FLAG_FRAG | DSC_FLAG_ACK))) {
+            STATS_ADD(s->stats.admit_busy, 1);
+            return busy_response(req, is_loopback(addr), resp_buf, resp_len);
+        }
+        return NULL;
+    }
+
+    /* Check the integrity of the request packet */
+    if (!verify_command_packet(buf, req_len, is_loopback(addr), &s->stats)) {
+        /* Discard invaid packet */
+        return NULL;
+    }
+
+    req = (dsc_command_t *)buf;
+    if (req->flags & (DSC_FLAG_FRAG | DSC_FLAG_ACK)) {
+        req = receive_fragment(s, fd, addr, req, &x);
+        if (req == NULL) {
+            return NULL;
+        }
+        return handle_request(s, &s->stats, fd, addr, req, x, resp_buf,
+            resp_len);
+    }
+
+    /* The response is cached, only the request ID is changed */
+    locked = lock_caches(s);
+    e = NULL;
+    if (!(req->flags & DSC_FLAG_COMPRESSED)) {
+        e = lookup_resp_cache(s, req);
+    }
+    if (e != NULL) {
+        if ((e->zlen > 0) && (req->flags & DSC_FLAG_ACCEPT_LZ)) {
+            memcpy(resp_buf, e->zpkt, e->zlen);
+            *resp_len = e->zlen;
+        } else {
+            memcpy(resp_buf, e->pkt, e->len);
+            *resp_len = e->len;
+        }
+        unlock_caches(s, locked);
+        cs = cmd_stats(&s->stats, req->command);
+        STATS_ADD(cs->requests, 1);
+        STATS_ADD(cs->cache_hits, 1);
+        STATS_ADD(cs->bytes_in, req_len);
+        STATS_ADD(cs->bytes_out, *resp_len);
+        patch_request_id((dsc_command_t *)resp_buf, *resp_len,
+            req->request_id, req->flags & DSC_FLAG_INTEGRITY);
+        return (dsc_command_t *)resp_buf;
+    }
+
+    /* The request is sent again, don't run the handler twice */
+    r = lookup_replay(s, addr, req->request_id);
+    if (r != NULL) {
+        memcpy(resp_buf, r->pkt, r->len);
+        *resp_len = r->len;
+        unlock_caches(s, locked);
+        STATS_ADD(s->stats.replays, 1);
+        return (dsc_command_t *)resp_buf;
+    }
+    unlock_caches(s, locked);
+
+    /* Its response is being sent in fragments */
+    x = find_xfer(s, addr, req->request_id);
+    if ((x != NULL) && x->tx_active) {
+        frag_tx_pump(&x->tx, now_usec());
+        return NULL;
+    }
+
+    if (__atomic_load_n(&s->workq, __ATOMIC_ACQUIRE) != NULL) {
+        /*
+         * The response is kept only when the worker is done, note the request
+         * now, and drop a retry of it while it's queued or running: the
+         * response to the first one is on its way
+         */
+        locked = lock_caches(s);
+        noted = begin_replay(s, addr, req->request_id);
+        unlock_caches(s, locked);
+        if (!noted) {
+            return NULL;
+        }
+        return queue_request(s, fd, addr, buf, req_len, resp_buf, resp_len);
+    }
+
+    return handle_request(s, &s->stats, fd, addr, req, NULL, resp_buf,
+        resp_len);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      worker_thread
+ *
+ * DESCRIPTION: 
+ *      Run the handlers of the queued requests and send the responses from
+ *      the socket which the requests come from, until the server is closed.
+ *      The responses may be sent out of order.
+ *
+ * PARAMETERS:
+ *      arg - A pointer of worker info
+ *
+ * RETURN:
+ *      NULL
+ ******************************************************************************/
+static void *worker_thread(void *arg)
+{
+    struct dsc_worker *wk = (struct dsc_worker *)arg;
+    dsc_server_t *s = wk->s;
+    dsc_command_t *resp;
+    struct dsc_work *w;
+    ssize_t resp_len;
+    uint64_t pos;
+
+    while ((w = workq_wait(wk->q, &pos)) != NULL) {
+        resp = handle_request(s, &wk->stats, w->fd, &w->addr,
+            (dsc_command_t *)w->buf, NULL, wk->resp_buf, &resp_len);
+        if (resp != NULL) {
+            if (sendto(w->fd, resp, resp_len, 0, &w->addr.sa,
+                w->addr.len) != resp_len) {
+                STATS_ADD(wk->stats.send_errors, 1);
+                DSC_LOG_LIMITED(DSC_LOG_LEVEL_ERROR, "sendto error: %m\n");
+            }
+            if ((resp != (dsc_command_t *)w->buf) &&
+                (resp != (dsc_command_t *)wk->resp_buf)) {
+                free(resp);
+            }
+        }
+        workq_release(wk->q, w, pos);
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_accept_request
+ *
+ * DESCRIPTION: 
+ *      Accept a request from client and process it.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_accept_request(dsc_server_t *s)
+{
+    dsc_command_t *resp;
+    uint8_t buf[DSC_BUF_SIZE];
+    uint8_t resp_buf[DSC_BUF_SIZE];
+    ssize_t bytes, req_len, resp_len;
+    dsc_addr_t client_addr;
+    socklen_t client_addrlen = sizeof(client_addr.un);
+
+    if (s == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    /* Receive request from client */
+    memset(buf, 0, sizeof(buf));
+    req_len = recvfrom(s->sockfd, &buf, sizeof(buf), 0,
+        &client_addr.sa, &client_addrlen);
+    if (req_len < 0) {
+        //DSC_LOG_ERROR("recvform error: %m\n");
+        return -1;
+    } else if (req_len == 0) {
+        return -1;
+    }
+    client_addr.len = client_addrlen;
+
+    resp = process_request(s, s->sockfd, &client_addr, buf, req_len,
+        resp_buf, &resp_len);
+    if (resp == NULL) {
+        return -1;
+    }
+
+    int rc = 0;
+    /* Send response */
+    bytes = sendto(s->sockfd, resp, resp_len, 0, &client_addr.sa,
+        client_addr.len);
+    if (bytes != resp_len) {
+        STATS_ADD(s->stats.send_errors, 1);
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_ERROR, "sendto error: %m\n");
+        rc = -1;
+    }
+    /* If NOT local buffer, free it */
+    if ((resp != (dsc_command_t *)buf) && (resp != (dsc_command_t *)resp_buf)) {
+        free(resp);
+    }
+
+    return rc;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      serve_batch
+ *
+ * DESCRIPTION: 
+ *      Receive a batch of requests from a socket with one recvmmsg() call,
+ *      process them and send all the responses with one sendmmsg() call.
+ *
+ * PARAMETERS:
+ *      s     - A pointer of server info
+ *      fd    - The socket to receive requests from
+ *      max   - The max number of requests to receive
+ *      flags - The flags of recvmmsg(), MSG_WAITFORONE to wait for the first
+ *              request, MSG_DONTWAIT to take only the queued requests.
+ *
+ * RETURN:
+ *      The number of requests received, -1 on error.
+ ******************************************************************************/
+static int serve_batch(dsc_server_t *s, int fd, int max, int flags)
+{
+    struct dsc_batch *b;
+    int i, n, nresp, sent;
+    ssize_t resp_len;
+    dsc_command_t *resp;
+
+    if (s->batch == NULL) {
+        s->batch = (struct dsc_batch *)malloc(sizeof(struct dsc_batch));
+        if (s->batch == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            return -1;
+        }
+    }
+    b = s->batch;
+
+    for (i = 0; i < max; i++) {
+        b->iovs[i].iov_base = b->bufs[i];
+        b->iovs[i].iov_len = DSC_BUF_SIZE;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i].un);
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    n = recvmmsg(fd, b->msgs, max, flags, NULL);
+    if (n <= 0) {
+        return -1;
+    }
+
+    /* Process the requests */
+    nresp = 0;
+    for (i = 0; i < n; i++) {
+        if (b->msgs[i].msg_len == 0) {
+            continue;
+        }
+        b->addrs[i].len = b->msgs[i].msg_hdr.msg_namelen;
+        resp = process_request(s, fd, &b->addrs[i], b->bufs[i],
+            b->msgs[i].msg_len, b->resp_bufs[i], &resp_len);
+        if (resp == NULL) {
+            continue;
+        }
+
+        b->allocs[nresp] = NULL;
+        if ((resp != (dsc_command_t *)b->bufs[i]) &&
+            (resp != (dsc_command_t *)b->resp_bufs[i])) {
+            b->allocs[nresp] = resp;
+        }
+        b->resp_iovs[nresp].iov_base = resp;
+        b->resp_iovs[nresp].iov_len = resp_len;
+        memset(&b->resp_msgs[nresp].msg_hdr, 0, sizeof(struct msghdr));
+        b->resp_msgs[nresp].msg_hdr.msg_name = &b->addrs[i];
+        b->resp_msgs[nresp].msg_hdr.msg_namelen = b->addrs[i].len;
+        b->resp_msgs[nresp].msg_hdr.msg_iov = &b->resp_iovs[nresp];
+        b->resp_msgs[nresp].msg_hdr.msg_iovlen = 1;
+        nresp++;
+    }
+
+    /*
+     * Send all the responses, sendmmsg() may send part of them per call. It
+     * stops at the first error, which concerns one client only (e.g. a local
+     * client whose queue is full), so skip that response and go on
+     */
+    sent = 0;
+    while (sent < nresp) {
+        int rc = sendmmsg(fd, &b->resp_msgs[sent], nresp - sent, 0);
+        if (rc < 0) {
+            STATS_ADD(s->stats.send_errors, 1);
+            DSC_LOG_LIMITED(DSC_LOG_LEVEL_ERROR, "sendmmsg error: %m\n");
+            rc = 1;
+        }
+        sent += rc;
+    }
+
+    /* Free the responses allocated by the request handler */
+    for (i = 0; i < nresp; i++) {
+        free(b->allocs[i]);
+    }
+
+    /* Without server_run(), the handed off responses are started here */
+    if (__atomic_load_n(&s->handoffs, __ATOMIC_ACQUIRE) != NULL) {
+        run_handoffs(s);
+    }
+
+    return n;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_accept_batch
+ *
+ * DESCRIPTION: 
+ *      Accept a batch of requests with one recvmmsg() call, process them and
+ *      send all the responses with one sendmmsg() call. It blocks until one
+ *      request arrives (or the receive timeout expires), then takes whatever
+ *      else is already queued on the socket, up to max requests.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      max - The max number of requests to accept, no more than DSC_BATCH_MAX
+ *
+ * RETURN:
+ *      The number of requests received, -1 on error.
+ ******************************************************************************/
+int server_accept_batch(dsc_server_t *s, int max)
+{
+    if ((s == NULL) || (max <= 0)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+    if (max > DSC_BATCH_MAX) {
+        max = DSC_BATCH_MAX;
+    }
+
+    /* Wait for the first request, then drain the socket without blocking */
+    return serve_batch(s, s->sockfd, max, MSG_WAITFORONE);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_add_listener
+ *
+ * DESCRIPTION: 
+ *      Listen on one more port. The requests from all listening sockets are
+ *      served by server_run(), the response is sent from the socket which the
+ *      request comes from.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      port - The port number to listen on
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_add_listener(dsc_server_t *s, int port)
+{
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    int fd;
+
+    if ((s == NULL) || (s->nlisteners >= DSC_MAX_LISTENERS)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    fd = open_socket(port, -1, s->reuseport, &addr);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* Set the fd first, the server may be running already */
+    s->listen_fds[s->nlisteners] = fd;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = SERVER_EV_LISTENER | s->nlisteners;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        DSC_LOG_ERROR("epoll_ctl error: %m\n");
+        close(fd);
+        return -1;
+    }
+    __atomic_store_n(&s->nlisteners, s->nlisteners + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      remove_stale_socket
+ *
+ * DESCRIPTION: 
+ *      Remove the socket file left at the path of a local socket by a server
+ *      which is gone, found by a refused connect(). Any other file is kept.
+ *
+ * PARAMETERS:
+ *      addr - The address, a path
+ *
+ * RETURN:
+ *      0 - OK (removed, or no file), Others - Error, errno is EADDRINUSE if
+ *      the path is taken
+ ******************************************************************************/
+static int remove_stale_socket(const dsc_addr_t *addr)
+{
+    struct stat st;
+    int fd, rc;
+
+    if (lstat(addr->un.sun_path, &st) != 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        DSC_LOG_ERROR("lstat %s error: %m\n", addr->un.sun_path);
+        return -1;
+    }
+
+    rc = -1;
+    errno = EADDRINUSE;
+    if (S_ISSOCK(st.st_mode)) {
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            DSC_LOG_ERROR("socket error: %m\n");
+            return -1;
+        }
+        if (connect(fd, &addr->sa, addr->len) != 0) {
+            rc = (errno == ECONNREFUSED) ? 0 : -1;
+        }
+        close(fd);
+    }
+    if (rc != 0) {
+        DSC_LOG_ERROR("%s is in use\n", addr->un.sun_path);
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    if ((unlink(addr->un.sun_path) != 0) && (errno != ENOENT)) {
+        DSC_LOG_ERROR("unlink %s error: %m\n", addr->un.sun_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_add_unix_listener
+ *
+ * DESCRIPTION: 
+ *      Listen on a Unix domain datagram socket too, for the clients on the
+ *      same host (client_init_unix()). The packets and the handlers are the
+ *      same as over UDP, the requests are served by server_run() with the
+ *      other listeners. A stale socket file left at the path is removed, but
+ *      not another kind of file or a socket some process still receives on
+ *      (EADDRINUSE). The file is removed again by server_close().
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      path - The path of the socket, or "@name" for an abstract name
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_add_unix_listener(dsc_server_t *s, const char *path)
+{
+    dsc_addr_t addr;
+    struct epoll_event ev;
+    int fd;
+
+    if ((s == NULL) || (path == NULL) ||
+        (s->nlisteners >= DSC_MAX_LISTENERS) || (unix_addr(path, &addr) < 0)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*
+     * Never block on a client whose receive queue is full, its response is
+     * dropped like a lost datagram and the client sends the request again
+     */
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        DSC_LOG_ERROR("socket error: %m\n");
+        return -1;
+    }
+
+    if ((addr.un.sun_path[0] != '\0') && (remove_stale_socket(&addr) != 0)) {
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, &addr.sa, addr.len) != 0) {
+        DSC_LOG_ERROR("bind error: %m\n");
+        close(fd);
+        return -1;
+    }
+
+    /* Set the fd first, the server may be running already */
+    s->listen_fds[s->nlisteners] = fd;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = SERVER_EV_LISTENER | s->nlisteners;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        DSC_LOG_ERROR("epoll_ctl error: %m\n");
+        if (addr.un.sun_path[0] != '\0') {
+            unlink(addr.un.sun_path);
+        }
+        close(fd);
+        return -1;
+    }
+    __atomic_store_n(&s->nlisteners, s->nlisteners + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_add_timer
+ *
+ * DESCRIPTION: 
+ *      Add a periodic timer to server_run(), e.g. for housekeeping. The timer
+ *      function is called from the thread of server_run(), between requests.
+ *
+ * PARAMETERS:
+ *      s        - A pointer of server info
+ *      interval - The interval(milliseconds) of the timer
+ *      func     - The timer function
+ *      arg      - The argument passed to the timer function
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_add_timer(dsc_server_t *s, int interval, server_timer_t func,
+    void *arg)
+{
+    struct itimerspec its;
+    struct epoll_event ev;
+    int fd;
+
+    if ((s == NULL) || (interval <= 0) || (func == NULL) ||
+        (s->ntimers >= DSC_MAX_TIMERS)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        DSC_LOG_ERROR("timerfd_create error: %m\n");
+        return -1;
+    }
+
+    its.it_interval.tv_sec = interval / 1000;
+    its.it_interval.tv_nsec = (long)(interval % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, NULL) != 0) {
+        DSC_LOG_ERROR("timerfd_settime error: %m\n");
+        close(fd);
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = SERVER_EV_TIMER | s->ntimers;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        DSC_LOG_ERROR("epoll_ctl error: %m\n");
+        close(fd);
+        return -1;
+    }
+
+    s->timers[s->ntimers].fd = fd;
+    s->timers[s->ntimers].func = func;
+    s->timers[s->ntimers].arg = arg;
+    s->ntimers++;
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_workers
+ *
+ * DESCRIPTION: 
+ *      Run the request handlers in a pool of worker threads, so a slow handler
+ *      doesn't stop the server from receiving. The serving thread verifies the
+ *      requests, answers them from the caches, and queues the others for the
+ *      workers, which send the responses themselves (maybe out of order).
+ *      The fragmented requests are still handled by the serving thread.
+ *      It can be called only once per server.
+ *
+ * PARAMETERS:
+ *      s          - A pointer of server info
+ *      nworkers   - The number of workers
+ *      queue_size - The max number of requests queued, rounded up to power
+ *                   of 2
+ *      policy     - DSC_QUEUE_DROP or DSC_QUEUE_BUSY, what to do with a
+ *                   request if the queue is full
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_set_workers(dsc_server_t *s, int nworkers, int queue_size,
+    int policy)
+{
+    struct dsc_workq *q = NULL;
+    struct dsc_worker *workers = NULL;
+    struct epoll_event ev;
+    sigset_t all, old;
+    uint32_t size = 1;
+    int i, rc;
+
+    if ((s == NULL) || (s->workq != NULL) || (nworkers <= 0) ||
+        (queue_size <= 0) || (queue_size > 65536) ||
+        ((policy != DSC_QUEUE_DROP) && (policy != DSC_QUEUE_BUSY))) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+    while (size < (uint32_t)queue_size) {
+        size <<= 1;
+    }
+
+    /* The workers wake up the serving thread to send large responses */
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->wake_fd < 0) {
+        DSC_LOG_ERROR("eventfd error: %m\n");
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = SERVER_EV_WORKER;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake_fd, &ev) != 0) {
+        DSC_LOG_ERROR("epoll_ctl error: %m\n");
+        close(s->wake_fd);
+        s->wake_fd = -1;
+        return -1;
+    }
+
+    if (posix_memalign((void **)&q, 64, sizeof(struct dsc_workq) +
+        size * sizeof(struct dsc_work)) != 0) {
+        DSC_LOG_ERROR("malloc error\n");
+        q = NULL;
+        goto fail;
+    }
+    memset(q, 0, sizeof(struct dsc_workq));
+    q->size = size;
+    for (i = 0; i < (int)size; i++) {
+        q->slots[i].seq = i;
+    }
+
+    workers = (struct dsc_worker *)calloc(nworkers,
+        sizeof(struct dsc_worker));
+    if (workers == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        goto fail;
+    }
+
+    /* The signals are handled by the thread of the caller */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < nworkers; i++) {
+        workers[i].s = s;
+        workers[i].q = q;
+        rc = pthread_create(&workers[i].tid, NULL, worker_thread,
+            &workers[i]);
+        if (rc != 0) {
+            DSC_LOG_ERROR("pthread_create error (%s)\n", strerror(rc));
+            break;
+        }
+        workers[i].started = 1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (i < nworkers) {
+        /* Nothing is queued yet, the started ones just wait */
+        __atomic_store_n(&q->stop, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&q->futex, 1, __ATOMIC_SEQ_CST);
+        sys_futex(&q->futex, FUTEX_WAKE_PRIVATE, INT32_MAX);
+        while (--i >= 0) {
+            pthread_join(workers[i].tid, NULL);
+        }
+        goto fail;
+    }
+
+    /*
+     * The caches are locked once there are workers, then the requests can be
+     * queued. The servers of a pool are already serving here.
+     */
+    s->workers = workers;
+    s->queue_policy = policy;
+    __atomic_store_n(&s->nworkers, nworkers, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&s->workq, q, __ATOMIC_RELEASE);
+
+    return 0;
+
+fail:
+    free(workers);
+    free(q);
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->wake_fd, NULL);
+    close(s->wake_fd);
+    s->wake_fd = -1;
+    return -1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_backend
+ *
+ * DESCRIPTION: 
+ *      Select how server_run() receives the requests and sends the responses.
+ *      DSC_BACKEND_URING sets up an io_uring instance with a ring of receive
+ *      buffers provided to the kernel: the requests of all listening sockets
+ *      arrive by multishot receive without a system call per packet, and the
+ *      responses of a round are submitted together. If io_uring is not
+ *      available (old kernel, or disabled by seccomp or sysctl), the server
+ *      falls back to DSC_BACKEND_EPOLL. Call it before server_run().
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      backend - DSC_BACKEND_EPOLL or DSC_BACKEND_URING
+ *
+ * RETURN:
+ *      The backend in use, -1 on error.
+ ******************************************************************************/
+int server_set_backend(dsc_server_t *s, int backend)
+{
+    struct dsc_uring_io *io;
+    size_t buf_size;
+    int i;
+
+    if ((s == NULL) || ((backend != DSC_BACKEND_EPOLL) &&
+        (backend != DSC_BACKEND_URING))) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+    if ((backend == DSC_BACKEND_EPOLL) || (s->uring != NULL)) {
+        if ((backend == DSC_BACKEND_EPOLL) && (s->uring != NULL)) {
+            uring_release(s);
+        }
+        return s->backend;
+    }
+
+    io = (struct dsc_uring_io *)calloc(1, sizeof(struct dsc_uring_io));
+    if (io == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        return s->backend;
+    }
+
+    /* A buffer holds the header, the client address and the packet */
+    buf_size = sizeof(struct io_uring_recvmsg_out) +
+        URING_NAME_LEN + DSC_BUF_SIZE;
+    if (uring_init(&io->ring, URING_ENTRIES, URING_RECV_BUFS, buf_size) != 0) {
+        DSC_LOG_WARN("io_uring not available, use epoll: %m\n");
+        free(io);
+        return s->backend;
+    }
+    io->recv_msg.msg_namelen = URING_NAME_LEN;
+
+    for (i = 0; i < URING_SEND_SLOTS; i++) {
+        io->sends[i].iov.iov_base = io->sends[i].buf;
+        io->sends[i].msg.msg_name = &io->sends[i].addr;
+        io->sends[i].msg.msg_iov = &io->sends[i].iov;
+        io->sends[i].msg.msg_iovlen = 1;
+        io->free[i] = URING_SEND_SLOTS - 1 - i;
+    }
+    io->nfree = URING_SEND_SLOTS;
+
+    s->uring = io;
+    s->backend = DSC_BACKEND_URING;
+    return s->backend;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_default_backend
+ *
+ * DESCRIPTION: 
+ *      Select the backend of the servers created after, by server_init*() and
+ *      server_init_pool*(), refer server_set_backend(). The servers of a pool
+ *      are serving once it's created, so this is the way to select it for
+ *      them.
+ *
+ * PARAMETERS:
+ *      backend - DSC_BACKEND_EPOLL (default) or DSC_BACKEND_URING
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_set_default_backend(int backend)
+{
+    default_backend = backend;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_event
+ *
+ * DESCRIPTION: 
+ *      Handle an event of epfd.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      tag - The tag of the event, SERVER_EV_*
+ *      max - The max number of requests per recvmmsg()
+ *
+ * RETURN:
+ *      1 if server_stop() is called, 0 otherwise.
+ ******************************************************************************/
+static int server_event(dsc_server_t *s, uint32_t tag, int max)
+{
+    uint64_t val;
+    int fd, round;
+
+    switch (SERVER_EV_TYPE(tag)) {
+    case SERVER_EV_STOP:
+        /* Leave the eventfd readable, so server_run() can't restart */
+        return 1;
+
+    case SERVER_EV_LISTENER:
+        fd = s->listen_fds[SERVER_EV_INDEX(tag)];
+        for (round = 0; round < SERVER_MAX_ROUNDS; round++) {
+            if (serve_batch(s, fd, max, MSG_DONTWAIT) < max) {
+                break;
+            }
+        }
+        break;
+
+    case SERVER_EV_TIMER:
+        fd = s->timers[SERVER_EV_INDEX(tag)].fd;
+        if (read(fd, &val, sizeof(val)) == sizeof(val)) {
+            s->timers[SERVER_EV_INDEX(tag)].func(s,
+                s->timers[SERVER_EV_INDEX(tag)].arg);
+        }
+        break;
+
+    case SERVER_EV_XFER:
+        if (read(s->xfer_timerfd, &val, sizeof(val)) == sizeof(val)) {
+            run_transfers(s);
+        }
+        break;
+
+    case SERVER_EV_WORKER:
+        if (read(s->wake_fd, &val, sizeof(val)) == sizeof(val)) {
+            run_handoffs(s);
+        }
+        break;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_arm_recv
+ *
+ * DESCRIPTION: 
+ *      Start the multishot receive of a listening socket. It stays active
+ *      until it completes without IORING_CQE_F_MORE, e.g. when no receive
+ *      buffer is left.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      idx - Index of the listening socket
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int uring_arm_recv(dsc_server_t *s, int idx)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->uring->ring);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    uring_prep_recvmsg_multishot(sqe, s->listen_fds[idx], &s->uring->recv_msg,
+        URING_DATA(URING_OP_RECV, idx));
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_send
+ *
+ * DESCRIPTION: 
+ *      Queue a response to be sent with sendmsg(), it's submitted with the
+ *      other ones by the next io_uring_enter(). If all send slots are busy,
+ *      it is sent with sendto() at once.
+ *
+ * PARAMETERS:
+ *      s    - A pointer of server info
+ *      fd   - The socket to send from
+ *      addr - Client address
+ *      resp - The response packet, it's copied
+ *      len  - Length of the response packet
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void uring_send(dsc_server_t *s, int fd, dsc_addr_t *addr,
+    dsc_command_t *resp, ssize_t len)
+{
+    struct dsc_uring_io *io = s->uring;
+    struct dsc_uring_send *slot;
+    struct io_uring_sqe *sqe;
+    int idx;
+
+    if ((io->nfree > 0) && (len <= DSC_BUF_SIZE)) {
+        sqe = uring_get_sqe(&io->ring);
+        if (sqe != NULL) {
+            idx = io->free[--io->nfree];
+            slot = &io->sends[idx];
+            if (resp != (dsc_command_t *)slot->buf) {
+                memcpy(slot->buf, resp, len);
+            }
+            slot->addr = *addr;
+            slot->msg.msg_namelen = addr->len;
+            slot->iov.iov_len = len;
+            uring_prep_sendmsg(sqe, fd, &slot->msg,
+                URING_DATA(URING_OP_SEND, idx));
+            return;
+        }
+    }
+
+    if (sendto(fd, resp, len, 0, &addr->sa, addr->len) != len) {
+        STATS_ADD(s->stats.send_errors, 1);
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_ERROR, "sendto error: %m\n");
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_receive
+ *
+ * DESCRIPTION: 
+ *      Process a request received by the multishot receive, and queue its
+ *      response. The response is built in a free send slot, so it's not
+ *      copied in the common case.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      fd  - The socket the request comes from
+ *      buf - The receive buffer, struct io_uring_recvmsg_out is the first
+ *      len - The number of bytes received in the buffer
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void uring_receive(dsc_server_t *s, int fd, uint8_t *buf, int len)
+{
+    struct dsc_uring_io *io = s->uring;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    dsc_addr_t addr;
+    uint8_t local_buf[DSC_BUF_SIZE];
+    uint8_t *resp_buf, *payload;
+    dsc_command_t *resp;
+    ssize_t resp_len;
+    size_t hdr_len;
+
+    hdr_len = sizeof(*out) + io->recv_msg.msg_namelen +
+        io->recv_msg.msg_controllen;
+    if (((size_t)len < hdr_len) || (out->flags & MSG_TRUNC) ||
+        (out->namelen < sizeof(sa_family_t)) ||
+        (out->namelen > sizeof(addr.un)) || (out->payloadlen == 0)) {
+        /* Larger than DSC_BUF_SIZE, not a valid request anyway */
+        STATS_ADD(s->stats.rx_packets, 1);
+        STATS_ADD(s->stats.drop_length, 1);
+        return;
+    }
+    memcpy(&addr.sa, buf + sizeof(*out), out->namelen);
+    addr.len = out->namelen;
+    payload = buf + hdr_len;
+
+    /* Build the response in the send slot used next */
+    resp_buf = (io->nfree > 0) ? io->sends[io->free[io->nfree - 1]].buf :
+        local_buf;
+    resp = process_request(s, fd, &addr, payload, out->payloadlen, resp_buf,
+        &resp_len);
+    if (resp == NULL) {
+        return;
+    }
+    uring_send(s, fd, &addr, resp, resp_len);
+    if ((resp != (dsc_command_t *)payload) &&
+        (resp != (dsc_command_t *)resp_buf)) {
+        free(resp);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_poll_events
+ *
+ * DESCRIPTION: 
+ *      Handle the events of epfd, which is polled by the io_uring backend for
+ *      server_stop(), the timers, the transfers and the workers.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      1 if server_stop() is called, 0 otherwise.
+ ******************************************************************************/
+static int uring_poll_events(dsc_server_t *s)
+{
+    struct epoll_event events[DSC_MAX_LISTENERS + DSC_MAX_TIMERS + 3];
+    int i, n, max;
+
+    max = s->batch_size;
+    if ((max <= 0) || (max > DSC_BATCH_MAX)) {
+        max = DSC_BATCH_MAX;
+    }
+
+    do {
+        n = epoll_wait(s->epfd, events, sizeof(events) / sizeof(events[0]), 0);
+        for (i = 0; i < n; i++) {
+            if (server_event(s, events[i].data.u32, max)) {
+                return 1;
+            }
+        }
+    } while (n == sizeof(events) / sizeof(events[0]));
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_release
+ *
+ * DESCRIPTION: 
+ *      Destroy the io_uring backend of a server, and serve the listening
+ *      sockets with epoll again. The responses being sent are completed
+ *      first.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void uring_release(dsc_server_t *s)
+{
+    struct dsc_uring_io *io = s->uring;
+    struct io_uring_cqe *cqe;
+    struct epoll_event ev;
+    int i;
+
+    if (io == NULL) {
+        return;
+    }
+
+    while (io->nfree < URING_SEND_SLOTS) {
+        if (uring_submit_and_wait(&io->ring, 1) < 0) {
+            break;
+        }
+        while ((cqe = uring_peek_cqe(&io->ring)) != NULL) {
+            if (URING_DATA_OP(cqe->user_data) == URING_OP_SEND) {
+                io->free[io->nfree++] = URING_DATA_INDEX(cqe->user_data);
+            }
+            uring_cqe_seen(&io->ring);
+        }
+    }
+    uring_exit(&io->ring);
+    free(io);
+    s->uring = NULL;
+    s->backend = DSC_BACKEND_EPOLL;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    for (i = 0; i < __atomic_load_n(&s->nlisteners, __ATOMIC_ACQUIRE); i++) {
+        ev.data.u32 = SERVER_EV_LISTENER | i;
+        epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->listen_fds[i], &ev);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_run
+ *
+ * DESCRIPTION: 
+ *      server_run() of the io_uring backend. A multishot receive per listening
+ *      socket delivers the requests into the provided buffers, and the
+ *      responses are queued as sendmsg() operations. One io_uring_enter()
+ *      submits all the responses of a round and waits for the next requests.
+ *      The other events of epfd are taken by a multishot poll of epfd.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int uring_run(dsc_server_t *s)
+{
+    struct dsc_uring_io *io = s->uring;
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    uint64_t data;
+    uint32_t flags, idx;
+    int i, res, rc = 0, stop = 0, recycled, served = 0;
+
+    /* The listening sockets are served by the ring instead of epoll */
+    for (i = 0; i < __atomic_load_n(&s->nlisteners, __ATOMIC_ACQUIRE); i++) {
+        epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->listen_fds[i], NULL);
+        if (uring_arm_recv(s, i) != 0) {
+            rc = -1;
+            goto out;
+        }
+    }
+    sqe = uring_get_sqe(&io->ring);
+    if (sqe == NULL) {
+        rc = -1;
+        goto out;
+    }
+    uring_prep_poll_multishot(sqe, s->epfd, URING_DATA(URING_OP_POLL, 0));
+
+    while (!stop) {
+        if (uring_submit_and_wait(&io->ring, 1) < 0) {
+            rc = -1;
+            break;
+        }
+
+        recycled = 0;
+        while ((cqe = uring_peek_cqe(&io->ring)) != NULL) {
+            data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            idx = URING_DATA_INDEX(data);
+
+            switch (URING_DATA_OP(data)) {
+            case URING_OP_RECV:
+                if (flags & IORING_CQE_F_BUFFER) {
+                    uint32_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                    uring_receive(s, s->listen_fds[idx],
+                        uring_buf(&io->ring, bid), res);
+                    uring_buf_recycle(&io->ring, bid);
+                    recycled++;
+                    served = 1;
+                } else if ((res == -EINVAL) && !served) {
+                    /* The kernel doesn't support the multishot receive */
+                    DSC_LOG_WARN("io_uring receive not supported, use epoll\n");
+                    uring_cqe_seen(&io->ring);
+                    uring_release(s);
+                    return server_run(s);
+                } else if ((res < 0) && (res != -ENOBUFS)) {
+                    errno = -res;
+                    DSC_LOG_LIMITED(DSC_LOG_LEVEL_ERROR,
+                        "io_uring receive error: %m\n");
+                }
+                if (!(flags & IORING_CQE_F_MORE) &&
+                    (uring_arm_recv(s, idx) != 0)) {
+                    rc = -1;
+                    stop = 1;
+                }
+                break;
+
+            case URING_OP_SEND:
+                if (res < 0) {
+                    STATS_ADD(s->stats.send_errors, 1);
+                    errno = -res;
+                    DSC_LOG_LIMITED(DSC_LOG_LEVEL_ERROR,
+                        "sendmsg error: %m\n");
+                }
+                io->free[io->nfree++] = idx;
+                break;
+
+            case URING_OP_POLL:
+                if (uring_poll_events(s)) {
+                    stop = 1;
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    sqe = uring_get_sqe(&io->ring);
+                    if (sqe == NULL) {
+                        rc = -1;
+                        stop = 1;
+                        break;
+                    }
+                    uring_prep_poll_multishot(sqe, s->epfd,
+                        URING_DATA(URING_OP_POLL, 0));
+                }
+                break;
+            }
+            uring_cqe_seen(&io->ring);
+        }
+
+        /* Give the buffers back to the kernel at once */
+        if (recycled > 0) {
+            uring_buf_publish(&io->ring);
+        }
+
+        /*
+         * The eventfd of the workers is seen through the poll of the epoll
+         * set, one more trip through the ring. Start the responses handed off
+         * meanwhile after each batch instead, the poll only wakes up an idle
+         * loop.
+         */
+        if (__atomic_load_n(&s->handoffs, __ATOMIC_ACQUIRE) != NULL) {
+            run_handoffs(s);
+        }
+    }
+
+out:
+    /* Submit the responses queued, and wait for them to be sent */
+    uring_release(s);
+    return rc;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_run
+ *
+ * DESCRIPTION: 
+ *      Serve the requests from all listening sockets and run the timers until
+ *      server_stop() is called. It sleeps in epoll_wait() while idle, and
+ *      drains a readable socket in batches of s->batch_size requests. With
+ *      the io_uring backend, refer server_set_backend(), the requests are
+ *      received and the responses sent by io_uring instead, and the backend
+ *      is released on return.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_run(dsc_server_t *s)
+{
+    struct epoll_event events[DSC_MAX_LISTENERS + DSC_MAX_TIMERS + 3];
+    int i, n, max;
+
+    if (s == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    if (s->uring != NULL) {
+        return uring_run(s);
+    }
+
+    max = s->batch_size;
+    if ((max <= 0) || (max > DSC_BATCH_MAX)) {
+        max = DSC_BATCH_MAX;
+    }
+
+    for (;;) {
+        n = epoll_wait(s->epfd, events,
+            sizeof(events) / sizeof(events[0]), -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DSC_LOG_ERROR("epoll_wait error: %m\n");
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (server_event(s, events[i].data.u32, max)) {
+                return 0;
+            }
+        }
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_stop
+ *
+ * DESCRIPTION: 
+ *      Make server_run() return. It is async-signal-safe, so it can be called
+ *      from a signal handler, and from any thread.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_stop(dsc_server_t *s)
+{
+    uint64_t val = 1;
+    int saved_errno = errno;
+
+    if (s == NULL) {
+        return;
+    }
+
+    if (write(s->evfd, &val, sizeof(val)) < 0) {
+        /* The counter is full, server_run() is being stopped anyway */
+    }
+    errno = saved_errno;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_register_handler
+ *
+ * DESCRIPTION: 
+ *      Register the handler of a command. The handlers are kept in a table
+ *      indexed by command, so the dispatch costs one load no matter how many
+ *      commands are registered. The registered handler takes precedence over
+ *      the request handler passed to server_init_buf(). It can be called while
+ *      the server is running, requests received before are answered as if
+ *      the handler was not registered.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      cmd     - The command, DSC_CMD_BASE ~ DSC_CMD_BASE+DSC_MAX_COMMANDS-1
+ *      handler - The handler, NULL to unregister
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_register_handler(dsc_server_t *s, uint32_t cmd,
+    request_buf_handler_t handler)
+{
+    uint32_t idx = cmd - DSC_CMD_BASE;
+
+    if ((s == NULL) || (idx >= DSC_MAX_COMMANDS)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    __atomic_store_n(&s->handlers[idx], handler, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_replay_cache
+ *
+ * DESCRIPTION: 
+ *      Set the size of the replay cache, which keeps the latest responses by
+ *      client address and request ID. A request sent again by the client
+ *      (since the response is lost) is answered from the cache, so requests
+ *      like CMD_PUT_MESSAGE are not executed twice. Every client address
+ *      keeps the responses of its DSC_REPLAY_WINDOW latest requests, however
+ *      busy the other clients are, as long as no more than entries /
+ *      DSC_REPLAY_WINDOW addresses (4 per set, by hash) are active: a new
+ *      address takes the place of the least recently seen one. Responses
+ *      larger than DSC_BUF_SIZE are not cached. It can be called while the
+ *      server is running, the cache is emptied then.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      entries - The number of responses kept (rounded up to a power of 2
+ *                of client windows), 0 to disable the cache. The default is
+ *                DSC_REPLAY_CACHE_SIZE.
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_set_replay_cache(dsc_server_t *s, int entries)
+{
+    int size = 0;
+
+    if ((s == NULL) || (entries < 0) || (entries > 65536)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    if (entries > 0) {
+        for (size = REPLAY_WAYS; size * DSC_REPLAY_WINDOW < entries;
+            size <<= 1) {
+        }
+    }
+
+    __atomic_store_n(&s->replay_wanted, size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_compression
+ *
+ * DESCRIPTION: 
+ *      Set the min data length of the responses compressed. A response is
+ *      compressed only if the request has DSC_FLAG_ACCEPT_LZ and it gets
+ *      shorter. The compressed requests are always taken. It can be called
+ *      while the server is running.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      min_len - The min data length, 0 to never compress. The default is
+ *                DSC_COMPRESS_MIN.
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_set_compression(dsc_server_t *s, uint32_t min_len)
+{
+    if (s == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    __atomic_store_n(&s->compress_min, min_len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_remote_stats
+ *
+ * DESCRIPTION: 
+ *      Answer DSC_CMD_GET_STATS from the other hosts too. By default only the
+ *      clients on the loopback address or a local socket get the stats: the
+ *      response is over 70KB for a request of 22 bytes, and the source
+ *      address of a datagram may be forged. It can be called while the server
+ *      is running.
+ *
+ * PARAMETERS:
+ *      s      - A pointer of server info
+ *      enable - 1 to answer all clients, 0 the local ones only
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_set_remote_stats(dsc_server_t *s, int enable)
+{
+    if (s == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&s->remote_stats, enable ? 1 : 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_max_lease
+ *
+ * DESCRIPTION: 
+ *      Set the max lease granted to a subscriber of server_publish(), a
+ *      longer one asked for is cut to it. It can be called while the server
+ *      is running, the leases granted already are kept.
+ *
+ * PARAMETERS:
+ *      s     - A pointer of server info
+ *      lease - The max lease(seconds), default: DSC_SUB_LEASE
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_set_max_lease(dsc_server_t *s, uint32_t lease)
+{
+    if ((s == NULL) || (lease == 0)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&s->sub_max_lease, lease, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_reassembly
+ *
+ * DESCRIPTION: 
+ *      Limit the fragmented requests: the max data length of a request, and
+ *      the max memory of all requests being reassembled (by all servers of a
+ *      pool). The memory of a request grows as its fragments arrive, a
+ *      fragment over the limit is dropped and sent again by the client. It
+ *      can be called while the server is running, a new max memory applies
+ *      to the requests started later.
+ *
+ * PARAMETERS:
+ *      s       - A pointer of server info
+ *      max_msg - The max data length (1 - DSC_MAX_MSG_SIZE), the default is
+ *                DSC_MAX_MSG_SIZE
+ *      max_mem - The max memory(bytes), the default is DSC_REASSEMBLY_MEM
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_set_reassembly(dsc_server_t *s, uint32_t max_msg, size_t max_mem)
+{
+    if ((s == NULL) || (max_msg == 0) || (max_msg > DSC_MAX_MSG_SIZE) ||
+        (max_mem == 0)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&s->xfer_max_msg, max_msg, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->xfer_mem_max, max_mem, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_set_admission
+ *
+ * DESCRIPTION: 
+ *      Limit the packets taken from every client address with a token bucket,
+ *      checked before the packet is verified, so a noisy client or a flood of
+ *      junk can't starve the others. The fragments of a message count one by
+ *      one, so the burst shall cover DSC_FRAG_WINDOW if the clients send
+ *      large messages. The buckets of a pool are shared by all servers, refer
+ *      server_pool_set_admission(). It can be called while the server is
+ *      running.
+ *
+ * PARAMETERS:
+ *      s      - A pointer of server info
+ *      rate   - The packets per second per client address, 0 to admit all
+ *               (the default)
+ *      burst  - The max packets in a burst, 0 for rate (a burst of 1 second)
+ *      policy - DSC_QUEUE_DROP to drop the packets over the rate, or
+ *               DSC_QUEUE_BUSY to answer the requests with STATUS_BUSY
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_set_admission(dsc_server_t *s, uint32_t rate, uint32_t burst,
+    int policy)
+{
+    if ((s == NULL) || (burst > 1000000) ||
+        ((policy != DSC_QUEUE_DROP) && (policy != DSC_QUEUE_BUSY))) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    if (burst == 0) {
+        burst = (rate < 1000000) ? rate : 1000000;
+    }
+    __atomic_store_n(&s->admit_burst, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->admit_policy, policy, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->admit_rate, rate, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_invalidate_cache
+ *
+ * DESCRIPTION: 
+ *      Drop the cached responses of a command, e.g. after the value returned
+ *      by it is changed. If the server is in a pool, the responses cached by
+ *      all servers of the pool are dropped. It can be called from any thread,
+ *      including the request handlers.
+ *
+ * PARAMETERS:
+ *      s   - A pointer of server info
+ *      cmd - The command
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_invalidate_cache(dsc_server_t *s, uint32_t cmd)
+{
+    uint32_t idx = cmd - DSC_CMD_BASE;
+
+    if ((s == NULL) || (idx >= DSC_MAX_COMMANDS)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    if (s->pool != NULL) {
+        return server_pool_invalidate_cache(s->pool, cmd);
+    }
+
+    __atomic_add_fetch(&s->cache_gen[idx], 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      add_stats
+ *
+ * DESCRIPTION: 
+ *      Add the stats of a server to a snapshot. The counters are read one by
+ *      one while the serving thread keeps counting, so the snapshot is not
+ *      atomic as a whole, but no counter is torn.
+ *
+ * PARAMETERS:
+ *      dst - The snapshot
+ *      src - The stats of a server
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void add_stats(dsc_stats_t *dst, dsc_stats_t *src)
+{
+    uint64_t *d = (uint64_t *)dst;
+    uint64_t *p = (uint64_t *)src;
+    size_t i;
+
+    for (i = 0; i < sizeof(dsc_stats_t) / sizeof(uint64_t); i++) {
+        d[i] += __atomic_load_n(&p[i], __ATOMIC_RELAXED);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      add_server_stats
+ *
+ * DESCRIPTION: 
+ *      Add the stats of a server and its workers to a snapshot.
+ *
+ * PARAMETERS:
+ *      dst - The snapshot
+ *      s   - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void add_server_stats(dsc_stats_t *dst, dsc_server_t *s)
+{
+    int i;
+
+    add_stats(dst, &s->stats);
+    for (i = 0; i < s->nworkers; i++) {
+        add_stats(dst, &s->workers[i].stats);
+    }
+    if (s->workq != NULL) {
+        dst->queue_depth += __atomic_load_n(&s->workq->tail, __ATOMIC_RELAXED)
+            - __atomic_load_n(&s->workq->head, __ATOMIC_RELAXED);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_get_stats
+ *
+ * DESCRIPTION: 
+ *      Take a snapshot of the stats of a server. If the server is in a pool,
+ *      the stats of all servers of the pool are added up. It can be called
+ *      from any thread, the serving threads are never blocked by it.
+ *
+ * PARAMETERS:
+ *      s     - A pointer of server info
+ *      stats - Output, the snapshot
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_get_stats(dsc_server_t *s, dsc_stats_t *stats)
+{
+    if ((s == NULL) || (stats == NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    if (s->pool != NULL) {
+        return server_pool_get_stats(s->pool, stats);
+    }
+
+    memset(stats, 0, sizeof(dsc_stats_t));
+    add_server_stats(stats, s);
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      latency_percentile
+ *
+ * DESCRIPTION: 
+ *      Get a percentile of a latency histogram, as the upper bound of the
+ *      bucket it falls in.
+ *
+ * PARAMETERS:
+ *      hist - The histogram, DSC_LATENCY_BUCKETS buckets
+ *      q    - The percentile, 0.0 - 1.0
+ *
+ * RETURN:
+ *      The latency in nanoseconds, 0 if the histogram is empty
+ ******************************************************************************/
+static uint64_t latency_percentile(const uint64_t *hist, double q)
+{
+    uint64_t total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < DSC_LATENCY_BUCKETS; i++) {
+        total += hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < DSC_LATENCY_BUCKETS - 1; i++) {
+        sum += hist[i];
+        if (sum >= q * total) {
+            break;
+        }
+    }
+
+    return (uint64_t)2 << i;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_print_stats
+ *
+ * DESCRIPTION: 
+ *      Print a snapshot of stats, one line per command received.
+ *
+ * PARAMETERS:
+ *      stats - The snapshot
+ *      fp    - The file to print to
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_print_stats(const dsc_stats_t *stats, FILE *fp)
+{
+    const dsc_cmd_stats_t *cs;
+    int i;
+
+    if ((stats == NULL) || (fp == NULL)) {
+        return;
+    }
+
+    fprintf(fp, "Received:   %llu packets, %llu bytes\n",
+        (unsigned long long)stats->rx_packets,
+        (unsigned long long)stats->rx_bytes);
+    fprintf(fp, "Dropped:    %llu signature, %llu length, %llu checksum\n",
+        (unsigned long long)stats->drop_signature,
+        (unsigned long long)stats->drop_length,
+        (unsigned long long)stats->drop_checksum);
+    fprintf(fp, "Send error: %llu, replayed: %llu\n",
+        (unsigned long long)stats->send_errors,
+        (unsigned long long)stats->replays);
+    fprintf(fp, "Queue:      %llu queued, %llu peak, %llu dropped, %llu busy\n",
+        (unsigned long long)stats->queue_depth,
+        (unsigned long long)stats->queue_peak,
+        (unsigned long long)stats->queue_drops,
+        (unsigned long long)stats->queue_busy);
+    fprintf(fp, "Admission:  %llu shed, %llu busy, %llu evictions\n",
+        (unsigned long long)stats->admit_shed,
+        (unsigned long long)stats->admit_busy,
+        (unsigned long long)stats->admit_evictions);
+    fprintf(fp, "%-8s %12s %10s %12s %14s %14s %10s %10s\n", "command",
+        "requests", "errors", "cache_hits", "bytes_in", "bytes_out",
+        "p50(us)", "p99(us)");
+
+    for (i = 0; i <= DSC_MAX_COMMANDS; i++) {
+        cs = &stats->cmds[i];
+        if (cs->requests == 0) {
+            continue;
+        }
+        if (i < DSC_MAX_COMMANDS) {
+            fprintf(fp, "0x%04X  ", DSC_CMD_BASE + i);
+        } else {
+            fprintf(fp, "%-8s", "others");
+        }
+        fprintf(fp, " %12llu %10llu %12llu %14llu %14llu %10.1f %10.1f\n",
+            (unsigned long long)cs->requests,
+            (unsigned long long)cs->errors,
+            (unsigned long long)cs->cache_hits,
+            (unsigned long long)cs->bytes_in,
+            (unsigned long long)cs->bytes_out,
+            latency_percentile(cs->latency, 0.50) / 1000.0,
+            latency_percentile(cs->latency, 0.99) / 1000.0);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      unlink_listener
+ *
+ * DESCRIPTION: 
+ *      Remove the socket file of a Unix domain listener, so the clients fail
+ *      at once instead of sending into a socket nobody reads.
+ *
+ * PARAMETERS:
+ *      fd - A listening socket
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void unlink_listener(int fd)
+{
+    dsc_addr_t addr;
+    socklen_t len = sizeof(addr.un);
+
+    memset(&addr, 0, sizeof(addr));
+    if ((getsockname(fd, &addr.sa, &len) == 0) &&
+        (addr.sa.sa_family == AF_UNIX) &&
+        (len > offsetof(struct sockaddr_un, sun_path)) &&
+        (addr.un.sun_path[0] != '\0')) {
+        unlink(addr.un.sun_path);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_close
+ *
+ * DESCRIPTION: 
+ *      Close the socket fd and free memory.
+ *
+ * PARAMETERS:
+ *      s - A pointer of server info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_close(dsc_server_t *s)
+{
+    int i;
+
+    if (s == NULL) {
+        return;
+    }
+
+    /* A server closed without server_run() may still have the ring */
+    uring_release(s);
+
+    /* Stop the workers before the sockets are closed */
+    if (s->workq != NULL) {
+        __atomic_store_n(&s->workq->stop, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&s->workq->futex, 1, __ATOMIC_SEQ_CST);
+        sys_futex(&s->workq->futex, FUTEX_WAKE_PRIVATE, INT32_MAX);
+        for (i = 0; i < s->nworkers; i++) {
+            if (s->workers[i].started) {
+                pthread_join(s->workers[i].tid, NULL);
+            }
+        }
+        while (s->handoffs != NULL) {
+            struct dsc_handoff *h = s->handoffs;
+            s->handoffs = h->next;
+            free(h->resp);
+            free(h);
+        }
+        free(s->workers);
+        free(s->workq);
+    }
+    if (s->wake_fd >= 0) {
+        close(s->wake_fd);
+    }
+
+    for (i = 0; i < s->nlisteners; i++) {
+        unlink_listener(s->listen_fds[i]);
+        close(s->listen_fds[i]);
+    }
+    for (i = 0; i < s->ntimers; i++) {
+        close(s->timers[i].fd);
+    }
+    if (s->epfd >= 0) {
+        close(s->epfd);
+    }
+    if (s->evfd >= 0) {
+        close(s->evfd);
+    }
+    if (s->xfers != NULL) {
+        for (i = 0; i < DSC_MAX_TRANSFERS; i++) {
+            if (s->xfers[i].in_use) {
+                free_xfer(s, &s->xfers[i]);
+            }
+        }
+        free(s->xfers);
+    }
+    if (s->xfer_timerfd >= 0) {
+        close(s->xfer_timerfd);
+    }
+    free_replay(s);
+    if (s->resp_cache != NULL) {
+        for (i = 0; i < DSC_MAX_COMMANDS; i++) {
+            free(s->resp_cache[i].pkt);
+            free(s->resp_cache[i].zpkt);
+        }
+        free(s->resp_cache);
+    }
+    free(s->batch);
+    free(s->admit_own);
+    if (s->subs != NULL) {
+        free(s->subs->entries);
+        free(s->subs);
+    }
+    pthread_mutex_destroy(&s->sub_lock);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_thread
+ *
+ * DESCRIPTION: 
+ *      The serving thread of a server in the pool, it serves requests until
+ *      the pool is closed.
+ *
+ * PARAMETERS:
+ *      arg - A pointer of server info
+ *
+ * RETURN:
+ *      NULL
+ ******************************************************************************/
+static void *server_pool_thread(void *arg)
+{
+    server_run((dsc_server_t *)arg);
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      pool_create
+ *
+ * DESCRIPTION: 
+ *      Create the servers of a pool and start the serving threads. All signals
+ *      are blocked in the serving threads, so they are delivered to the other
+ *      threads of the process.
+ *
+ * PARAMETERS:
+ *      req_handler - The function pointer of a user-defined request handler,
+ *                    it is called from all serving threads concurrently.
+ *      buf_handler - The same as req_handler, but fills the response in a
+ *                    server-owned buffer. Only one of the handlers is used.
+ *      port        - The port number of server
+ *      nthreads    - The number of servers/threads in the pool
+ *
+ * RETURN:
+ *      A pointer of server pool info.
+ ******************************************************************************/
+static dsc_server_pool_t *pool_create(request_handler_t req_handler,
+    request_buf_handler_t buf_handler, int port, int nthreads)
+{
+    dsc_server_pool_t *p;
+    sigset_t all, old;
+    int i, rc;
+
+    if (nthreads <= 0) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return NULL;
+    }
+
+    p = (dsc_server_pool_t *)malloc(sizeof(dsc_server_pool_t));
+    if (p == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        return NULL;
+    }
+    memset(p, 0, sizeof(dsc_server_pool_t));
+
+    p->servers = (dsc_server_t **)calloc(nthreads, sizeof(dsc_server_t *));
+    p->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    if ((p->servers == NULL) || (p->threads == NULL)) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        server_pool_close(p);
+        return NULL;
+    }
+
+    /* Open all sockets first, so no request is lost by a failed init */
+    for (i = 0; i < nthreads; i++) {
+        p->servers[i] = server_create(req_handler, buf_handler, port, -1, 1);
+        if (p->servers[i] == NULL) {
+            server_pool_close(p);
+            return NULL;
+        }
+        p->servers[i]->pool = p;
+        p->servers[i]->xfer_mem = &p->xfer_mem;
+        p->servers[i]->sub_secret = p->servers[0]->sub_secret;
+        p->servers[i]->admit = &p->admit;
+        p->nservers++;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < nthreads; i++) {
+        rc = pthread_create(&p->threads[i], NULL, server_pool_thread,
+            p->servers[i]);
+        if (rc != 0) {
+            DSC_LOG_ERROR("pthread_create error (%s)\n", strerror(rc));
+            break;
+        }
+        p->nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (p->nthreads != nthreads) {
+        server_pool_close(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_init_pool
+ *
+ * DESCRIPTION: 
+ *      Create a pool of servers on the same port. Every server has its own
+ *      socket bound with SO_REUSEPORT and its own serving thread, the kernel
+ *      distributes the requests over the sockets by the client address.
+ *      The serving threads are started before return and run until
+ *      server_pool_close() is called. All signals are blocked in the serving
+ *      threads, so they are delivered to the other threads of the process.
+ *
+ * PARAMETERS:
+ *      req_handler - The function pointer of a user-defined request handler,
+ *                    it is called from all serving threads concurrently.
+ *      port        - The port number of server
+ *      nthreads    - The number of servers/threads in the pool
+ *
+ * RETURN:
+ *      A pointer of server pool info.
+ ******************************************************************************/
+dsc_server_pool_t *server_init_pool(request_handler_t req_handler, int port,
+    int nthreads)
+{
+    if (req_handler == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return NULL;
+    }
+
+    return pool_create(req_handler, NULL, port, nthreads);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_init_pool_buf
+ *
+ * DESCRIPTION: 
+ *      The same as server_init_pool, but the request handler fills the response
+ *      in a buffer owned by the server.
+ *
+ * PARAMETERS:
+ *      buf_handler - The function pointer of a user-defined request handler,
+ *                    it is called from all serving threads concurrently.
+ *                    NULL to use the handlers registered only.
+ *      port        - The port number of server
+ *      nthreads    - The number of servers/threads in the pool
+ *
+ * RETURN:
+ *      A pointer of server pool info.
+ ******************************************************************************/
+dsc_server_pool_t *server_init_pool_buf(request_buf_handler_t buf_handler,
+    int port, int nthreads)
+{
+    return pool_create(NULL, buf_handler, port, nthreads);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_register_handler
+ *
+ * DESCRIPTION: 
+ *      Register the handler of a command on all servers of the pool, refer
+ *      server_register_handler().
+ *
+ * PARAMETERS:
+ *      p       - A pointer of server pool info
+ *      cmd     - The command, DSC_CMD_BASE ~ DSC_CMD_BASE+DSC_MAX_COMMANDS-1
+ *      handler - The handler, NULL to unregister
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_register_handler(dsc_server_pool_t *p, uint32_t cmd,
+    request_buf_handler_t handler)
+{
+    int i;
+
+    if (p == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        if (server_register_handler(p->servers[i], cmd, handler) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_set_replay_cache
+ *
+ * DESCRIPTION: 
+ *      Set the size of the replay cache of all servers in the pool, refer
+ *      server_set_replay_cache().
+ *
+ * PARAMETERS:
+ *      p       - A pointer of server pool info
+ *      entries - The number of entries per server, 0 to disable the cache
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_set_replay_cache(dsc_server_pool_t *p, int entries)
+{
+    int i;
+
+    if (p == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        if (server_set_replay_cache(p->servers[i], entries) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_set_compression
+ *
+ * DESCRIPTION: 
+ *      Set the min data length of the responses compressed by all servers in
+ *      the pool, refer server_set_compression().
+ *
+ * PARAMETERS:
+ *      p       - A pointer of server pool info
+ *      min_len - The min data length, 0 to never compress
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_set_compression(dsc_server_pool_t *p, uint32_t min_len)
+{
+    int i;
+
+    if (p == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        server_set_compression(p->servers[i], min_len);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_set_remote_stats
+ *
+ * DESCRIPTION: 
+ *      Answer DSC_CMD_GET_STATS from the other hosts on all servers in the
+ *      pool, refer server_set_remote_stats().
+ *
+ * PARAMETERS:
+ *      p      - A pointer of server pool info
+ *      enable - 1 to answer all clients, 0 the local ones only
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_set_remote_stats(dsc_server_pool_t *p, int enable)
+{
+    int i;
+
+    if (p == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        server_set_remote_stats(p->servers[i], enable);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_set_max_lease
+ *
+ * DESCRIPTION: 
+ *      Set the max lease of the subscribers on all servers in the pool, refer
+ *      server_set_max_lease().
+ *
+ * PARAMETERS:
+ *      p     - A pointer of server pool info
+ *      lease - The max lease(seconds)
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_set_max_lease(dsc_server_pool_t *p, uint32_t lease)
+{
+    int i;
+
+    if ((p == NULL) || (lease == 0)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        server_set_max_lease(p->servers[i], lease);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_set_reassembly
+ *
+ * DESCRIPTION: 
+ *      Limit the fragmented requests of all servers in the pool, refer
+ *      server_set_reassembly(). The max memory is shared by the pool.
+ *
+ * PARAMETERS:
+ *      p       - A pointer of server pool info
+ *      max_msg - The max data length (1 - DSC_MAX_MSG_SIZE)
+ *      max_mem - The max memory(bytes)
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_set_reassembly(dsc_server_pool_t *p, uint32_t max_msg,
+    size_t max_mem)
+{
+    int i;
+
+    if (p == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        if (server_set_reassembly(p->servers[i], max_msg, max_mem) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_set_admission
+ *
+ * DESCRIPTION: 
+ *      Limit the packets of every client address on all servers in the pool,
+ *      refer server_set_admission(). The servers share the buckets, so a
+ *      client address using several ports, spread over the servers by
+ *      SO_REUSEPORT, still gets the rate once.
+ *
+ * PARAMETERS:
+ *      p      - A pointer of server pool info
+ *      rate   - The packets per second per client address, 0 to admit all
+ *      burst  - The max packets in a burst, 0 for rate
+ *      policy - DSC_QUEUE_DROP or DSC_QUEUE_BUSY
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_set_admission(dsc_server_pool_t *p, uint32_t rate,
+    uint32_t burst, int policy)
+{
+    int i;
+
+    if (p == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        if (server_set_admission(p->servers[i], rate, burst, policy) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_invalidate_cache
+ *
+ * DESCRIPTION: 
+ *      Drop the cached responses of a command on all servers of the pool,
+ *      refer server_invalidate_cache().
+ *
+ * PARAMETERS:
+ *      p   - A pointer of server pool info
+ *      cmd - The command
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_invalidate_cache(dsc_server_pool_t *p, uint32_t cmd)
+{
+    uint32_t idx = cmd - DSC_CMD_BASE;
+    int i;
+
+    if ((p == NULL) || (idx >= DSC_MAX_COMMANDS)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        __atomic_add_fetch(&p->servers[i]->cache_gen[idx], 1,
+            __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_get_stats
+ *
+ * DESCRIPTION: 
+ *      Take a snapshot of the stats of all servers of the pool, added up,
+ *      refer server_get_stats().
+ *
+ * PARAMETERS:
+ *      p     - A pointer of server pool info
+ *      stats - Output, the snapshot
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_get_stats(dsc_server_pool_t *p, dsc_stats_t *stats)
+{
+    int i;
+
+    if ((p == NULL) || (stats == NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(dsc_stats_t));
+    for (i = 0; i < p->nservers; i++) {
+        add_server_stats(stats, p->servers[i]);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_publish
+ *
+ * DESCRIPTION: 
+ *      Push a message to the subscribers of all servers of the pool, the
+ *      packet is encoded once, refer server_publish().
+ *
+ * PARAMETERS:
+ *      p    - A pointer of server pool info
+ *      cmd  - The command of the message
+ *      data - The data of the message
+ *      len  - The data length, no more than DSC_BUF_SIZE - header
+ *
+ * RETURN:
+ *      The number of subscribers the message is sent to, -1 on error.
+ ******************************************************************************/
+int server_pool_publish(dsc_server_pool_t *p, uint32_t cmd, const void *data,
+    uint32_t len)
+{
+    uint8_t buf[DSC_BUF_SIZE];
+    struct iovec iov;
+    uint64_t now;
+    int i, sent = 0;
+
+    if (p == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+    if (encode_push(buf, cmd, data, len, &iov) != 0) {
+        return -1;
+    }
+
+    now = now_usec();
+    for (i = 0; i < p->nservers; i++) {
+        sent += fan_out(p->servers[i], &iov, now);
+    }
+
+    return sent;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_set_workers
+ *
+ * DESCRIPTION: 
+ *      Give every server of the pool its own workers and queue, refer
+ *      server_set_workers().
+ *
+ * PARAMETERS:
+ *      p          - A pointer of server pool info
+ *      nworkers   - The number of workers per server
+ *      queue_size - The max number of requests queued per server
+ *      policy     - DSC_QUEUE_DROP or DSC_QUEUE_BUSY
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int server_pool_set_workers(dsc_server_pool_t *p, int nworkers,
+    int queue_size, int policy)
+{
+    int i;
+
+    if (p == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        if (server_set_workers(p->servers[i], nworkers, queue_size,
+            policy) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      server_pool_close
+ *
+ * DESCRIPTION: 
+ *      Stop the serving threads of the pool, wait for them to exit, then close
+ *      all servers and free memory.
+ *
+ * PARAMETERS:
+ *      p - A pointer of server pool info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void server_pool_close(dsc_server_pool_t *p)
+{
+    int i;
+
+    if (p == NULL) {
+        return;
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        server_stop(p->servers[i]);
+    }
+
+    for (i = 0; i < p->nthreads; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+
+    for (i = 0; i < p->nservers; i++) {
+        server_close(p->servers[i]);
+    }
+    free(p->admit);
+    free(p->servers);
+    free(p->threads);
+    free(p);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_open
+ *
+ * DESCRIPTION: 
+ *      Do some initialzation work for client. The socket is connected to the
+ *      server, so datagrams from other sources are dropped by the kernel, and
+ *      a request fails at once with ECONNREFUSED if the server is down.
+ *
+ * PARAMETERS:
+ *      addr - The address of server, IPv4 or a local socket
+ *
+ * RETURN:
+ *      A pointer of client info.
+ ******************************************************************************/
+static dsc_client_t *client_open(const dsc_addr_t *addr)
+{
+    dsc_client_t *c;
+    int fd, on;
+
+    c = (dsc_client_t *)malloc(sizeof(dsc_client_t));
+    if (c == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        return NULL;
+    }
+    memset(c, 0, sizeof(dsc_client_t));
+
+    c->resp_buf = (uint8_t *)malloc(DSC_BUF_SIZE);
+    if (c->resp_buf == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        free(c);
+        return NULL;
+    }
+
+    c->serv_addr = *addr;
+    fd = socket(addr->sa.sa_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        DSC_LOG_ERROR("socket error: %m\n");
+        free(c->resp_buf);
+        free(c);
+        return NULL;
+    }
+    c->sockfd = fd;
+
+    /* Don't reuse the IDs of a previous client on the same port */
+    c->next_id = (uint32_t)now_usec() ^ ((uint32_t)getpid() << 16);
+    c->oldest_id = c->next_id;
+    c->seed = c->next_id | 1;
+    c->rto = DSC_CLIENT_INIT_RTO;
+    c->rcvtimeo = DSC_CLIENT_TIMEOUT;
+    c->compress_min = DSC_COMPRESS_MIN;
+
+    struct timeval tv;
+    tv.tv_sec = DSC_CLIENT_TIMEOUT / 1000;
+    tv.tv_usec = (DSC_CLIENT_TIMEOUT % 1000) * 1000;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        DSC_LOG_ERROR("Set recv timeout Error: %m\n");
+        free(c->resp_buf);
+        free(c);
+        close(fd);
+        return NULL;
+    }
+
+    if (addr->sa.sa_family == AF_UNIX) {
+        /*
+         * A local socket has no name unless bound, and the server can't
+         * answer a client without name: bind to a unique abstract name
+         * chosen by the kernel (autobind)
+         */
+        if (bind(fd, &addr->sa, sizeof(sa_family_t)) < 0) {
+            DSC_LOG_ERROR("bind error: %m\n");
+            free(c->resp_buf);
+            free(c);
+            close(fd);
+            return NULL;
+        }
+    } else {
+        /*
+         * Report the ICMP errors of the datagrams sent (e.g. port unreachable
+         * if the server is down), so a request fails at once instead of
+         * timing out
+         */
+        on = 1;
+        if (setsockopt(fd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) < 0) {
+            DSC_LOG_WARN("Set IP_RECVERR error: %m\n");
+        }
+    }
+
+    /* Only the datagrams from the server are received */
+    if (connect(fd, &addr->sa, addr->len) < 0) {
+        DSC_LOG_ERROR("connect error: %m\n");
+        free(c->resp_buf);
+        free(c);
+        close(fd);
+        return NULL;
+    }
+
+    return c;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_init
+ *
+ * DESCRIPTION: 
+ *      Create a client of a server over UDP.
+ *
+ * PARAMETERS:
+ *      server_ip   - The IP address of server
+ *      server_port - The port number of server
+ *
+ * RETURN:
+ *      A pointer of client info.
+ ******************************************************************************/
+dsc_client_t *client_init(const char *server_ip, int server_port)
+{
+    dsc_addr_t addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.in.sin_family = AF_INET;
+    addr.in.sin_port = htons(server_port);
+    addr.in.sin_addr.s_addr = inet_addr(server_ip);
+    addr.len = sizeof(addr.in);
+
+    return client_open(&addr);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_init_unix
+ *
+ * DESCRIPTION: 
+ *      Create a client of a server on the same host, over a Unix domain
+ *      datagram socket (server_add_unix_listener()). The packets are the
+ *      same as over UDP, they just skip the IP stack.
+ *
+ * PARAMETERS:
+ *      path - The path of the server socket, or "@name" for an abstract name
+ *
+ * RETURN:
+ *      A pointer of client info.
+ ******************************************************************************/
+dsc_client_t *client_init_unix(const char *path)
+{
+    dsc_addr_t addr;
+
+    if ((path == NULL) || (unix_addr(path, &addr) < 0)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return client_open(&addr);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      update_rtt
+ *
+ * DESCRIPTION: 
+ *      Update the retransmission timeout with an RTT measured, by the
+ *      algorithm of Jacobson/Karels (RFC-6298). Only the requests sent once
+ *      are measured, the response of a retried request is ambiguous.
+ *
+ * PARAMETERS:
+ *      c   - A pointer of client info
+ *      rtt - The RTT measured(microseconds)
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void update_rtt(dsc_client_t *c, uint64_t rtt)
+{
+    uint32_t r = (rtt > DSC_CLIENT_MAX_RTO) ? DSC_CLIENT_MAX_RTO :
+        (rtt > 0) ? (uint32_t)rtt : 1;
+    uint32_t delta, rto;
+
+    if (c->srtt == 0) {
+        c->srtt = r;
+        c->rttvar = r / 2;
+    } else {
+        delta = (c->srtt > r) ? (c->srtt - r) : (r - c->srtt);
+        c->rttvar = (3 * c->rttvar + delta) / 4;
+        c->srtt = (7 * c->srtt + r) / 8;
+    }
+
+    rto = c->srtt + 4 * c->rttvar;
+    if (rto < DSC_CLIENT_MIN_RTO) {
+        rto = DSC_CLIENT_MIN_RTO;
+    } else if (rto > DSC_CLIENT_MAX_RTO) {
+        rto = DSC_CLIENT_MAX_RTO;
+    }
+
+    /* The callers of a shared client read it without lock */
+    __atomic_store_n(&c->rto, rto, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      backoff_timeout
+ *
+ * DESCRIPTION: 
+ *      Get the time to wait before sending a request again: the RTO doubled
+ *      per retry up to DSC_CLIENT_MAX_RTO, plus up to 1/4 of random jitter,
+ *      so the retries of many clients are not synchronized.
+ *
+ * PARAMETERS:
+ *      rto   - The retransmission timeout(microseconds)
+ *      tries - The number of retries already done
+ *      seed  - The random seed of the jitter, updated
+ *
+ * RETURN:
+ *      The timeout(microseconds)
+ ******************************************************************************/
+static uint64_t backoff_timeout(uint64_t rto, int tries, uint32_t *seed)
+{
+    while ((tries-- > 0) && (rto < DSC_CLIENT_MAX_RTO)) {
+        rto <<= 1;
+    }
+    if (rto > DSC_CLIENT_MAX_RTO) {
+        rto = DSC_CLIENT_MAX_RTO;
+    }
+
+    /* xorshift32 */
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+
+    return rto + *seed % (rto / 4 + 1);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      retry_timeout
+ *
+ * DESCRIPTION: 
+ *      Get the time to wait before sending a request again, refer
+ *      backoff_timeout().
+ *
+ * PARAMETERS:
+ *      c     - A pointer of client info
+ *      tries - The number of retries already done
+ *
+ * RETURN:
+ *      The timeout(microseconds)
+ ******************************************************************************/
+static uint64_t retry_timeout(dsc_client_t *c, int tries)
+{
+    return backoff_timeout(c->rto, tries, &c->seed);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      set_recv_timeout
+ *
+ * DESCRIPTION: 
+ *      Set SO_RCVTIMEO of the client socket, only if it's changed.
+ *
+ * PARAMETERS:
+ *      c       - A pointer of client info
+ *      timeout - The timeout(microseconds), rounded up to milliseconds
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void set_recv_timeout(dsc_client_t *c, uint64_t timeout)
+{
+    struct timeval tv;
+    int ms = (int)((timeout + 999) / 1000);
+
+    if (ms <= 0) {
+        ms = 1;
+    }
+    if (ms == c->rcvtimeo) {
+        return;
+    }
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    if (setsockopt(c->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        DSC_LOG_ERROR("Set recv timeout Error: %m\n");
+        return;
+    }
+    c->rcvtimeo = ms;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      unreachable
+ *
+ * DESCRIPTION: 
+ *      Check if a socket error of client means the server can't be reached,
+ *      reported by ICMP for a datagram sent. The errors queued by IP_RECVERR
+ *      are read and logged, or they would fill the error queue.
+ *
+ * PARAMETERS:
+ *      c   - A pointer of client info
+ *      err - The errno of send() or recv()
+ *
+ * RETURN:
+ *      1 if the server is unreachable (errno is kept), 0 for other errors.
+ ******************************************************************************/
+static int unreachable(dsc_client_t *c, int err)
+{
+    uint8_t cbuf[256];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *ee;
+    char name[128];
+
+    if ((err != ECONNREFUSED) && (err != EHOSTUNREACH) &&
+        (err != ENETUNREACH) && (err != EHOSTDOWN)) {
+        return 0;
+    }
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        if (recvmsg(c->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if ((cm->cmsg_level == IPPROTO_IP) &&
+                (cm->cmsg_type == IP_RECVERR)) {
+                ee = (struct sock_extended_err *)CMSG_DATA(cm);
+                DSC_LOG_LIMITED(DSC_LOG_LEVEL_WARN, "server %s: %s\n",
+                    addr_name(&c->serv_addr, name, sizeof(name)),
+                    strerror(ee->ee_errno));
+            }
+        }
+    }
+
+    errno = err;
+    return 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      encode_request
+ *
+ * DESCRIPTION: 
+ *      Set the ID of a request, fill the signature and checksum, and compress
+ *      it if the data is no shorter than compress_min and gets shorter. The
+ *      checksum of a request larger than DSC_BUF_SIZE is not computed, it's
+ *      sent in fragments.
+ *
+ * PARAMETERS:
+ *      c          - A pointer of client info
+ *      req        - The request to send
+ *      request_id - The ID of the request
+ *      zbuf       - The buffer of the compressed request, DSC_BUF_SIZE bytes
+ *      len        - Output, the length of the packet to send
+ *
+ * RETURN:
+ *      The packet to send, req or zbuf.
+ ******************************************************************************/
+static dsc_command_t *encode_request(dsc_client_t *c, dsc_command_t *req,
+    uint32_t request_id, uint8_t *zbuf, ssize_t *len)
+{
+    dsc_command_t *pkt = req;
+    ssize_t zlen = 0;
+
+    *len = sizeof(dsc_command_t) + req->data_len;
+    req->signature = DSC_SIGNATURE;
+    req->request_id = request_id;
+    req->flags = DSC_FLAG_ACCEPT_LZ | c->integrity;
+    if ((c->compress_min > 0) && (req->data_len >= c->compress_min)) {
+        zlen = compress_packet(req, zbuf);
+    }
+    if (zlen > 0) {
+        pkt = (dsc_command_t *)zbuf;
+        *len = zlen;
+    }
+    if (*len <= DSC_BUF_SIZE) {
+        seal_packet(pkt, *len);
+    }
+
+    return pkt;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      send_request
+ *
+ * DESCRIPTION: 
+ *      Send a request packet to server.
+ *
+ * PARAMETERS:
+ *      c   - A pointer of client info
+ *      pkt - The packet, refer encode_request()
+ *      len - The length of the packet
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int send_request(dsc_client_t *c, dsc_command_t *pkt, ssize_t len)
+{
+    ssize_t bytes;
+
+    bytes = send(c->sockfd, pkt, len, 0);
+
+    /* An error of an earlier datagram, the server may be up again */
+    if ((bytes < 0) && unreachable(c, errno)) {
+        bytes = send(c->sockfd, pkt, len, 0);
+    }
+    if (bytes != len) {
+        DSC_LOG_ERROR("send error: %m\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      keep_push
+ *
+ * DESCRIPTION: 
+ *      Keep a message pushed by the server, received while waiting for a
+ *      response, until client_recv_push(). It is dropped if the client isn't
+ *      subscribed or DSC_CLIENT_PUSHES messages are kept already.
+ *
+ * PARAMETERS:
+ *      c     - A pointer of client info
+ *      pkt   - The packet, verified
+ *      bytes - The length of the packet
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void keep_push(dsc_client_t *c, dsc_command_t *pkt, ssize_t bytes)
+{
+    struct dsc_push *push;
+
+    if ((c->pushes == NULL) || (c->npushes == DSC_CLIENT_PUSHES) ||
+        (bytes > DSC_BUF_SIZE)) {
+        c->push_drops++;
+        return;
+    }
+
+    push = &c->pushes[(c->push_head + c->npushes) % DSC_CLIENT_PUSHES];
+    memcpy(push->pkt, pkt, bytes);
+    push->len = (uint16_t)bytes;
+    c->npushes++;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      receive_compressed
+ *
+ * DESCRIPTION: 
+ *      Decompress a response with DSC_FLAG_COMPRESSED into the buffer of
+ *      caller, refer transact().
+ *
+ * PARAMETERS:
+ *      pkt      - The response, verified
+ *      bytes    - The length of the response
+ *      buf      - A buffer of DSC_BUF_SIZE bytes, the response is moved here
+ *                 if it's in resp_buf
+ *      resp_buf - The buffer of response
+ *      cap      - The size of the response buffer
+ *      large    - Output, a response larger than the buffer is allocated and
+ *                 returned here. NULL to fail with EMSGSIZE.
+ *
+ * RETURN:
+ *      The length of the response decompressed, -1 on error (errno is EINVAL
+ *      if the response is invalid).
+ ******************************************************************************/
+static ssize_t receive_compressed(dsc_command_t *pkt, ssize_t bytes,
+    uint8_t *buf, void *resp_buf, size_t cap, dsc_command_t **large)
+{
+    dsc_command_t *resp;
+    size_t len;
+    ssize_t ret;
+
+    if (pkt == (dsc_command_t *)resp_buf) {
+        memcpy(buf, pkt, bytes);
+        pkt = (dsc_command_t *)buf;
+    }
+
+    len = decompressed_len(pkt);
+    if (len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len <= cap) {
+        return decompress_packet(pkt, resp_buf, cap);
+    }
+    if (large == NULL) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    resp = (dsc_command_t *)malloc(len);
+    if (resp == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        return -1;
+    }
+    ret = decompress_packet(pkt, resp, len);
+    if (ret < 0) {
+        free(resp);
+        return -1;
+    }
+    *large = resp;
+
+    return ret;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      finish_call
+ *
+ * DESCRIPTION: 
+ *      Fill the response of a call claimed by the receiver, and wake up the
+ *      caller. A compressed response is decompressed into the buffer of
+ *      caller directly.
+ *
+ * PARAMETERS:
+ *      call  - The call, CALL_FILLING
+ *      pkt   - The response packet, verified. NULL to fail the call.
+ *      bytes - The length of the packet, or the errno to fail the call
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void finish_call(struct dsc_call *call, dsc_command_t *pkt,
+    ssize_t bytes)
+{
+    void *dst = call->resp_buf;
+    size_t len = bytes;
+
+    call->len = -1;
+    if (pkt == NULL) {
+        call->err = (int)bytes;
+        goto out;
+    }
+    if (pkt->flags & (DSC_FLAG_FRAG | DSC_FLAG_ACK)) {
+        /* A shared client takes the responses of one datagram only */
+        call->err = EMSGSIZE;
+        goto out;
+    }
+
+    if (pkt->flags & DSC_FLAG_COMPRESSED) {
+        len = decompressed_len(pkt);
+        if (len == 0) {
+            call->err = EINVAL;
+            goto out;
+        }
+    }
+    if (len > call->cap) {
+        if (!call->alloc) {
+            call->err = EMSGSIZE;
+            goto out;
+        }
+        call->large = (dsc_command_t *)malloc(len);
+        if (call->large == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            call->err = ENOMEM;
+            goto out;
+        }
+        dst = call->large;
+    }
+
+    if (!(pkt->flags & DSC_FLAG_COMPRESSED)) {
+        memcpy(dst, pkt, bytes);
+    } else if (decompress_packet(pkt, dst, len) < 0) {
+        call->err = errno;
+        free(call->large);
+        call->large = NULL;
+        goto out;
+    }
+    call->len = len;
+
+out:
+    __atomic_store_n(&call->state, CALL_DONE, __ATOMIC_RELEASE);
+    sys_futex(&call->state, FUTEX_WAKE_PRIVATE, 1);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      claim_call
+ *
+ * DESCRIPTION: 
+ *      Find the call waiting for a response by the request ID, and take it
+ *      from the caller to fill the response.
+ *
+ * PARAMETERS:
+ *      c          - A pointer of client info
+ *      request_id - The request ID of the response
+ *
+ * RETURN:
+ *      The call, CALL_FILLING. NULL if no call waits for it, e.g. a late
+ *      response of a call timed out.
+ ******************************************************************************/
+static struct dsc_call *claim_call(dsc_client_t *c, uint32_t request_id)
+{
+    struct dsc_call *call;
+    uint32_t state = CALL_WAITING;
+
+    call = &c->calls[(request_id - c->id_base) & (DSC_SHARED_CALLS - 1)];
+    if (__atomic_load_n(&call->request_id, __ATOMIC_ACQUIRE) != request_id) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(&call->state, &state, CALL_FILLING, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    /* The slot may be reused by another call between the two checks */
+    if (__atomic_load_n(&call->request_id, __ATOMIC_RELAXED) != request_id) {
+        __atomic_store_n(&call->state, CALL_WAITING, __ATOMIC_RELEASE);
+        sys_futex(&call->state, FUTEX_WAKE_PRIVATE, 1);
+        return NULL;
+    }
+
+    return call;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      fail_calls
+ *
+ * DESCRIPTION: 
+ *      Fail all calls waiting for responses, e.g. the server is unreachable.
+ *
+ * PARAMETERS:
+ *      c   - A pointer of client info
+ *      err - The errno of the calls
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void fail_calls(dsc_client_t *c, int err)
+{
+    struct dsc_call *call;
+    uint32_t state;
+    int i;
+
+    for (i = 0; i < DSC_SHARED_CALLS; i++) {
+        call = &c->calls[i];
+        state = CALL_WAITING;
+        if (__atomic_compare_exchange_n(&call->state, &state, CALL_FILLING, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            finish_call(call, NULL, err);
+        }
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      receiver_thread
+ *
+ * DESCRIPTION: 
+ *      The thread receiving all datagrams of a shared client, and handing
+ *      every response to the call waiting for it, by the request ID.
+ *
+ * PARAMETERS:
+ *      arg - A pointer of client info
+ *
+ * RETURN:
+ *      NULL
+ ******************************************************************************/
+static void *receiver_thread(void *arg)
+{
+    dsc_client_t *c = (dsc_client_t *)arg;
+    uint8_t buf[DSC_BUF_SIZE];
+    dsc_command_t *pkt = (dsc_command_t *)buf;
+    struct dsc_call *call;
+    int trusted = is_loopback(&c->serv_addr);
+    ssize_t bytes;
+
+    while (!__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) {
+        bytes = recv(c->sockfd, buf, sizeof(buf), MSG_TRUNC);
+        if (bytes < 0) {
+            if (unreachable(c, errno)) {
+                fail_calls(c, errno);
+            } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                (errno != EINTR)) {
+                DSC_LOG_LIMITED(DSC_LOG_LEVEL_WARN, "recv error: %s\n",
+                    strerror(errno));
+            }
+            continue;
+        }
+
+        /* Woken up by client_close(), or larger than any single datagram */
+        if ((bytes == 0) || ((size_t)bytes > sizeof(buf))) {
+            continue;
+        }
+
+        /* The pushes are dropped, a shared client doesn't subscribe */
+        if (!verify_command_packet(buf, bytes, trusted, NULL) ||
+            (pkt->flags & DSC_FLAG_PUSH)) {
+            continue;
+        }
+
+        call = claim_call(c, pkt->request_id);
+        if (call != NULL) {
+            finish_call(call, pkt, bytes);
+        }
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      shared_transact
+ *
+ * DESCRIPTION: 
+ *      The same as transact, for a shared client: it can be called from many
+ *      threads at a time. The call takes a free wait slot (lock free), and
+ *      sleeps on it until the receiver thread fills the response, waking up
+ *      only to send the request again or to give up at its own timeout. The
+ *      request ID tells the slot, so the receiver finds it at once.
+ *      The requests and responses must fit in one datagram, compressed or
+ *      not.
+ *
+ * PARAMETERS:
+ *      c        - A pointer of client info
+ *      req      - The request to send
+ *      resp_buf - The buffer of response
+ *      cap      - The size of the response buffer
+ *      large    - Output, a response larger than the buffer is allocated and
+ *                 returned here. NULL to fail with EMSGSIZE.
+ *      timeout  - The timeout(milliseconds) of the call
+ *
+ * RETURN:
+ *      The length of the response, -1 on error.
+ ******************************************************************************/
+static ssize_t shared_transact(dsc_client_t *c, dsc_command_t *req,
+    void *resp_buf, size_t cap, dsc_command_t **large, int timeout)
+{
+    uint8_t zbuf[DSC_BUF_SIZE];
+    struct dsc_call *call = NULL;
+    dsc_command_t *wire;
+    uint64_t now, sent_at, deadline, retry_at, wait;
+    uint32_t idx, start, state, request_id, seed;
+    ssize_t wire_len, ret = -1;
+    int i, tries = 0, err;
+
+    /* Take a free slot, the first one won by compare-and-swap */
+    start = __atomic_fetch_add(&c->call_hint, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < DSC_SHARED_CALLS; i++) {
+        idx = (start + i) & (DSC_SHARED_CALLS - 1);
+        state = CALL_FREE;
+        if (__atomic_compare_exchange_n(&c->calls[idx].state, &state,
+            CALL_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            call = &c->calls[idx];
+            break;
+        }
+    }
+    if (call == NULL) {
+        DSC_LOG_ERROR("too many calls in progress\n");
+        errno = EAGAIN;
+        return -1;
+    }
+
+    request_id = c->id_base + call->gen++ * DSC_SHARED_CALLS + idx;
+    wire = encode_request(c, req, request_id, zbuf, &wire_len);
+    if (wire_len > DSC_BUF_SIZE) {
+        errno = EMSGSIZE;
+        goto out;
+    }
+    call->resp_buf = resp_buf;
+    call->cap = cap;
+    call->alloc = (large != NULL);
+    call->large = NULL;
+    __atomic_store_n(&call->request_id, request_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&call->state, CALL_WAITING, __ATOMIC_RELEASE);
+
+    sent_at = now_usec();
+    deadline = sent_at + (uint64_t)timeout * 1000;
+    seed = request_id | 1;
+    retry_at = sent_at +
+        backoff_timeout(__atomic_load_n(&c->rto, __ATOMIC_RELAXED), 0, &seed);
+    if (send_request(c, wire, wire_len) != 0) {
+        /* Fail at once, unless the receiver has got a response already */
+        deadline = 0;
+    }
+
+    for (;;) {
+        state = __atomic_load_n(&call->state, __ATOMIC_ACQUIRE);
+        if (state == CALL_DONE) {
+            break;
+        }
+
+        now = now_usec();
+        wait = 1000;
+        if (state == CALL_WAITING) {
+            if (now >= deadline) {
+                err = (deadline == 0) ? errno : ETIMEDOUT;
+                if (__atomic_compare_exchange_n(&call->state, &state,
+                    CALL_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                    if (err == ETIMEDOUT) {
+                        DSC_LOG_ERROR("request timed out\n");
+                    }
+                    errno = err;
+                    goto out;
+                }
+                continue;
+            }
+            if (now >= retry_at) {
+                if ((send(c->sockfd, wire, wire_len, 0) < 0) &&
+                    unreachable(c, errno)) {
+                    deadline = 0;
+                    continue;
+                }
+                __atomic_add_fetch(&c->retries, 1, __ATOMIC_RELAXED);
+                retry_at = now + backoff_timeout(
+                    __atomic_load_n(&c->rto, __ATOMIC_RELAXED), ++tries, &seed);
+            }
+            wait = ((retry_at < deadline) ? retry_at : deadline) - now;
+        }
+
+        /* Woken up by the receiver, or to retry */
+        futex_wait(&call->state, state, wait);
+    }
+
+    ret = call->len;
+    if (ret < 0) {
+        errno = call->err;
+    } else if (call->large != NULL) {
+        *large = call->large;
+    }
+
+    /* Skip the sample if another call is updating it, never wait */
+    if ((ret > 0) && (tries == 0) &&
+        (pthread_mutex_trylock(&c->rtt_lock) == 0)) {
+        update_rtt(c, now_usec() - sent_at);
+        pthread_mutex_unlock(&c->rtt_lock);
+    }
+
+out:
+    __atomic_store_n(&call->state, CALL_FREE, __ATOMIC_RELEASE);
+    return ret;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      transact
+ *
+ * DESCRIPTION: 
+ *      Send a request to server and wait for its response. A request larger
+ *      than DSC_BUF_SIZE is sent in fragments, and a fragmented response is
+ *      reassembled. A single datagram response is received directly into the
+ *      buffer of caller. Responses of other requests are discarded.
+ *      If no response arrives in the retransmission timeout, the request is
+ *      sent again with the same ID (the last fragment only if fragmented),
+ *      until the timeout, or until an ICMP error reports the server
+ *      unreachable. A shared client goes to shared_transact().
+ *
+ * PARAMETERS:
+ *      c        - A pointer of client info
+ *      req      - The request to send
+ *      resp_buf - The buffer of response
+ *      cap      - The size of the response buffer
+ *      large    - Output, a fragmented response larger than the buffer is
+ *                 allocated and returned here. NULL to fail with EMSGSIZE.
+ *      timeout  - The timeout(milliseconds), extended while fragments are
+ *                 transferred
+ *
+ * RETURN:
+ *      The length of the response, -1 on error.
+ ******************************************************************************/
+static ssize_t transact(dsc_client_t *c, dsc_command_t *req, void *resp_buf,
+    size_t cap, dsc_command_t **large, int timeout)
+{
+    uint8_t buf[DSC_BUF_SIZE], zbuf[DSC_BUF_SIZE];
+    dsc_command_t *pkt, *wire;
+    frag_tx_t tx;
+    frag_rx_t rx;
+    struct pollfd pfd;
+    uint64_t now, deadline, sent_at, retry_at;
+    int fragmented = 0, tx_active = 0, rx_active = 0, tries = 0, wait_ms, rc;
+    ssize_t bytes, wire_len, ret = -1;
+
+    if (req->data_len > DSC_MAX_MSG_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (c->calls != NULL) {
+        return shared_transact(c, req, resp_buf, cap, large, timeout);
+    }
+
+    /* Send request, in fragments if it doesn't fit even compressed */
+    wire = encode_request(c, req, c->next_id++, zbuf, &wire_len);
+    if (wire_len > DSC_BUF_SIZE) {
+        req->flags = c->integrity;
+        frag_tx_init(&tx, req, c->sockfd, &c->serv_addr);
+        fragmented = 1;
+        tx_active = 1;
+    } else if (send_request(c, wire, wire_len) != 0) {
+        return -1;
+    }
+    sent_at = now_usec();
+    deadline = sent_at + (uint64_t)timeout * 1000;
+    retry_at = sent_at + retry_timeout(c, 0);
+
+    /* Get response */
+    for (;;) {
+        now = now_usec();
+        if (now >= deadline) {
+            DSC_LOG_ERROR("request timed out\n");
+            errno = ETIMEDOUT;
+            goto out;
+        }
+
+        if (!tx_active && !rx_active) {
+            /* The response is lost, or the request */
+            if (now >= retry_at) {
+                if (fragmented) {
+                    frag_tx_probe(&tx, now);
+                } else if ((send(c->sockfd, wire, wire_len, 0) < 0) &&
+                    unreachable(c, errno)) {
+                    goto out;
+                }
+                c->retries++;
+                retry_at = now + retry_timeout(c, ++tries);
+            }
+
+            /* One datagram is expected, wait in recv() until the next retry */
+            set_recv_timeout(c, ((retry_at < deadline) ? retry_at : deadline) -
+                now);
+            pkt = (dsc_command_t *)resp_buf;
+            bytes = recv(c->sockfd, resp_buf, cap, MSG_TRUNC);
+            if (bytes < 0) {
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                    (errno == EINTR)) {
+                    continue;
+                }
+                if (!unreachable(c, errno)) {
+                    DSC_LOG_ERROR("recv error: %m\n");
+                }
+                goto out;
+            }
+        } else {
+            /* A transfer is going on, wake up to retransmit */
+            if (tx_active) {
+                frag_tx_pump(&tx, now);
+            }
+            wait_ms = (deadline - now + 999) / 1000;
+            if (tx_active && (wait_ms > FRAG_RTO / 4000)) {
+                wait_ms = FRAG_RTO / 4000;
+            }
+            pfd.fd = c->sockfd;
+            pfd.events = POLLIN;
+            if ((poll(&pfd, 1, wait_ms) < 0) && (errno != EINTR)) {
+                DSC_LOG_ERROR("poll error: %m\n");
+                goto out;
+            }
+
+            pkt = (dsc_command_t *)buf;
+            bytes = recv(c->sockfd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC);
+            if (bytes < 0) {
+                if ((errno == EAGAIN) || (errno == EINTR)) {
+                    continue;
+                }
+                if (!unreachable(c, errno)) {
+                    DSC_LOG_ERROR("recv error: %m\n");
+                }
+                goto out;
+            }
+            if ((size_t)bytes > sizeof(buf)) {
+                continue;
+            }
+        }
+        if (bytes == 0) {
+            goto out;
+        }
+
+        /* MSG_TRUNC makes recv() return the real length of the datagram */
+        if ((size_t)bytes > cap) {
+            if (pkt->request_id == req->request_id) {
+                errno = EMSGSIZE;
+                goto out;
+            }
+            continue;
+        }
+
+        /* Check the integrity of the response packet */
+        if (!verify_command_packet(pkt, bytes, is_loopback(&c->serv_addr),
+            NULL)) {
+            continue;
+        }
+        if (pkt->flags & DSC_FLAG_PUSH) {
+            keep_push(c, pkt, bytes);
+            continue;
+        }
+        if (pkt->request_id != req->request_id) {
+            continue;
+        }
+
+        if (pkt->flags & DSC_FLAG_ACK) {
+            if (tx_active) {
+                now = now_usec();
+                deadline = now + (uint64_t)timeout * 1000;
+                if (frag_tx_ack(&tx, pkt)) {
+                    /* Wait for the response from now on */
+                    tx_active = 0;
+                    retry_at = now + retry_timeout(c, 0);
+                }
+            }
+            continue;
+        }
+
+        /* The server has got the whole request if it responds */
+        tx_active = 0;
+
+        if (!(pkt->flags & DSC_FLAG_FRAG)) {
+            if (rx_active) {
+                continue;
+            }
+            if (pkt->flags & DSC_FLAG_COMPRESSED) {
+                ret = receive_compressed(pkt, bytes, buf, resp_buf, cap,
+                    large);
+                if ((ret < 0) && (errno == EINVAL)) {
+                    continue;
+                }
+                if ((ret > 0) && !fragmented && (tries == 0)) {
+                    update_rtt(c, now_usec() - sent_at);
+                }
+                goto out;
+            }
+            if (pkt != (dsc_command_t *)resp_buf) {
+                memcpy(resp_buf, pkt, bytes);
+            }
+            if (!fragmented && (tries == 0)) {
+                update_rtt(c, now_usec() - sent_at);
+            }
+            ret = bytes;
+            goto out;
+        }
+
+        if (!rx_active) {
+            /* The message may be reassembled in the buffer of caller */
+            if (pkt != (dsc_command_t *)buf) {
+                memcpy(buf, pkt, bytes);
+                pkt = (dsc_command_t *)buf;
+            }
+            rc = frag_rx_init(&rx, pkt, resp_buf, cap);
+            if ((rc != 0) && (errno == EMSGSIZE) && (large != NULL)) {
+                rc = frag_rx_init(&rx, pkt, NULL, 0);
+            }
+            if (rc != 0) {
+                if (errno == EINVAL) {
+                    continue;
+                }
+                goto out;
+            }
+            rx_active = 1;
+        }
+
+        deadline = now_usec() + (uint64_t)timeout * 1000;
+        if (frag_rx_add(&rx, pkt, c->sockfd, &c->serv_addr) == 1) {
+            ret = sizeof(dsc_command_t) + rx.msg->data_len;
+            if (rx.own_msg) {
+                *large = rx.msg;
+                rx.own_msg = 0;
+            }
+            goto out;
+        }
+    }
+
+out:
+    if (rx_active) {
+        frag_rx_free(&rx);
+    }
+    return ret;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_send_request_into
+ *
+ * DESCRIPTION: 
+ *      Send a request to server, and receive the response directly into the
+ *      buffer of caller, no memory is allocated. Responses of other requests
+ *      (e.g. late responses of timed out requests) are discarded, so don't
+ *      call it while asynchronous requests are in flight. On a shared client
+ *      (client_init_shared()), it can be called from many threads at a time.
+ *
+ * PARAMETERS:
+ *      c        - A pointer of client info
+ *      req      - The request to send, it can be larger than DSC_BUF_SIZE
+ *      resp_buf - The buffer of response
+ *      cap      - The size of the response buffer, DSC_BUF_SIZE is enough for
+ *                 any response not fragmented
+ *
+ * RETURN:
+ *      The length of the response, -1 on error (errno is EMSGSIZE if the
+ *      response is larger than the buffer, ECONNREFUSED if the server is
+ *      down, ETIMEDOUT if no response).
+ ******************************************************************************/
+ssize_t client_send_request_into(dsc_client_t *c, dsc_command_t *req,
+    void *resp_buf, size_t cap)
+{
+    if ((c == NULL) || (req == NULL) || (resp_buf == NULL) ||
+        (cap < sizeof(dsc_command_t))) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    return transact(c, req, resp_buf, cap, NULL, DSC_CLIENT_TIMEOUT);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_send_request_buf
+ *
+ * DESCRIPTION: 
+ *      Send a request to server, and get the response in the buffer of the
+ *      client, no memory is allocated.
+ *
+ * PARAMETERS:
+ *      c   - A pointer of client info
+ *      req - The request to send
+ *
+ * RETURN:
+ *      The response for the request, it is valid until the next request is
+ *      sent with this function. NULL on error.
+ ******************************************************************************/
+dsc_command_t *client_send_request_buf(dsc_client_t *c, dsc_command_t *req)
+{
+    if ((c == NULL) || (c->calls != NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (client_send_request_into(c, req, c->resp_buf, DSC_BUF_SIZE) < 0) {
+        return NULL;
+    }
+
+    return (dsc_command_t *)c->resp_buf;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_send_request
+ *
+ * DESCRIPTION: 
+ *      Send a request to server, and get the response. Both of them can be
+ *      larger than DSC_BUF_SIZE (up to DSC_MAX_MSG_SIZE of data), they are
+ *      transferred in fragments.
+ *
+ * PARAMETERS:
+ *      c   - A pointer of client info
+ *      req - The request to send
+ *
+ * RETURN:
+ *      The response for the request. The caller need to free the memory.
+ ******************************************************************************/
+dsc_command_t *client_send_request(dsc_client_t *c, dsc_command_t *req)
+{
+    uint8_t buf[DSC_BUF_SIZE];
+    dsc_command_t *resp = NULL;
+    ssize_t bytes;
+
+    if ((c == NULL) || (req == NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return NULL;
+    }
+
+    bytes = transact(c, req, buf, sizeof(buf), &resp, DSC_CLIENT_TIMEOUT);
+    if (bytes < 0) {
+        return NULL;
+    }
+    if (resp != NULL) {
+        return resp;
+    }
+
+    resp = (dsc_command_t *)malloc(bytes);
+    if (resp) {
+        memcpy(resp, buf, bytes);
+    } else {
+        DSC_LOG_ERROR("malloc error: %m\n");
+    }
+
+    return resp;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_call
+ *
+ * DESCRIPTION: 
+ *      The same as client_send_request_into, with a timeout of the call. On a
+ *      shared client, the calls from many threads wait independently, each
+ *      until its own response or timeout.
+ *
+ * PARAMETERS:
+ *      c        - A pointer of client info
+ *      req      - The request to send
+ *      resp_buf - The buffer of response
+ *      cap      - The size of the response buffer
+ *      timeout  - The timeout(milliseconds)
+ *
+ * RETURN:
+ *      The length of the response, -1 on error (errno is EMSGSIZE if the
+ *      response is larger than the buffer, or the request or response of a
+ *      shared client doesn't fit in one datagram, EAGAIN if too many calls
+ *      are in progress, ETIMEDOUT if no response).
+ ******************************************************************************/
+ssize_t client_call(dsc_client_t *c, dsc_command_t *req, void *resp_buf,
+    size_t cap, int timeout)
+{
+    if ((c == NULL) || (req == NULL) || (resp_buf == NULL) ||
+        (cap < sizeof(dsc_command_t)) || (timeout <= 0)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    return transact(c, req, resp_buf, cap, NULL, timeout);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      share_client
+ *
+ * DESCRIPTION: 
+ *      Make a client shared by many threads: allocate the wait slots and
+ *      start the receiver thread. The client is closed on error.
+ *
+ * PARAMETERS:
+ *      c - A pointer of client info, just created
+ *
+ * RETURN:
+ *      The client, NULL on error.
+ ******************************************************************************/
+static dsc_client_t *share_client(dsc_client_t *c)
+{
+    int rc;
+
+    c->calls = (struct dsc_call *)aligned_alloc(64,
+        DSC_SHARED_CALLS * sizeof(struct dsc_call));
+    if (c->calls == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        client_close(c);
+        return NULL;
+    }
+    memset(c->calls, 0, DSC_SHARED_CALLS * sizeof(struct dsc_call));
+    c->id_base = c->next_id;
+    pthread_mutex_init(&c->rtt_lock, NULL);
+
+    rc = pthread_create(&c->receiver, NULL, receiver_thread, c);
+    if (rc != 0) {
+        DSC_LOG_ERROR("pthread_create error: %s\n", strerror(rc));
+        pthread_mutex_destroy(&c->rtt_lock);
+        free(c->calls);
+        c->calls = NULL;
+        client_close(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_init_shared
+ *
+ * DESCRIPTION: 
+ *      Create a client to be shared by many threads, over one socket: a
+ *      receiver thread takes all the responses, and hands every one to the
+ *      call waiting for it. client_send_request(),
+ *      client_send_request_into() and client_call() can be called from any
+ *      thread at a time, the requests and responses must fit in one
+ *      datagram (compressed or not). The asynchronous requests, the
+ *      subscriptions and client_send_request_buf() are not supported.
+ *
+ * PARAMETERS:
+ *      server_ip   - The IP address of server
+ *      server_port - The port number of server
+ *
+ * RETURN:
+ *      A pointer of client info.
+ ******************************************************************************/
+dsc_client_t *client_init_shared(const char *server_ip, int server_port)
+{
+    dsc_client_t *c;
+
+    c = client_init(server_ip, server_port);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    return share_client(c);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_init_shared_unix
+ *
+ * DESCRIPTION: 
+ *      Create a client shared by many threads (see client_init_shared()),
+ *      over a Unix domain datagram socket.
+ *
+ * PARAMETERS:
+ *      path - The path of the server socket, or "@name" for an abstract name
+ *
+ * RETURN:
+ *      A pointer of client info.
+ ******************************************************************************/
+dsc_client_t *client_init_shared_unix(const char *path)
+{
+    dsc_client_t *c;
+
+    c = client_init_unix(path);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    return share_client(c);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      flush_batch
+ *
+ * DESCRIPTION: 
+ *      Send the batch being filled as a multi-command packet, or as is if it
+ *      has one request only. From then on it's sent again like any request
+ *      in flight.
+ *
+ * PARAMETERS:
+ *      c - A pointer of client info
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int flush_batch(dsc_client_t *c)
+{
+    uint8_t zbuf[DSC_BUF_SIZE];
+    struct dsc_inflight *slot = c->batch;
+    dsc_command_t *req = (dsc_command_t *)c->batch_buf, *wire;
+    ssize_t wire_len;
+    uint8_t *pkt;
+    uint64_t now;
+
+    if (slot == NULL) {
+        return 0;
+    }
+    c->batch = NULL;
+
+    if (slot->nsubs == 1) {
+        req = req + 1;
+        slot->cookie = slot->cookies[0];
+        slot->nsubs = 0;
+    } else {
+        req->command = DSC_CMD_MULTI;
+        req->data_len = c->batch_len - sizeof(dsc_command_t);
+    }
+    wire = encode_request(c, req, slot->request_id, zbuf, &wire_len);
+
+    /* Keep a copy to send it again, the buffer of the slot is reused */
+    if (slot->cap < (size_t)wire_len) {
+        pkt = (uint8_t *)realloc(slot->pkt, wire_len);
+        if (pkt == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            slot->deadline = 0;
+            return -1;
+        }
+        slot->pkt = pkt;
+        slot->cap = wire_len;
+    }
+    memcpy(slot->pkt, wire, wire_len);
+    slot->len = wire_len;
+
+    now = now_usec();
+    slot->deadline = now + DSC_CLIENT_TIMEOUT * 1000;
+    slot->sent_at = now;
+    slot->sends = 1;
+    slot->retry_at = now + retry_timeout(c, 0);
+    if (slot->retry_at < c->next_retry) {
+        c->next_retry = slot->retry_at;
+    }
+
+    /* If it's not sent, it's sent again like a lost one */
+    return send_request(c, wire, wire_len);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      batch_request
+ *
+ * DESCRIPTION: 
+ *      Add an asynchronous request to the batch being filled. The batch is
+ *      sent when it's full, or when its first request has waited for the
+ *      budget of client_set_batching(). The requests of a batch share the
+ *      request ID.
+ *
+ * PARAMETERS:
+ *      c      - A pointer of client info
+ *      req    - The request to send, its request_id is set on return
+ *      cookie - User data reported with the completion
+ *
+ * RETURN:
+ *      0 - OK, Others - Error (errno is EAGAIN if too many requests in flight)
+ ******************************************************************************/
+static int batch_request(dsc_client_t *c, dsc_command_t *req, void *cookie)
+{
+    struct dsc_inflight *slot = c->batch;
+    dsc_command_t *sub;
+    size_t len = sizeof(dsc_command_t) + req->data_len;
+    uint64_t now = now_usec();
+
+    /* No room for the request, send the batch first */
+    if ((slot != NULL) &&
+        ((c->batch_len + DSC_MULTI_PAD(len) > c->batch_max) ||
+        (slot->nsubs == DSC_MULTI_MAX))) {
+        flush_batch(c);
+        slot = NULL;
+    }
+
+    if (slot == NULL) {
+        slot = &c->inflight[c->next_id & (DSC_MAX_INFLIGHT - 1)];
+        if (slot->in_use) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (c->batch_buf == NULL) {
+            c->batch_buf = (uint8_t *)malloc(DSC_BUF_SIZE);
+            if (c->batch_buf == NULL) {
+                DSC_LOG_ERROR("malloc error: %m\n");
+                return -1;
+            }
+        }
+        if (slot->cookies == NULL) {
+            slot->cookies = (void **)malloc(DSC_MULTI_MAX * sizeof(void *));
+            if (slot->cookies == NULL) {
+                DSC_LOG_ERROR("malloc error: %m\n");
+                return -1;
+            }
+        }
+
+        /* Not sent yet, it neither expires nor is sent again */
+        if (c->ninflight == 0) {
+            c->oldest_id = c->next_id;
+            c->next_retry = UINT64_MAX;
+        }
+        slot->in_use = 1;
+        slot->request_id = c->next_id++;
+        slot->nsubs = 0;
+        slot->deadline = UINT64_MAX;
+        slot->retry_at = UINT64_MAX;
+        c->batch = slot;
+        c->batch_len = sizeof(dsc_command_t);
+        c->batch_flush_at = now + c->batch_budget;
+    }
+
+    sub = (dsc_command_t *)(c->batch_buf + c->batch_len);
+    memcpy(sub, req, len);
+    memset((uint8_t *)sub + len, 0, DSC_MULTI_PAD(len) - len);
+    sub->signature = DSC_SIGNATURE;
+    sub->request_id = slot->request_id;
+    sub->flags = 0;
+    sub->checksum = 0;
+    req->request_id = slot->request_id;
+    slot->cookies[slot->nsubs++] = cookie;
+    c->batch_len += DSC_MULTI_PAD(len);
+    c->ninflight++;
+
+    if ((c->batch_len >= c->batch_max) || (now >= c->batch_flush_at)) {
+        flush_batch(c);
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_submit
+ *
+ * DESCRIPTION: 
+ *      Send a request to server without waiting for the response. The response
+ *      is reported by client_poll()/client_wait() later, matched by the
+ *      request ID. The request is sent again by them if no response arrives in
+ *      the retransmission timeout. If no response arrives in
+ *      DSC_CLIENT_TIMEOUT milliseconds, a completion without response is
+ *      reported. With client_set_batching(), a small request may wait to be
+ *      sent in a batch, sharing its request ID with the others.
+ *
+ * PARAMETERS:
+ *      c      - A pointer of client info
+ *      req    - The request to send, its request_id is set on return
+ *      cookie - User data reported with the completion
+ *
+ * RETURN:
+ *      0 - OK, Others - Error (errno is EAGAIN if too many requests in flight,
+ *      EMSGSIZE if the request doesn't fit in one datagram)
+ ******************************************************************************/
+int client_submit(dsc_client_t *c, dsc_command_t *req, void *cookie)
+{
+    uint8_t zbuf[DSC_BUF_SIZE];
+    struct dsc_inflight *slot;
+    dsc_command_t *wire;
+    ssize_t wire_len;
+    uint8_t *pkt;
+    uint64_t now;
+
+    if ((c == NULL) || (req == NULL) || (c->calls != NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (c->inflight == NULL) {
+        c->inflight = (struct dsc_inflight *)calloc(DSC_MAX_INFLIGHT,
+            sizeof(struct dsc_inflight));
+        if (c->inflight == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            return -1;
+        }
+    }
+
+    /* Small requests wait in the batch, refer client_set_batching() */
+    if ((c->batch_max > 0) && (sizeof(dsc_command_t) +
+        DSC_MULTI_PAD(sizeof(dsc_command_t) + req->data_len) <=
+        c->batch_max)) {
+        return batch_request(c, req, cookie);
+    }
+
+    /* The slot is still used by a request submitted DSC_MAX_INFLIGHT ago */
+    slot = &c->inflight[c->next_id & (DSC_MAX_INFLIGHT - 1)];
+    if (slot->in_use) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /* Fragmented messages are transferred by client_send_request() only */
+    wire = encode_request(c, req, c->next_id++, zbuf, &wire_len);
+    if (wire_len > DSC_BUF_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (c->ninflight == 0) {
+        c->oldest_id = req->request_id;
+    }
+    if (send_request(c, wire, wire_len) != 0) {
+        return -1;
+    }
+
+    /* Keep a copy to send it again, the buffer of the slot is reused */
+    if (slot->cap < (size_t)wire_len) {
+        pkt = (uint8_t *)realloc(slot->pkt, wire_len);
+        if (pkt == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            return -1;
+        }
+        slot->pkt = pkt;
+        slot->cap = wire_len;
+    }
+    memcpy(slot->pkt, wire, wire_len);
+    slot->len = wire_len;
+
+    now = now_usec();
+    slot->in_use = 1;
+    slot->request_id = req->request_id;
+    slot->cookie = cookie;
+    slot->nsubs = 0;
+    slot->deadline = now + DSC_CLIENT_TIMEOUT * 1000;
+    slot->sent_at = now;
+    slot->sends = 1;
+    slot->retry_at = now + retry_timeout(c, 0);
+    if ((c->ninflight == 0) || (slot->retry_at < c->next_retry)) {
+        c->next_retry = slot->retry_at;
+    }
+    c->ninflight++;
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      complete_request
+ *
+ * DESCRIPTION: 
+ *      Release the slot of a request in flight and fill its completion.
+ *
+ * PARAMETERS:
+ *      c    - A pointer of client info
+ *      slot - The slot of the request
+ *      resp - The response, NULL if timed out
+ *      comp - Output, the completion
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void complete_request(dsc_client_t *c, struct dsc_inflight *slot,
+    dsc_command_t *resp, dsc_completion_t *comp)
+{
+    comp->request_id = slot->request_id;
+    comp->cookie = slot->cookie;
+    comp->resp = resp;
+    slot->in_use = 0;
+    c->ninflight--;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      fail_requests
+ *
+ * DESCRIPTION: 
+ *      Make all asynchronous requests in flight expire, the server is
+ *      unreachable. They complete as timed out by the next client_poll().
+ *
+ * PARAMETERS:
+ *      c - A pointer of client info
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void fail_requests(dsc_client_t *c)
+{
+    int i;
+
+    for (i = 0; i < DSC_MAX_INFLIGHT; i++) {
+        if (c->inflight[i].in_use) {
+            c->inflight[i].deadline = 0;
+        }
+    }
+    c->next_retry = UINT64_MAX;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      retry_requests
+ *
+ * DESCRIPTION: 
+ *      Send the asynchronous requests again if their retransmission timeout
+ *      expires, and find the time of the next retry.
+ *
+ * PARAMETERS:
+ *      c   - A pointer of client info
+ *      now - The current time(microseconds)
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void retry_requests(dsc_client_t *c, uint64_t now)
+{
+    struct dsc_inflight *slot;
+    uint64_t next = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < DSC_MAX_INFLIGHT; i++) {
+        slot = &c->inflight[i];
+        if (!slot->in_use) {
+            continue;
+        }
+        if (slot->retry_at <= now) {
+            if ((send(c->sockfd, slot->pkt, slot->len, 0) < 0) &&
+                unreachable(c, errno)) {
+                fail_requests(c);
+                return;
+            }
+            c->retries++;
+            slot->retry_at = now + retry_timeout(c, slot->sends++);
+        }
+        if (slot->retry_at < next) {
+            next = slot->retry_at;
+        }
+    }
+
+    c->next_retry = next;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      park_batch
+ *
+ * DESCRIPTION: 
+ *      Keep the response of a batch, or mark it timed out, until all of its
+ *      requests are completed by drain_batch().
+ *
+ * PARAMETERS:
+ *      c    - A pointer of client info
+ *      slot - The slot of the batch
+ *      resp - The response (allocated), NULL if timed out
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void park_batch(dsc_client_t *c, struct dsc_inflight *slot,
+    dsc_command_t *resp)
+{
+    slot->resp = resp;
+    slot->next_sub = 0;
+    slot->sub_off = 0;
+    slot->deadline = UINT64_MAX;
+    slot->retry_at = UINT64_MAX;
+    if (c->batch == slot) {
+        c->batch = NULL;
+    }
+    c->parked = slot;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      drain_batch
+ *
+ * DESCRIPTION: 
+ *      Complete the requests of the parked batch, each with a copy of its
+ *      own response. If the batch failed (e.g. STATUS_BUSY), every request
+ *      gets the status of the batch. The slot is released after the last
+ *      one.
+ *
+ * PARAMETERS:
+ *      c     - A pointer of client info
+ *      comps - Output, the completions
+ *      max   - The max number of completions to get
+ *
+ * RETURN:
+ *      The number of completions
+ ******************************************************************************/
+static int drain_batch(dsc_client_t *c, dsc_completion_t *comps, int max)
+{
+    struct dsc_inflight *slot = c->parked;
+    dsc_command_t *resp = slot->resp, *sub, *r;
+    uint32_t left;
+    size_t len;
+    int n = 0;
+
+    while ((n < max) && (slot->next_sub < slot->nsubs)) {
+        r = NULL;
+        if (resp != NULL) {
+            sub = (dsc_command_t *)((uint8_t *)(resp + 1) + slot->sub_off);
+            left = (slot->sub_off < resp->data_len) ?
+                resp->data_len - slot->sub_off : 0;
+            if ((resp->status == STATUS_SUCCESS) &&
+                (left >= sizeof(dsc_command_t)) &&
+                (sub->data_len <= left - sizeof(dsc_command_t))) {
+                len = sizeof(dsc_command_t) + sub->data_len;
+                slot->sub_off += DSC_MULTI_PAD(len);
+            } else {
+                sub = resp;
+                len = sizeof(dsc_command_t);
+                if (resp->status == STATUS_SUCCESS) {
+                    resp->status = STATUS_ERROR;
+                }
+            }
+            r = (dsc_command_t *)malloc(len);
+            if (r != NULL) {
+                memcpy(r, sub, len);
+                r->data_len = len - sizeof(dsc_command_t);
+                r->request_id = slot->request_id;
+                r->flags = 0;
+            } else {
+                DSC_LOG_ERROR("malloc error: %m\n");
+            }
+        }
+
+        comps[n].request_id = slot->request_id;
+        comps[n].cookie = slot->cookies[slot->next_sub++];
+        comps[n].resp = r;
+        c->ninflight--;
+        n++;
+    }
+
+    if (slot->next_sub == slot->nsubs) {
+        free(slot->resp);
+        slot->resp = NULL;
+        slot->in_use = 0;
+        c->parked = NULL;
+    }
+
+    return n;
+}
 
 
 /******************************************************************************
  * NAME:
- *      compute_checksum
+ *      client_poll
  *
  * DESCRIPTION: 
- *      Compute 16-bit One's Complement sum of data. (The algorithm comes from
- *      RFC-1071)
- *      NOTES: Before call this function, please set the checksum field to 0.
+ *      Get the completions of asynchronous requests without blocking: the
+ *      responses already received, and the requests timed out. The requests
+ *      without response in the retransmission timeout are sent again.
  *
  * PARAMETERS:
- *      buf  - The data buffer
- *      len  - The length of data(bytes).
+ *      c     - A pointer of client info
+ *      comps - Output, the completions
+ *      max   - The max number of completions to get
  *
  * RETURN:
- *      Checksum
+ *      The number of completions, -1 on error.
  ******************************************************************************/
-static uint16_t compute_checksum(void *buf, ssize_t len)
+int client_poll(dsc_client_t *c, dsc_completion_t *comps, int max)
 {
-    uint16_t *word;
-    uint8_t *byte;
-    ssize_t i;
-    unsigned long sum = 0;
+    uint8_t buf[DSC_BUF_SIZE];
+    dsc_command_t *resp = (dsc_command_t *)buf;
+    struct dsc_inflight *slot;
+    ssize_t bytes;
+    size_t len;
+    uint64_t now;
+    int n = 0;
 
-    if (!buf) {
-        return 0;
+    if ((c == NULL) || (comps == NULL) || (max <= 0) || (c->calls != NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    /* The requests of a batch answered before come first */
+    if (c->parked != NULL) {
+        n = drain_batch(c, comps, max);
     }
 
-    word = (uint16_t *)buf;
-    for (i = 0; i < len/2; i++) {
-        sum += word[i];
+    /* Get the responses already received */
+    while ((n < max) && (c->ninflight > 0)) {
+        bytes = recv(c->sockfd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (bytes <= 0) {
+            if ((bytes < 0) && unreachable(c, errno)) {
+                fail_requests(c);
+            }
+            break;
+        }
+        if (!verify_command_packet(buf, bytes, is_loopback(&c->serv_addr),
+            NULL)) {
+            continue;
+        }
+        if (resp->flags & DSC_FLAG_PUSH) {
+            keep_push(c, resp, bytes);
+            continue;
+        }
+        if (resp->flags & ~(DSC_FLAG_COMPRESSED | DSC_FLAG_INTEGRITY)) {
+            continue;
+        }
+
+        /* Discard the late response of a completed request */
+        slot = &c->inflight[resp->request_id & (DSC_MAX_INFLIGHT - 1)];
+        if (!slot->in_use || (slot->request_id != resp->request_id) ||
+            (slot == c->parked) || (slot == c->batch)) {
+            continue;
+        }
+
+        len = bytes;
+        if (resp->flags & DSC_FLAG_COMPRESSED) {
+            len = decompressed_len(resp);
+            if (len == 0) {
+                continue;
+            }
+        }
+        resp = (dsc_command_t *)malloc(len);
+        if (resp == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            return (n > 0) ? n : -1;
+        }
+        if (!(((dsc_command_t *)buf)->flags & DSC_FLAG_COMPRESSED)) {
+            memcpy(resp, buf, bytes);
+        } else if (decompress_packet((dsc_command_t *)buf, resp, len) < 0) {
+            free(resp);
+            resp = (dsc_command_t *)buf;
+            continue;
+        }
+        if (slot->sends == 1) {
+            update_rtt(c, now_usec() - slot->sent_at);
+        }
+        if (slot->nsubs > 0) {
+            park_batch(c, slot, resp);
+            n += drain_batch(c, comps + n, max - n);
+        } else {
+            complete_request(c, slot, resp, &comps[n++]);
+        }
+        resp = (dsc_command_t *)buf;
     }
 
-    /* If the length(bytes) of data buffer is an odd number, add the last byte. */
-    if (len & 1) {
-        byte = (uint8_t *)buf;
-        sum += byte[len-1];
+    now = now_usec();
+    if ((c->batch != NULL) && (now >= c->batch_flush_at)) {
+        flush_batch(c);
+    }
+    if ((c->ninflight > 0) && (now >= c->next_retry)) {
+        retry_requests(c, now);
     }
 
-    /* Take only 16 bits out of the sum and add up the carries */
-    while (sum>>16) {
-        sum = (sum>>16) + (sum&0xFFFF);
+    /* Expire the requests in the order of submission */
+    while ((n < max) && (c->ninflight > 0)) {
+        slot = &c->inflight[c->oldest_id & (DSC_MAX_INFLIGHT - 1)];
+        if (slot->in_use && (slot->request_id == c->oldest_id)) {
+            if (slot->deadline > now) {
+                break;
+            }
+            if (slot->nsubs > 0) {
+                park_batch(c, slot, NULL);
+                n += drain_batch(c, comps + n, max - n);
+            } else {
+                complete_request(c, slot, NULL, &comps[n++]);
+            }
+        }
+        c->oldest_id++;
     }
 
-    return (uint16_t)(~sum);
+    return n;
 }
 
 
 /******************************************************************************
  * NAME:
- *      verify_command_packet
+ *      client_wait
  *
  * DESCRIPTION: 
- *      Verify the data integrity of the command packet.
+ *      Wait for the completions of asynchronous requests.
  *
  * PARAMETERS:
- *      buf  - The data of command packet
- *      len  - The length of data
+ *      c       - A pointer of client info
+ *      comps   - Output, the completions
+ *      max     - The max number of completions to get
+ *      timeout - The max time(milliseconds) to wait, -1 to wait until a
+ *                completion (every request completes in DSC_CLIENT_TIMEOUT)
  *
  * RETURN:
- *      1 - OK, 0 - FAIL
+ *      The number of completions (0 if timed out or nothing in flight),
+ *      -1 on error.
  ******************************************************************************/
-static int verify_command_packet(void *buf, size_t len)
+int client_wait(dsc_client_t *c, dsc_completion_t *comps, int max,
+    int timeout)
 {
-    dsc_command_t *pkt;
+    struct dsc_inflight *slot;
+    struct pollfd pfd;
+    struct timespec ts;
+    uint64_t now, deadline, wake, wait_us;
+    int n;
 
-    if (buf == NULL) {
-        return 0;
+    if (c == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
     }
-    pkt = (dsc_command_t *)buf;
 
-    if (pkt->signature != DSC_SIGNATURE) {
-        printf("Error: invalid signature of packet (0x%08X)\n", pkt->signature);
-        return 0;
-    }
+    deadline = now_usec() + (uint64_t)timeout * 1000;
+    for (;;) {
+        n = client_poll(c, comps, max);
+        if ((n != 0) || (c->ninflight == 0)) {
+            return n;
+        }
 
-    if (pkt->data_len + sizeof(dsc_command_t) != len) {
-        printf("Error: invalid length of packet (%ld:%ld)\n",
-            pkt->data_len + sizeof(dsc_command_t), len);
-        return 0;
-    }
+        /*
+         * Sleep until a response arrives, the oldest request expires, a
+         * request is to be sent again or the batch is to be sent. The budget
+         * of a batch is in microseconds, so is the timeout of ppoll().
+         */
+        now = now_usec();
+        slot = &c->inflight[c->oldest_id & (DSC_MAX_INFLIGHT - 1)];
+        wake = (slot->deadline < c->next_retry) ? slot->deadline :
+            c->next_retry;
+        if ((c->batch != NULL) && (c->batch_flush_at < wake)) {
+            wake = c->batch_flush_at;
+        }
+        wait_us = (wake > now) ? wake - now : 0;
+        if (timeout >= 0) {
+            if (now >= deadline) {
+                return 0;
+            }
+            if (deadline - now < wait_us) {
+                wait_us = deadline - now;
+            }
+        }
 
-    if (compute_checksum(buf, len) != 0) {
-        printf("Error: invalid checksum of packet\n");
-        return 0;
+        pfd.fd = c->sockfd;
+        pfd.events = POLLIN;
+        ts.tv_sec = wait_us / 1000000;
+        ts.tv_nsec = (wait_us % 1000000) * 1000;
+        if ((ppoll(&pfd, 1, &ts, NULL) < 0) && (errno != EINTR)) {
+            DSC_LOG_ERROR("ppoll error: %m\n");
+            return -1;
+        }
     }
-
-    return 1;
 }
 
 
 /******************************************************************************
  * NAME:
- *      server_init
+ *      client_get_stats
  *
  * DESCRIPTION: 
- *      Do some initialzation work for server.
+ *      Get a snapshot of the stats of the server with DSC_CMD_GET_STATS.
  *
  * PARAMETERS:
- *      req_handler - The function pointer of a user-defined request handler.
- *      port        - The port number of server
- *      timeout     - Timeout value(seconds) of recvfrom operation while waiting
- *                    for request from client.
+ *      c     - A pointer of client info
+ *      stats - Output, the snapshot
  *
  * RETURN:
- *      A pointer of server info.
+ *      0 - OK, Others - Error
  ******************************************************************************/
-dsc_server_t *server_init(request_handler_t req_handler, int port, int timeout)
+int client_get_stats(dsc_client_t *c, dsc_stats_t *stats)
 {
-    dsc_server_t *s;
-    int rc;
+    dsc_command_t req;
+    dsc_command_t *resp;
+    int rc = -1;
 
-    if (req_handler == NULL) {
-        printf("Error: invalid parameter!\n");
-        return NULL;
+    if ((c == NULL) || (stats == NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
     }
 
-    s = (dsc_server_t *)malloc(sizeof(dsc_server_t));
-    if (s == NULL) {
-        perror("malloc error");
-        return NULL;
+    req.command = DSC_CMD_GET_STATS;
+    req.data_len = 0;
+    resp = client_send_request(c, &req);
+    if (resp == NULL) {
+        return -1;
     }
-    memset(s, 0, sizeof(dsc_server_t));
-
-    /* Setup request handler */
-    s->request_handler = req_handler;
 
-    memset(&s->addr, 0, sizeof(s->addr));
-    s->addr.sin_family = AF_INET;
-    s->addr.sin_port = htons(port);
-    s->addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    s->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (s->sockfd < 0) {
-        perror("socket error");
-        free(s);
-        return NULL;
+    if ((resp->status == STATUS_SUCCESS) &&
+        (resp->data_len == sizeof(dsc_stats_t))) {
+        memcpy(stats, resp + 1, sizeof(dsc_stats_t));
+        rc = 0;
+    } else {
+        DSC_LOG_ERROR("invalid response of stats (%u)\n", resp->status);
     }
+    free(resp);
 
-    /* Set the timeout value of recvfrom operation. */
-    if (timeout >= 0) {
-        struct timeval tv;
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        if (setsockopt(s->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-            perror("Set recv timeout error");
-            close(s->sockfd);
-            free(s);
-            return NULL;
-        }
-    }
+    return rc;
+}
 
-    /* Avoid "Address already in use" error in bind() */
-    int val = 1;
-    if (setsockopt(s->sockfd, SOL_SOCKET, SO_REUSEADDR, &val,
-        sizeof(val)) == -1) {
-        perror("setsockopt error");
-        close(s->sockfd);
-        free(s);
-        return NULL;
-    }
 
-    rc = bind(s->sockfd, (struct sockaddr *)&s->addr, sizeof(s->addr));
-    if (rc != 0) {
-        perror("bind error");
-        close(s->sockfd);
-        free(s);
-        return NULL;
+/******************************************************************************
+ * NAME:
+ *      client_set_compression
+ *
+ * DESCRIPTION: 
+ *      Set the min data length of the requests compressed. A request is sent
+ *      compressed only if it gets shorter, so a request larger than
+ *      DSC_BUF_SIZE may fit in one datagram instead of fragments. The
+ *      compressed responses are always taken.
+ *
+ * PARAMETERS:
+ *      c       - A pointer of client info
+ *      min_len - The min data length, 0 to send the requests as is. The
+ *                default is DSC_COMPRESS_MIN.
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int client_set_compression(dsc_client_t *c, uint32_t min_len)
+{
+    if (c == NULL) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
     }
 
-    return s;
+    c->compress_min = min_len;
+    return 0;
 }
 
 
 /******************************************************************************
  * NAME:
- *      server_accept_request
+ *      client_set_integrity
  *
  * DESCRIPTION: 
- *      Accept a request from client and process it.
+ *      Set the integrity check of the requests, the server responds in the
+ *      same mode. DSC_INTEGRITY_CRC32C catches the errors the 16-bit sum
+ *      misses (e.g. swapped words), and is faster with SSE4.2.
+ *      DSC_INTEGRITY_NONE skips the checks, it's taken only if the server is
+ *      on a loopback address, where the packets never leave the host.
  *
  * PARAMETERS:
- *      s - A pointer of server info
+ *      c    - A pointer of client info
+ *      mode - DSC_INTEGRITY_SUM16 (the default), DSC_INTEGRITY_CRC32C or
+ *             DSC_INTEGRITY_NONE
  *
  * RETURN:
  *      0 - OK, Others - Error
  ******************************************************************************/
-int server_accept_request(dsc_server_t *s)
+int client_set_integrity(dsc_client_t *c, int mode)
 {
-    dsc_command_t *req;
-    dsc_command_t *resp;
-    uint8_t buf[DSC_BUF_SIZE];
-    ssize_t bytes, req_len, resp_len;
-    struct sockaddr_in client_addr;
-    socklen_t client_addrlen = sizeof(struct sockaddr);
-
-    if (s == NULL) {
-        printf("Error: invalid parameter!\n");
+    if ((c == NULL) || ((mode != DSC_INTEGRITY_SUM16) &&
+        (mode != DSC_INTEGRITY_CRC32C) && (mode != DSC_INTEGRITY_NONE))) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
         return -1;
     }
-
-    /* Receive request from client */
-    memset(buf, 0, sizeof(buf));
-    req_len = recvfrom(s->sockfd, &buf, sizeof(buf), 0,
-        (struct sockaddr *)&client_addr, &client_addrlen);
-    if (req_len < 0) {
-        //perror("recvform error");
-        return -1;
-    } else if (req_len == 0) {
+    if ((mode == DSC_INTEGRITY_NONE) && !is_loopback(&c->serv_addr)) {
+        DSC_LOG_ERROR("no integrity check is for a loopback server only\n");
+        errno = EINVAL;
         return -1;
     }
 
-    /* Check the integrity of the request packet */
-    if (!verify_command_packet(buf, req_len)) {
-        /* Discard invaid packet */
+    c->integrity = (uint16_t)mode;
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_set_batching
+ *
+ * DESCRIPTION: 
+ *      Batch the small requests of client_submit() into multi-command
+ *      packets (DSC_CMD_MULTI), like Nagle's algorithm: a batch is sent when
+ *      it reaches max_len bytes or DSC_MULTI_MAX requests, or when its first
+ *      request has waited for budget microseconds (checked by
+ *      client_submit(), client_poll() and client_wait()). The server answers
+ *      a batch with one packet, which shall fit in one datagram (after
+ *      compression), and every request completes with its own response.
+ *
+ * PARAMETERS:
+ *      c       - A pointer of client info
+ *      max_len - The max length of a batch packet, up to DSC_BUF_SIZE, 0 to
+ *                send every request at once (the default)
+ *      budget  - The max time(microseconds) a request waits in the batch
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int client_set_batching(dsc_client_t *c, uint32_t max_len, uint32_t budget)
+{
+    if ((c == NULL) || (c->calls != NULL) || (max_len > DSC_BUF_SIZE)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
         return -1;
     }
 
-    /* Process the request */
-    req = (dsc_command_t *)buf;
-    resp = s->request_handler(req);
-    if (resp == NULL) {
-        resp = (dsc_command_t *)buf;   /* Use a local buffer */
-        resp->status = STATUS_ERROR;
-        resp->data_len = 0;
-    }
+    /* The batch being filled is sent with the old policy */
+    flush_batch(c);
+    c->batch_max = max_len;
+    c->batch_budget = budget;
+    return 0;
+}
 
-    resp_len = sizeof(dsc_command_t) + resp->data_len;
-    resp->signature = req->signature;
-    resp->checksum = 0;
-    resp->checksum = compute_checksum(resp, resp_len);
 
-    int rc = 0;
-    /* Send response */
-    bytes = sendto(s->sockfd, resp, resp_len, 0, (struct sockaddr *)&client_addr,
-        sizeof(struct sockaddr));
-    if (bytes != resp_len) {
-        perror("sendto error");
-        rc = -1;
-    }
-    if (resp != (dsc_command_t *)buf) {    /* If NOT local buffer, free it */
-        free(resp);
+/******************************************************************************
+ * NAME:
+ *      client_flush
+ *
+ * DESCRIPTION: 
+ *      Send the batch being filled at once, refer client_set_batching().
+ *
+ * PARAMETERS:
+ *      c - A pointer of client info
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int client_flush(dsc_client_t *c)
+{
+    if ((c == NULL) || (c->calls != NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
     }
 
-    return rc;
+    return flush_batch(c);
 }
 
 
 /******************************************************************************
  * NAME:
- *      server_close
+ *      send_subscription
  *
  * DESCRIPTION: 
- *      Close the socket fd and free memory.
+ *      Send DSC_CMD_SUBSCRIBE or DSC_CMD_UNSUBSCRIBE to server.
  *
  * PARAMETERS:
- *      s - A pointer of server info
+ *      c     - A pointer of client info
+ *      cmd   - The command
+ *      lease - The lease(seconds) asked for, 0 for DSC_SUB_LEASE
  *
  * RETURN:
- *      None
+ *      The lease granted, -1 on error.
  ******************************************************************************/
-void server_close(dsc_server_t *s)
+static int64_t send_subscription(dsc_client_t *c, uint32_t cmd, uint32_t lease)
 {
-    if (s == NULL) {
-        return;
+    uint8_t buf[DSC_BUF_SIZE];
+    dsc_command_t *req = (dsc_command_t *)buf;
+    dsc_command_t *resp = (dsc_command_t *)buf;
+    ssize_t bytes;
+    int tries;
+
+    /* Send again once with a new nonce, the one kept may be too old */
+    for (tries = 0; tries < 2; tries++) {
+        req->command = cmd;
+        req->data_len = sizeof(dsc_subscribe_t);
+        ((dsc_subscribe_t *)(req + 1))->lease = lease;
+        ((dsc_subscribe_t *)(req + 1))->nonce = c->sub_nonce;
+        bytes = client_send_request_into(c, req, buf, sizeof(buf));
+        if (bytes < 0) {
+            return -1;
+        }
+        if ((resp->status != STATUS_CHALLENGE) ||
+            (resp->data_len < sizeof(dsc_subscribe_t))) {
+            break;
+        }
+        c->sub_nonce = ((dsc_subscribe_t *)(resp + 1))->nonce;
+    }
+    if (resp->status != STATUS_SUCCESS) {
+        DSC_LOG_ERROR("subscription refused (%u)\n", resp->status);
+        return -1;
+    }
+    if ((cmd == DSC_CMD_SUBSCRIBE) &&
+        (resp->data_len >= sizeof(dsc_subscribe_t))) {
+        return ((dsc_subscribe_t *)(resp + 1))->lease;
     }
 
-    close(s->sockfd);
-    free(s);
+    return 0;
 }
 
 
 /******************************************************************************
  * NAME:
- *      client_init
+ *      client_subscribe
  *
  * DESCRIPTION: 
- *      Do some initialzation work for client.
+ *      Subscribe to the messages pushed by server_publish(), or renew the
+ *      subscription. The server drops the subscription when its lease ends,
+ *      so subscribe again before that to keep it, and may grant a shorter
+ *      lease than asked for. The nonce the server challenges the request
+ *      with is echoed here. The messages pushed are got with
+ *      client_recv_push(), the ones received while waiting for a response
+ *      are kept, up to DSC_CLIENT_PUSHES.
  *
  * PARAMETERS:
- *      server_ip   - The IP address of server
- *      server_port - The port number of server
+ *      c     - A pointer of client info
+ *      lease - The lease(seconds) asked for, 0 for DSC_SUB_LEASE
  *
  * RETURN:
- *      A pointer of client info.
+ *      The lease(seconds) granted, -1 on error.
  ******************************************************************************/
-dsc_client_t *client_init(const char *server_ip, int server_port)
+int client_subscribe(dsc_client_t *c, uint32_t lease)
 {
-    dsc_client_t *c;
-    int fd;
-
-    c = (dsc_client_t *)malloc(sizeof(dsc_client_t));
-    if (c == NULL) {
-        perror("malloc error");
-        return NULL;
+    if ((c == NULL) || (c->calls != NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
     }
-    memset(c, 0, sizeof(dsc_client_t));
 
-    memset(&c->serv_addr, 0, sizeof(c->serv_addr));
-    c->serv_addr.sin_family = AF_INET;
-    c->serv_addr.sin_port = htons(server_port);
-    c->serv_addr.sin_addr.s_addr = inet_addr(server_ip);
-    fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd < 0) {
-        perror("socket error");
-        free(c);
-        return NULL;
+    if (c->pushes == NULL) {
+        c->pushes = (struct dsc_push *)malloc(DSC_CLIENT_PUSHES *
+            sizeof(struct dsc_push));
+        if (c->pushes == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            return -1;
+        }
+        c->push_head = 0;
+        c->npushes = 0;
     }
-    c->sockfd = fd;
 
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        perror("Set recv timeout Error");
-        free(c);
-        close(fd);
-        return NULL;
+    return (int)send_subscription(c, DSC_CMD_SUBSCRIBE, lease);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      client_unsubscribe
+ *
+ * DESCRIPTION: 
+ *      Cancel the subscription of client_subscribe(), answering the nonce
+ *      challenge of the server like it. The messages kept are still got with
+ *      client_recv_push().
+ *
+ * PARAMETERS:
+ *      c - A pointer of client info
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int client_unsubscribe(dsc_client_t *c)
+{
+    if ((c == NULL) || (c->calls != NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
     }
 
-    return c;
+    return (send_subscription(c, DSC_CMD_UNSUBSCRIBE, 0) < 0) ? -1 : 0;
 }
 
 
 /******************************************************************************
  * NAME:
- *      client_send_request
+ *      client_recv_push
  *
  * DESCRIPTION: 
- *      Send a request to server, and get the response.
+ *      Get a message pushed by server_publish(): the oldest one kept, or wait
+ *      for one. Responses received meanwhile are discarded, so don't call it
+ *      while asynchronous requests are in flight.
  *
  * PARAMETERS:
- *      c   - A pointer of client info
- *      req - The request to send
+ *      c       - A pointer of client info
+ *      buf     - Output, the packet: dsc_command_t with the command
+ *                published, then the data
+ *      cap     - The size of the buffer, DSC_BUF_SIZE is enough for any
+ *                message
+ *      timeout - The max time(milliseconds) to wait, -1 to wait forever
  *
  * RETURN:
- *      The response for the request. The caller need to free the memory.
+ *      The length of the packet, 0 if timed out, -1 on error.
  ******************************************************************************/
-dsc_command_t *client_send_request(dsc_client_t *c, dsc_command_t *req)
+ssize_t client_recv_push(dsc_client_t *c, void *buf, size_t cap, int timeout)
 {
-    uint8_t buf[DSC_BUF_SIZE];
-    ssize_t bytes, req_len;
-    struct sockaddr_in server_addr;
-    socklen_t server_addrlen = sizeof(struct sockaddr);
-    
-    if ((c == NULL) || (req == NULL)) {
-        printf("Error: invalid parameter!\n");
-        return NULL;
-    }
+    uint8_t pkt_buf[DSC_BUF_SIZE];
+    dsc_command_t *pkt = (dsc_command_t *)pkt_buf;
+    struct dsc_push *push;
+    struct pollfd pfd;
+    uint64_t now, deadline;
+    ssize_t bytes;
+    int wait_ms;
 
-    /* Send request */
-    req_len = sizeof(dsc_command_t) + req->data_len;
-    req->signature = DSC_SIGNATURE;
-    req->checksum = 0;
-    req->checksum = compute_checksum(req, req_len);
-    bytes = sendto(c->sockfd, req, req_len, 0, (struct sockaddr *)&c->serv_addr,
-        sizeof(struct sockaddr));
-    if (bytes != req_len) {
-        perror("sendto error");
-        return NULL;
+    if ((c == NULL) || (buf == NULL) || (c->calls != NULL)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        errno = EINVAL;
+        return -1;
     }
 
-    /* Get response */
-    memset(buf, 0, sizeof(buf));
-    bytes = recvfrom(c->sockfd, &buf, sizeof(buf), 0,
-        (struct sockaddr *)&server_addr, &server_addrlen);
-    if (bytes < 0) {
-        perror("recvform error");
-        return NULL;
-    } else if (bytes == 0) {
-        return NULL;
+    if (c->npushes > 0) {
+        push = &c->pushes[c->push_head];
+        if (push->len > cap) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        memcpy(buf, push->pkt, push->len);
+        c->push_head = (c->push_head + 1) % DSC_CLIENT_PUSHES;
+        c->npushes--;
+        return push->len;
     }
 
-    /* Check the integrity of the response packet */
-    if (verify_command_packet(buf, bytes)) {
-        dsc_command_t *resp = (dsc_command_t *)malloc(bytes);
-        if (resp) {
-            memcpy(resp, buf, bytes);
-        } else {
-            perror("malloc error");
+    deadline = now_usec() + (uint64_t)timeout * 1000;
+    for (;;) {
+        bytes = recv(c->sockfd, pkt_buf, sizeof(pkt_buf), MSG_DONTWAIT);
+        if (bytes > 0) {
+            if (!verify_command_packet(pkt, bytes,
+                is_loopback(&c->serv_addr), NULL) ||
+                !(pkt->flags & DSC_FLAG_PUSH)) {
+                continue;
+            }
+            if ((size_t)bytes > cap) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            memcpy(buf, pkt_buf, bytes);
+            return bytes;
+        }
+        if ((bytes < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+            if (!unreachable(c, errno)) {
+                DSC_LOG_ERROR("recv error: %m\n");
+            }
+            return -1;
         }
-        return resp;
-    }
 
-    return NULL;
+        wait_ms = -1;
+        if (timeout >= 0) {
+            now = now_usec();
+            if (now >= deadline) {
+                return 0;
+            }
+            wait_ms = (int)((deadline - now + 999) / 1000);
+        }
+        pfd.fd = c->sockfd;
+        pfd.events = POLLIN;
+        if ((poll(&pfd, 1, wait_ms) < 0) && (errno != EINTR)) {
+            DSC_LOG_ERROR("poll error: %m\n");
+            return -1;
+        }
+    }
 }
 
 
@@ -420,11 +8219,33 @@ dsc_command_t *client_send_request(dsc_client_t *c, dsc_command_t *req)
  ******************************************************************************/
 void client_close(dsc_client_t *c)
 {
+    int i;
+
     if (c == NULL) {
         return;
     }
 
+    /* Wake up the receiver in recv(), before the socket is closed */
+    if (c->calls != NULL) {
+        __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+        shutdown(c->sockfd, SHUT_RD);
+        pthread_join(c->receiver, NULL);
+        pthread_mutex_destroy(&c->rtt_lock);
+        free(c->calls);
+    }
+
     close(c->sockfd);
+    if (c->inflight != NULL) {
+        for (i = 0; i < DSC_MAX_INFLIGHT; i++) {
+            free(c->inflight[i].pkt);
+            free(c->inflight[i].cookies);
+            free(c->inflight[i].resp);
+        }
+    }
+    free(c->inflight);
+    free(c->batch_buf);
+    free(c->resp_buf);
+    free(c->pushes);
     free(c);
 }
 
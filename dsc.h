@@ -13,8 +13,11 @@
 ******************************************************************************/
 #ifndef _DSC_H_
 #define _DSC_H_
+#include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 
 
 /*--------------------------------------------------------------
@@ -24,6 +27,9 @@
 /* The read/write buffer size of socket */
 #define DSC_BUF_SIZE            4096
 
+/* The max number of requests accepted by one server_accept_batch() call */
+#define DSC_BATCH_MAX           64
+
 /* The signature of the request/response packet */
 #define DSC_SIGNATURE           0xDEADBEEF
 
@@ -34,6 +40,106 @@
 /* Status code, the values used in struct dsc_command_t.status */
 #define STATUS_SUCCESS          0   /* Success */
 #define STATUS_ERROR            1   /* Generic error */
+#define STATUS_INVALID_COMMAND  3   /* Unkown request type */
+#define STATUS_BUSY             4   /* Too many requests queued, retry later */
+#define STATUS_CHALLENGE        5   /* Send again with the nonce of the data */
+
+/* The first command, the values used in struct dsc_command_t.command */
+#define DSC_CMD_BASE            0x8001
+
+/* The max number of commands registered by server_register_handler() */
+#define DSC_MAX_COMMANDS        256
+
+/* Reserved command answered by the server library, data is dsc_stats_t */
+#define DSC_CMD_GET_STATS       (DSC_CMD_BASE - 1)
+
+/*
+ * Reserved commands answered by the server library: subscribe the client to
+ * the messages of server_publish(), data is dsc_subscribe_t (optional in the
+ * request), and cancel the subscription.
+ */
+#define DSC_CMD_SUBSCRIBE       (DSC_CMD_BASE - 2)
+#define DSC_CMD_UNSUBSCRIBE     (DSC_CMD_BASE - 3)
+
+/*
+ * Reserved command of a multi-command packet: the data is a sequence of
+ * requests, each a header (command, data_len and request_id, the others are
+ * unused) and its data, padded to DSC_MULTI_ALIGN bytes. The server runs
+ * them in order and answers with one packet of the same layout, holding the
+ * response of every request.
+ */
+#define DSC_CMD_MULTI           (DSC_CMD_BASE - 4)
+#define DSC_MULTI_ALIGN         4
+#define DSC_MULTI_PAD(len)      (((len) + DSC_MULTI_ALIGN - 1) & \
+                                 ~(size_t)(DSC_MULTI_ALIGN - 1))
+
+/* Flags of packet, the values used in struct dsc_command_t.flags */
+#define DSC_FLAG_FRAG           0x0001  /* A fragment, data is dsc_frag_t + part
+                                           of the data of the message */
+#define DSC_FLAG_ACK            0x0002  /* Ack of fragments, data is
+                                           dsc_frag_ack_t */
+#define DSC_FLAG_PUSH           0x0004  /* Pushed by server_publish(), not a
+                                           response: command is the one
+                                           published, request_id is 0 */
+#define DSC_FLAG_COMPRESSED     0x0008  /* Data is dsc_lz_t + the data of the
+                                           message compressed (lz.h) */
+#define DSC_FLAG_ACCEPT_LZ      0x0010  /* Set in the request if the client
+                                           takes a compressed response */
+#define DSC_FLAG_CRC32C         0x0020  /* checksum is CRC32C of the packet
+                                           before it and the data */
+#define DSC_FLAG_TRUSTED        0x0040  /* No checksum, taken from a loopback
+                                           address only */
+#define DSC_FLAG_INTEGRITY      (DSC_FLAG_CRC32C | DSC_FLAG_TRUSTED)
+#define DSC_FLAG_CACHEABLE      0x8000  /* Set in the response by the handler
+                                           to cache it, never sent */
+
+/*
+ * A message larger than DSC_BUF_SIZE is sent in fragments of
+ * DSC_FRAG_DATA_SIZE bytes, so every datagram fits in an Ethernet frame.
+ */
+#define DSC_FRAG_DATA_SIZE      1400
+
+/* The max number of fragments in flight, shall be no less than 64 */
+#define DSC_FRAG_WINDOW         64
+
+/* The max data length of a fragmented message */
+#define DSC_MAX_MSG_SIZE        (64 * 1024 * 1024)
+
+
+/*
+ * The default min data length compressed, by the client and the server.
+ * The data is sent as is if it doesn't get shorter.
+ */
+#define DSC_COMPRESS_MIN        128
+
+
+/*
+ * The integrity check of the packets, set by client_set_integrity(). The
+ * server responds in the mode of the request.
+ */
+#define DSC_INTEGRITY_SUM16     0                   /* 16-bit checksum */
+#define DSC_INTEGRITY_CRC32C    DSC_FLAG_CRC32C     /* CRC32C */
+#define DSC_INTEGRITY_NONE      DSC_FLAG_TRUSTED    /* None, loopback only */
+
+
+/* The default lease(seconds) of a subscription, renewed by subscribing again,
+ * also the default max granted, refer server_set_max_lease() */
+#define DSC_SUB_LEASE           60
+
+
+/*
+ * Address of a peer on either transport: UDP (AF_INET), or a datagram socket
+ * of the host (AF_UNIX), named by a path or by an abstract name (sun_path[0]
+ * is 0, written as "@name" in the API).
+ */
+typedef struct dsc_addr {
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in in;  /* AF_INET */
+        struct sockaddr_un un;  /* AF_UNIX */
+    };
+    socklen_t len;              /* Length of the address */
+} dsc_addr_t;
 
 
 /* Common header of both request/response packets */
@@ -44,24 +150,191 @@ typedef struct dsc_command {
         uint32_t status;        /* Status code of response, refer dsc_status_code */
     };
     uint32_t data_len;          /* The data length of packet */
+    uint32_t request_id;        /* Set by client, echoed back by server */
+    uint16_t flags;             /* Flags of packet, refer DSC_FLAG_FRAG */
 
-    uint16_t checksum;          /* The checksum of the packet */
+    uint32_t checksum;          /* The checksum of the packet, the 16-bit sum
+                                   in the low half (the high half is 0), or
+                                   the CRC32C */
 } BYTE_ALIGNED dsc_command_t;
 
+/* Header of a fragment, followed by the data of the fragment */
+typedef struct dsc_frag {
+    uint32_t msg_len;           /* The data length of the whole message */
+    uint32_t index;             /* Index of the fragment, from 0 */
+    uint32_t count;             /* Number of fragments of the message */
+} BYTE_ALIGNED dsc_frag_t;
+
+/* Acknowledgment of the fragments received */
+typedef struct dsc_frag_ack {
+    uint32_t next;              /* All fragments before it are received */
+    uint32_t count;             /* Number of fragments of the message */
+    uint64_t bitmap;            /* Bit i: fragment next+1+i is received */
+} BYTE_ALIGNED dsc_frag_ack_t;
+
+
+/* Header of the data of a packet with DSC_FLAG_COMPRESSED */
+typedef struct dsc_lz {
+    uint32_t raw_len;           /* The data length decompressed */
+} BYTE_ALIGNED dsc_lz_t;
+
+
+/* Data of DSC_CMD_SUBSCRIBE, the request asks for a lease, the response has
+ * the one granted. A request without the nonce of the server for its address
+ * gets STATUS_CHALLENGE with the nonce, and is sent again with it: the pushes
+ * only go to the addresses which got it. DSC_CMD_UNSUBSCRIBE echoes the nonce
+ * too, so a forged one can't drop a subscriber. */
+typedef struct dsc_subscribe {
+    uint32_t lease;             /* Lease(seconds), 0 for DSC_SUB_LEASE */
+    uint32_t nonce;             /* Nonce echoed, 0 if none yet */
+} BYTE_ALIGNED dsc_subscribe_t;
+
+
+/*
+ * Number of buckets of the latency histograms, bucket i counts the latencies
+ * in [2^i, 2^(i+1)) nanoseconds, the last one counts all the longer ones.
+ */
+#define DSC_LATENCY_BUCKETS     32
+
+/* Statistics of a command, all fields shall be uint64_t */
+typedef struct dsc_cmd_stats {
+    uint64_t requests;          /* Requests received */
+    uint64_t errors;            /* Responses with status other than success */
+    uint64_t bytes_in;          /* Bytes of requests, header included */
+    uint64_t bytes_out;         /* Bytes of responses, header included */
+    uint64_t cache_hits;        /* Answered from the response cache */
+    uint64_t latency[DSC_LATENCY_BUCKETS];  /* Histogram of handler time */
+} dsc_cmd_stats_t;
+
+/* Statistics of a server, all fields shall be uint64_t */
+typedef struct dsc_stats {
+    uint64_t rx_packets;        /* Datagrams received */
+    uint64_t rx_bytes;          /* Bytes of the datagrams received */
+    uint64_t drop_signature;    /* Packets dropped for invalid signature */
+    uint64_t drop_length;       /* Packets dropped for invalid length */
+    uint64_t drop_checksum;     /* Packets dropped for invalid checksum */
+    uint64_t send_errors;       /* Responses failed to send */
+    uint64_t replays;           /* Retried requests answered from the replay cache */
+    uint64_t queue_depth;       /* Requests queued for the workers now */
+    uint64_t queue_peak;        /* The max requests queued */
+    uint64_t queue_drops;       /* Requests dropped as the queue is full */
+    uint64_t queue_busy;        /* Requests answered with STATUS_BUSY */
+    uint64_t admit_shed;        /* Packets shed by the admission control */
+    uint64_t admit_busy;        /* Shed requests answered with STATUS_BUSY */
+    uint64_t admit_evictions;   /* Clients evicted from the admission table */
+    dsc_cmd_stats_t cmds[DSC_MAX_COMMANDS + 1]; /* By command, the last one
+                                                   counts all the others */
+} dsc_stats_t;
+
 
 /*--------------------------------------------------------------
  * Definition for client only
  *--------------------------------------------------------------*/
 
+/* The timeout value(milliseconds) of waiting for the response, retries included */
+#define DSC_CLIENT_TIMEOUT      1000
+
+/*
+ * The retransmission timeout(microseconds) of a request: the initial one used
+ * before the RTT is measured, and the limits of the one estimated from RTT.
+ */
+#define DSC_CLIENT_INIT_RTO     100000
+#define DSC_CLIENT_MIN_RTO      2000
+#define DSC_CLIENT_MAX_RTO      250000
+
+/* The max number of asynchronous requests in flight, shall be power of 2 */
+#define DSC_MAX_INFLIGHT        1024
+
+/* The max number of pushed messages kept until client_recv_push() */
+#define DSC_CLIENT_PUSHES       16
+
+/* The max number of calls in progress on a shared client, power of 2 */
+#define DSC_SHARED_CALLS        1024
+
+/* The max number of requests batched in one packet, refer
+ * client_set_batching() */
+#define DSC_MULTI_MAX           64
+
 /* Keep the information of client */
 typedef struct dsc_client {
     int sockfd;                     /* Socket fd of the client */
-    struct sockaddr_in serv_addr;   /* Server address */
+    dsc_addr_t serv_addr;           /* Server address */
+    uint32_t next_id;               /* ID of the next request */
+    uint32_t oldest_id;             /* ID of the oldest request in flight */
+    int ninflight;                  /* Number of asynchronous requests in flight */
+    struct dsc_inflight *inflight;  /* Asynchronous requests, indexed by ID */
+    uint8_t *resp_buf;              /* Response of client_send_request_buf() */
+    uint32_t srtt;                  /* Smoothed RTT(microseconds), 0 if unknown */
+    uint32_t rttvar;                /* RTT variation(microseconds) */
+    uint32_t rto;                   /* Retransmission timeout(microseconds) */
+    uint32_t seed;                  /* Random seed of the jitter of timeouts */
+    int rcvtimeo;                   /* SO_RCVTIMEO(milliseconds) of the socket */
+    uint64_t next_retry;            /* Time(microseconds) of the next retry of
+                                       asynchronous requests */
+    uint64_t retries;               /* Number of requests sent again */
+    struct dsc_push *pushes;        /* Pushed messages received, allocated by
+                                       client_subscribe() */
+    int push_head;                  /* The oldest pushed message */
+    int npushes;                    /* Number of pushed messages kept */
+    uint64_t push_drops;            /* Pushed messages dropped, no space */
+    uint32_t sub_nonce;             /* The nonce of DSC_CMD_SUBSCRIBE from the
+                                       server, 0 if none yet */
+    uint32_t compress_min;          /* Min data length compressed, 0 to send
+                                       the requests as is */
+    uint16_t integrity;             /* Integrity check of the requests, refer
+                                       DSC_INTEGRITY_SUM16 */
+    struct dsc_call *calls;         /* Wait slots of the calls in progress,
+                                       NULL if the client is not shared */
+    uint32_t call_hint;             /* Where to look for a free slot */
+    uint32_t id_base;               /* Request ID of the first call in slot 0 */
+    int stop;                       /* Set to stop the receiver thread */
+    pthread_t receiver;             /* Thread receiving the responses of a
+                                       shared client */
+    pthread_mutex_t rtt_lock;       /* Protects the RTT estimate of a shared
+                                       client, never waited for */
+    struct dsc_inflight *batch;     /* The batch being filled, not sent */
+    uint8_t *batch_buf;             /* The multi-command packet of it */
+    uint32_t batch_len;             /* The length of the packet */
+    uint32_t batch_max;             /* Send the batch at this length, 0 to
+                                       send every request at once */
+    uint32_t batch_budget;          /* Max time(microseconds) a request
+                                       waits in the batch */
+    uint64_t batch_flush_at;        /* Time(microseconds) to send the batch */
+    struct dsc_inflight *parked;    /* A batch answered or timed out, with
+                                       completions left to report */
 } dsc_client_t;
 
+/* Completion of an asynchronous request */
+typedef struct dsc_completion {
+    uint32_t request_id;            /* ID of the request */
+    void *cookie;                   /* User data passed to client_submit() */
+    dsc_command_t *resp;            /* The response, NULL if timed out.
+                                       The caller need to free the memory. */
+} dsc_completion_t;
+
 
 dsc_client_t *client_init(const char *server_ip, int server_port);
+dsc_client_t *client_init_shared(const char *server_ip, int server_port);
+dsc_client_t *client_init_unix(const char *path);
+dsc_client_t *client_init_shared_unix(const char *path);
+ssize_t client_call(dsc_client_t *c, dsc_command_t *req, void *resp_buf,
+    size_t cap, int timeout);
 dsc_command_t *client_send_request(dsc_client_t *c, dsc_command_t *req);
+ssize_t client_send_request_into(dsc_client_t *c, dsc_command_t *req,
+    void *resp_buf, size_t cap);
+dsc_command_t *client_send_request_buf(dsc_client_t *c, dsc_command_t *req);
+int client_submit(dsc_client_t *c, dsc_command_t *req, void *cookie);
+int client_poll(dsc_client_t *c, dsc_completion_t *comps, int max);
+int client_wait(dsc_client_t *c, dsc_completion_t *comps, int max,
+    int timeout);
+int client_get_stats(dsc_client_t *c, dsc_stats_t *stats);
+int client_set_compression(dsc_client_t *c, uint32_t min_len);
+int client_set_integrity(dsc_client_t *c, int mode);
+int client_set_batching(dsc_client_t *c, uint32_t max_len, uint32_t budget);
+int client_flush(dsc_client_t *c);
+int client_subscribe(dsc_client_t *c, uint32_t lease);
+int client_unsubscribe(dsc_client_t *c);
+ssize_t client_recv_push(dsc_client_t *c, void *buf, size_t cap, int timeout);
 void client_close(dsc_client_t *c);
 
 
@@ -71,17 +344,210 @@ void client_close(dsc_client_t *c);
 
 typedef dsc_command_t * (*request_handler_t) (dsc_command_t *);
 
+/*
+ * Request handler filling the response in place. The response buffer is owned
+ * by the server and has cap bytes (header included), so no memory is allocated
+ * per request. The handler shall fill the status, data_len and data of the
+ * response, and return 0 - OK, Others - Error (STATUS_ERROR is replied).
+ * If the response doesn't fit, it can return the size needed (> cap) before
+ * doing anything else, then it's called again with a buffer large enough and
+ * the response is sent in fragments.
+ * If the response depends on the request only (e.g. constant data), the
+ * handler can set DSC_FLAG_CACHEABLE in resp->flags. The encoded response is
+ * kept and the same requests are answered from it without calling the
+ * handler, until server_invalidate_cache() is called for the command.
+ */
+typedef int (*request_buf_handler_t) (dsc_command_t *req, dsc_command_t *resp,
+    size_t cap);
+
+/* The max number of listening sockets of a server */
+#define DSC_MAX_LISTENERS       8
+
+/* The max number of timers of a server */
+#define DSC_MAX_TIMERS          8
+
+/* The max number of fragmented messages transferring per server */
+#define DSC_MAX_TRANSFERS       64
+
+/* The max number of fragmented requests reassembled at a time from one client
+ * host (IP address, or a local client) */
+#define DSC_XFER_PER_SOURCE     4
+
+/* The default max memory of the fragmented requests being reassembled, by a
+ * server or by all servers of a pool, refer server_set_reassembly() */
+#define DSC_REASSEMBLY_MEM      (64 * 1024 * 1024)
+
+/* The default number of responses kept to answer retried requests */
+#define DSC_REPLAY_CACHE_SIZE   4096
+
+/* The number of latest responses kept for every client address */
+#define DSC_REPLAY_WINDOW       16
+
+/* The max data length of a request whose response can be cached */
+#define DSC_CACHE_KEY_SIZE      64
+
+/* The max number of subscribers of a server */
+#define DSC_MAX_SUBSCRIBERS     65536
+
+/* The max number of messages per sendmmsg() of server_publish() */
+#define DSC_PUBLISH_BATCH       1024
+
+/*
+ * The number of client addresses tracked by the admission control, and the
+ * entries probed for one, the least recently seen of them is evicted.
+ */
+#define DSC_ADMIT_TABLE_SIZE    4096
+#define DSC_ADMIT_PROBE         8
+
+/* Policy of server_set_workers() when the queue of requests is full, and of
+ * server_set_admission() when a client is over its rate */
+#define DSC_QUEUE_DROP          0   /* Drop the request, the client retries */
+#define DSC_QUEUE_BUSY          1   /* Reply STATUS_BUSY at once */
+
+/* Backends of server_run(), refer server_set_backend() */
+#define DSC_BACKEND_EPOLL       0   /* epoll_wait() + recvmmsg()/sendmmsg() */
+#define DSC_BACKEND_URING       1   /* io_uring, multishot receive */
+
+struct dsc_server;
+
+/* Timer function of server_add_timer() */
+typedef void (*server_timer_t) (struct dsc_server *s, void *arg);
+
+/* A periodic timer of server_run() */
+typedef struct dsc_timer {
+    int fd;                             /* timerfd of the timer */
+    server_timer_t func;                /* Timer function */
+    void *arg;                          /* Argument of the timer function */
+} dsc_timer_t;
+
 /* Keep the information of server */
 typedef struct dsc_server {
     int sockfd;                         /* Socket fd of the server */
     struct sockaddr_in addr;            /* Server address */
     request_handler_t request_handler;  /* Function pointer of the request handle */
+    request_buf_handler_t request_buf_handler;  /* Or the in-place handler */
+    request_buf_handler_t handlers[DSC_MAX_COMMANDS];   /* Indexed by command */
+    struct dsc_batch *batch;            /* Buffers of server_accept_batch() */
+    struct dsc_server_pool *pool;       /* The pool of the server, or NULL */
+    int reuseport;                      /* The sockets are bound with SO_REUSEPORT */
+    int batch_size;                     /* Max requests per recvmmsg() in server_run() */
+    int epfd;                           /* epoll fd of server_run() */
+    int evfd;                           /* eventfd written by server_stop() */
+    int nlisteners;                     /* Number of listening sockets */
+    int listen_fds[DSC_MAX_LISTENERS];  /* Listening sockets, sockfd is the first */
+    int ntimers;                        /* Number of timers */
+    dsc_timer_t timers[DSC_MAX_TIMERS]; /* Timers of server_run() */
+    struct dsc_xfer *xfers;             /* Fragmented messages transferring */
+    int nxfers;                         /* Number of transfers in use */
+    int xfer_timerfd;                   /* Retransmit timer of the transfers */
+    uint32_t xfer_max_msg;              /* Max data length of a fragmented
+                                           request */
+    size_t xfer_mem_max;                /* Max memory of the requests being
+                                           reassembled */
+    size_t *xfer_mem;                   /* Memory of them, shared by a pool */
+    size_t xfer_mem_own;                /* The counter out of a pool */
+    struct dsc_replay_client *replay;   /* Responses to answer retried
+                                           requests, by client address */
+    int replay_size;                    /* Number of clients allocated */
+    uint64_t replay_clock;              /* Count of the clients taken */
+    int replay_wanted;                  /* Set by server_set_replay_cache() */
+    struct dsc_resp_cache *resp_cache;  /* Cached responses, by command */
+    uint32_t cache_gen[DSC_MAX_COMMANDS];   /* Bumped to invalidate them */
+    dsc_stats_t stats;                  /* Written by the serving thread only */
+    struct dsc_workq *workq;            /* Requests queued for the workers */
+    struct dsc_worker *workers;         /* Threads running the handlers */
+    int nworkers;                       /* Number of workers, 0 to run the
+                                           handlers in the serving thread */
+    int queue_policy;                   /* DSC_QUEUE_DROP or DSC_QUEUE_BUSY */
+    int wake_fd;                        /* eventfd written by the workers */
+    struct dsc_handoff *handoffs;       /* Large responses from the workers */
+    pthread_mutex_t lock;               /* Protects the caches and handoffs
+                                           shared with the workers */
+    int backend;                        /* DSC_BACKEND_* of server_run() */
+    struct dsc_uring_io *uring;         /* State of the io_uring backend */
+    struct dsc_subs *subs;              /* Subscribers of server_publish() */
+    pthread_mutex_t sub_lock;           /* Protects the subscribers */
+    uint32_t compress_min;              /* Min data length of the responses
+                                           compressed, 0 to never compress */
+    struct dsc_admit **admit;           /* Token buckets by client address,
+                                           &admit_own or the one of a pool */
+    struct dsc_admit *admit_own;        /* Token buckets of a lone server */
+    uint32_t admit_rate;                /* Packets per second per client
+                                           address, 0 to admit all */
+    uint32_t admit_burst;               /* Max packets in a burst */
+    int admit_policy;                   /* DSC_QUEUE_DROP or DSC_QUEUE_BUSY */
+    int remote_stats;                   /* Answer DSC_CMD_GET_STATS from the
+                                           other hosts too */
+    uint32_t sub_max_lease;             /* Max lease(seconds) granted */
+    uint64_t sub_secret;                /* Key of the nonces of subscribers,
+                                           the same in a pool */
 } dsc_server_t;
 
+/* Keep the information of a pool of servers sharing one port */
+typedef struct dsc_server_pool {
+    int nservers;                       /* Number of servers created */
+    int nthreads;                       /* Number of serving threads started */
+    dsc_server_t **servers;             /* One server(socket) per thread */
+    pthread_t *threads;                 /* Serving threads */
+    size_t xfer_mem;                    /* Memory of the requests being
+                                           reassembled by all servers */
+    struct dsc_admit *admit;            /* Token buckets shared by all
+                                           servers */
+} dsc_server_pool_t;
+
 
 dsc_server_t *server_init(request_handler_t req_handler, int port, int timeout);
+dsc_server_t *server_init_buf(request_buf_handler_t buf_handler, int port,
+    int timeout);
 int server_accept_request(dsc_server_t *s);
+int server_accept_batch(dsc_server_t *s, int max);
+int server_register_handler(dsc_server_t *s, uint32_t cmd,
+    request_buf_handler_t handler);
+int server_add_listener(dsc_server_t *s, int port);
+int server_add_unix_listener(dsc_server_t *s, const char *path);
+int server_add_timer(dsc_server_t *s, int interval, server_timer_t func,
+    void *arg);
+int server_set_replay_cache(dsc_server_t *s, int entries);
+int server_set_compression(dsc_server_t *s, uint32_t min_len);
+int server_set_reassembly(dsc_server_t *s, uint32_t max_msg, size_t max_mem);
+int server_set_admission(dsc_server_t *s, uint32_t rate, uint32_t burst,
+    int policy);
+int server_invalidate_cache(dsc_server_t *s, uint32_t cmd);
+int server_get_stats(dsc_server_t *s, dsc_stats_t *stats);
+int server_set_remote_stats(dsc_server_t *s, int enable);
+int server_set_max_lease(dsc_server_t *s, uint32_t lease);
+int server_set_workers(dsc_server_t *s, int nworkers, int queue_size,
+    int policy);
+int server_set_backend(dsc_server_t *s, int backend);
+void server_set_default_backend(int backend);
+int server_publish(dsc_server_t *s, uint32_t cmd, const void *data,
+    uint32_t len);
+void server_print_stats(const dsc_stats_t *stats, FILE *fp);
+int server_run(dsc_server_t *s);
+void server_stop(dsc_server_t *s);
 void server_close(dsc_server_t *s);
 
+dsc_server_pool_t *server_init_pool(request_handler_t req_handler, int port,
+    int nthreads);
+dsc_server_pool_t *server_init_pool_buf(request_buf_handler_t buf_handler,
+    int port, int nthreads);
+int server_pool_register_handler(dsc_server_pool_t *p, uint32_t cmd,
+    request_buf_handler_t handler);
+int server_pool_set_replay_cache(dsc_server_pool_t *p, int entries);
+int server_pool_set_compression(dsc_server_pool_t *p, uint32_t min_len);
+int server_pool_set_reassembly(dsc_server_pool_t *p, uint32_t max_msg,
+    size_t max_mem);
+int server_pool_set_admission(dsc_server_pool_t *p, uint32_t rate,
+    uint32_t burst, int policy);
+int server_pool_invalidate_cache(dsc_server_pool_t *p, uint32_t cmd);
+int server_pool_get_stats(dsc_server_pool_t *p, dsc_stats_t *stats);
+int server_pool_set_remote_stats(dsc_server_pool_t *p, int enable);
+int server_pool_set_max_lease(dsc_server_pool_t *p, uint32_t lease);
+int server_pool_set_workers(dsc_server_pool_t *p, int nworkers,
+    int queue_size, int policy);
+int server_pool_publish(dsc_server_pool_t *p, uint32_t cmd, const void *data,
+    uint32_t len);
+void server_pool_close(dsc_server_pool_t *p);
+
 
 #endif /* _DSC_H_ */
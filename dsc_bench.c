@@ -0,0 +1,749 @@
+/******************************************************************************
+*
+* FILENAME:
+*     dsc_bench.c
+*
+* DESCRIPTION:
+*     Load generator of the server, it reports the throughput, loss and the
+*     latency distribution of requests.
+*
+* REVISION(MM/DD/YYYY):
+*     10/16/2026
+*     - Initial version
+*
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "common.h"
+
+
+/* Default options */
+#define BENCH_CONCURRENCY       16
+#define BENCH_DURATION          5
+#define BENCH_PAYLOAD           64
+#define BENCH_BATCH_BUDGET      50
+
+/*
+ * The latency histogram is log-linear like HdrHistogram: every power of 2 is
+ * split into 2^HIST_SUB_BITS buckets, so the error of a value is < 1/32.
+ */
+#define HIST_SUB_BITS           5
+#define HIST_SUB_COUNT          (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS            ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/* The latency histogram, values in nanoseconds */
+typedef struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} hist_t;
+
+/* The request mix, weights of the commands */
+typedef struct mix {
+    int version;                /* Weight of CMD_GET_VERSION */
+    int get_msg;                /* Weight of CMD_GET_MESSAGE */
+    int put_msg;                /* Weight of CMD_PUT_MESSAGE */
+} mix_t;
+
+/* Options and results of a load thread */
+typedef struct worker {
+    pthread_t tid;
+    const char *server_ip;
+    int server_port;
+    const char *unix_path;      /* Local socket of server, or NULL for UDP */
+    int concurrency;            /* Max requests in flight */
+    double rate;                /* Requests per second, 0 for closed-loop */
+    double duration;            /* Seconds */
+    int payload;                /* Data length of CMD_PUT_MESSAGE */
+    int integrity;              /* Integrity check, refer DSC_INTEGRITY_SUM16 */
+    unsigned int batch_max;     /* Max length of a batch packet, 0 for none */
+    unsigned int batch_budget;  /* Max wait(microseconds) in the batch */
+    mix_t mix;
+    unsigned int seed;
+    dsc_client_t *shared;       /* The client shared by all threads, or NULL */
+
+    uint64_t sent;              /* Requests sent */
+    uint64_t completed;         /* Responses received */
+    uint64_t timeouts;          /* Requests without response */
+    uint64_t retries;           /* Requests sent again by the client */
+    uint64_t errors;            /* Responses with error status, send errors */
+    hist_t hist;                /* Latency of completed requests */
+} worker_t;
+
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      hist_index
+ *
+ * DESCRIPTION:
+ *      Get the bucket index of a value in the histogram.
+ *
+ * PARAMETERS:
+ *      v - The value
+ *
+ * RETURN:
+ *      The bucket index
+ ******************************************************************************/
+static int hist_index(uint64_t v)
+{
+    int shift;
+
+    if (v < HIST_SUB_COUNT) {
+        return (int)v;
+    }
+
+    /* v >> shift is in [HIST_SUB_COUNT, 2*HIST_SUB_COUNT) */
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (int)((v >> shift) - HIST_SUB_COUNT);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      hist_value
+ *
+ * DESCRIPTION:
+ *      Get the highest value of a bucket in the histogram.
+ *
+ * PARAMETERS:
+ *      idx - The bucket index
+ *
+ * RETURN:
+ *      The highest value of the bucket
+ ******************************************************************************/
+static uint64_t hist_value(int idx)
+{
+    int shift = idx / HIST_SUB_COUNT - 1;
+    uint64_t sub = idx % HIST_SUB_COUNT + HIST_SUB_COUNT;
+
+    if (shift < 0) {
+        return (uint64_t)idx;
+    }
+
+    return ((sub + 1) << shift) - 1;
+}
+
+
+static void hist_record(hist_t *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+
+static void hist_merge(hist_t *dst, const hist_t *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      hist_percentile
+ *
+ * DESCRIPTION:
+ *      Get the value at a percentile of the histogram.
+ *
+ * PARAMETERS:
+ *      h - The histogram
+ *      p - The percentile, e.g. 99.9
+ *
+ * RETURN:
+ *      The value, no more than the max value recorded
+ ******************************************************************************/
+static uint64_t hist_percentile(const hist_t *h, double p)
+{
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (h->total == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t)(p / 100.0 * h->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            return (hist_value(i) < h->max) ? hist_value(i) : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      build_request
+ *
+ * DESCRIPTION:
+ *      Build a request picked from the mix.
+ *
+ * PARAMETERS:
+ *      w   - The load thread
+ *      buf - Output, the request, DSC_BUF_SIZE bytes
+ *
+ * RETURN:
+ *      The request
+ ******************************************************************************/
+static dsc_command_t *build_request(worker_t *w, uint8_t *buf)
+{
+    dsc_command_t *req = (dsc_command_t *)buf;
+    int total = w->mix.version + w->mix.get_msg + w->mix.put_msg;
+    int r = rand_r(&w->seed) % total;
+
+    if (r < w->mix.version) {
+        req->command = CMD_GET_VERSION;
+        req->data_len = 0;
+    } else if (r < w->mix.version + w->mix.get_msg) {
+        req->command = CMD_GET_MESSAGE;
+        req->data_len = 0;
+    } else {
+        /* The data is filled once, the server prints it as a string */
+        req->command = CMD_PUT_MESSAGE;
+        req->data_len = w->payload;
+    }
+
+    return req;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      handle_completions
+ *
+ * DESCRIPTION:
+ *      Account the completions of requests.
+ *
+ * PARAMETERS:
+ *      w     - The load thread
+ *      comps - The completions, the cookie is the time the request is sent
+ *              (open-loop: the time it is scheduled to be sent)
+ *      n     - The number of completions
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void handle_completions(worker_t *w, dsc_completion_t *comps, int n)
+{
+    uint64_t now = now_nsec();
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (comps[i].resp == NULL) {
+            w->timeouts++;
+            continue;
+        }
+
+        w->completed++;
+        if (comps[i].resp->status != STATUS_SUCCESS) {
+            w->errors++;
+        }
+        hist_record(&w->hist, now - (uint64_t)(uintptr_t)comps[i].cookie);
+        free(comps[i].resp);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      worker_thread
+ *
+ * DESCRIPTION:
+ *      Send requests to server until the duration elapses, then wait for the
+ *      requests in flight.
+ *      Closed-loop: keep w->concurrency requests in flight.
+ *      Open-loop: send at w->rate requests per second regardless of the
+ *      responses (up to w->concurrency in flight), the latency is measured
+ *      from the scheduled time, so a stalled server is not hidden.
+ *
+ * PARAMETERS:
+ *      arg - The load thread
+ *
+ * RETURN:
+ *      NULL
+ ******************************************************************************/
+static void *worker_thread(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    dsc_completion_t comps[64];
+    uint8_t buf[DSC_BUF_SIZE];
+    dsc_client_t *c;
+    uint64_t start, end, next, interval = 0, now;
+    int n;
+
+    c = (w->unix_path != NULL) ? client_init_unix(w->unix_path) :
+        client_init(w->server_ip, w->server_port);
+    if (c == NULL) {
+        w->errors++;
+        return NULL;
+    }
+    if ((client_set_integrity(c, w->integrity) != 0) ||
+        (client_set_batching(c, w->batch_max, w->batch_budget) != 0)) {
+        w->errors++;
+        client_close(c);
+        return NULL;
+    }
+    memset(buf, 'x', sizeof(buf));
+    buf[sizeof(dsc_command_t) + w->payload - 1] = 0;
+
+    start = now_nsec();
+    end = start + (uint64_t)(w->duration * 1e9);
+    next = start;
+    if (w->rate > 0) {
+        interval = (uint64_t)(1e9 / w->rate);
+    }
+
+    while ((now = now_nsec()) < end) {
+        /* Send the requests due */
+        while ((c->ninflight < w->concurrency) && ((w->rate == 0) ||
+            (next <= now))) {
+            uint64_t sched = (w->rate > 0) ? next : now_nsec();
+            if (client_submit(c, build_request(w, buf),
+                (void *)(uintptr_t)sched) != 0) {
+                w->errors++;
+                break;
+            }
+            w->sent++;
+            next += interval;
+        }
+
+        /*
+         * Open-loop: wait no longer than the next request is due. If it's
+         * due already (the requests in flight are at the max, or a submit
+         * failed), wait for a completion, there is nothing else to do
+         */
+        if ((w->rate > 0) && (next > now) && (next - now < 1000000)) {
+            n = client_poll(c, comps, 64);
+        } else {
+            int ms = -1;
+            if ((w->rate > 0) && (next > now)) {
+                ms = (int)((next - now) / 1000000);
+            } else if ((w->rate > 0) && (c->ninflight == 0)) {
+                ms = 0;
+            }
+            n = client_wait(c, comps, 64, ms);
+        }
+        if (n > 0) {
+            handle_completions(w, comps, n);
+        }
+    }
+
+    /* Wait for the requests in flight, they complete in DSC_CLIENT_TIMEOUT */
+    while (c->ninflight > 0) {
+        n = client_wait(c, comps, 64, -1);
+        if (n < 0) {
+            break;
+        }
+        handle_completions(w, comps, n);
+    }
+
+    w->retries = c->retries;
+    client_close(c);
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      shared_thread
+ *
+ * DESCRIPTION:
+ *      Call the server with the client shared by all threads until the
+ *      duration elapses, one call in flight per thread.
+ *
+ * PARAMETERS:
+ *      arg - The load thread
+ *
+ * RETURN:
+ *      NULL
+ ******************************************************************************/
+static void *shared_thread(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    uint8_t buf[DSC_BUF_SIZE];
+    uint8_t resp_buf[DSC_BUF_SIZE];
+    dsc_command_t *resp = (dsc_command_t *)resp_buf;
+    uint64_t start, end, done;
+    ssize_t len;
+
+    memset(buf, 'x', sizeof(buf));
+    buf[sizeof(dsc_command_t) + w->payload - 1] = 0;
+
+    end = now_nsec() + (uint64_t)(w->duration * 1e9);
+    while ((start = now_nsec()) < end) {
+        w->sent++;
+        len = client_call(w->shared, build_request(w, buf), resp_buf,
+            sizeof(resp_buf), DSC_CLIENT_TIMEOUT);
+        done = now_nsec();
+        if (len < 0) {
+            if (errno == ETIMEDOUT) {
+                w->timeouts++;
+            } else {
+                w->errors++;
+            }
+            continue;
+        }
+
+        w->completed++;
+        if (resp->status != STATUS_SUCCESS) {
+            w->errors++;
+        }
+        hist_record(&w->hist, done - start);
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      print_usage
+ *
+ * DESCRIPTION:
+ *      Print usage information and exit the program.
+ *
+ * PARAMETERS:
+ *      pname - The name of the program.
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void print_usage(char *pname)
+{
+    printf("\n"
+        "================================================\n"
+        "     Load generator of datagram socket server   \n"
+        "                    v%d.%d                      \n"
+        "================================================\n"
+        "\n"
+        "Usage: %s [-s server_ip] [-p port_number] [-U path] [-t threads]\n"
+        "          [-c concurrency] [-r rate] [-d seconds] [-l payload] "
+        "[-m mix]\n"
+        "          [-i mode] [-b len[:usec]] [-x] [-j]\n"
+        "\n"
+        "Options:\n"
+        "    -s server_ip     The IP address of server, default: %s\n"
+        "    -p port_number   The port number of server, default: %d\n"
+        "    -U path          Connect to the Unix domain socket of server\n"
+        "                     instead, '@name' for an abstract name\n"
+        "    -t threads       The number of load threads, one socket per thread,\n"
+        "                     default: 1\n"
+        "    -c concurrency   The max requests in flight of all threads,\n"
+        "                     default: %d\n"
+        "    -r rate          Open-loop: send rate requests per second,\n"
+        "                     default: closed-loop\n"
+        "    -d seconds       The duration of the test, default: %d\n"
+        "    -l payload       The data length of CMD_PUT_MESSAGE (1-%d),\n"
+        "                     default: %d\n"
+        "    -m mix           The weights of CMD_GET_VERSION:CMD_GET_MESSAGE:\n"
+        "                     CMD_PUT_MESSAGE, default: 1:1:1\n"
+        "    -i mode          The integrity check of the packets: sum (16-bit\n"
+        "                     checksum), crc (CRC32C) or none (loopback\n"
+        "                     server only), default: sum\n"
+        "    -b len[:usec]    Batch the requests in packets of up to len bytes,\n"
+        "                     waiting no longer than usec, default: 50\n"
+        "    -x               Share one client between the threads, each\n"
+        "                     makes one call at a time (closed-loop only,\n"
+        "                     no batching)\n"
+        "    -j               Print the result in JSON\n"
+        "\n"
+        "Example:\n"
+        "    %s -c 64 -d 10 -m 8:1:1\n"
+        "    %s -r 50000 -l 256 -m 0:0:1 -j\n"
+        "    %s -l 1024 -m 0:0:1 -i crc\n"
+        "    %s -t 32 -x\n"
+        "    %s -c 256 -m 1:1:0 -b 1400:100\n"
+        "    %s -c 1 -U /tmp/dsc.sock\n"
+        "\n",
+        VERSION_MAJOR, VERSION_MINOR,
+        pname, SERVER_IP, SERVER_PORT, BENCH_CONCURRENCY, BENCH_DURATION,
+        (int)(DSC_BUF_SIZE - sizeof(dsc_command_t)), BENCH_PAYLOAD,
+        pname, pname, pname, pname, pname, pname
+        );
+    exit(STATUS_ERROR);
+}
+
+
+int main(int argc, char *argv[])
+{
+    char *pname = argv[0];
+    worker_t *workers;
+    worker_t total;
+    mix_t mix = { 1, 1, 1 };
+    const char *server_ip = SERVER_IP;
+    int serv_port = SERVER_PORT;
+    const char *unix_path = NULL;
+    int nthreads = 1;
+    int concurrency = BENCH_CONCURRENCY;
+    double rate = 0;
+    double duration = BENCH_DURATION;
+    int payload = BENCH_PAYLOAD;
+    int integrity = DSC_INTEGRITY_SUM16;
+    const char *mode = "sum";
+    dsc_client_t *shared = NULL;
+    int share = 0;
+    unsigned int batch_max = 0;
+    unsigned int batch_budget = BENCH_BATCH_BUDGET;
+    int json = 0;
+    uint64_t start;
+    double elapsed;
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, ":hs:p:U:t:c:r:d:l:m:i:b:xj")) != -1) {
+        switch (opt) {
+        case 's':
+            server_ip = optarg;
+            break;
+
+        case 'p':
+            serv_port = strtol(optarg, NULL, 10);
+            if (serv_port <= 0) {
+                printf("Error: invalid port number!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'U':
+            unix_path = optarg;
+            break;
+
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            if (nthreads <= 0) {
+                printf("Error: invalid number of threads!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'c':
+            concurrency = strtol(optarg, NULL, 10);
+            if (concurrency <= 0) {
+                printf("Error: invalid concurrency!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'r':
+            rate = strtod(optarg, NULL);
+            if (rate <= 0) {
+                printf("Error: invalid rate!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'd':
+            duration = strtod(optarg, NULL);
+            if (duration <= 0) {
+                printf("Error: invalid duration!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'l':
+            payload = strtol(optarg, NULL, 10);
+            if ((payload <= 0) ||
+                (payload > (int)(DSC_BUF_SIZE - sizeof(dsc_command_t)))) {
+                printf("Error: invalid payload length!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'm':
+            if ((sscanf(optarg, "%d:%d:%d", &mix.version, &mix.get_msg,
+                &mix.put_msg) != 3) || (mix.version < 0) ||
+                (mix.get_msg < 0) || (mix.put_msg < 0) ||
+                (mix.version + mix.get_msg + mix.put_msg == 0)) {
+                printf("Error: invalid mix '%s'\n", optarg);
+                print_usage(pname);
+            }
+            break;
+
+        case 'i':
+            mode = optarg;
+            if (strcmp(mode, "sum") == 0) {
+                integrity = DSC_INTEGRITY_SUM16;
+            } else if (strcmp(mode, "crc") == 0) {
+                integrity = DSC_INTEGRITY_CRC32C;
+            } else if (strcmp(mode, "none") == 0) {
+                integrity = DSC_INTEGRITY_NONE;
+            } else {
+                printf("Error: invalid integrity mode '%s'\n", optarg);
+                print_usage(pname);
+            }
+            break;
+
+        case 'b':
+            if ((sscanf(optarg, "%u:%u", &batch_max, &batch_budget) < 1) ||
+                (batch_max > DSC_BUF_SIZE)) {
+                printf("Error: invalid batching '%s'\n", optarg);
+                print_usage(pname);
+            }
+            break;
+
+        case 'x':
+            share = 1;
+            break;
+
+        case 'j':
+            json = 1;
+            break;
+
+        case 'h':
+            print_usage(pname);
+            break;
+
+        case ':':
+            printf("Error: option '-%c' needs a value\n", optopt);
+            print_usage(pname);
+            break;
+
+        case '?':
+        default:
+            printf("Error: invalid option '-%c'\n", optopt);
+            print_usage(pname);
+            break;
+        }
+    }
+    if (optind < argc) {
+        printf("Error: invalid argument '%s'\n", argv[optind]);
+        print_usage(pname);
+    }
+    if (concurrency < nthreads) {
+        concurrency = nthreads;
+    }
+    if (share) {
+        /* Every thread makes one call at a time */
+        if ((rate > 0) || (batch_max > 0)) {
+            printf("Error: -x is closed-loop only, without batching\n");
+            print_usage(pname);
+        }
+        concurrency = nthreads;
+        shared = (unix_path != NULL) ? client_init_shared_unix(unix_path) :
+            client_init_shared(server_ip, serv_port);
+        if ((shared == NULL) ||
+            (client_set_integrity(shared, integrity) != 0)) {
+            printf("Error: failed to create the shared client\n");
+            return STATUS_ERROR;
+        }
+    }
+
+    workers = (worker_t *)calloc(nthreads, sizeof(worker_t));
+    if (workers == NULL) {
+        perror("malloc error");
+        return STATUS_ERROR;
+    }
+
+    start = now_nsec();
+    for (i = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+
+        w->server_ip = server_ip;
+        w->server_port = serv_port;
+        w->unix_path = unix_path;
+        w->concurrency = concurrency / nthreads +
+            (i < concurrency % nthreads ? 1 : 0);
+        if (w->concurrency > DSC_MAX_INFLIGHT) {
+            w->concurrency = DSC_MAX_INFLIGHT;
+        }
+        w->rate = rate / nthreads;
+        w->duration = duration;
+        w->payload = payload;
+        w->integrity = integrity;
+        w->batch_max = batch_max;
+        w->batch_budget = batch_budget;
+        w->mix = mix;
+        w->seed = (unsigned int)start + i;
+        w->shared = shared;
+        if (pthread_create(&w->tid, NULL,
+            share ? shared_thread : worker_thread, w) != 0) {
+            perror("pthread_create error");
+            return STATUS_ERROR;
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        total.sent += workers[i].sent;
+        total.completed += workers[i].completed;
+        total.timeouts += workers[i].timeouts;
+        total.retries += workers[i].retries;
+        total.errors += workers[i].errors;
+        hist_merge(&total.hist, &workers[i].hist);
+    }
+    elapsed = (now_nsec() - start) / 1e9;
+    if (shared != NULL) {
+        total.retries = shared->retries;
+        client_close(shared);
+    }
+
+    if (json) {
+        printf("{\"transport\": \"%s\", \"threads\": %d, \"shared\": %s, "
+            "\"concurrency\": %d, "
+            "\"rate\": %.0f, \"duration\": %.3f, \"payload\": %d, "
+            "\"integrity\": \"%s\", \"batch\": [%u, %u], "
+            "\"mix\": [%d, %d, %d], "
+            "\"sent\": %" PRIu64 ", \"completed\": %" PRIu64 ", "
+            "\"timeouts\": %" PRIu64 ", \"retries\": %" PRIu64 ", "
+            "\"errors\": %" PRIu64 ", "
+            "\"throughput\": %.1f, \"latency_us\": "
+            "{\"p50\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}}\n",
+            (unix_path != NULL) ? "unix" : "udp", nthreads,
+            share ? "true" : "false", concurrency, rate, elapsed,
+            payload, mode, batch_max, batch_budget,
+            mix.version, mix.get_msg, mix.put_msg,
+            total.sent, total.completed, total.timeouts, total.retries,
+            total.errors, total.completed / elapsed,
+            hist_percentile(&total.hist, 50) / 1e3,
+            hist_percentile(&total.hist, 99) / 1e3,
+            hist_percentile(&total.hist, 99.9) / 1e3,
+            total.hist.max / 1e3);
+    } else {
+        printf("Requests:   %" PRIu64 " sent, %" PRIu64 " completed, "
+            "%" PRIu64 " timeouts(%.3f%%), %" PRIu64 " errors\n",
+            total.sent, total.completed, total.timeouts,
+            total.sent ? 100.0 * total.timeouts / total.sent : 0.0,
+            total.errors);
+        printf("Retries:    %" PRIu64 "\n", total.retries);
+        printf("Throughput: %.1f requests/s\n", total.completed / elapsed);
+        printf("Latency:    p50 %.1f us, p99 %.1f us, p99.9 %.1f us, "
+            "max %.1f us\n",
+            hist_percentile(&total.hist, 50) / 1e3,
+            hist_percentile(&total.hist, 99) / 1e3,
+            hist_percentile(&total.hist, 99.9) / 1e3,
+            total.hist.max / 1e3);
+    }
+
+    free(workers);
+    return STATUS_SUCCESS;
+}
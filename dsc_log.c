@@ -0,0 +1,358 @@
+/******************************************************************************
+ *
+ * FILENAME:
+ *     dsc_log.c
+ *
+ * DESCRIPTION:
+ *     Leveled logging through a bounded lock-free ring. Any thread formats its
+ *     message into a slot claimed with one compare-and-swap, a background
+ *     thread writes the slots to the log file in order. If the ring is full,
+ *     the message is dropped and counted, the caller never waits.
+ *
+ * REVISION(MM/DD/YYYY):
+ *     10/16/2026
+ *     - Initial version
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "dsc_log.h"
+
+
+/* Time(milliseconds) the log thread sleeps without being woken up */
+#define LOG_IDLE_WAIT           100
+
+/*
+ * A message in the ring. The sequence is the position of the slot when it
+ * can be written, position + 1 when it has been written.
+ */
+struct log_slot {
+    uint64_t seq;                       /* Sequence of the slot */
+    int level;                          /* Level of the message */
+    char text[DSC_LOG_MSG_SIZE];        /* The message */
+};
+
+
+int dsc_log_level = DSC_LOG_LEVEL_INFO;
+
+static struct log_slot log_ring[DSC_LOG_RING_SIZE];
+static uint64_t log_tail;               /* Next position written */
+static uint64_t log_head;               /* Next position read, by the reader
+                                           holding log_lock only */
+static uint64_t log_dropped;            /* Messages dropped as the ring is full */
+static int log_sleeping;                /* The log thread waits for messages */
+static FILE *log_file;                  /* NULL for stderr */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+static const char *log_prefix[] = { "Error: ", "Warning: ", "", "Debug: " };
+
+
+/******************************************************************************
+ * NAME:
+ *      log_drain
+ *
+ * DESCRIPTION:
+ *      Write all the messages in the ring to the log file.
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      The number of messages written
+ ******************************************************************************/
+static int log_drain(void)
+{
+    static uint64_t reported;
+    struct log_slot *slot;
+    FILE *fp;
+    uint64_t dropped;
+    int n = 0;
+
+    pthread_mutex_lock(&log_lock);
+    fp = (log_file != NULL) ? log_file : stderr;
+    for (;;) {
+        slot = &log_ring[log_head & (DSC_LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_head + 1) {
+            break;
+        }
+        fputs(log_prefix[slot->level], fp);
+        fputs(slot->text, fp);
+
+        /* Hand the slot back to the writers, one lap later */
+        __atomic_store_n(&slot->seq, log_head + DSC_LOG_RING_SIZE,
+            __ATOMIC_RELEASE);
+        log_head++;
+        n++;
+    }
+
+    dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+        fprintf(fp, "Warning: %llu log messages dropped\n",
+            (unsigned long long)(dropped - reported));
+        reported = dropped;
+    }
+    if (n > 0) {
+        fflush(fp);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    return n;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      log_thread
+ *
+ * DESCRIPTION:
+ *      Write the messages until the process exits. It sleeps on a futex while
+ *      the ring is empty, and is woken up by the writers.
+ *
+ * PARAMETERS:
+ *      arg - Not used
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void *log_thread(void *arg)
+{
+    struct timespec ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = LOG_IDLE_WAIT * 1000000L;
+    for (;;) {
+        if (log_drain() > 0) {
+            continue;
+        }
+
+        /* Check the ring again after telling the writers to wake us up */
+        __atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (log_drain() == 0) {
+            syscall(SYS_futex, &log_sleeping, FUTEX_WAIT_PRIVATE, 1, &ts,
+                NULL, 0);
+        }
+        __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      log_init
+ *
+ * DESCRIPTION:
+ *      Initialize the ring and start the log thread, on the first message.
+ *      The messages left at exit are written by an atexit() handler.
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void log_init(void)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigset_t all, old;
+    int i;
+
+    for (i = 0; i < DSC_LOG_RING_SIZE; i++) {
+        log_ring[i].seq = i;
+    }
+    atexit(dsc_log_flush);
+
+    /* The signals are handled by the other threads */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, log_thread, NULL) != 0) {
+        /* The messages are written when the ring is flushed at exit */
+        fprintf(stderr, "Error: failed to start the log thread\n");
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      dsc_log_write
+ *
+ * DESCRIPTION:
+ *      Format a message into the ring, it's written to the log file later by
+ *      the log thread. Use the DSC_LOG_* macros instead, they check the level
+ *      before the arguments are evaluated.
+ *
+ * PARAMETERS:
+ *      level - The level of the message
+ *      fmt   - The format of the message, as printf()
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void dsc_log_write(int level, const char *fmt, ...)
+{
+    struct log_slot *slot;
+    uint64_t pos, seq;
+    va_list ap;
+    int err = errno;
+
+    pthread_once(&log_once, log_init);
+
+    /* Claim a slot, Vyukov's bounded queue */
+    pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &log_ring[pos & (DSC_LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((int64_t)(seq - pos) < 0) {
+            /* Full, the slot is not read yet */
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Keep errno for %m, it may be changed by starting the log thread */
+    errno = err;
+    va_start(ap, fmt);
+    vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    va_end(ap);
+    slot->level = (level < DSC_LOG_LEVEL_ERROR) ? DSC_LOG_LEVEL_ERROR :
+        (level > DSC_LOG_LEVEL_DEBUG) ? DSC_LOG_LEVEL_DEBUG : level;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* Pairs with the store of log_sleeping before the ring is checked */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_RELAXED)) {
+        syscall(SYS_futex, &log_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL,
+            NULL, 0);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      dsc_log_limit
+ *
+ * DESCRIPTION:
+ *      Check the rate of the messages of a call site, refer DSC_LOG_LIMITED().
+ *      When a new second starts, the number of messages dropped in the last
+ *      one is logged.
+ *
+ * PARAMETERS:
+ *      rl    - The state of the call site
+ *      level - The level of the message
+ *
+ * RETURN:
+ *      1 - Log the message, 0 - Drop it
+ ******************************************************************************/
+int dsc_log_limit(dsc_log_limit_t *rl, int level)
+{
+    struct timespec ts;
+    uint64_t window, now;
+    uint32_t suppressed;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    now = ts.tv_sec;
+
+    window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
+    if ((window != now) && __atomic_compare_exchange_n(&rl->window, &window,
+        now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+        suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+        if (suppressed > 0) {
+            dsc_log_write(level, "%u similar messages suppressed\n",
+                suppressed);
+        }
+    }
+
+    if (__atomic_add_fetch(&rl->count, 1, __ATOMIC_RELAXED) >
+        DSC_LOG_LIMIT_BURST) {
+        __atomic_add_fetch(&rl->suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      dsc_log_set_level
+ *
+ * DESCRIPTION:
+ *      Set the max level of the messages logged, DSC_LOG_LEVEL_INFO by
+ *      default. The levels above DSC_LOG_MAX_LEVEL are never logged.
+ *
+ * PARAMETERS:
+ *      level - The level
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void dsc_log_set_level(int level)
+{
+    dsc_log_level = level;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      dsc_log_set_file
+ *
+ * DESCRIPTION:
+ *      Set the file which the messages are written to, stderr by default.
+ *
+ * PARAMETERS:
+ *      fp - The file, NULL for stderr
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void dsc_log_set_file(FILE *fp)
+{
+    pthread_mutex_lock(&log_lock);
+    log_file = fp;
+    pthread_mutex_unlock(&log_lock);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      dsc_log_flush
+ *
+ * DESCRIPTION:
+ *      Write the messages in the ring now, in the calling thread.
+ *
+ * PARAMETERS:
+ *      None
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void dsc_log_flush(void)
+{
+    log_drain();
+}
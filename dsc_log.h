@@ -0,0 +1,92 @@
+/******************************************************************************
+*
+* FILENAME:
+*     dsc_log.h
+*
+* DESCRIPTION:
+*     Define the leveled logging of the library. The messages are formatted
+*     into a lock-free ring in memory by the caller, and written to the log
+*     file by a background thread, so the serving threads never block on it.
+*
+* REVISION(MM/DD/YYYY):
+*     10/16/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _DSC_LOG_H_
+#define _DSC_LOG_H_
+#include <stdio.h>
+#include <stdint.h>
+
+
+/* Log levels, a message is logged if its level <= the level set */
+#define DSC_LOG_LEVEL_ERROR     0
+#define DSC_LOG_LEVEL_WARN      1
+#define DSC_LOG_LEVEL_INFO      2
+#define DSC_LOG_LEVEL_DEBUG     3
+
+/*
+ * The max level compiled in, the messages above it are removed at compile
+ * time. Build with -DDSC_LOG_MAX_LEVEL=DSC_LOG_LEVEL_DEBUG to get all.
+ */
+#ifndef DSC_LOG_MAX_LEVEL
+#define DSC_LOG_MAX_LEVEL       DSC_LOG_LEVEL_INFO
+#endif
+
+/* The max length of a message, the longer ones are truncated */
+#define DSC_LOG_MSG_SIZE        240
+
+/* The number of messages buffered in the ring, shall be power of 2 */
+#define DSC_LOG_RING_SIZE       1024
+
+/* The max number of messages per second logged by DSC_LOG_LIMITED() */
+#define DSC_LOG_LIMIT_BURST     10
+
+
+/* State of DSC_LOG_LIMITED(), one per call site */
+typedef struct dsc_log_limit {
+    uint64_t window;            /* The second counted */
+    uint32_t count;             /* Messages in the second */
+    uint32_t suppressed;        /* Messages dropped since the last one logged */
+} dsc_log_limit_t;
+
+
+/* The level set by dsc_log_set_level() */
+extern int dsc_log_level;
+
+void dsc_log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int dsc_log_limit(dsc_log_limit_t *rl, int level);
+void dsc_log_set_level(int level);
+void dsc_log_set_file(FILE *fp);
+void dsc_log_flush(void);
+
+
+/* Log a message of the level, if it's compiled in and enabled */
+#define DSC_LOG(level, ...)                                                 \
+    do {                                                                    \
+        if (((level) <= DSC_LOG_MAX_LEVEL) && ((level) <= dsc_log_level)) { \
+            dsc_log_write((level), __VA_ARGS__);                            \
+        }                                                                   \
+    } while (0)
+
+/*
+ * The same, but no more than DSC_LOG_LIMIT_BURST messages per second from the
+ * call site, e.g. for the messages caused by the packets received.
+ */
+#define DSC_LOG_LIMITED(level, ...)                                         \
+    do {                                                                    \
+        static dsc_log_limit_t _dsc_log_rl;                                 \
+        if (((level) <= DSC_LOG_MAX_LEVEL) && ((level) <= dsc_log_level) && \
+            dsc_log_limit(&_dsc_log_rl, (level))) {                         \
+            dsc_log_write((level), __VA_ARGS__);                            \
+        }                                                                   \
+    } while (0)
+
+#define DSC_LOG_ERROR(...)      DSC_LOG(DSC_LOG_LEVEL_ERROR, __VA_ARGS__)
+#define DSC_LOG_WARN(...)       DSC_LOG(DSC_LOG_LEVEL_WARN, __VA_ARGS__)
+#define DSC_LOG_INFO(...)       DSC_LOG(DSC_LOG_LEVEL_INFO, __VA_ARGS__)
+#define DSC_LOG_DEBUG(...)      DSC_LOG(DSC_LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+
+#endif /* _DSC_LOG_H_ */
@@ -0,0 +1,416 @@
+/******************************************************************************
+ *
+ * FILENAME:
+ *     dsc_uring.c
+ *
+ * DESCRIPTION:
+ *     A minimal io_uring wrapper over the raw system calls, no liburing is
+ *     needed. The rings are used by one thread only, so only the indexes
+ *     shared with the kernel are accessed with acquire/release ordering.
+ *
+ * REVISION(MM/DD/YYYY):
+ *     10/16/2026
+ *     - Initial version
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "dsc_uring.h"
+#include "dsc_log.h"
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+    unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+        NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+    unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_init
+ *
+ * DESCRIPTION:
+ *      Create an io_uring instance, map its rings, and register a ring of
+ *      receive buffers as the group URING_BUF_GROUP.
+ *
+ * PARAMETERS:
+ *      u        - The instance
+ *      entries  - The number of submission entries, the completion ring has
+ *                 4 times of them
+ *      nbufs    - The number of receive buffers, power of 2
+ *      buf_size - The size of a receive buffer
+ *
+ * RETURN:
+ *      0 - OK, Others - Error (errno is set, e.g. ENOSYS or EPERM if io_uring
+ *      is not available, EINVAL if the kernel is too old)
+ ******************************************************************************/
+int uring_init(dsc_uring_t *u, unsigned entries, unsigned nbufs,
+    unsigned buf_size)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    uint8_t *sq, *cq;
+    unsigned i;
+    int err;
+
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    u->fd = sys_io_uring_setup(entries, &p);
+    if (u->fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        /* The completions of the multishot receive may overflow */
+        errno = EINVAL;
+        goto fail;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size) {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    sq = (uint8_t *)u->sq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sq_local = u->sq_submitted = *u->sq_tail;
+    cq = (uint8_t *)u->cq_ring;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* The receive buffers, given to the kernel through a ring */
+    u->nbufs = nbufs;
+    u->buf_size = buf_size;
+    u->br_size = nbufs * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        goto fail;
+    }
+    u->bufs = (uint8_t *)malloc((size_t)nbufs * buf_size);
+    if (u->bufs == NULL) {
+        goto fail;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        goto fail;
+    }
+    for (i = 0; i < nbufs; i++) {
+        uring_buf_recycle(u, i);
+    }
+    uring_buf_publish(u);
+
+    return 0;
+
+fail:
+    err = errno;
+    uring_exit(u);
+    errno = err;
+    return -1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_exit
+ *
+ * DESCRIPTION:
+ *      Destroy the io_uring instance, the pending requests are cancelled.
+ *
+ * PARAMETERS:
+ *      u - The instance
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void uring_exit(dsc_uring_t *u)
+{
+    if (u->fd >= 0) {
+        close(u->fd);
+        u->fd = -1;
+    }
+    if (u->sqes != NULL) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if ((u->cq_ring != NULL) && (u->cq_ring != u->sq_ring)) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring != NULL) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->br != NULL) {
+        munmap(u->br, u->br_size);
+    }
+    free(u->bufs);
+    u->sqes = NULL;
+    u->sq_ring = u->cq_ring = NULL;
+    u->br = NULL;
+    u->bufs = NULL;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_get_sqe
+ *
+ * DESCRIPTION:
+ *      Get a free submission entry, it's submitted by the next
+ *      uring_submit_and_wait(). If the ring is full, the prepared entries are
+ *      submitted first.
+ *
+ * PARAMETERS:
+ *      u - The instance
+ *
+ * RETURN:
+ *      The entry (zeroed), NULL on error.
+ ******************************************************************************/
+struct io_uring_sqe *uring_get_sqe(dsc_uring_t *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+        u->sq_entries) {
+        if (uring_submit_and_wait(u, 0) < 0) {
+            return NULL;
+        }
+        if (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+            u->sq_entries) {
+            return NULL;
+        }
+    }
+
+    idx = u->sq_local & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local++;
+
+    return sqe;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_prep_recvmsg_multishot
+ *
+ * DESCRIPTION:
+ *      Prepare a multishot receive: one completion per datagram, each in a
+ *      buffer of URING_BUF_GROUP, laid out as struct io_uring_recvmsg_out,
+ *      the address (msg_namelen bytes) and the payload.
+ *
+ * PARAMETERS:
+ *      sqe       - The submission entry
+ *      fd        - The socket
+ *      msg       - msg_namelen is the space reserved for the address, it
+ *                  shall stay valid while the receive is active
+ *      user_data - Reported with the completions
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void uring_prep_recvmsg_multishot(struct io_uring_sqe *sqe, int fd,
+    struct msghdr *msg, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = user_data;
+}
+
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+    const struct msghdr *msg, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+    uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_submit_and_wait
+ *
+ * DESCRIPTION:
+ *      Submit the prepared entries with one system call, and wait for the
+ *      completions.
+ *
+ * PARAMETERS:
+ *      u       - The instance
+ *      wait_nr - The number of completions to wait for, 0 not to wait
+ *
+ * RETURN:
+ *      The number of entries submitted, -1 on error.
+ ******************************************************************************/
+int uring_submit_and_wait(dsc_uring_t *u, unsigned wait_nr)
+{
+    unsigned to_submit;
+    int rc;
+
+    to_submit = u->sq_local - u->sq_submitted;
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+    if ((to_submit == 0) && (wait_nr == 0)) {
+        return 0;
+    }
+
+    do {
+        rc = sys_io_uring_enter(u->fd, to_submit, wait_nr,
+            (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0);
+    } while ((rc < 0) && (errno == EINTR));
+    if (rc < 0) {
+        DSC_LOG_ERROR("io_uring_enter error: %m\n");
+        return -1;
+    }
+    u->sq_submitted += rc;
+
+    return rc;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_peek_cqe
+ *
+ * DESCRIPTION:
+ *      Get the next completion without waiting. Call uring_cqe_seen() when
+ *      it's handled.
+ *
+ * PARAMETERS:
+ *      u - The instance
+ *
+ * RETURN:
+ *      The completion, NULL if none.
+ ******************************************************************************/
+struct io_uring_cqe *uring_peek_cqe(dsc_uring_t *u)
+{
+    unsigned head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &u->cqes[head & *u->cq_mask];
+}
+
+
+void uring_cqe_seen(dsc_uring_t *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+uint8_t *uring_buf(dsc_uring_t *u, unsigned bid)
+{
+    return u->bufs + (size_t)bid * u->buf_size;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      uring_buf_recycle
+ *
+ * DESCRIPTION:
+ *      Give a receive buffer back to the kernel. The buffers are seen by the
+ *      kernel after uring_buf_publish(), so a batch is published at once.
+ *
+ * PARAMETERS:
+ *      u   - The instance
+ *      bid - The buffer ID
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void uring_buf_recycle(dsc_uring_t *u, unsigned bid)
+{
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->nbufs - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)uring_buf(u, bid);
+    b->len = u->buf_size;
+    b->bid = bid;
+    u->br_tail++;
+}
+
+
+void uring_buf_publish(dsc_uring_t *u)
+{
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
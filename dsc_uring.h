@@ -0,0 +1,78 @@
+/******************************************************************************
+*
+* FILENAME:
+*     dsc_uring.h
+*
+* DESCRIPTION:
+*     Define a minimal io_uring wrapper over the raw system calls, used by the
+*     io_uring backend of server_run(): the submission/completion rings and a
+*     ring of receive buffers provided to the kernel (IORING_REGISTER_PBUF_RING)
+*     for the multishot receive.
+*
+* REVISION(MM/DD/YYYY):
+*     10/16/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _DSC_URING_H_
+#define _DSC_URING_H_
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+
+/* The group ID of the receive buffers */
+#define URING_BUF_GROUP         1
+
+/* An io_uring instance with its receive buffers */
+typedef struct dsc_uring {
+    int fd;                             /* io_uring fd */
+    unsigned *sq_head;                  /* Submission ring, shared with kernel */
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;                /* Number of submission entries */
+    unsigned sq_local;                  /* Tail of the entries prepared */
+    unsigned sq_submitted;              /* Tail of the entries submitted */
+    struct io_uring_sqe *sqes;          /* Submission entries */
+    unsigned *cq_head;                  /* Completion ring, shared with kernel */
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;          /* Completion entries */
+    void *sq_ring;                      /* Mappings of the rings */
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *br;       /* Ring of the receive buffers */
+    size_t br_size;
+    uint8_t *bufs;                      /* The receive buffers */
+    unsigned nbufs;                     /* Number of receive buffers, power of 2 */
+    unsigned buf_size;                  /* Size of a receive buffer */
+    uint16_t br_tail;                   /* Tail of the buffers given back */
+} dsc_uring_t;
+
+
+int uring_init(dsc_uring_t *u, unsigned entries, unsigned nbufs,
+    unsigned buf_size);
+void uring_exit(dsc_uring_t *u);
+
+struct io_uring_sqe *uring_get_sqe(dsc_uring_t *u);
+void uring_prep_recvmsg_multishot(struct io_uring_sqe *sqe, int fd,
+    struct msghdr *msg, uint64_t user_data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+    const struct msghdr *msg, uint64_t user_data);
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+    uint64_t user_data);
+int uring_submit_and_wait(dsc_uring_t *u, unsigned wait_nr);
+
+struct io_uring_cqe *uring_peek_cqe(dsc_uring_t *u);
+void uring_cqe_seen(dsc_uring_t *u);
+
+uint8_t *uring_buf(dsc_uring_t *u, unsigned bid);
+void uring_buf_recycle(dsc_uring_t *u, unsigned bid);
+void uring_buf_publish(dsc_uring_t *u);
+
+
+#endif /* _DSC_URING_H_ */
@@ -0,0 +1,619 @@
+/******************************************************************************
+ *
+ * FILENAME:
+ *     frag.c
+ *
+ * DESCRIPTION:
+ *     Transfer messages larger than one datagram. The sender keeps up to
+ *     DSC_FRAG_WINDOW fragments in flight, the receiver acknowledges them with
+ *     the first missing fragment and a bitmap of the fragments received after
+ *     it, so only the lost fragments are sent again. The window opens after
+ *     the first ack, a request with a forged source address gets only the
+ *     first fragment sent to it.
+ *
+ * REVISION(MM/DD/YYYY):
+ *     10/16/2026
+ *     - Initial version
+ *
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "frag.h"
+#include "checksum.h"
+#include "dsc_log.h"
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_count
+ *
+ * DESCRIPTION:
+ *      Get the number of fragments of a message.
+ *
+ * PARAMETERS:
+ *      msg_len - The data length of the message
+ *
+ * RETURN:
+ *      The number of fragments
+ ******************************************************************************/
+uint32_t frag_count(uint32_t msg_len)
+{
+    return (msg_len + DSC_FRAG_DATA_SIZE - 1) / DSC_FRAG_DATA_SIZE;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_send_ack
+ *
+ * DESCRIPTION:
+ *      Send an acknowledgment of the fragments received.
+ *
+ * PARAMETERS:
+ *      fd         - The socket to send from
+ *      addr       - The address of the sender of the fragments
+ *      request_id - The request ID of the message
+ *      next       - The first fragment not received
+ *      count      - The number of fragments of the message
+ *      bitmap     - Bit i is set if fragment next+1+i is received
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+int frag_send_ack(int fd, const dsc_addr_t *addr, uint32_t request_id,
+    uint32_t next, uint32_t count, uint64_t bitmap)
+{
+    uint8_t buf[sizeof(dsc_command_t) + sizeof(dsc_frag_ack_t)];
+    dsc_command_t *pkt = (dsc_command_t *)buf;
+    dsc_frag_ack_t *ack = (dsc_frag_ack_t *)(pkt + 1);
+
+    pkt->signature = DSC_SIGNATURE;
+    pkt->command = 0;
+    pkt->data_len = sizeof(dsc_frag_ack_t);
+    pkt->request_id = request_id;
+    pkt->flags = DSC_FLAG_ACK;
+    ack->next = next;
+    ack->count = count;
+    ack->bitmap = bitmap;
+    pkt->checksum = 0;
+    pkt->checksum = compute_checksum(buf, sizeof(buf));
+
+    if (sendto(fd, buf, sizeof(buf), 0, &addr->sa, addr->len) !=
+        sizeof(buf)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      send_fragment
+ *
+ * DESCRIPTION:
+ *      Send one fragment of a message. The data is sent from the message
+ *      directly, only the headers are built per fragment.
+ *
+ * PARAMETERS:
+ *      tx  - The sending side of the message
+ *      idx - The index of the fragment
+ *      now - The current time(microseconds)
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void send_fragment(frag_tx_t *tx, uint32_t idx, uint64_t now)
+{
+    uint8_t buf[sizeof(dsc_command_t) + sizeof(dsc_frag_t)];
+    dsc_command_t *pkt = (dsc_command_t *)buf;
+    dsc_frag_t *frag = (dsc_frag_t *)(pkt + 1);
+    const uint8_t *data;
+    struct iovec iov[2];
+    struct msghdr msg;
+    uint32_t off, len, sum;
+
+    off = idx * DSC_FRAG_DATA_SIZE;
+    len = tx->msg->data_len - off;
+    if (len > DSC_FRAG_DATA_SIZE) {
+        len = DSC_FRAG_DATA_SIZE;
+    }
+    data = (const uint8_t *)(tx->msg + 1) + off;
+
+    pkt->signature = DSC_SIGNATURE;
+    pkt->command = tx->msg->command;
+    pkt->data_len = sizeof(dsc_frag_t) + len;
+    pkt->request_id = tx->msg->request_id;
+    pkt->flags = DSC_FLAG_FRAG | (tx->msg->flags & DSC_FLAG_INTEGRITY);
+    frag->msg_len = tx->msg->data_len;
+    frag->index = idx;
+    frag->count = tx->count;
+
+    if (pkt->flags & DSC_FLAG_CRC32C) {
+        /* The CRC is chained over the pieces like over the whole packet */
+        sum = compute_crc32c(0, buf, offsetof(dsc_command_t, checksum));
+        sum = compute_crc32c(sum, frag, sizeof(dsc_frag_t));
+        sum = compute_crc32c(sum, data, len);
+        pkt->checksum = sum;
+    } else if (pkt->flags & DSC_FLAG_TRUSTED) {
+        pkt->checksum = 0;
+    } else {
+        /*
+         * The headers are an even number of bytes, so the sums of the headers
+         * and the data add up to the sum of the whole packet.
+         */
+        pkt->checksum = 0;
+        sum = (uint16_t)~compute_checksum(buf, sizeof(buf));
+        sum += (uint16_t)~compute_checksum((void *)data, len);
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        pkt->checksum = (uint16_t)~sum;
+    }
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &tx->addr.sa;
+    msg.msg_namelen = tx->addr.len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    /* A fragment failed to send is the same as a lost one */
+    sendmsg(tx->fd, &msg, 0);
+    tx->sent_at[idx % DSC_FRAG_WINDOW] = now;
+    if (tx->sends[idx % DSC_FRAG_WINDOW] < 255) {
+        tx->sends[idx % DSC_FRAG_WINDOW]++;
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_tx_init
+ *
+ * DESCRIPTION:
+ *      Start to send a message in fragments. Nothing is sent until
+ *      frag_tx_pump() is called.
+ *
+ * PARAMETERS:
+ *      tx   - The sending side of the message
+ *      msg  - The message (header + data), it shall be kept until the transfer
+ *             ends. The command/status and request_id are sent with every
+ *             fragment.
+ *      fd   - The socket to send from
+ *      addr - The address of the receiver
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void frag_tx_init(frag_tx_t *tx, const dsc_command_t *msg, int fd,
+    const dsc_addr_t *addr)
+{
+    memset(tx, 0, sizeof(*tx));
+    tx->msg = msg;
+    tx->fd = fd;
+    tx->addr = *addr;
+    tx->count = frag_count(msg->data_len);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_tx_pump
+ *
+ * DESCRIPTION:
+ *      Send the fragments due: the lost ones, and the new ones while the
+ *      window is open. A fragment is lost if it's not acknowledged in FRAG_RTO,
+ *      or a later fragment has been acknowledged: then it's sent again at once
+ *      the first time, and after a quarter of FRAG_RTO later on. The timeout
+ *      is doubled every time it expires, until an ack arrives.
+ *
+ * PARAMETERS:
+ *      tx  - The sending side of the message
+ *      now - The current time(microseconds)
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void frag_tx_pump(frag_tx_t *tx, uint64_t now)
+{
+    uint64_t rto = (uint64_t)FRAG_RTO << tx->backoff;
+    uint32_t idx, slot, window;
+    uint64_t age;
+    int timeout = 0;
+
+    for (idx = tx->base; idx < tx->next; idx++) {
+        slot = idx % DSC_FRAG_WINDOW;
+        if (tx->acked[slot] ||
+            (!tx->acked_any && (tx->sends[slot] >= FRAG_FIRST_SENDS))) {
+            continue;
+        }
+        age = now - tx->sent_at[slot];
+        if (age >= rto) {
+            send_fragment(tx, idx, now);
+            timeout = 1;
+        } else if ((idx < tx->high) &&
+            ((tx->sends[slot] == 1) || (age >= FRAG_RTO / 4))) {
+            send_fragment(tx, idx, now);
+        }
+    }
+
+    /* Back off while the receiver is silent, it may be gone */
+    if (timeout && (tx->backoff < FRAG_MAX_BACKOFF)) {
+        tx->backoff++;
+    }
+
+    /* Only the first fragment until the receiver proves it's there */
+    window = tx->acked_any ? DSC_FRAG_WINDOW : 1;
+    while ((tx->next < tx->count) && (tx->next < tx->base + window)) {
+        send_fragment(tx, tx->next, now);
+        tx->next++;
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_tx_probe
+ *
+ * DESCRIPTION:
+ *      Send the last fragment again after all fragments are acknowledged, so
+ *      the receiver replies again if its reply is lost.
+ *
+ * PARAMETERS:
+ *      tx  - The sending side of the message
+ *      now - The current time(microseconds)
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void frag_tx_probe(frag_tx_t *tx, uint64_t now)
+{
+    if (tx->count > 0) {
+        send_fragment(tx, tx->count - 1, now);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_tx_ack
+ *
+ * DESCRIPTION:
+ *      Take an acknowledgment from the receiver, which slides the window.
+ *
+ * PARAMETERS:
+ *      tx  - The sending side of the message
+ *      pkt - The acknowledgment packet (verified)
+ *
+ * RETURN:
+ *      1 - All fragments are acknowledged, 0 - Not yet
+ ******************************************************************************/
+int frag_tx_ack(frag_tx_t *tx, const dsc_command_t *pkt)
+{
+    const dsc_frag_ack_t *ack = (const dsc_frag_ack_t *)(pkt + 1);
+    uint32_t idx;
+    int i;
+
+    /* Ignore a broken ack, the fragments are sent again on timeout */
+    if ((pkt->data_len != sizeof(dsc_frag_ack_t)) ||
+        (ack->count != tx->count) || (ack->next > tx->next)) {
+        return 0;
+    }
+
+    tx->backoff = 0;
+    tx->acked_any = 1;
+    while (tx->base < ack->next) {
+        tx->acked[tx->base % DSC_FRAG_WINDOW] = 0;
+        tx->sends[tx->base % DSC_FRAG_WINDOW] = 0;
+        tx->base++;
+    }
+
+    for (i = 0; i < 64; i++) {
+        if (!(ack->bitmap & (1ULL << i))) {
+            continue;
+        }
+        idx = ack->next + 1 + i;
+        if (idx >= tx->next) {
+            break;
+        }
+        if (idx >= tx->base) {
+            tx->acked[idx % DSC_FRAG_WINDOW] = 1;
+        }
+        if (idx + 1 > tx->high) {
+            tx->high = idx + 1;
+        }
+    }
+
+    while ((tx->base < tx->next) && tx->acked[tx->base % DSC_FRAG_WINDOW]) {
+        tx->acked[tx->base % DSC_FRAG_WINDOW] = 0;
+        tx->sends[tx->base % DSC_FRAG_WINDOW] = 0;
+        tx->base++;
+    }
+
+    return (tx->base >= tx->count);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_rx_init
+ *
+ * DESCRIPTION:
+ *      Start to reassemble a message from its first fragment received, which
+ *      is not added yet, call frag_rx_add() for it. Without a buffer given,
+ *      only the header is allocated here, the buffer grows as the fragments
+ *      arrive, so a sender gets no more memory than the data it has sent.
+ *
+ * PARAMETERS:
+ *      rx  - The receiving side of the message
+ *      pkt - A fragment of the message (verified)
+ *      buf - The buffer of the message (header + data), NULL to allocate it
+ *      cap - The size of buf
+ *
+ * RETURN:
+ *      0 - OK, Others - Error (errno is EMSGSIZE if the message is larger than
+ *      the buffer or DSC_MAX_MSG_SIZE)
+ ******************************************************************************/
+int frag_rx_init(frag_rx_t *rx, const dsc_command_t *pkt, void *buf,
+    size_t cap)
+{
+    const dsc_frag_t *frag = (const dsc_frag_t *)(pkt + 1);
+    size_t msg_size;
+
+    memset(rx, 0, sizeof(*rx));
+    if ((pkt->data_len < sizeof(dsc_frag_t)) || (frag->msg_len == 0) ||
+        (frag->count != frag_count(frag->msg_len))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (frag->msg_len > DSC_MAX_MSG_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    msg_size = sizeof(dsc_command_t) + frag->msg_len;
+    if (buf == NULL) {
+        buf = malloc(sizeof(dsc_command_t));
+        if (buf == NULL) {
+            DSC_LOG_ERROR("malloc error: %m\n");
+            return -1;
+        }
+        rx->own_msg = 1;
+        rx->size = sizeof(dsc_command_t);
+    } else if (cap < msg_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    rx->got = (uint8_t *)calloc(frag->count, 1);
+    if (rx->got == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        if (rx->own_msg) {
+            free(buf);
+        }
+        return -1;
+    }
+
+    rx->msg = (dsc_command_t *)buf;
+    rx->msg->signature = DSC_SIGNATURE;
+    rx->msg->command = pkt->command;
+    rx->msg->data_len = frag->msg_len;
+    rx->msg->request_id = pkt->request_id;
+    rx->msg->flags = pkt->flags & DSC_FLAG_INTEGRITY;
+    rx->msg->checksum = 0;
+    rx->count = frag->count;
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_rx_set_budget
+ *
+ * DESCRIPTION:
+ *      Charge the growth of a message allocated by frag_rx_init() to a
+ *      counter shared by the messages being reassembled. A fragment which
+ *      would take the counter over the max is dropped, the sender sends it
+ *      again later. The counter is updated atomically.
+ *
+ * PARAMETERS:
+ *      rx      - The receiving side of the message
+ *      mem     - The counter of bytes
+ *      mem_max - The max of the counter
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void frag_rx_set_budget(frag_rx_t *rx, size_t *mem, size_t mem_max)
+{
+    rx->mem = mem;
+    rx->mem_max = mem_max;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      rx_grow
+ *
+ * DESCRIPTION:
+ *      Grow the allocated message to hold need bytes (header + data), at
+ *      least doubling it, up to the size of the whole message.
+ *
+ * PARAMETERS:
+ *      rx   - The receiving side of the message
+ *      need - The bytes needed
+ *
+ * RETURN:
+ *      0 - OK, Others - Error (out of memory or over the budget)
+ ******************************************************************************/
+static int rx_grow(frag_rx_t *rx, size_t need)
+{
+    size_t msg_size = sizeof(dsc_command_t) + rx->msg->data_len;
+    size_t size = rx->size * 2;
+    void *p;
+
+    if (size < need) {
+        size = need;
+    }
+    if (size > msg_size) {
+        size = msg_size;
+    }
+
+    if ((rx->mem != NULL) && (__atomic_add_fetch(rx->mem, size - rx->size,
+        __ATOMIC_RELAXED) > rx->mem_max)) {
+        __atomic_sub_fetch(rx->mem, size - rx->size, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    p = realloc(rx->msg, size);
+    if (p == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        if (rx->mem != NULL) {
+            __atomic_sub_fetch(rx->mem, size - rx->size, __ATOMIC_RELAXED);
+        }
+        return -1;
+    }
+    rx->msg = (dsc_command_t *)p;
+    rx->size = size;
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_rx_add
+ *
+ * DESCRIPTION:
+ *      Add a fragment to the message, and acknowledge the fragments received
+ *      when FRAG_ACK_EVERY new fragments arrived, the fragment is out of order
+ *      or duplicated, or the message is complete.
+ *
+ * PARAMETERS:
+ *      rx   - The receiving side of the message
+ *      pkt  - A fragment of the message (verified)
+ *      fd   - The socket to send the acknowledgment from
+ *      addr - The address of the sender
+ *
+ * RETURN:
+ *      1 - The message is complete, 0 - Not yet, -1 - Invalid fragment, or
+ *      dropped for lack of memory
+ ******************************************************************************/
+int frag_rx_add(frag_rx_t *rx, const dsc_command_t *pkt, int fd,
+    const dsc_addr_t *addr)
+{
+    const dsc_frag_t *frag = (const dsc_frag_t *)(pkt + 1);
+    uint32_t off, len, idx;
+    uint64_t bitmap;
+    int i, need_ack = 0;
+
+    if ((pkt->data_len < sizeof(dsc_frag_t)) ||
+        (frag->msg_len != rx->msg->data_len) || (frag->count != rx->count) ||
+        (frag->index >= rx->count)) {
+        return -1;
+    }
+
+    /*
+     * The sender never goes a window beyond the fragments acknowledged, so
+     * a fragment far ahead is forged, don't allocate the message up to it
+     */
+    if (frag->index >= rx->next + DSC_FRAG_WINDOW) {
+        return -1;
+    }
+
+    idx = frag->index;
+    off = idx * DSC_FRAG_DATA_SIZE;
+    len = rx->msg->data_len - off;
+    if (len > DSC_FRAG_DATA_SIZE) {
+        len = DSC_FRAG_DATA_SIZE;
+    }
+    if (pkt->data_len != sizeof(dsc_frag_t) + len) {
+        return -1;
+    }
+
+    if (rx->own_msg && !rx->got[idx] &&
+        (sizeof(dsc_command_t) + off + len > rx->size) &&
+        (rx_grow(rx, sizeof(dsc_command_t) + off + len) != 0)) {
+        return -1;
+    }
+
+    if (rx->got[idx]) {
+        /* The ack is lost, or the fragment is sent again too early */
+        need_ack = 1;
+    } else {
+        memcpy((uint8_t *)(rx->msg + 1) + off, frag + 1, len);
+        rx->got[idx] = 1;
+        rx->nrecv++;
+        rx->since_ack++;
+
+        /* Report the gap at once, so the lost fragments are sent again soon */
+        if (idx != rx->next) {
+            need_ack = 1;
+        }
+        while ((rx->next < rx->count) && rx->got[rx->next]) {
+            rx->next++;
+        }
+    }
+
+    if ((rx->since_ack >= FRAG_ACK_EVERY) || (rx->nrecv == 1) ||
+        (rx->nrecv == rx->count)) {
+        need_ack = 1;
+    }
+
+    if (need_ack) {
+        bitmap = 0;
+        for (i = 0; i < 64; i++) {
+            idx = rx->next + 1 + i;
+            if (idx >= rx->count) {
+                break;
+            }
+            if (rx->got[idx]) {
+                bitmap |= 1ULL << i;
+            }
+        }
+        frag_send_ack(fd, addr, rx->msg->request_id, rx->next, rx->count,
+            bitmap);
+        rx->since_ack = 0;
+    }
+
+    return (rx->nrecv == rx->count);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      frag_rx_free
+ *
+ * DESCRIPTION:
+ *      Free the memory of the receiving side, and the message if it is
+ *      allocated by frag_rx_init().
+ *
+ * PARAMETERS:
+ *      rx - The receiving side of the message
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void frag_rx_free(frag_rx_t *rx)
+{
+    free(rx->got);
+    if (rx->own_msg) {
+        free(rx->msg);
+    }
+
+    /* The message taken by the caller (own_msg cleared) is not counted too */
+    if ((rx->mem != NULL) && (rx->size > 0)) {
+        __atomic_sub_fetch(rx->mem, rx->size - sizeof(dsc_command_t),
+            __ATOMIC_RELAXED);
+    }
+    memset(rx, 0, sizeof(*rx));
+}
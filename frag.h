@@ -0,0 +1,96 @@
+/******************************************************************************
+*
+* FILENAME:
+*     frag.h
+*
+* DESCRIPTION:
+*     Define the transfer of messages larger than one datagram: the message is
+*     split into fragments, sent with a sliding window and reassembled by the
+*     receiver, which acknowledges the fragments selectively.
+*
+* REVISION(MM/DD/YYYY):
+*     10/16/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _FRAG_H_
+#define _FRAG_H_
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "dsc.h"
+
+
+/* Time(microseconds) to retransmit a fragment without acknowledgment */
+#define FRAG_RTO                20000
+
+/* The max times FRAG_RTO is doubled while no ack arrives */
+#define FRAG_MAX_BACKOFF        6
+
+/* The receiver acknowledges every FRAG_ACK_EVERY fragments in order, and the
+ * first fragment at once */
+#define FRAG_ACK_EVERY          16
+
+/* The times the first fragment is sent until the receiver acknowledges
+ * anything, no more is sent to an address which may be forged */
+#define FRAG_FIRST_SENDS        3
+
+/* The length of a datagram carrying a fragment */
+#define FRAG_PKT_SIZE   (sizeof(dsc_command_t) + sizeof(dsc_frag_t) + \
+                         DSC_FRAG_DATA_SIZE)
+
+
+/* Sending side of a fragmented message */
+typedef struct frag_tx {
+    const dsc_command_t *msg;           /* The message, header + data */
+    int fd;                             /* Socket to send fragments from */
+    dsc_addr_t addr;                    /* Address of the receiver */
+    uint32_t count;                     /* Number of fragments */
+    uint32_t base;                      /* Fragments before it are acked */
+    uint32_t next;                      /* The first fragment never sent */
+    uint32_t high;                      /* Fragments before it are either
+                                           acknowledged or have been skipped */
+    int backoff;                        /* Timeouts since the last ack */
+    int acked_any;                      /* The receiver has acknowledged,
+                                           the window is open */
+    uint8_t acked[DSC_FRAG_WINDOW];     /* Acknowledged, by fragment % window */
+    uint8_t sends[DSC_FRAG_WINDOW];     /* Times sent, the same */
+    uint64_t sent_at[DSC_FRAG_WINDOW];  /* Time of the last send, the same */
+} frag_tx_t;
+
+/* Receiving side of a fragmented message */
+typedef struct frag_rx {
+    dsc_command_t *msg;                 /* The message being reassembled */
+    int own_msg;                        /* The message buffer is allocated */
+    size_t size;                        /* Bytes allocated for the message,
+                                           grown as the fragments arrive */
+    size_t *mem;                        /* Memory of all messages being
+                                           reassembled, or NULL */
+    size_t mem_max;                     /* The max of *mem */
+    uint32_t count;                     /* Number of fragments */
+    uint32_t next;                      /* The first fragment not received */
+    uint32_t nrecv;                     /* Number of fragments received */
+    uint32_t since_ack;                 /* Fragments since the last ack */
+    uint8_t *got;                       /* Received flags, by fragment */
+} frag_rx_t;
+
+
+uint32_t frag_count(uint32_t msg_len);
+int frag_send_ack(int fd, const dsc_addr_t *addr, uint32_t request_id,
+    uint32_t next, uint32_t count, uint64_t bitmap);
+
+void frag_tx_init(frag_tx_t *tx, const dsc_command_t *msg, int fd,
+    const dsc_addr_t *addr);
+void frag_tx_pump(frag_tx_t *tx, uint64_t now);
+void frag_tx_probe(frag_tx_t *tx, uint64_t now);
+int frag_tx_ack(frag_tx_t *tx, const dsc_command_t *pkt);
+
+int frag_rx_init(frag_rx_t *rx, const dsc_command_t *pkt, void *buf,
+    size_t cap);
+void frag_rx_set_budget(frag_rx_t *rx, size_t *mem, size_t mem_max);
+int frag_rx_add(frag_rx_t *rx, const dsc_command_t *pkt, int fd,
+    const dsc_addr_t *addr);
+void frag_rx_free(frag_rx_t *rx);
+
+
+#endif /* _FRAG_H_ */
@@ -0,0 +1,332 @@
+/******************************************************************************
+ *
+ * FILENAME:
+ *     lz.c
+ *
+ * DESCRIPTION:
+ *     Compress and decompress data with a small LZ77 codec (LZ4 block format).
+ *     The compressor finds matches with a hash table of the last position of
+ *     every 4-byte prefix, it gives up as soon as the output doesn't fit, so
+ *     data that doesn't compress costs little. The decompressor checks every
+ *     length and offset, the input comes from the network.
+ *
+ * REVISION(MM/DD/YYYY):
+ *     10/16/2026
+ *     - Initial version
+ *
+ ******************************************************************************/
+#include <string.h>
+#include "lz.h"
+
+
+/* The min length of a match */
+#define LZ_MIN_MATCH            4
+
+/* The max distance of a match, it's encoded in 2 bytes */
+#define LZ_MAX_OFFSET           65535
+
+/* Number of bits of the hash of 4 bytes, the table has 2^LZ_HASH_BITS slots */
+#define LZ_HASH_BITS            12
+
+/* The last bytes are always literals, no match starts in the last
+ * LZ_MF_LIMIT bytes */
+#define LZ_LAST_LITERALS        5
+#define LZ_MF_LIMIT             12
+
+/* The step of the search grows every 2^LZ_SKIP_SHIFT misses in a row */
+#define LZ_SKIP_SHIFT           5
+
+
+/******************************************************************************
+ * NAME:
+ *      read32
+ *
+ * DESCRIPTION:
+ *      Read 4 bytes at any alignment.
+ *
+ * PARAMETERS:
+ *      p - The bytes
+ *
+ * RETURN:
+ *      The value
+ ******************************************************************************/
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lz_hash
+ *
+ * DESCRIPTION:
+ *      Hash 4 bytes to a slot of the match table.
+ *
+ * PARAMETERS:
+ *      v - The 4 bytes
+ *
+ * RETURN:
+ *      The slot
+ ******************************************************************************/
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      put_length
+ *
+ * DESCRIPTION:
+ *      Write the rest of a length which doesn't fit in the token: bytes of
+ *      255 and a last byte less than 255.
+ *
+ * PARAMETERS:
+ *      op   - Where to write
+ *      oend - End of the output
+ *      n    - The length minus 15
+ *
+ * RETURN:
+ *      The position after the length, NULL if the output is full.
+ ******************************************************************************/
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t n)
+{
+    while (n >= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+        n -= 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = (uint8_t)n;
+
+    return op;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      put_sequence
+ *
+ * DESCRIPTION:
+ *      Write a sequence: the token, the literals and the match.
+ *
+ * PARAMETERS:
+ *      op   - Where to write
+ *      oend - End of the output
+ *      lit  - The literals
+ *      nlit - Number of literals
+ *      off  - Offset of the match
+ *      mlen - Length of the match, 0 for the last sequence
+ *
+ * RETURN:
+ *      The position after the sequence, NULL if the output is full.
+ ******************************************************************************/
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+    size_t nlit, size_t off, size_t mlen)
+{
+    uint8_t *token = op++;
+
+    if (op > oend) {
+        return NULL;
+    }
+    *token = (uint8_t)(((nlit >= 15) ? 15 : nlit) << 4);
+    if (nlit >= 15) {
+        op = put_length(op, oend, nlit - 15);
+        if (op == NULL) {
+            return NULL;
+        }
+    }
+    if (nlit > (size_t)(oend - op)) {
+        return NULL;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) {
+        return op;
+    }
+
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++ = (uint8_t)off;
+    *op++ = (uint8_t)(off >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= (uint8_t)((mlen >= 15) ? 15 : mlen);
+    if (mlen >= 15) {
+        op = put_length(op, oend, mlen - 15);
+    }
+
+    return op;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lz_compress
+ *
+ * DESCRIPTION:
+ *      Compress data. Pass the max length worth sending as cap, e.g. less
+ *      than len, to give up early if the data doesn't compress.
+ *
+ * PARAMETERS:
+ *      src - The data
+ *      len - The data length
+ *      dst - Output, the compressed data
+ *      cap - The size of the output
+ *
+ * RETURN:
+ *      The length of the compressed data, 0 if it doesn't fit in cap.
+ ******************************************************************************/
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip, *ref, *m, *r, *anchor = base, *iend = base + len;
+    uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+    uint32_t v, h, misses = 0;
+
+    if (len > LZ_MF_LIMIT) {
+        memset(table, 0, sizeof(table));
+        ip = base + 1;
+        while (ip < iend - LZ_MF_LIMIT) {
+            v = read32(ip);
+            h = lz_hash(v);
+            ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+            if ((ip - ref > LZ_MAX_OFFSET) || (read32(ref) != v)) {
+                ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+                continue;
+            }
+            misses = 0;
+
+            /* Extend the match backward over the literals, then forward */
+            while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1])) {
+                ip--;
+                ref--;
+            }
+            m = ip + LZ_MIN_MATCH;
+            r = ref + LZ_MIN_MATCH;
+            while ((m < iend - LZ_LAST_LITERALS) && (*m == *r)) {
+                m++;
+                r++;
+            }
+
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+            if (op == NULL) {
+                return 0;
+            }
+            ip = m;
+            anchor = ip;
+            if (ip < iend - LZ_MF_LIMIT) {
+                table[lz_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+            }
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+
+    return op - (uint8_t *)dst;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      lz_decompress
+ *
+ * DESCRIPTION:
+ *      Decompress data of lz_compress(). Invalid data never makes it read or
+ *      write out of the buffers.
+ *
+ * PARAMETERS:
+ *      src - The compressed data
+ *      len - The length of the compressed data
+ *      dst - Output, the data
+ *      cap - The size of the output
+ *
+ * RETURN:
+ *      The data length, -1 if the compressed data is invalid or the data
+ *      doesn't fit in cap.
+ ******************************************************************************/
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + len;
+    uint8_t *base = (uint8_t *)dst, *op = base, *oend = base + cap;
+    const uint8_t *ref;
+    size_t n, off;
+    uint8_t token, b;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        /* Literals */
+        n = token >> 4;
+        if (n == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                n += b;
+            } while (b == 255);
+        }
+        if ((n > (size_t)(iend - ip)) || (n > (size_t)(oend - op))) {
+            return -1;
+        }
+        memcpy(op, ip, n);
+        op += n;
+        ip += n;
+
+        /* The last sequence has no match */
+        if (ip == iend) {
+            break;
+        }
+
+        /* Match */
+        if (iend - ip < 2) {
+            return -1;
+        }
+        off = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if ((off == 0) || (off > (size_t)(op - base))) {
+            return -1;
+        }
+        n = token & 15;
+        if (n == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                n += b;
+            } while (b == 255);
+        }
+        n += LZ_MIN_MATCH;
+        if (n > (size_t)(oend - op)) {
+            return -1;
+        }
+        ref = op - off;
+        if (off >= n) {
+            memcpy(op, ref, n);
+            op += n;
+        } else {
+            /* The match overlaps the output, repeat the last off bytes */
+            while (n-- > 0) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op - base;
+}
@@ -0,0 +1,27 @@
+/******************************************************************************
+*
+* FILENAME:
+*     lz.h
+*
+* DESCRIPTION:
+*     Define a small LZ77 codec for the payload of the packets, in the block
+*     format of LZ4: sequences of literals followed by a match (2-byte offset
+*     back in the output, length >= 4), the last sequence has literals only.
+*
+* REVISION(MM/DD/YYYY):
+*     10/16/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _LZ_H_
+#define _LZ_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+
+#endif /* _LZ_H_ */
@@ -16,122 +16,265 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 #include "common.h"
+#include "dsc_log.h"
+#include "store.h"
 
 
 volatile sig_atomic_t loop_flag = 1;
 
+/* Set by SIGUSR1 to print the stats of server, if enabled by '-s' */
+volatile sig_atomic_t dump_flag = 0;
+int dump_stats = 0;
+dsc_stats_t stats;
 
 /*
- * Return the version of server.
+ * Run the handlers in worker threads, refer server_set_workers(). With a store
+ * CMD_PUT_MESSAGE waits for the group commit, so STORE_WORKERS are started if
+ * '-w' is not given, and the serving thread keeps receiving meanwhile.
  */
-dsc_command_t *cmd_get_version(void)
+#define STORE_WORKERS   8
+int nworkers = 0;
+int queue_size = 1024;
+int queue_policy = DSC_QUEUE_DROP;
+
+/* Compress the responses no shorter than it, refer server_set_compression() */
+int compress_min = DSC_COMPRESS_MIN;
+
+/* Packets per second and burst per client address, refer
+ * server_set_admission() */
+unsigned int admit_rate = 0;
+unsigned int admit_burst = 0;
+
+/* The path of the Unix domain socket for local clients, if given by '-U' */
+char *unix_path = NULL;
+
+/* The server stopped by SIGINT in single thread mode */
+dsc_server_t *server = NULL;
+
+/* The pool of servers in multiple threads mode */
+dsc_server_pool_t *pool = NULL;
+
+/* The message stored by CMD_PUT_MESSAGE, returned by CMD_GET_MESSAGE */
+pthread_mutex_t msg_lock = PTHREAD_MUTEX_INITIALIZER;
+char message[DSC_GET_MSG_SIZE] = "Hello, this is a message from the server.";
+
+/* The messages stored by CMD_PUT_MESSAGE, if a directory is given by '-S' */
+store_t *store = NULL;
+char *store_dir = NULL;
+int commit_budget = STORE_COMMIT_BUDGET;
+
+/* The message stored by CMD_PUT_BLOB, shared by all serving threads */
+pthread_mutex_t blob_lock = PTHREAD_MUTEX_INITIALIZER;
+uint8_t *blob = NULL;
+uint32_t blob_len = 0;
+
+
+/*
+ * Return the version of server. It never changes, so the response is cached
+ * and the handler is called only once.
+ */
+int cmd_get_version(dsc_command_t *req, dsc_command_t *resp, size_t cap)
 {
-    dsc_response_version_t *ver;
+    dsc_response_version_t *ver = (dsc_response_version_t *)resp;
 
-    printf("CMD_GET_VERSION\n");
+    DSC_LOG_DEBUG("CMD_GET_VERSION\n");
 
-    ver = (dsc_response_version_t *)malloc(sizeof(dsc_response_version_t));
-    if (ver != NULL) {
-        ver->common.status = STATUS_SUCCESS;
-        ver->common.data_len = sizeof(ver->major) + sizeof(ver->minor);
-        ver->major = VERSION_MAJOR;
-        ver->minor = VERSION_MINOR;
+    if (cap < sizeof(dsc_response_version_t)) {
+        return -1;
     }
+    ver->common.status = STATUS_SUCCESS;
+    ver->common.data_len = sizeof(ver->major) + sizeof(ver->minor);
+    ver->major = VERSION_MAJOR;
+    ver->minor = VERSION_MINOR;
+    ver->common.flags |= DSC_FLAG_CACHEABLE;
 
-    return (dsc_command_t *)ver;
+    return 0;
 }
 
 
 /*
- * Get a message string from server
+ * Get a message from server, the last one stored by CMD_PUT_MESSAGE, or the
+ * one at the offset given if the messages are kept in the store. A message in
+ * the store never changes, and the last one is invalidated by CMD_PUT_MESSAGE,
+ * so the response is cached.
  */
-dsc_command_t *cmd_get_msg(void)
+int cmd_get_msg(dsc_command_t *req, dsc_command_t *resp, size_t cap)
 {
-    dsc_response_get_msg_t *res;
-    const char *str = "Hello, this is a message from the server.";
-
-    printf("CMD_GET_MESSAGE\n");
-
-    res = (dsc_response_get_msg_t *)malloc(sizeof(dsc_response_get_msg_t));
-    if (res != NULL) {
-        res->common.status = STATUS_SUCCESS;
-        res->common.data_len = strlen(str);
-        snprintf(res->data, DSC_GET_MSG_SIZE, "%s", str);
-        res->data[DSC_GET_MSG_SIZE-1] = 0;
+    dsc_request_get_msg_t *get_msg = (dsc_request_get_msg_t *)req;
+    dsc_response_get_msg_t *res = (dsc_response_get_msg_t *)resp;
+    const void *data;
+    uint32_t len;
+    int64_t offset;
+
+    DSC_LOG_DEBUG("CMD_GET_MESSAGE\n");
+
+    if (store != NULL) {
+        offset = (req->data_len >= sizeof(get_msg->offset)) ?
+            (int64_t)get_msg->offset : store_last(store);
+        data = (offset >= 0) ? store_read(store, offset, &len) : NULL;
+        if (data == NULL) {
+            resp->status = STATUS_ERROR;
+            resp->data_len = 0;
+            return 0;
+        }
+        /* A message larger than the buffer is sent in fragments */
+        if (sizeof(dsc_command_t) + len > cap) {
+            return sizeof(dsc_command_t) + len;
+        }
+        memcpy(resp + 1, data, len);
+        resp->status = STATUS_SUCCESS;
+        resp->data_len = len;
+        resp->flags |= DSC_FLAG_CACHEABLE;
+        return 0;
     }
 
-    return (dsc_command_t *)res;
+    if (req->data_len != 0) {
+        resp->status = STATUS_ERROR;
+        resp->data_len = 0;
+        return 0;
+    }
+    if (cap < sizeof(dsc_response_get_msg_t)) {
+        return -1;
+    }
+    pthread_mutex_lock(&msg_lock);
+    res->common.status = STATUS_SUCCESS;
+    res->common.data_len = strlen(message);
+    snprintf(res->data, DSC_GET_MSG_SIZE, "%s", message);
+    pthread_mutex_unlock(&msg_lock);
+    res->common.flags |= DSC_FLAG_CACHEABLE;
+
+    return 0;
 }
 
 
 /*
- * Send a message string to server
+ * Send a message to server. With the store, it's appended to the log, and
+ * answered with its offset once it's committed to the disk.
  */
-dsc_command_t *cmd_put_msg(dsc_command_t *req)
+int cmd_put_msg(dsc_command_t *req, dsc_command_t *resp, size_t cap)
 {
-    dsc_command_t *res;
     dsc_request_put_msg_t *put_msg = (dsc_request_put_msg_t *)req;
+    dsc_response_put_msg_t *res = (dsc_response_put_msg_t *)resp;
+    dsc_server_pool_t *p;
+    int64_t offset;
 
-    printf("CMD_PUT_MESSAGE\n");
+    DSC_LOG_DEBUG("CMD_PUT_MESSAGE\n");
+    DSC_LOG_DEBUG("Message: %.*s\n", (int)req->data_len,
+        (char *)put_msg->data);
 
-    printf("Message: %s\n", (char *)put_msg->data);
+    if (store != NULL) {
+        if (cap < sizeof(dsc_response_put_msg_t)) {
+            return -1;
+        }
+        offset = store_append(store, put_msg->data, req->data_len);
+        if ((offset < 0) || (store_wait(store, offset) != 0)) {
+            resp->status = STATUS_ERROR;
+            resp->data_len = 0;
+            return 0;
+        }
+        res->offset = offset;
+        resp->data_len = sizeof(res->offset);
+    } else {
+        pthread_mutex_lock(&msg_lock);
+        snprintf(message, sizeof(message), "%.*s", (int)req->data_len,
+            (char *)put_msg->data);
+        pthread_mutex_unlock(&msg_lock);
+        resp->data_len = 0;
+    }
 
-    res = (dsc_command_t *)malloc(sizeof(dsc_command_t));
-    if (res != NULL) {
-        res->status = STATUS_SUCCESS;
-        res->data_len = 0;
+    /* The cached response of CMD_GET_MESSAGE is out of date */
+    p = __atomic_load_n(&pool, __ATOMIC_ACQUIRE);
+    if (p != NULL) {
+        server_pool_invalidate_cache(p, CMD_GET_MESSAGE);
+    } else {
+        server_invalidate_cache(server, CMD_GET_MESSAGE);
     }
 
-    return (dsc_command_t *)res;
+    /* Push the message to the subscribers if it fits in a datagram */
+    if (req->data_len <= DSC_BUF_SIZE - sizeof(dsc_command_t)) {
+        if (p != NULL) {
+            server_pool_publish(p, CMD_PUT_MESSAGE, put_msg->data,
+                req->data_len);
+        } else {
+            server_publish(server, CMD_PUT_MESSAGE, put_msg->data,
+                req->data_len);
+        }
+    }
+
+    resp->status = STATUS_SUCCESS;
+
+    return 0;
 }
 
 
 /*
- * Unknown request type
+ * Store a large message on server, it's sent by client in fragments.
  */
-dsc_command_t *cmd_unknown(dsc_command_t *req)
+int cmd_put_blob(dsc_command_t *req, dsc_command_t *resp, size_t cap)
 {
-    dsc_command_t *res;
+    uint8_t *data;
 
-    printf("Unknown request type\n");
+    DSC_LOG_INFO("CMD_PUT_BLOB (%u bytes)\n", req->data_len);
+
+    data = (uint8_t *)malloc(req->data_len);
+    if (data == NULL) {
+        return -1;
+    }
+    memcpy(data, req + 1, req->data_len);
 
-    res = (dsc_command_t *)malloc(sizeof(dsc_command_t));
-    if (res != NULL) {
-        res->status = STATUS_INVALID_COMMAND;
-        res->data_len = 0;
+    pthread_mutex_lock(&blob_lock);
+    free(blob);
+    blob = data;
+    blob_len = req->data_len;
+    pthread_mutex_unlock(&blob_lock);
+
+    resp->status = STATUS_SUCCESS;
+    resp->data_len = 0;
+
+    return 0;
+}
+
+
+/*
+ * Get the message stored by CMD_PUT_BLOB. If it doesn't fit in the response
+ * buffer, ask for a larger one, the response is sent in fragments.
+ */
+int cmd_get_blob(dsc_command_t *req, dsc_command_t *resp, size_t cap)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&blob_lock);
+    if (sizeof(dsc_command_t) + blob_len > cap) {
+        rc = sizeof(dsc_command_t) + blob_len;
+    } else {
+        DSC_LOG_INFO("CMD_GET_BLOB (%u bytes)\n", blob_len);
+        memcpy(resp + 1, blob, blob_len);
+        resp->status = STATUS_SUCCESS;
+        resp->data_len = blob_len;
     }
+    pthread_mutex_unlock(&blob_lock);
 
-    return res;
+    return rc;
 }
 
 
 /*
- * The handler to handle all requests from client
+ * Register the handlers of all requests from client. The requests of unknown
+ * type are answered with STATUS_INVALID_COMMAND by the server library.
  */
-dsc_command_t *my_request_handler(dsc_command_t *req)
+int register_handlers(dsc_server_t *s)
 {
-    dsc_command_t *resp = NULL;
-
-    switch (req->command) {
-    case CMD_GET_VERSION:
-        resp = cmd_get_version();
-        break;
-
-    case CMD_GET_MESSAGE:
-        resp = cmd_get_msg();
-        break;
-        
-    case CMD_PUT_MESSAGE:
-        resp = cmd_put_msg(req);
-        break;
-        
-    default:
-        resp = cmd_unknown(req);
-        break;
-    }
-
-    return resp;
+    if ((server_register_handler(s, CMD_GET_VERSION, cmd_get_version) != 0) ||
+        (server_register_handler(s, CMD_GET_MESSAGE, cmd_get_msg) != 0) ||
+        (server_register_handler(s, CMD_PUT_MESSAGE, cmd_put_msg) != 0) ||
+        (server_register_handler(s, CMD_PUT_BLOB, cmd_put_blob) != 0) ||
+        (server_register_handler(s, CMD_GET_BLOB, cmd_get_blob) != 0)) {
+        return -1;
+    }
+
+    return 0;
 }
 
 
@@ -141,6 +284,16 @@ dsc_command_t *my_request_handler(dsc_command_t *req)
 void handler_sigint(int sig)
 {
     loop_flag = 0;
+    server_stop(server);
+}
+
+/*
+ * When user sends SIGUSR1, print the stats of server. It's printed out of the
+ * signal handler, by a timer or the main thread of the pool.
+ */
+void handler_sigusr1(int sig)
+{
+    dump_flag = 1;
 }
 
 void install_sig_handler()
@@ -151,6 +304,26 @@ void install_sig_handler()
     act.sa_handler = handler_sigint;
     act.sa_flags = 0;
     sigaction(SIGINT, &act, 0);
+
+    if (dump_stats) {
+        act.sa_handler = handler_sigusr1;
+        sigaction(SIGUSR1, &act, 0);
+    }
+}
+
+
+/*
+ * Timer of the server in single thread mode, print the stats if SIGUSR1 is
+ * received.
+ */
+void check_dump(dsc_server_t *s, void *arg)
+{
+    if (dump_flag) {
+        dump_flag = 0;
+        server_get_stats(s, &stats);
+        server_print_stats(&stats, stdout);
+        fflush(stdout);
+    }
 }
 
 
@@ -175,29 +348,133 @@ void print_usage(char *pname)
         "                    v%d.%d                      \n"
         "================================================\n"
         "\n"
-        "Usage: %s [-p port_number]\n"
+        "Usage: %s [-p port_number] [-U path] [-b batch_size] [-t threads]\n"
+        "          [-r entries] [-w workers] [-q queue_size] [-B] [-u] "
+        "[-S dir]\n"
+        "          [-G usec] [-z len] [-a rate[:burst]] [-s] [-v]\n"
         "\n"
         "Options:\n"
         "    -p port_number   The port number of server, default: %d\n"
+        "    -U path          Listen on a Unix domain socket too, for the\n"
+        "                     local clients, '@name' for an abstract name\n"
+        "    -b batch_size    Accept up to batch_size requests per system call\n"
+        "                     (1-%d), default: %d\n"
+        "    -t threads       Serve with a pool of threads, one socket per thread\n"
+        "                     bound with SO_REUSEPORT, default: 1\n"
+        "    -r entries       Keep the latest responses to answer the retried\n"
+        "                     requests, 0 to disable, default: %d\n"
+        "    -w workers       Run the handlers in worker threads, per socket,\n"
+        "                     default: 0 (in the serving thread), %d with '-S'\n"
+        "    -q queue_size    The max requests queued for the workers,\n"
+        "                     default: 1024\n"
+        "    -B               Reply busy if the queue is full or the client is\n"
+        "                     over its rate, default: drop\n"
+        "    -u               Serve with io_uring if available, default: epoll\n"
+        "    -S dir           Keep the messages in a store in the directory,\n"
+        "                     default: only the last one, in memory\n"
+        "    -G usec          Commit the messages stored within usec together,\n"
+        "                     default: %d\n"
+        "    -z len           Compress the responses of len bytes or more if\n"
+        "                     the client takes it, 0 to disable, default: %d\n"
+        "    -a rate[:burst]  Take up to rate packets per second from a client\n"
+        "                     address, burst: the max in a burst, default: rate\n"
+        "                     (0 to admit all, the default)\n"
+        "    -s               Print the stats of server on SIGUSR1\n"
+        "    -v               Log every request, if built with 'make DEBUG=1'\n"
         "\n"
         "Example:\n"
         "    %s -p 9000\n"
+        "    %s -t 4 -s & kill -USR1 $!\n"
+        "    %s -U /tmp/dsc.sock\n"
         "\n",
         VERSION_MAJOR, VERSION_MINOR,
-        pname, SERVER_PORT, pname
+        pname, SERVER_PORT, DSC_BATCH_MAX, DSC_BATCH_MAX,
+        DSC_REPLAY_CACHE_SIZE, STORE_WORKERS, STORE_COMMIT_BUDGET,
+        DSC_COMPRESS_MIN, pname, pname, pname
         );
     exit(STATUS_ERROR);
 }
 
 
+/*
+ * Serve with a pool of threads until user press CTRL+C.
+ */
+int run_pool(int port, int nthreads, int replay)
+{
+    dsc_server_pool_t *p;
+    sigset_t mask, old;
+    int i;
+
+    /* Block SIGINT before checking loop_flag, so it can't sneak in between */
+    install_sig_handler();
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+
+    p = server_init_pool_buf(NULL, port, nthreads);
+    if (p == NULL) {
+        printf("Error: server init error\n");
+        return STATUS_INIT_ERROR;
+    }
+
+    /* The threads are serving already, set it before any handler runs */
+    __atomic_store_n(&pool, p, __ATOMIC_RELEASE);
+    for (i = 0; i < p->nservers; i++) {
+        if (register_handlers(p->servers[i]) != 0) {
+            printf("Error: server init error\n");
+            server_pool_close(p);
+            pool = NULL;
+            return STATUS_INIT_ERROR;
+        }
+    }
+    server_pool_set_replay_cache(p, replay);
+    server_pool_set_compression(p, compress_min);
+    server_pool_set_admission(p, admit_rate, admit_burst, queue_policy);
+    if ((nworkers > 0) &&
+        (server_pool_set_workers(p, nworkers, queue_size, queue_policy) != 0)) {
+        printf("Error: server init error\n");
+        server_pool_close(p);
+        pool = NULL;
+        return STATUS_INIT_ERROR;
+    }
+
+    /* A local socket can't be shared by SO_REUSEPORT, one thread serves it */
+    if ((unix_path != NULL) &&
+        (server_add_unix_listener(p->servers[0], unix_path) != 0)) {
+        printf("Error: server init error\n");
+        server_pool_close(p);
+        pool = NULL;
+        return STATUS_INIT_ERROR;
+    }
+
+    while (loop_flag) {
+        sigsuspend(&old);
+        if (dump_flag) {
+            dump_flag = 0;
+            server_pool_get_stats(p, &stats);
+            server_print_stats(&stats, stdout);
+            fflush(stdout);
+        }
+    }
+
+    server_pool_close(p);
+    pool = NULL;
+    return STATUS_SUCCESS;
+}
+
+
 int main(int argc, char *argv[])
 {
     dsc_server_t *s;
     char *pname = argv[0];
     int serv_port = SERVER_PORT;
-    int opt;
+    int batch_size = DSC_BATCH_MAX;
+    int nthreads = 1;
+    int replay = DSC_REPLAY_CACHE_SIZE;
+    int opt, rc;
 
-    while ((opt = getopt(argc, argv, ":hp:")) != -1) {
+    while ((opt = getopt(argc, argv, ":hp:U:b:t:r:w:q:BuS:G:z:a:sv")) != -1) {
         switch (opt) {
         case 'p':
             serv_port = strtol(optarg, NULL, 10);
@@ -207,6 +484,93 @@ int main(int argc, char *argv[])
             }
             break;
 
+        case 'U':
+            unix_path = optarg;
+            break;
+
+        case 'b':
+            batch_size = strtol(optarg, NULL, 10);
+            if ((batch_size <= 0) || (batch_size > DSC_BATCH_MAX)) {
+                printf("Error: invalid batch size!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            if (nthreads <= 0) {
+                printf("Error: invalid number of threads!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'r':
+            replay = strtol(optarg, NULL, 10);
+            if ((replay < 0) || (replay > 65536)) {
+                printf("Error: invalid number of entries!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'w':
+            nworkers = strtol(optarg, NULL, 10);
+            if (nworkers <= 0) {
+                printf("Error: invalid number of workers!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'q':
+            queue_size = strtol(optarg, NULL, 10);
+            if ((queue_size <= 0) || (queue_size > 65536)) {
+                printf("Error: invalid queue size!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'B':
+            queue_policy = DSC_QUEUE_BUSY;
+            break;
+
+        case 'u':
+            server_set_default_backend(DSC_BACKEND_URING);
+            break;
+
+        case 'S':
+            store_dir = optarg;
+            break;
+
+        case 'G':
+            commit_budget = strtol(optarg, NULL, 10);
+            if ((commit_budget < 0) || (commit_budget > 1000000)) {
+                printf("Error: invalid commit budget!\n");
+                print_usage(pname);
+            }
+            break;
+        case 'z':
+            compress_min = strtol(optarg, NULL, 10);
+            if ((compress_min < 0) || (compress_min > DSC_MAX_MSG_SIZE)) {
+                printf("Error: invalid compression length!\n");
+                print_usage(pname);
+            }
+            break;
+
+        case 'a':
+            if ((sscanf(optarg, "%u:%u", &admit_rate, &admit_burst) < 1) ||
+                (admit_burst > 1000000)) {
+                printf("Error: invalid rate '%s'\n", optarg);
+                print_usage(pname);
+            }
+            break;
+
+        case 's':
+            dump_stats = 1;
+            break;
+
+        case 'v':
+            dsc_log_set_level(DSC_LOG_LEVEL_DEBUG);
+            break;
+
         case 'h':
             print_usage(pname);
             break;
@@ -228,19 +592,60 @@ int main(int argc, char *argv[])
         print_usage(pname);
     }
 
+    if (store_dir != NULL) {
+        if (nworkers == 0) {
+            nworkers = STORE_WORKERS;
+        }
+        store = store_open(store_dir, 0, commit_budget);
+        if (store == NULL) {
+            printf("Error: store init error\n");
+            return STATUS_INIT_ERROR;
+        }
+    }
+
     printf("Server listening on port %d\n", serv_port);
-    s = server_init(&my_request_handler, serv_port, 2);
-    if (s == NULL) {
+    if (unix_path != NULL) {
+        printf("Server listening on %s\n", unix_path);
+    }
+    if (nthreads > 1) {
+        rc = run_pool(serv_port, nthreads, replay);
+        store_close(store);
+        return rc;
+    }
+
+    s = server_init_buf(NULL, serv_port, -1);
+    if ((s == NULL) || (register_handlers(s) != 0)) {
+        printf("Error: server init error\n");
+        server_close(s);
+        return STATUS_INIT_ERROR;
+    }
+    s->batch_size = batch_size;
+    server_set_replay_cache(s, replay);
+    server_set_compression(s, compress_min);
+    server_set_admission(s, admit_rate, admit_burst, queue_policy);
+    if ((nworkers > 0) &&
+        (server_set_workers(s, nworkers, queue_size, queue_policy) != 0)) {
         printf("Error: server init error\n");
+        server_close(s);
+        return STATUS_INIT_ERROR;
+    }
+    if ((unix_path != NULL) && (server_add_unix_listener(s, unix_path) != 0)) {
+        printf("Error: server init error\n");
+        server_close(s);
+        return STATUS_INIT_ERROR;
+    }
+    if (dump_stats && (server_add_timer(s, 200, check_dump, NULL) != 0)) {
+        printf("Error: server init error\n");
+        server_close(s);
         return STATUS_INIT_ERROR;
     }
 
+    server = s;
     install_sig_handler();
 
-    while (loop_flag) {
-        server_accept_request(s);
-    }
+    server_run(s);
 
     server_close(s);
+    store_close(store);
     return STATUS_SUCCESS;
 }
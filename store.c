@@ -0,0 +1,842 @@
+/******************************************************************************
+ *
+ * FILENAME:
+ *     store.c
+ *
+ * DESCRIPTION:
+ *     The message store, an append-only log of memory-mapped segments. The
+ *     appends are serialized by a mutex, the reads take no lock: a segment
+ *     and its records are published with release stores, and never change
+ *     once published.
+ *
+ *     A segment "<base>.log" is created at its full size and mapped. Each
+ *     commit of the segment appends an entry to "<base>.idx": the length
+ *     committed and the offset of the last record. The index is written after
+ *     the records are synced and never synced itself, so an entry lost in a
+ *     crash only makes the recovery check more records.
+ *
+ * REVISION(MM/DD/YYYY):
+ *     10/16/2026
+ *     - Initial version
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "store.h"
+#include "checksum.h"
+#include "dsc_log.h"
+
+
+#define STORE_REC_MAGIC         0x5352      /* "RS" */
+#define STORE_IDX_MAGIC         0x58444953  /* "SIDX" */
+
+/*
+ * A commit waits for more appends in slices of the budget, it doesn't wait
+ * any longer once a slice passes without appends
+ */
+#define COMMIT_SLICE(budget)    ((budget) / 8 + 1)
+
+/* Time(microseconds) to wait before a failed commit is tried again */
+#define COMMIT_RETRY            100000
+
+/* Length of a record with its header */
+#define STORE_REC_SIZE(len)     (sizeof(store_rec_t) + (((len) + 7) & ~7ULL))
+
+/* An entry of the index file, appended by every commit of the segment */
+struct store_idx {
+    uint64_t used;                      /* Bytes committed */
+    uint64_t last;                      /* Offset of the last record */
+    uint32_t magic;                     /* STORE_IDX_MAGIC */
+    uint32_t sum;                       /* Checksum of the fields above */
+};
+
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static uint16_t rec_sum(const void *data, uint32_t len)
+{
+    return compute_checksum((void *)data, len) ^ (uint16_t)len ^
+        (uint16_t)(len >> 16);
+}
+
+
+static void seg_path(store_t *st, uint64_t base, const char *ext, char *path,
+    size_t size)
+{
+    snprintf(path, size, "%s/%020llu.%s", st->dir, (unsigned long long)base,
+        ext);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      check_record
+ *
+ * DESCRIPTION:
+ *      Check the record at a position of a segment.
+ *
+ * PARAMETERS:
+ *      seg  - The segment
+ *      pos  - Position of the record in the segment
+ *      used - The bytes of the segment holding records
+ *
+ * RETURN:
+ *      The record, NULL if there is no valid record.
+ ******************************************************************************/
+static store_rec_t *check_record(store_seg_t *seg, uint64_t pos, uint64_t used)
+{
+    store_rec_t *rec;
+
+    if ((pos & 7) || (pos + sizeof(store_rec_t) > used)) {
+        return NULL;
+    }
+    rec = (store_rec_t *)(seg->map + pos);
+    if ((rec->magic != STORE_REC_MAGIC) ||
+        (rec->len > used - pos - sizeof(store_rec_t)) ||
+        (rec->sum != rec_sum(rec + 1, rec->len))) {
+        return NULL;
+    }
+
+    return rec;
+}
+
+
+static void seg_free(store_seg_t *seg)
+{
+    if (seg->map != NULL) {
+        munmap(seg->map, seg->size);
+    }
+    if (seg->fd >= 0) {
+        close(seg->fd);
+    }
+    if (seg->idx_fd >= 0) {
+        close(seg->idx_fd);
+    }
+    free(seg);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      seg_map
+ *
+ * DESCRIPTION:
+ *      Open the segment and index files of a segment, and map the segment.
+ *
+ * PARAMETERS:
+ *      st     - The store
+ *      base   - Offset of the first record of the segment
+ *      create - 1 to create the files, the segment is empty
+ *
+ * RETURN:
+ *      The segment, NULL on error.
+ ******************************************************************************/
+static store_seg_t *seg_map(store_t *st, uint64_t base, int create)
+{
+    char path[4096];
+    store_seg_t *seg;
+    struct stat sb;
+    int dfd;
+
+    seg = (store_seg_t *)calloc(1, sizeof(store_seg_t));
+    if (seg == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        return NULL;
+    }
+    seg->base = base;
+    seg->last = UINT64_MAX;
+    seg->fd = seg->idx_fd = -1;
+
+    seg_path(st, base, "log", path, sizeof(path));
+    seg->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0),
+        0644);
+    if ((seg->fd < 0) ||
+        (create && (ftruncate(seg->fd, st->seg_size) != 0)) ||
+        (fstat(seg->fd, &sb) != 0)) {
+        DSC_LOG_ERROR("segment %s error: %m\n", path);
+        seg_free(seg);
+        return NULL;
+    }
+    seg->size = sb.st_size;
+    if (seg->size < sizeof(store_rec_t)) {
+        DSC_LOG_ERROR("segment %s is truncated\n", path);
+        seg_free(seg);
+        return NULL;
+    }
+    seg->map = (uint8_t *)mmap(NULL, seg->size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        DSC_LOG_ERROR("mmap %s error: %m\n", path);
+        seg_free(seg);
+        return NULL;
+    }
+
+    seg_path(st, base, "idx", path, sizeof(path));
+    seg->idx_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (seg->idx_fd < 0) {
+        DSC_LOG_ERROR("index %s error: %m\n", path);
+        seg_free(seg);
+        return NULL;
+    }
+
+    /* The new files survive a crash only if the directory is synced */
+    if (create) {
+        dfd = open(st->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if ((dfd < 0) || (fsync(dfd) != 0)) {
+            DSC_LOG_ERROR("fsync %s error: %m\n", st->dir);
+        }
+        if (dfd >= 0) {
+            close(dfd);
+        }
+    }
+
+    return seg;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      seg_recover
+ *
+ * DESCRIPTION:
+ *      Find the records of a segment opened. The last valid entry of the
+ *      index gives the bytes committed, only the records after them are
+ *      checked one by one.
+ *
+ * PARAMETERS:
+ *      seg - The segment
+ *
+ * RETURN:
+ *      1 if there are records not noted in the index, 0 otherwise.
+ ******************************************************************************/
+static int seg_recover(store_seg_t *seg)
+{
+    struct store_idx e;
+    store_rec_t *rec;
+    struct stat sb;
+    off_t pos;
+    uint64_t used = 0, indexed;
+
+    if (fstat(seg->idx_fd, &sb) == 0) {
+        pos = sb.st_size - sb.st_size % sizeof(e);
+        while (pos > 0) {
+            pos -= sizeof(e);
+            if ((pread(seg->idx_fd, &e, sizeof(e), pos) == sizeof(e)) &&
+                (e.magic == STORE_IDX_MAGIC) &&
+                (e.sum == compute_checksum(&e,
+                    offsetof(struct store_idx, sum))) &&
+                (e.used <= seg->size)) {
+                used = e.used;
+                seg->last = e.last;
+                break;
+            }
+        }
+    }
+
+    /* The records appended after the last commit noted */
+    indexed = used;
+    while ((rec = check_record(seg, used, seg->size)) != NULL) {
+        seg->last = seg->base + used;
+        used += STORE_REC_SIZE(rec->len);
+        if (used > seg->size) {
+            used = seg->size;
+        }
+    }
+    seg->used = seg->synced = used;
+
+    return (used != indexed);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      seg_zero_tail
+ *
+ * DESCRIPTION:
+ *      Clear the segment after its records, before appending to it again.
+ *      The pages not committed before a crash may be written back out of
+ *      order, so the bytes after the first invalid record may still look
+ *      like records, and be taken as such after the new appends.
+ *
+ * PARAMETERS:
+ *      seg     - The segment
+ *      unclean - 1 if the segment was not committed completely
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+static void seg_zero_tail(store_seg_t *seg, int unclean)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t start;
+
+    start = (seg->used + page_size - 1) & ~((uint64_t)page_size - 1);
+    if (start > seg->size) {
+        start = seg->size;
+    }
+    memset(seg->map + seg->used, 0, start - seg->used);
+    if (start == seg->size) {
+        return;
+    }
+
+    /* Cheap on a sparse file, otherwise clear it only after a crash */
+    if ((fallocate(seg->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        start, seg->size - start) != 0) && unclean) {
+        memset(seg->map + start, 0, seg->size - start);
+    }
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      seg_commit
+ *
+ * DESCRIPTION:
+ *      Sync the records of a segment to the disk, then note them in the
+ *      index.
+ *
+ * PARAMETERS:
+ *      seg  - The segment
+ *      used - The bytes to commit
+ *      last - Offset of the last record in them
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int seg_commit(store_seg_t *seg, uint64_t used, uint64_t last)
+{
+    static long page_size;
+    struct store_idx e;
+    uint64_t start;
+
+    if (used <= seg->synced) {
+        return 0;
+    }
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    start = seg->synced & ~((uint64_t)page_size - 1);
+    if (msync(seg->map + start, used - start, MS_SYNC) != 0) {
+        DSC_LOG_LIMITED(DSC_LOG_LEVEL_ERROR, "msync error: %m\n");
+        return -1;
+    }
+    seg->synced = used;
+
+    memset(&e, 0, sizeof(e));
+    e.used = used;
+    e.last = last;
+    e.magic = STORE_IDX_MAGIC;
+    e.sum = compute_checksum(&e, offsetof(struct store_idx, sum));
+    if (write(seg->idx_fd, &e, sizeof(e)) != sizeof(e)) {
+        /* Only the recovery is slower */
+        DSC_LOG_WARN("index write error: %m\n");
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      commit_thread
+ *
+ * DESCRIPTION:
+ *      Commit the records appended, until the store is closed. After the first
+ *      append not committed, it waits for the latency budget to collect more
+ *      appends, then commits all of them with one msync() per segment, and
+ *      wakes up the callers of store_wait().
+ *
+ * PARAMETERS:
+ *      arg - The store
+ *
+ * RETURN:
+ *      NULL
+ ******************************************************************************/
+static void *commit_thread(void *arg)
+{
+    store_t *st = (store_t *)arg;
+    store_seg_t *seg;
+    struct timespec ts;
+    uint64_t target, used, last, deadline, start, seen, wait;
+    int i, n, first, rc;
+
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        while (!st->stop && (st->durable == st->end)) {
+            pthread_cond_wait(&st->commit_cond, &st->lock);
+        }
+        if (st->durable == st->end) {
+            break;
+        }
+
+        /*
+         * Let more appends join the commit, until the budget is used up, or
+         * no append arrives within a slice of it, as the appenders are all
+         * waiting for the commit then.
+         */
+        deadline = st->pending_since + st->budget;
+        while (!st->stop && ((start = now_usec()) < deadline)) {
+            seen = st->end;
+            wait = (deadline - start < COMMIT_SLICE(st->budget)) ?
+                deadline - start : COMMIT_SLICE(st->budget);
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += wait * 1000;
+            while (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&st->commit_cond, &st->lock, &ts);
+            if (st->end == seen) {
+                break;
+            }
+        }
+        start = now_usec();
+
+        /* The segments before the last one are full, they never change */
+        target = st->end;
+        n = st->nsegs;
+        seg = st->segs[n - 1];
+        used = seg->used;
+        last = seg->last;
+        for (first = n - 1; first > 0; first--) {
+            if (st->segs[first]->base <= st->durable) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&st->lock);
+
+        rc = 0;
+        for (i = first; (i < n - 1) && (rc == 0); i++) {
+            rc = seg_commit(st->segs[i], st->segs[i]->used,
+                st->segs[i]->last);
+        }
+        if (rc == 0) {
+            rc = seg_commit(seg, used, last);
+        }
+
+        pthread_mutex_lock(&st->lock);
+        if (rc == 0) {
+            st->durable = target;
+            st->error = 0;
+            st->pending_since = start;
+        } else {
+            /* Fail the waiters, and try again later */
+            st->error = errno;
+            st->pending_since = now_usec() + COMMIT_RETRY;
+        }
+        pthread_cond_broadcast(&st->durable_cond);
+        if ((rc != 0) && st->stop) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    return NULL;
+}
+
+
+static int compare_base(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      store_load
+ *
+ * DESCRIPTION:
+ *      Open the segments found in the directory of the store, in order of
+ *      offset.
+ *
+ * PARAMETERS:
+ *      st      - The store
+ *      unclean - Output, 1 if the last segment was not committed completely
+ *
+ * RETURN:
+ *      0 - OK, Others - Error
+ ******************************************************************************/
+static int store_load(store_t *st, int *unclean)
+{
+    uint64_t bases[STORE_MAX_SEGMENTS];
+    struct dirent *de;
+    store_seg_t *seg;
+    char *end;
+    DIR *d;
+    int i, n = 0;
+
+    d = opendir(st->dir);
+    if (d == NULL) {
+        DSC_LOG_ERROR("opendir %s error: %m\n", st->dir);
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if ((strlen(de->d_name) != 24) || (strcmp(de->d_name + 20, ".log"))) {
+            continue;
+        }
+        if (n == STORE_MAX_SEGMENTS) {
+            DSC_LOG_ERROR("too many segments in %s\n", st->dir);
+            closedir(d);
+            return -1;
+        }
+        bases[n] = strtoull(de->d_name, &end, 10);
+        if (end == de->d_name + 20) {
+            n++;
+        }
+    }
+    closedir(d);
+    qsort(bases, n, sizeof(bases[0]), compare_base);
+
+    for (i = 0; i < n; i++) {
+        seg = seg_map(st, bases[i], 0);
+        if (seg == NULL) {
+            return -1;
+        }
+        *unclean = seg_recover(seg);
+        st->segs[st->nsegs++] = seg;
+        if (seg->last != UINT64_MAX) {
+            st->last = seg->last;
+        }
+        st->end = seg->base + seg->used;
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      store_open
+ *
+ * DESCRIPTION:
+ *      Open the message store in a directory, create it if it doesn't exist,
+ *      and start the commit thread. The records left by the last run are
+ *      recovered.
+ *
+ * PARAMETERS:
+ *      dir      - The directory of the files
+ *      seg_size - Size of the new segment files, 0 for STORE_SEGMENT_SIZE
+ *      budget   - The time(microseconds) an append waits for others to be
+ *                 committed with it, 0 to commit at once
+ *
+ * RETURN:
+ *      A pointer of the store, NULL on error.
+ ******************************************************************************/
+store_t *store_open(const char *dir, size_t seg_size, int budget)
+{
+    pthread_condattr_t attr;
+    sigset_t all, old;
+    store_seg_t *seg;
+    store_t *st;
+    long page_size = sysconf(_SC_PAGESIZE);
+    int rc, unclean = 0;
+
+    if ((dir == NULL) || (budget < 0)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return NULL;
+    }
+    if (seg_size == 0) {
+        seg_size = STORE_SEGMENT_SIZE;
+    }
+    seg_size = (seg_size + page_size - 1) & ~((size_t)page_size - 1);
+
+    if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+        DSC_LOG_ERROR("mkdir %s error: %m\n", dir);
+        return NULL;
+    }
+
+    st = (store_t *)calloc(1, sizeof(store_t));
+    if (st == NULL) {
+        DSC_LOG_ERROR("malloc error: %m\n");
+        return NULL;
+    }
+    st->dir = strdup(dir);
+    st->seg_size = seg_size;
+    st->budget = budget;
+    st->last = UINT64_MAX;
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&st->commit_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&st->durable_cond, NULL);
+
+    if ((st->dir == NULL) || (store_load(st, &unclean) != 0)) {
+        store_close(st);
+        return NULL;
+    }
+
+    /*
+     * Append to the last segment. The records found after the last commit
+     * noted may be in the page cache only, commit them again.
+     */
+    if (st->nsegs > 0) {
+        seg = st->segs[st->nsegs - 1];
+        seg_zero_tail(seg, unclean);
+        seg->synced = 0;
+        if (seg_commit(seg, seg->used, seg->last) != 0) {
+            store_close(st);
+            return NULL;
+        }
+    } else {
+        seg = seg_map(st, 0, 1);
+        if (seg == NULL) {
+            store_close(st);
+            return NULL;
+        }
+        st->segs[st->nsegs++] = seg;
+    }
+    st->durable = st->end;
+
+    DSC_LOG_INFO("Store %s: %d segments, %llu bytes, last record %lld\n",
+        dir, st->nsegs, (unsigned long long)st->end,
+        (long long)(int64_t)st->last);
+
+    /* The signals are handled by the other threads */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rc = pthread_create(&st->tid, NULL, commit_thread, st);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        DSC_LOG_ERROR("pthread_create error (%s)\n", strerror(rc));
+        store_close(st);
+        return NULL;
+    }
+    st->started = 1;
+
+    return st;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      store_append
+ *
+ * DESCRIPTION:
+ *      Append a record to the store. A new segment is started if it doesn't
+ *      fit in the current one. The record can be read at once, call
+ *      store_wait() to wait until it's committed.
+ *
+ * PARAMETERS:
+ *      st   - The store
+ *      data - The data of the record
+ *      len  - The data length
+ *
+ * RETURN:
+ *      Offset of the record, -1 on error.
+ ******************************************************************************/
+int64_t store_append(store_t *st, const void *data, uint32_t len)
+{
+    store_seg_t *seg;
+    store_rec_t *rec;
+    uint64_t pos, offset;
+
+    if ((st == NULL) || (STORE_REC_SIZE(len) > st->seg_size)) {
+        DSC_LOG_ERROR("invalid parameter!\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&st->lock);
+    seg = st->segs[st->nsegs - 1];
+    if (seg->used + STORE_REC_SIZE(len) > seg->size) {
+        if (st->nsegs == STORE_MAX_SEGMENTS) {
+            pthread_mutex_unlock(&st->lock);
+            DSC_LOG_ERROR("the store is full\n");
+            return -1;
+        }
+        seg = seg_map(st, st->end, 1);
+        if (seg == NULL) {
+            pthread_mutex_unlock(&st->lock);
+            return -1;
+        }
+        st->segs[st->nsegs] = seg;
+        __atomic_store_n(&st->nsegs, st->nsegs + 1, __ATOMIC_RELEASE);
+    }
+
+    pos = seg->used;
+    rec = (store_rec_t *)(seg->map + pos);
+    memcpy(rec + 1, data, len);
+    rec->len = len;
+    rec->magic = STORE_REC_MAGIC;
+    rec->sum = rec_sum(data, len);
+    offset = seg->base + pos;
+    seg->last = offset;
+    __atomic_store_n(&st->last, offset, __ATOMIC_RELAXED);
+    __atomic_store_n(&seg->used, pos + STORE_REC_SIZE(len), __ATOMIC_RELEASE);
+
+    /* The first append not committed starts the latency budget */
+    if (st->durable == st->end) {
+        st->pending_since = now_usec();
+        pthread_cond_signal(&st->commit_cond);
+    }
+    st->end = seg->base + seg->used;
+    pthread_mutex_unlock(&st->lock);
+
+    return offset;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      store_wait
+ *
+ * DESCRIPTION:
+ *      Wait until a record is committed. The callers waiting together share
+ *      one commit.
+ *
+ * PARAMETERS:
+ *      st     - The store
+ *      offset - Offset of the record, returned by store_append()
+ *
+ * RETURN:
+ *      0 - OK, Others - Error (the commit failed, errno is set)
+ ******************************************************************************/
+int store_wait(store_t *st, uint64_t offset)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&st->lock);
+    while (st->durable <= offset) {
+        pthread_cond_wait(&st->durable_cond, &st->lock);
+        if ((st->durable <= offset) && (st->error != 0)) {
+            errno = st->error;
+            rc = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    return rc;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      store_read
+ *
+ * DESCRIPTION:
+ *      Read a record in place, without lock. The data stays valid until the
+ *      store is closed.
+ *
+ * PARAMETERS:
+ *      st     - The store
+ *      offset - Offset of the record
+ *      len    - Output, the data length
+ *
+ * RETURN:
+ *      The data of the record in the mapping, NULL if there is no record at
+ *      the offset.
+ ******************************************************************************/
+const void *store_read(store_t *st, uint64_t offset, uint32_t *len)
+{
+    store_seg_t *seg;
+    store_rec_t *rec;
+    int lo = 0, hi, mid;
+
+    /* The last segment whose base <= offset */
+    hi = __atomic_load_n(&st->nsegs, __ATOMIC_ACQUIRE) - 1;
+    if ((hi < 0) || (offset < st->segs[0]->base)) {
+        return NULL;
+    }
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (st->segs[mid]->base <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    seg = st->segs[lo];
+
+    rec = check_record(seg, offset - seg->base,
+        __atomic_load_n(&seg->used, __ATOMIC_ACQUIRE));
+    if (rec == NULL) {
+        return NULL;
+    }
+    *len = rec->len;
+
+    return rec + 1;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      store_last
+ *
+ * DESCRIPTION:
+ *      Get the offset of the last record appended.
+ *
+ * PARAMETERS:
+ *      st - The store
+ *
+ * RETURN:
+ *      The offset, -1 if the store is empty.
+ ******************************************************************************/
+int64_t store_last(store_t *st)
+{
+    uint64_t last = __atomic_load_n(&st->last, __ATOMIC_RELAXED);
+
+    return (last == UINT64_MAX) ? -1 : (int64_t)last;
+}
+
+
+/******************************************************************************
+ * NAME:
+ *      store_close
+ *
+ * DESCRIPTION:
+ *      Commit the records appended and close the store.
+ *
+ * PARAMETERS:
+ *      st - The store
+ *
+ * RETURN:
+ *      None
+ ******************************************************************************/
+void store_close(store_t *st)
+{
+    int i;
+
+    if (st == NULL) {
+        return;
+    }
+
+    if (st->started) {
+        pthread_mutex_lock(&st->lock);
+        st->stop = 1;
+        pthread_cond_signal(&st->commit_cond);
+        pthread_mutex_unlock(&st->lock);
+        pthread_join(st->tid, NULL);
+    }
+    for (i = 0; i < st->nsegs; i++) {
+        seg_free(st->segs[i]);
+    }
+    pthread_cond_destroy(&st->durable_cond);
+    pthread_cond_destroy(&st->commit_cond);
+    pthread_mutex_destroy(&st->lock);
+    free(st->dir);
+    free(st);
+}
@@ -0,0 +1,88 @@
+/******************************************************************************
+*
+* FILENAME:
+*     store.h
+*
+* DESCRIPTION:
+*     Define the message store: an append-only log of records, split into
+*     memory-mapped segment files. A record is addressed by its offset in the
+*     log, and read in place from the mapping. The appends are made durable
+*     by a commit thread, one msync() for all the records appended within a
+*     latency budget (group commit). Every commit is noted in the index file
+*     of the segment, so the log is recovered on open by reading the indexes
+*     and checking only the records appended after the last commit.
+*
+* REVISION(MM/DD/YYYY):
+*     10/16/2026
+*     - Initial version
+*
+******************************************************************************/
+#ifndef _STORE_H_
+#define _STORE_H_
+#include <stdint.h>
+#include <pthread.h>
+
+
+/* The default size of a segment file */
+#define STORE_SEGMENT_SIZE      (64 * 1024 * 1024)
+
+/* The max number of segments of a store */
+#define STORE_MAX_SEGMENTS      4096
+
+/* The default time(microseconds) an append waits for others to be committed
+ * with it */
+#define STORE_COMMIT_BUDGET     200
+
+/* The header of a record, the data follows, padded to 8 bytes */
+typedef struct store_rec {
+    uint32_t len;                       /* Data length */
+    uint16_t magic;                     /* STORE_REC_MAGIC */
+    uint16_t sum;                       /* Checksum of the header and data */
+} store_rec_t;
+
+/* A segment file, holding the records from offset base */
+typedef struct store_seg {
+    uint64_t base;                      /* Offset of the first record */
+    uint8_t *map;                       /* Mapping of the whole file */
+    size_t size;                        /* Size of the file */
+    uint64_t used;                      /* Bytes appended, read without lock */
+    uint64_t synced;                    /* Bytes committed */
+    uint64_t last;                      /* Offset of the last record, or
+                                           UINT64_MAX if it's empty */
+    int fd;                             /* The segment file */
+    int idx_fd;                         /* The index file */
+} store_seg_t;
+
+/* A message store */
+typedef struct store {
+    char *dir;                          /* Directory of the files */
+    size_t seg_size;                    /* Size of the segment files */
+    int budget;                         /* Commit latency budget(microseconds) */
+    int nsegs;                          /* Number of segments, read without
+                                           lock */
+    store_seg_t *segs[STORE_MAX_SEGMENTS];  /* The segments, by offset */
+    uint64_t end;                       /* Offset of the next record */
+    uint64_t durable;                   /* Records before it are committed */
+    uint64_t last;                      /* Offset of the last record, or
+                                           UINT64_MAX if it's empty */
+    uint64_t pending_since;             /* Time(microseconds) of the first
+                                           append not committed */
+    int error;                          /* errno of a failed commit */
+    int stop;                           /* Set to stop the commit thread */
+    int started;                        /* The commit thread is created */
+    pthread_t tid;                      /* The commit thread */
+    pthread_mutex_t lock;               /* Protects the appends and commits */
+    pthread_cond_t commit_cond;         /* Signaled to the commit thread */
+    pthread_cond_t durable_cond;        /* Signaled when durable advances */
+} store_t;
+
+
+store_t *store_open(const char *dir, size_t seg_size, int budget);
+int64_t store_append(store_t *st, const void *data, uint32_t len);
+int store_wait(store_t *st, uint64_t offset);
+const void *store_read(store_t *st, uint64_t offset, uint32_t *len);
+int64_t store_last(store_t *st);
+void store_close(store_t *st);
+
+
+#endif /* _STORE_H_ */